@@ -32,3 +32,22 @@ struct analyzer *get_default_analyzer(void) {
     return get_analyzer("default");
 }
 
+
+void token_stream_init(struct token_stream *ts) {
+    kv_init(ts->tokens);
+    kv_init(ts->chars);
+    kv_init(ts->ends);
+}
+
+/* Empties the stream keeping its buffers */
+void token_stream_reset(struct token_stream *ts) {
+    kv_size(ts->tokens) = 0;
+    kv_size(ts->chars) = 0;
+    kv_size(ts->ends) = 0;
+}
+
+void token_stream_free(struct token_stream *ts) {
+    kv_destroy(ts->tokens);
+    kv_destroy(ts->chars);
+    kv_destroy(ts->ends);
+}
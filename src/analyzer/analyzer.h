@@ -1,6 +1,8 @@
 #ifndef __ANALYZER_H__
 #define __ANALYZER_H__
+#include <inttypes.h>
 #include "word.h"
+#include "kvec.h"
 
 #define MAX_ANALYZER_NAME  256
 
@@ -9,6 +11,24 @@ typedef struct word_pos {
     int position;
 } word_pos_t;
 
+/* A token of a string analyzed into a token stream.  Its normalized chars
+ * start at chars in the chars of the stream */
+struct stream_token {
+    uint32_t start;     // Byte offset of the token in the string
+    uint32_t chars;
+    int length;
+    int position;
+};
+
+/* Tokens of an analyzed string along with the byte offset in the string
+ * every char of a token ends at.  The caller owns the stream and can reuse
+ * it from one string to the next */
+struct token_stream {
+    kvec_t(struct stream_token) tokens;
+    kvec_t(chr_t) chars;
+    kvec_t(uint32_t) ends;
+};
+
 struct analyzer;
 
 typedef void (*new_word_pos_f) (word_pos_t *wordpos, void *data);
@@ -17,6 +37,8 @@ typedef void (*index_string_f) (const char *str, new_word_pos_f cb, void *data);
 
 typedef void (*search_string_f) (const char *str, new_word_pos_f cb, void *data);
 
+typedef void (*stream_string_f) (const char *str, struct token_stream *ts);
+
 typedef void (*free_analyzer_f) (struct analyzer *a);
 
 
@@ -24,6 +46,7 @@ struct analyzer {
     char name[MAX_ANALYZER_NAME];
     index_string_f analyze_string_for_indexing; 
     search_string_f analyze_string_for_search; 
+    stream_string_f analyze_string_to_stream;   // Same non empty words as for indexing, NULL if not supported
     free_analyzer_f free_analyzer;
     void *cfg;
     struct analyzer *next;
@@ -35,5 +58,9 @@ void register_analyzer(struct analyzer *a);
 struct analyzer *get_analyzer(const char *name);
 struct analyzer *get_default_analyzer(void);
 
+void token_stream_init(struct token_stream *ts);
+void token_stream_reset(struct token_stream *ts);
+void token_stream_free(struct token_stream *ts);
+
 #endif
 
@@ -1,203 +1,341 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
 #include "analyzer.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-static void analyze_string_for_indexing(const char *str, new_word_pos_f cb, void *data) {
-    utf8proc_uint8_t *map_out;
-    // Strip accents, invalid chars and lower case everything
-    size_t len_out = utf8proc_map((uint8_t*)str, 0, &map_out, 
-                           UTF8PROC_NULLTERM | UTF8PROC_STABLE |
-                           UTF8PROC_STRIPMARK | UTF8PROC_COMPOSE |
-                           UTF8PROC_COMPAT | UTF8PROC_LUMP | UTF8PROC_STRIPCC | 
-                           UTF8PROC_STRIPNA | UTF8PROC_IGNORE |UTF8PROC_CASEFOLD);
-    const char *pos = (const char *)map_out;
-    const char *epos = (const char *)map_out + len_out;
+// Strip accents, invalid chars and lower case everything
+#define NORMALIZE_OPTIONS (UTF8PROC_NULLTERM | UTF8PROC_STABLE |                \
+                           UTF8PROC_STRIPMARK | UTF8PROC_COMPOSE |              \
+                           UTF8PROC_COMPAT | UTF8PROC_LUMP | UTF8PROC_STRIPCC | \
+                           UTF8PROC_STRIPNA | UTF8PROC_IGNORE | UTF8PROC_CASEFOLD)
+
+// Strings that decompose to more chars than this are normalized on the heap
+#define STACK_CHARS 1024
+
+/* Splits normalized text into words.  Holds the word being built and the
+ * position from one char to the next */
+struct tokenizer {
+    new_word_pos_f cb;
+    void *data;
+    struct token_stream *ts;    // Words go to the stream instead of cb if set
+    bool add_hyphenated;    // Add hyphenated words as a whole besides their parts
     chr_t token[128];
-    chr_t cp;
-    int len = 0;
-    int is_abbrev = 0;
-    int is_hyphen = 0;
+    uint32_t starts[128];   // Byte offsets of the token chars, tracked for the stream
+    uint32_t ends[128];
+    int len;
+    int is_abbrev;
+    int is_hyphen;
+    int position;
+    int hs;
+};
+
+/* Adds the word made of length token chars from the given one.  Empty words
+ * only take up their position in a stream, as they have no start */
+static void add_token(struct tokenizer *t, int from, int length, int position) {
+    if (t->ts) {
+        if (length == 0) return;
+        struct token_stream *ts = t->ts;
+        struct stream_token st = {t->starts[from], kv_size(ts->chars), length, position};
+        kv_push(struct stream_token, ts->tokens, st);
+        for (int i = from; i < from + length; i++) {
+            kv_push(chr_t, ts->chars, t->token[i]);
+            kv_push(uint32_t, ts->ends, t->ends[i]);
+        }
+        return;
+    }
     word_pos_t word_pos;
-    int position = 0;
-    int hs = 0;
-
-    while (pos < epos) {
-        int size = utf8proc_iterate((unsigned char *)pos, -1, &cp);
-        // If we reached the end we need to add the word
-        int add_word = (pos == (epos - size)) ? 2 : 0;
-        if (size > 0) {
-            // printf("%c %d %d %d\n", pos[0], cp,utf8proc_tolower(cp), utf8proc_category(cp));
-            utf8proc_category_t cat = utf8proc_category(cp);
-            switch (cat) {
-                case UTF8PROC_CATEGORY_LL:
-                case UTF8PROC_CATEGORY_LO:
-                case UTF8PROC_CATEGORY_PC:
-                case UTF8PROC_CATEGORY_MC:
-                case UTF8PROC_CATEGORY_MN:
-                case UTF8PROC_CATEGORY_ND:
-                case UTF8PROC_CATEGORY_NL:
-                case UTF8PROC_CATEGORY_NO:
-                    token[len++] = cp;
-                    break;
-                default:
-                    // u.s.a. => usa
-                    if (((char)cp) == '.') {
-                        if ((len == 1) || is_abbrev) {
-                            is_abbrev = 1;
-                            break;
-                        }
-                    }
-                    // don't => dont
-                    if (((char)cp) == '\'') {
-                        is_abbrev = 1;
-                        break;
-                    }
-                    // Handle hyphenated words
-                    if (((char)cp) == '-' && (len > 0)) {
-                        is_hyphen = 1;
-                        word_pos.word.chars = &token[hs];
-                        word_pos.word.length = len - hs;
-                        word_pos.position = ++position;
-                        cb(&word_pos, data);
-                        hs = len;
-                        break;
-                    }
-                    add_word = 1;
-                    break;
+    word_pos.word.chars = &t->token[from];
+    word_pos.word.length = length;
+    word_pos.position = position;
+    t->cb(&word_pos, t->data);
+}
+
+/* Takes the next char of the normalized text, is_last is set for its last char.
+ * The char comes from the bytes [start, end) of the string */
+static inline void tokenizer_next(struct tokenizer *t, chr_t cp, bool is_word, bool is_last,
+                                  uint32_t start, uint32_t end) {
+    // If we reached the end we need to add the word
+    int add_word = is_last;
+    if (is_word) {
+        t->starts[t->len] = start;
+        t->ends[t->len] = end;
+        t->token[t->len++] = cp;
+    } else if (((char)cp) == '.' && ((t->len == 1) || t->is_abbrev)) {
+        // u.s.a. => usa
+        t->is_abbrev = 1;
+    } else if (((char)cp) == '\'') {
+        // don't => dont
+        t->is_abbrev = 1;
+    } else if (((char)cp) == '-' && (t->len > 0)) {
+        // Handle hyphenated words
+        t->is_hyphen = 1;
+        add_token(t, t->hs, t->len - t->hs, ++t->position);
+        t->hs = t->len;
+    } else {
+        add_word = 1;
+    }
+    // if word needs to be added, do it now
+    if (add_word && t->len > 0) {
+        if (!t->is_hyphen) {
+            add_token(t, 0, t->len, ++t->position);
+        } else if ((t->len - t->hs) > 0) {
+            add_token(t, t->hs, t->len - t->hs, t->position);
+            t->position--;
+            if (t->add_hyphenated) {
+                add_token(t, 0, t->len, ++t->position);
             }
-            pos += size;
-        } else {
-            pos++;
         }
-        // if word needs to be added, do it now
-        if (add_word && len > 0) {
-            if (is_hyphen) {
-                if ((len - hs) > 0) {
-                    word_pos.word.chars = &token[hs];
-                    word_pos.word.length = len - hs;
-                    word_pos.position = position;
-                    cb(&word_pos, data);
-                    position--;
-                } else {
-                    // Word has already been added.
-                    goto reset_word;
-                }
+        // Otherwise the word has already been added.
+        t->is_hyphen = 0;
+        t->is_abbrev = 0;
+        t->len = 0;
+        t->hs = 0;
+    }
+    if (t->len >= 127) {
+        t->len = 0;
+    }
+}
+
+static inline bool is_word_category(utf8proc_category_t cat) {
+    switch (cat) {
+        case UTF8PROC_CATEGORY_LL:
+        case UTF8PROC_CATEGORY_LO:
+        case UTF8PROC_CATEGORY_PC:
+        case UTF8PROC_CATEGORY_MC:
+        case UTF8PROC_CATEGORY_MN:
+        case UTF8PROC_CATEGORY_ND:
+        case UTF8PROC_CATEGORY_NL:
+        case UTF8PROC_CATEGORY_NO:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Normalizes the string with utf8proc and tokenizes the result */
+static void tokenize_unicode(struct tokenizer *t, const char *str) {
+    chr_t stack[STACK_CHARS];
+    chr_t *buf = stack;
+    utf8proc_ssize_t n = utf8proc_decompose((const uint8_t *)str, 0, buf, STACK_CHARS,
+                                            NORMALIZE_OPTIONS);
+    if (n > STACK_CHARS) {
+        buf = malloc(n * sizeof(chr_t));
+        n = utf8proc_decompose((const uint8_t *)str, 0, buf, n, NORMALIZE_OPTIONS);
+    }
+    if (n > 0) {
+        n = utf8proc_normalize_utf32(buf, n, NORMALIZE_OPTIONS);
+    }
+    for (utf8proc_ssize_t i = 0; i < n; i++) {
+        tokenizer_next(t, buf[i], is_word_category(utf8proc_category(buf[i])), i == n - 1, 0, 0);
+    }
+    if (buf != stack) {
+        free(buf);
+    }
+}
+
+/* Returns the length of str if it is all ascii, -1 otherwise */
+static ssize_t ascii_length(const char *str) {
+    size_t n = strlen(str);
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        if (_mm_movemask_epi8(v)) return -1;
+    }
+#endif
+    for (; i < n; i++) {
+        if ((uint8_t)str[i] >= 0x80) return -1;
+    }
+    return n;
+}
+
+// Control chars normalization drops, tabs and line breaks become spaces instead
+static inline bool ascii_is_stripped(uint8_t c) {
+    return (c < 0x20 && (c < '\t' || c > '\r')) || c == 0x7F;
+}
+
+static inline bool ascii_is_word(uint8_t c) {
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+/* Tokenizes the ascii char at *pos the way tokenize_unicode would after
+ * normalization, and moves past it */
+static inline void ascii_next(struct tokenizer *t, const char *str, size_t n, size_t *pos,
+                              ssize_t last) {
+    size_t i = *pos;
+    uint8_t c = str[i];
+    if (c < 0x20 || c == 0x7F) {
+        if (!ascii_is_stripped(c)) {
+            // \r\n is a single space
+            if (c == '\r' && i + 1 < n && str[i + 1] == '\n') i++;
+            tokenizer_next(t, ' ', false, (ssize_t)i == last, *pos, i + 1);
+        }
+    } else {
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        tokenizer_next(t, c, ascii_is_word(c), (ssize_t)i == last, i, i + 1);
+    }
+    *pos = i + 1;
+}
+
+/* Tokenizes an ascii string, which normalization only lower cases and strips
+ * of control chars, without going through utf8proc */
+static void tokenize_ascii(struct tokenizer *t, const char *str, size_t n) {
+    // The last char left after normalization ends the last word
+    ssize_t last = (ssize_t)n - 1;
+    while (last >= 0 && ascii_is_stripped(str[last])) {
+        last--;
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    // Lower case and classify 16 chars at a time, blocks with control chars
+    // are left to ascii_next
+    const __m128i a_1 = _mm_set1_epi8('A' - 1), z1 = _mm_set1_epi8('Z' + 1);
+    const __m128i la_1 = _mm_set1_epi8('a' - 1), lz1 = _mm_set1_epi8('z' + 1);
+    const __m128i d_1 = _mm_set1_epi8('0' - 1), d1 = _mm_set1_epi8('9' + 1);
+    const __m128i under = _mm_set1_epi8('_'), space = _mm_set1_epi8(' ');
+    const __m128i del = _mm_set1_epi8(0x7F), caseb = _mm_set1_epi8(0x20);
+    uint8_t lower[16];
+    while (i + 16 <= n) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        __m128i ctrl = _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del));
+        if (_mm_movemask_epi8(ctrl)) {
+            size_t end = i + 16;
+            while (i < end) {
+                ascii_next(t, str, n, &i, last);
             }
-            word_pos.word.chars = token;
-            word_pos.word.length = len;
-            word_pos.position = ++position;
-            cb(&word_pos, data);
-reset_word:
-            is_hyphen = 0;
-            is_abbrev = 0;
-            len = 0;
-            hs = 0;
+            continue;
         }
-        if (len >= 127) {
-            len = 0;
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, a_1), _mm_cmplt_epi8(v, z1));
+        __m128i l = _mm_or_si128(v, _mm_and_si128(upper, caseb));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, la_1), _mm_cmplt_epi8(l, lz1));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, d_1), _mm_cmplt_epi8(v, d1));
+        __m128i word = _mm_or_si128(_mm_or_si128(alpha, digit), _mm_cmpeq_epi8(v, under));
+        int wmask = _mm_movemask_epi8(word);
+        _mm_storeu_si128((__m128i *)lower, l);
+        for (int k = 0; k < 16; k++) {
+            tokenizer_next(t, lower[k], (wmask >> k) & 1, (ssize_t)(i + k) == last, i + k, i + k + 1);
         }
+        i += 16;
+    }
+#endif
+    while (i < n) {
+        ascii_next(t, str, n, &i, last);
     }
-    free(map_out);
 }
 
-static void analyze_string_for_search(const char *str, new_word_pos_f cb, void *data) {
-    utf8proc_uint8_t *map_out;
-    // Strip accents, invalid chars and lower case everything
-    size_t len_out = utf8proc_map((uint8_t*)str, 0, &map_out, 
-                           UTF8PROC_NULLTERM | UTF8PROC_STABLE |
-                           UTF8PROC_STRIPMARK | UTF8PROC_COMPOSE |
-                           UTF8PROC_COMPAT | UTF8PROC_LUMP | UTF8PROC_STRIPCC | 
-                           UTF8PROC_STRIPNA | UTF8PROC_IGNORE |UTF8PROC_CASEFOLD);
-    const char *pos = (const char *)map_out;
-    const char *epos = (const char *)map_out + len_out;
-    chr_t token[128];
-    chr_t cp;
-    int len = 0;
-    int is_abbrev = 0;
-    int is_hyphen = 0;
-    word_pos_t word_pos;
-    int position = 0;
-    int hs = 0;
-
-    while (pos < epos) {
-        int size = utf8proc_iterate((unsigned char *)pos, -1, &cp);
-        // If we reached the end we need to add the word
-        int add_word = (pos == (epos - size)) ? 2 : 0;
-        if (size > 0) {
-            // printf("%c %d %d %d\n", pos[0], cp,utf8proc_tolower(cp), utf8proc_category(cp));
-            utf8proc_category_t cat = utf8proc_category(cp);
-            switch (cat) {
-                case UTF8PROC_CATEGORY_LL:
-                case UTF8PROC_CATEGORY_LO:
-                case UTF8PROC_CATEGORY_PC:
-                case UTF8PROC_CATEGORY_MC:
-                case UTF8PROC_CATEGORY_MN:
-                case UTF8PROC_CATEGORY_ND:
-                case UTF8PROC_CATEGORY_NL:
-                case UTF8PROC_CATEGORY_NO:
-                    token[len++] = cp;
-                    break;
-                default:
-                    // u.s.a. => usa
-                    if (((char)cp) == '.') {
-                        if ((len == 1) || is_abbrev) {
-                            is_abbrev = 1;
-                            break;
-                        }
-                    }
-                    // don't => dont
-                    if (((char)cp) == '\'') {
-                        is_abbrev = 1;
-                        break;
-                    }
-                    // Handle hyphenated words
-                    if (((char)cp) == '-' && (len > 0)) {
-                        is_hyphen = 1;
-                        word_pos.word.chars = &token[hs];
-                        word_pos.word.length = len - hs;
-                        word_pos.position = ++position;
-                        cb(&word_pos, data);
-                        hs = len;
-                        break;
-                    }
-                    add_word = 1;
-                    break;
-            }
-            pos += size;
-        } else {
+// Composes with the char before it
+static inline bool is_second(chr_t cp) {
+    const utf8proc_property_t *p = utf8proc_get_property(cp);
+    return p->combining_class != 0 || (p->comb_index != UINT16_MAX && p->comb_index >= 0x8000) ||
+           (cp >= 0x1161 && cp <= 0x1175) || (cp >= 0x11A8 && cp <= 0x11C2);
+}
+
+/* Normalizes the string one cluster at a time, a char along with the marks
+ * and chars that compose with it, to know the bytes every normalized char
+ * comes from */
+static void tokenize_unicode_offsets(struct tokenizer *t, const char *str) {
+    const uint8_t *s = (const uint8_t *)str;
+    size_t n = strlen(str);
+    chr_t buf[64];
+    // A char is only fed to the tokenizer once the next one is known, as the
+    // last one ends the last word
+    chr_t pending = 0;
+    uint32_t pstart = 0, pend = 0;
+    bool has_pending = false;
+    size_t pos = 0;
+    while (pos < n) {
+        size_t start = pos;
+        chr_t cp;
+        utf8proc_ssize_t size = utf8proc_iterate(s + pos, n - pos, &cp);
+        if (size <= 0) {
             pos++;
+            continue;
         }
-        // if word needs to be added, do it now
-        if (add_word && len > 0) {
-            if (is_hyphen) {
-                if ((len - hs) > 0) {
-                    word_pos.word.chars = &token[hs];
-                    word_pos.word.length = len - hs;
-                    word_pos.position = position;
-                    cb(&word_pos, data);
-                    position--;
-                } else {
-                    // Word has already been added.
-                    goto reset_word;
-                }
-            } else {
-                word_pos.word.chars = token;
-                word_pos.word.length = len;
-                word_pos.position = ++position;
-                cb(&word_pos, data);
-            }
-reset_word:
-            is_hyphen = 0;
-            is_abbrev = 0;
-            len = 0;
-            hs = 0;
+        pos += size;
+        while (pos < n) {
+            chr_t next;
+            size = utf8proc_iterate(s + pos, n - pos, &next);
+            if (size <= 0 || !(is_second(next) || (cp == '\r' && next == '\n'))) break;
+            cp = next;
+            pos += size;
+        }
+        utf8proc_ssize_t len = utf8proc_decompose(s + start, pos - start, buf, 64,
+                                                  NORMALIZE_OPTIONS & ~UTF8PROC_NULLTERM);
+        if (len > 64) {
+            // Skip absurdly long clusters
+            continue;
+        }
+        if (len > 0) {
+            len = utf8proc_normalize_utf32(buf, len, NORMALIZE_OPTIONS);
         }
-        if (len >= 127) {
-            len = 0;
+        for (utf8proc_ssize_t i = 0; i < len; i++) {
+            if (has_pending) {
+                tokenizer_next(t, pending, is_word_category(utf8proc_category(pending)), false,
+                               pstart, pend);
+            }
+            pending = buf[i];
+            pstart = start;
+            pend = pos;
+            has_pending = true;
         }
     }
-    free(map_out);
+    if (has_pending) {
+        tokenizer_next(t, pending, is_word_category(utf8proc_category(pending)), true,
+                       pstart, pend);
+    }
+}
+
+static void tokenizer_init(struct tokenizer *t, bool add_hyphenated) {
+    t->cb = NULL;
+    t->data = NULL;
+    t->ts = NULL;
+    t->add_hyphenated = add_hyphenated;
+    t->len = 0;
+    t->is_abbrev = 0;
+    t->is_hyphen = 0;
+    t->position = 0;
+    t->hs = 0;
+}
+
+static void tokenize(const char *str, bool add_hyphenated, new_word_pos_f cb, void *data) {
+    struct tokenizer t;
+    tokenizer_init(&t, add_hyphenated);
+    t.cb = cb;
+    t.data = data;
+    ssize_t n = str ? ascii_length(str) : -1;
+    if (n >= 0) {
+        tokenize_ascii(&t, str, n);
+    } else {
+        tokenize_unicode(&t, str);
+    }
+}
+
+static void analyze_string_for_indexing(const char *str, new_word_pos_f cb, void *data) {
+    tokenize(str, true, cb, data);
+}
+
+static void analyze_string_for_search(const char *str, new_word_pos_f cb, void *data) {
+    tokenize(str, false, cb, data);
+}
+
+/* Appends the tokens for indexing str to the stream, with their offsets */
+static void analyze_string_to_stream(const char *str, struct token_stream *ts) {
+    if (!str) return;
+    struct tokenizer t;
+    tokenizer_init(&t, true);
+    t.ts = ts;
+    ssize_t n = ascii_length(str);
+    if (n >= 0) {
+        tokenize_ascii(&t, str, n);
+    } else {
+        tokenize_unicode_offsets(&t, str);
+    }
 }
 
 void init_default_analyzer(void) {
@@ -205,6 +343,7 @@ void init_default_analyzer(void) {
     snprintf(a->name, sizeof(a->name), "%s", "default");
     a->analyze_string_for_indexing = &analyze_string_for_indexing;
     a->analyze_string_for_search = &analyze_string_for_search;
+    a->analyze_string_to_stream = &analyze_string_to_stream;
     register_analyzer(a);
 }
 
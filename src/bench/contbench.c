@@ -0,0 +1,168 @@
+/* Microbenchmark for container operations.  Runs every container pair
+ * operation with each bitset / array kernel the cpu supports and prints
+ * the time per operation along with the speedup over the scalar kernel.
+ *
+ * Usage: contbench [iterations] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "cont.h"
+#include "array.h"
+#include "bitset.h"
+
+#define DEF_ITERATIONS 20000
+
+typedef enum bench_op {
+    B_AND,
+    B_ANDNOT,
+    B_AND_CARD,
+    B_OR,
+    B_CARD,
+    B_MAX
+} BENCH_OP;
+
+static const char *op_names[B_MAX] = {"and", "andnot", "and_card", "or", "card"};
+static const char *pair_names[] = {"bitset/bitset", "bitset/array", "array/bitset",
+                                   "array/array", "small/array", "array/small",
+                                   "run/bitset", "run/run"};
+#define NUM_PAIRS 8
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Creates a container with roughly card random items */
+static struct cont *random_cont(int card) {
+    struct cont *c = cont_new(0);
+    for (int i = 0; i < card; i++) {
+        cont_add(c, rand() & 0xFFFF);
+    }
+    return c;
+}
+
+/* Creates a run container with nruns runs of random lengths */
+static struct cont *random_run_cont(int nruns) {
+    struct cont *c = cont_new(0);
+    for (int i = 0; i < nruns; i++) {
+        int start = rand() & 0xFFFF;
+        int len = rand() % 1000;
+        for (int v = start; v < start + len && v < 65536; v++) {
+            cont_add(c, v);
+        }
+    }
+    cont_optimize(c);
+    return c;
+}
+
+// Keeps the compiler from optimizing away the work
+static volatile uint64_t sink;
+
+static double run_op(BENCH_OP op, struct cont *a, const struct cont *b, int iterations) {
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        struct cont *r = NULL;
+        switch (op) {
+            case B_AND:
+                r = cont_and(a, b);
+                break;
+            case B_ANDNOT:
+                r = cont_andnot(a, b);
+                break;
+            case B_AND_CARD:
+                sink += cont_and_cardinality(a, b);
+                break;
+            case B_OR:
+                // Lazy union is only defined into a bitset container
+                bitset_cont_inplace_union(a, b);
+                break;
+            case B_CARD:
+                bitset_cont_cardinality(a);
+                sink += cont_cardinality(a);
+                break;
+            default:
+                break;
+        }
+        if (r) {
+            sink += cont_cardinality(r);
+            cont_free(r);
+        }
+    }
+    return (now_ns() - start) / iterations;
+}
+
+static void run_pair(int p, const struct cont *a, const struct cont *b, bool bitset,
+                     const char *kernel, bool scalar_kernel, int iterations) {
+    static double scalar[NUM_PAIRS][B_MAX];
+    for (int op = B_AND; op < B_MAX; op++) {
+        // or and card only apply to a bitset on the left
+        if ((op == B_OR || op == B_CARD) && !bitset) {
+            continue;
+        }
+        if (op == B_CARD && p != 0) {
+            continue;
+        }
+        // Work on a copy so in place ops do not change the inputs
+        struct cont c = {cont_duplicate(a)};
+        double ns = run_op(op, &c, b, iterations);
+        free(c.buffer);
+        if (scalar_kernel) {
+            scalar[p][op] = ns;
+        }
+        printf("%-8s %-14s %-10s %12.1f %9.2fx\n", kernel, pair_names[p],
+               op_names[op], ns, scalar[p][op] / ns);
+    }
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : DEF_ITERATIONS;
+    if (iterations <= 0) iterations = DEF_ITERATIONS;
+    srand(42);
+
+    // Densities picked to cover both sides of the array / bitset cutoff
+    struct cont *bitsets[2] = {random_cont(20000), random_cont(40000)};
+    struct cont *arrays[3] = {random_cont(1000), random_cont(3000), random_cont(60)};
+    struct cont *runs[2] = {random_run_cont(20), random_run_cont(50)};
+    const struct cont *pairs[NUM_PAIRS][2] = {
+        {bitsets[0], bitsets[1]},
+        {bitsets[0], arrays[0]},
+        {arrays[0], bitsets[0]},
+        {arrays[0], arrays[1]},
+        // Skewed sizes, these gallop
+        {arrays[2], arrays[1]},
+        {arrays[1], arrays[2]},
+        {runs[0], bitsets[0]},
+        {runs[0], runs[1]},
+    };
+
+    printf("%-8s %-14s %-10s %12s %10s\n", "kernel", "pair", "op", "ns/op", "speedup");
+    for (int k = BK_SCALAR; k < BK_MAX; k++) {
+        if (!bitset_kernel_select(k)) {
+            continue;
+        }
+        for (int p = 0; p < 3; p++) {
+            run_pair(p, pairs[p][0], pairs[p][1], p < 2, bitset_ops.name, k == BK_SCALAR, iterations);
+        }
+        for (int p = 6; p < NUM_PAIRS; p++) {
+            run_pair(p, pairs[p][0], pairs[p][1], false, bitset_ops.name, k == BK_SCALAR, iterations);
+        }
+    }
+    for (int k = AK_SCALAR; k < AK_MAX; k++) {
+        if (!array_kernel_select(k)) {
+            continue;
+        }
+        for (int p = 3; p < 6; p++) {
+            run_pair(p, pairs[p][0], pairs[p][1], false, array_ops.name, k == AK_SCALAR, iterations);
+        }
+    }
+
+    cont_free(bitsets[0]);
+    cont_free(bitsets[1]);
+    for (int i = 0; i < 3; i++) {
+        cont_free(arrays[i]);
+    }
+    cont_free(runs[0]);
+    cont_free(runs[1]);
+    return 0;
+}
@@ -0,0 +1,271 @@
+/* Microbenchmark for the disk trie.  Inserts random words into a new trie
+ * and prints the time per dtrie_insert, dtrie_exists and prefix / typo
+ * lookups, on the trie nodes and on the frozen trie.  Finally it measures
+ * lookup latency while another thread keeps inserting words in batches,
+ * like queries during indexing.
+ *
+ * Usage: dtriebench [words] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <lmdb.h>
+#include "dtrie.h"
+#include "bitset.h"
+#include "array.h"
+#include "kvec.h"
+
+#define DEF_WORDS   200000
+#define MAX_LEN     14
+// Words per write batch while measuring lookups during inserts
+#define BATCH_SIZE  1000
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Mostly ascii words with the odd non ascii char, like real text
+static const chr_t alphabet[] = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k',
+                                 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
+                                 'w', 'x', 'y', 'z', '0', '1', '2', 0xE9, 0xFC, 0x3B1};
+#define ALPHABET_SIZE (sizeof(alphabet) / sizeof(alphabet[0]))
+
+static void random_word(word_t *w) {
+    w->length = 2 + rand() % (MAX_LEN - 1);
+    w->chars = malloc(w->length * sizeof(chr_t));
+    for (int i = 0; i < w->length; i++) {
+        // Skew towards the first letters so that words share prefixes
+        int r = rand() % ALPHABET_SIZE;
+        w->chars[i] = alphabet[(r * r) / ALPHABET_SIZE];
+    }
+}
+
+static void report(const char *op, double ns, int count) {
+    printf("%-14s %10d %12.1f\n", op, count, ns / count);
+}
+
+// Keeps the compiler from optimizing away the work
+static volatile uint64_t sink;
+
+struct reader {
+    struct dtrie *dt;
+    word_t *words;
+    int num_words;
+    int stop;
+    double *latency;
+    int count;
+    int size;
+};
+
+/* Does prefix lookups till stopped, recording the time of each */
+static void *reader_thread(void *data) {
+    struct reader *r = data;
+    while (!__atomic_load_n(&r->stop, __ATOMIC_RELAXED) && r->count < r->size) {
+        word_t *word = &r->words[rand() % r->num_words];
+        word_t w = {word->chars, word->length > 5 ? 5 : word->length};
+        term_t t = {&w, 1, 0, 0};
+        double start = now_ns();
+        struct termresult *tr = dtrie_lookup_term(r->dt, &t);
+        r->latency[r->count++] = now_ns() - start;
+        sink += kh_size(tr->wordids) + kh_size(tr->twids);
+        termresult_free(tr);
+    }
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Prefix and typo lookups, names of the results get suffix */
+static void bench_lookups(struct dtrie *dt, word_t *words, int num_words, const char *suffix) {
+    char name[32];
+    // Prefix walks, on a prefix of the word with one char dropped
+    int num_lookups = num_words / 10;
+    double start = now_ns();
+    for (int i = 0; i < num_lookups; i++) {
+        word_t w = {words[i].chars, words[i].length > 5 ? 5 : words[i].length};
+        term_t t = {&w, 1, 0, 0};
+        struct termresult *tr = dtrie_lookup_term(dt, &t);
+        sink += kh_size(tr->wordids) + kh_size(tr->twids);
+        termresult_free(tr);
+    }
+    snprintf(name, sizeof(name), "prefix%s", suffix);
+    report(name, now_ns() - start, num_lookups);
+
+    // Typo lookups walk a lot more of the trie
+    num_lookups = num_words / 100;
+    for (int maxdist = 1; maxdist <= 2; maxdist++) {
+        start = now_ns();
+        for (int i = 0; i < num_lookups; i++) {
+            term_t t = {&words[i], 0, 1, maxdist};
+            struct termresult *tr = dtrie_lookup_term(dt, &t);
+            sink += kh_size(tr->wordids) + kh_size(tr->twids);
+            termresult_free(tr);
+        }
+        snprintf(name, sizeof(name), "typo%d%s", maxdist, suffix);
+        report(name, now_ns() - start, num_lookups);
+    }
+}
+
+/* Inserts words in batches while a reader thread does lookups and prints the
+ * lookup latency percentiles */
+static void bench_concurrent(struct dtrie *dt, MDB_dbi dbi, MDB_txn *txn,
+                             word_t *words, int num_words, word_t *more, int num_more) {
+    struct reader r = {dt, words, num_words, 0, NULL, 0, 10000000};
+    r.latency = malloc(r.size * sizeof(double));
+    kvec_t(struct dtrie_garbage *) garbage;
+    kv_init(garbage);
+    uint32_t twids[DT_MAX_LEVELS];
+    pthread_t thread;
+    pthread_create(&thread, NULL, reader_thread, &r);
+    double start = now_ns();
+    for (int i = 0; i < num_more; i += BATCH_SIZE) {
+        dtrie_write_start(dt);
+        for (int j = i; j < i + BATCH_SIZE && j < num_more; j++) {
+            if (!dtrie_exists(dt, more[j].chars, more[j].length, twids)) {
+                dtrie_insert(dt, more[j].chars, more[j].length, twids);
+            }
+        }
+        struct dtrie_garbage *g = dtrie_write_end(dt, dbi, txn);
+        if (g) {
+            kv_push(struct dtrie_garbage *, garbage, g);
+        }
+    }
+    double elapsed = now_ns() - start;
+    __atomic_store_n(&r.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+    // The reader is done, nodes replaced by the batches can be reused
+    for (int i = 0; i < kv_size(garbage); i++) {
+        dtrie_reclaim(kv_A(garbage, i));
+    }
+    kv_destroy(garbage);
+
+    report("insert_batch", elapsed, num_more);
+    qsort(r.latency, r.count, sizeof(double), cmp_double);
+    if (r.count) {
+        printf("%-14s %10d %12.1f\n", "lookup_p50", r.count, r.latency[r.count / 2]);
+        printf("%-14s %10d %12.1f\n", "lookup_p99", r.count, r.latency[(int)(r.count * 0.99)]);
+        printf("%-14s %10d %12.1f\n", "lookup_max", r.count, r.latency[r.count - 1]);
+    }
+    free(r.latency);
+}
+
+int main(int argc, char **argv) {
+    int num_words = argc > 1 ? atoi(argv[1]) : DEF_WORDS;
+    if (num_words <= 0) num_words = DEF_WORDS;
+    srand(42);
+    init_bitset_kernels();
+    init_array_kernels();
+
+    char dir[] = "/tmp/dtriebenchXXXXXX";
+    if (!mkdtemp(dir)) {
+        printf("Failed to create a temp dir\n");
+        return 1;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/trie", dir);
+
+    MDB_env *env;
+    MDB_txn *txn;
+    MDB_dbi dbi;
+    mdb_env_create(&env);
+    mdb_env_set_mapsize(env, 1UL << 30);
+    mdb_env_open(env, dir, MDB_NOSYNC, 0664);
+    mdb_txn_begin(env, NULL, 0, &txn);
+    mdb_dbi_open(txn, NULL, 0, &dbi);
+    struct dtrie *dt = dtrie_new(path, dbi, txn);
+    if (!dt) {
+        return 1;
+    }
+
+    // Half the words go in first, the rest are added while looking up
+    word_t *words = malloc(num_words * 2 * sizeof(word_t));
+    uint32_t *wids = malloc(num_words * sizeof(uint32_t));
+    for (int i = 0; i < num_words * 2; i++) {
+        random_word(&words[i]);
+    }
+
+    printf("%-14s %10s %12s\n", "op", "count", "ns/op");
+    uint32_t twids[DT_MAX_LEVELS];
+    dtrie_write_start(dt);
+    double start = now_ns();
+    for (int i = 0; i < num_words; i++) {
+        wids[i] = dtrie_insert(dt, words[i].chars, words[i].length, twids);
+    }
+    report("insert", now_ns() - start, num_words);
+    struct dtrie_garbage *g = dtrie_write_end(dt, dbi, txn);
+    if (g) {
+        dtrie_reclaim(g);
+    }
+
+    start = now_ns();
+    for (int i = 0; i < num_words; i++) {
+        sink += dtrie_insert(dt, words[i].chars, words[i].length, twids);
+    }
+    report("insert_exist", now_ns() - start, num_words);
+
+    int errors = 0;
+    start = now_ns();
+    for (int i = 0; i < num_words; i++) {
+        uint32_t wid = dtrie_exists(dt, words[i].chars, words[i].length, twids);
+        errors += (wid != wids[i]);
+    }
+    report("exists", now_ns() - start, num_words);
+
+    // Words which are mostly not there
+    start = now_ns();
+    for (int i = 0; i < num_words; i++) {
+        chr_t c = words[i].chars[0];
+        words[i].chars[0] = 0x4E00;
+        sink += dtrie_exists(dt, words[i].chars, words[i].length, twids);
+        words[i].chars[0] = c;
+    }
+    report("exists_miss", now_ns() - start, num_words);
+
+    bench_lookups(dt, words, num_words, "");
+
+    // The same lookups on the frozen trie
+    if (dtrie_freeze(dt)) {
+        uint64_t size, frozen_size;
+        dtrie_sizes(dt, &size, &frozen_size);
+        printf("%-14s %10" PRIu64 " %12" PRIu64 "\n", "size / frozen", size, frozen_size);
+        bench_lookups(dt, words, num_words, "_frozen");
+        start = now_ns();
+        for (int i = 0; i < num_words; i++) {
+            word_t w = {words[i].chars, words[i].length};
+            errors += (dtrie_lookup_exact(dt, &w) != wids[i]);
+        }
+        report("exact_frozen", now_ns() - start, num_words);
+    } else {
+        printf("Failed to freeze the trie\n");
+    }
+
+    bench_concurrent(dt, dbi, txn, words, num_words, words + num_words, num_words);
+
+    if (errors) {
+        printf("%d words were not found after insert\n", errors);
+    }
+
+    dump_dtrie_stats(dt);
+    mdb_txn_abort(txn);
+    mdb_env_close(env);
+    dtrie_clear(dt);
+    dtrie_free(dt, dbi, NULL);
+    for (int i = 0; i < num_words * 2; i++) {
+        free(words[i].chars);
+    }
+    free(words);
+    free(wids);
+    snprintf(path, sizeof(path), "%s/data.mdb", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/lock.mdb", dir);
+    unlink(path);
+    rmdir(dir);
+    return errors ? 1 : 0;
+}
@@ -43,6 +43,8 @@
 #define MDB_DATA_FILE   "data.mdb"
 #define MDB_LOCK_FILE   "lock.mdb"
 #define DTRIE_FILE      "dtrie.db"
+#define SEGMENT_WAL_FILE        "segment.wal"
+#define SEGMENT_MERGE_WAL_FILE  "segment.merge.wal"
 
 // Settings
 #define APPID_SIZE      8
@@ -55,6 +57,7 @@
 #define PORT            "port"
 #define HTTPS           "https"
 #define NUMTHREADS      "numThreads"
+#define TRIE_HUGEPAGES  "trieHugePages"
 
 // Json responses
 #define J_SUCCESS   "{\"success\":true}"
@@ -75,6 +78,7 @@
 #define J_SHARDS        "shards"
 #define J_ID            "_id"
 #define J_DOCID         "_docid"
+#define J_DOC           "doc"
 #define J_HIGHLIGHT     "_highlight"
 #define J_TYPE          "type"
 #define J_PROPERTIES    "properties"
@@ -88,6 +92,19 @@
 #define J_SUM_DD        "sumDocDataLength"
 #define J_MAX_DD        "maxDocDataLength"
 #define J_AVG_DD        "avgDocDataLength"
+#define J_FROZEN        "frozen"
+#define J_TRIE_SIZE     "trieSize"
+#define J_FROZEN_SIZE   "frozenSize"
+#define J_TRIE          "trie"
+#define J_PAGES         "pages"
+#define J_FILE_PAGES    "filePages"
+#define J_BIG_NODES     "bigNodes"
+#define J_NODE_TYPES    "nodeTypes"
+#define J_NODE_SIZE     "nodeSize"
+#define J_USED          "used"
+#define J_FREE          "free"
+#define J_RETIRED       "retired"
+#define J_UTILIZATION   "utilization"
 
 // API Settings fields
 #define J_S_INDEXFIELDS     "indexedFields"
@@ -100,6 +117,9 @@
 #define J_S_RANKALGO        "rankAlgorithm"
 #define J_S_FULLSCAN        "fullScan"
 #define J_S_FULLSCAN_THRES  "fullScanThreshold"
+#define J_S_MIN_WORD_1TYPO  "minWordSizefor1Typo"
+#define J_S_MIN_WORD_2TYPOS "minWordSizefor2Typos"
+#define J_S_PREFIX_LEVELS   "prefixLevels"
 #define J_S_GET_FIELDS      "getFields"
 #define J_S_HIGHLIGHT_FIELDS    "highlightFields"
 #define J_S_HIGHLIGHT_SOURCE    "highlightSource"
@@ -138,6 +158,18 @@
 #define J_R_QUERYTEXT     "queryText"
 #define J_R_RESULTS       "results"
 #define J_R_SUCCESS       "success"
+#define J_R_ARENA         "arena"
+#define J_R_ALLOCS        "allocs"
+#define J_R_BYTES         "bytes"
+#define J_R_CHUNKS        "chunks"
+
+// Bulk response attributes
+#define J_B_BATCHES       "batches"
+#define J_B_FIRST_LINE    "firstLine"
+#define J_B_ERRORS        "errors"
+#define J_B_NUM_ERRORS    "numErrors"
+#define J_B_LINE          "line"
+#define J_B_MESSAGE       "message"
 
 #define ORDER_ASC           "asc"
 #define ORDER_DESC          "desc"
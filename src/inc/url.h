@@ -13,6 +13,8 @@
 #define URL_CLEAR       "clear"
 #define URL_QUERY       "query"
 #define URL_STATS       "stats"
+#define URL_FREEZE      "freeze"
+#define URL_BULK        "bulk"
 #define URL_MULTI       "*"
 
 #endif
@@ -42,6 +42,19 @@ struct hthread {
     pthread_t tid;
     h2o_context_t ctx;
     h2o_multithread_receiver_t server_notifications;
+    h2o_multithread_receiver_t api_responses;
+};
+
+/* A response to a request, sent once the work of its callback is done on
+ * another thread.  The request is gone before that if the client disconnects */
+struct api_async {
+    h2o_multithread_message_t super;
+    h2o_multithread_receiver_t *receiver;   // Of the thread owning the request
+    pthread_mutex_t lock;
+    h2o_req_t *req;                         // NULL once the request is disposed
+    int refs;                               // Held by the request and the response
+    HTTP_CODE code;
+    char *resp;
 };
 
 struct listener_ctx_t {
@@ -139,6 +152,76 @@ static int api_handle_cb(h2o_req_t *req, struct url_cbdata *cbdata) {
     return 0;
 }
 
+static void api_async_release(struct api_async *a) {
+    pthread_mutex_lock(&a->lock);
+    bool last = --a->refs == 0;
+    pthread_mutex_unlock(&a->lock);
+    if (last) {
+        pthread_mutex_destroy(&a->lock);
+        free(a);
+    }
+}
+
+static void on_async_req_dispose(void *data) {
+    struct api_async *a = *(struct api_async **)data;
+    pthread_mutex_lock(&a->lock);
+    a->req = NULL;
+    pthread_mutex_unlock(&a->lock);
+    api_async_release(a);
+}
+
+/* Called by a callback which returns NULL and responds later through
+ * api_async_respond from any thread */
+struct api_async *api_async_new(h2o_req_t *req) {
+    struct api_async *a = calloc(1, sizeof(struct api_async));
+    struct hthread *t = H2O_STRUCT_FROM_MEMBER(struct hthread, ctx, req->conn->ctx);
+    a->receiver = &t->api_responses;
+    pthread_mutex_init(&a->lock, NULL);
+    a->req = req;
+    a->refs = 2;
+    struct api_async **slot = h2o_mem_alloc_shared(&req->pool, sizeof(*slot), on_async_req_dispose);
+    *slot = a;
+    return a;
+}
+
+/* Returns the request, or NULL if it is gone.  The request stays valid till
+ * api_async_unlock, which has to be called either way */
+h2o_req_t *api_async_lock(struct api_async *a) {
+    pthread_mutex_lock(&a->lock);
+    return a->req;
+}
+
+void api_async_unlock(struct api_async *a) {
+    pthread_mutex_unlock(&a->lock);
+}
+
+/* Hands the response over to the thread of the request, a is not to be used
+ * after this */
+void api_async_respond(struct api_async *a, HTTP_CODE code, char *resp) {
+    a->code = code;
+    a->resp = resp;
+    h2o_multithread_send_message(a->receiver, &a->super);
+}
+
+static void on_api_response(h2o_multithread_receiver_t *receiver, h2o_linklist_t *messages) {
+    while (!h2o_linklist_is_empty(messages)) {
+        h2o_multithread_message_t *message = H2O_STRUCT_FROM_MEMBER(h2o_multithread_message_t, link, messages->next);
+        h2o_linklist_unlink(&message->link);
+        struct api_async *a = H2O_STRUCT_FROM_MEMBER(struct api_async, super, message);
+        // Requests are only disposed on this thread, so it stays valid once seen
+        h2o_req_t *req = api_async_lock(a);
+        api_async_unlock(a);
+        if (req) {
+            req->res.status = a->code;
+            req->res.reason = http_reason(a->code);
+            api_send_response(req, a->resp);
+        } else {
+            free(a->resp);
+        }
+        api_async_release(a);
+    }
+}
+
 static char * strnstr(const char *s, const char *find, size_t slen) {
     char c, sc;
     if ((c = *find++) != '\0') {
@@ -420,6 +503,8 @@ void *run_loop(void *_thread_index) {
     h2o_context_init(&threads[thread_index].ctx, h2o_evloop_create(), &config);
     h2o_multithread_register_receiver(threads[thread_index].ctx.queue, 
             &threads[thread_index].server_notifications, on_server_notification);
+    h2o_multithread_register_receiver(threads[thread_index].ctx.queue, 
+            &threads[thread_index].api_responses, on_api_response);
 
     threads[thread_index].tid = pthread_self();
     // First thread is the global context
@@ -2,6 +2,7 @@
 #define _API_H
 #include <h2o.h>
 #include "khash.h"
+#include "utils.h"
 
 #define M_APP_ID "x-marlin-application-id"
 #define M_APP_ID_LEN 23
@@ -31,5 +32,12 @@ char *api_bad_request(h2o_req_t *req);
 char *api_not_found(h2o_req_t *req);
 char *api_success(h2o_req_t *req);
 
+// Responding to a request from another thread
+struct api_async;
+struct api_async *api_async_new(h2o_req_t *req);
+h2o_req_t *api_async_lock(struct api_async *a);
+void api_async_unlock(struct api_async *a);
+void api_async_respond(struct api_async *a, HTTP_CODE code, char *resp);
+
 #endif
 
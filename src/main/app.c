@@ -43,14 +43,19 @@ const char *permission_str[] = {
 };
 
 
-static void app_free_job(struct app *c) {
-    // job has been added
-    // Process only one free job every timeout.  We are not in a hurry to
-    // free
-    // TODO: make sure APP_TIMER_SECS has passed before free
+/* Processes the oldest free job.  Unless forced, jobs are only processed
+ * once they are APP_TIMER_SECS old, so that readers still using what is
+ * freed are done with it.  Returns false if there was nothing to do */
+static bool app_free_job(struct app *c, bool force) {
+    bool done = false;
     WRLOCK(&c->free_lock);
     if (!c->fjob_head) goto unlock;
     struct free_job *fj = c->fjob_head;
+    if (!force) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        if (now.tv_sec - fj->time_added.tv_sec < APP_TIMER_SECS) goto unlock;
+    }
     // Incase this is the last job..
     if (c->fjob_head == c->fjob_tail) {
         c->fjob_head = c->fjob_tail = NULL;
@@ -61,15 +66,20 @@ static void app_free_job(struct app *c) {
     // Do the actual free
     switch(fj->type) {
         case FREE_TRIE:
-            dtrie_free(fj->ptr_to_free);
+            dtrie_free(fj->ptr_to_free, 0, NULL);
+            break;
+        case FREE_TRIE_NODES:
+            dtrie_reclaim(fj->ptr_to_free);
             break;
         case FREE_BMAP:
             bmap_free(fj->ptr_to_free);
             break;
     }
     free(fj);
+    done = true;
 unlock:
     UNLOCK(&c->free_lock);
+    return done;
 }
 
 /* NOTE: This gets called every 5 seconds */
@@ -77,7 +87,12 @@ static void app_timer_callback(h2o_timeout_entry_t *entry) {
     M_DBG("App timeout!");
     struct app_timeout *at = (struct app_timeout *)entry;
     struct app *a = at->app;
-    app_free_job(a);
+    // Every write batch adds a job, do all that are old enough
+    while (app_free_job(a, false));
+    // Merge the segments no write merged for a while
+    for (int i = 0; i < kv_size(a->indexes); i++) {
+        index_merge_aged_segments(kv_A(a->indexes, i));
+    }
     // restart the timer
     h2o_timeout_link(g_h2o_ctx->loop, &a->timeout, &a->timeout_entry.te);
 }
@@ -718,9 +733,7 @@ void app_free(struct app *a) {
     h2o_timeout_dispose(g_h2o_ctx->loop, &a->timeout);
 
     // Handle free jobs
-    while (a->fjob_head) {
-        app_free_job(a);
-    }
+    while (app_free_job(a, true));
     DESTROYLOCK(&a->free_lock);
     // finally free the app
     free(a);
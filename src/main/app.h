@@ -12,6 +12,7 @@
 
 typedef enum free_job_type {
     FREE_TRIE,
+    FREE_TRIE_NODES,
     FREE_BMAP,
 } FREE_JOB_TYPE;
 
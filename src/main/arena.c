@@ -0,0 +1,101 @@
+#include "arena.h"
+#include "platform.h"
+#include <stdlib.h>
+#include <string.h>
+
+static inline size_t align_size(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void arena_init(struct arena *a) {
+    memset(a, 0, sizeof(struct arena));
+}
+
+static struct arena_chunk *arena_chunk_new(struct arena *a, size_t size) {
+    struct arena_chunk *c = malloc(sizeof(struct arena_chunk) + size);
+    c->size = size;
+    c->used = 0;
+    a->num_chunks++;
+    return c;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    size = align_size(size);
+    a->num_allocs++;
+    a->bytes += size;
+    struct arena_chunk *c = a->head;
+    if (UNLIKELY(!c || c->used + size > c->size)) {
+        if (size > ARENA_BIG_SIZE && c) {
+            // Big items get a chunk of their own kept behind the head, so
+            // small items keep filling the head chunk
+            struct arena_chunk *big = arena_chunk_new(a, size);
+            big->used = size;
+            big->next = c->next;
+            c->next = big;
+            return big->data;
+        }
+        c = arena_chunk_new(a, size > ARENA_BIG_SIZE ? size : ARENA_CHUNK_SIZE);
+        c->next = a->head;
+        a->head = c;
+    }
+    void *p = c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+void *arena_calloc(struct arena *a, size_t n, size_t size) {
+    void *p = arena_alloc(a, n * size);
+    memset(p, 0, n * size);
+    return p;
+}
+
+/* Grows p in place when it is the last item allocated and the chunk has
+ * room, copies it to a new item otherwise */
+void *arena_realloc(struct arena *a, void *p, size_t old_size, size_t size) {
+    if (!p) {
+        return arena_alloc(a, size);
+    }
+    struct arena_chunk *c = a->head;
+    old_size = align_size(old_size);
+    size = align_size(size);
+    char *end = c->data + c->used;
+    if ((char *)p + old_size == end && (char *)p + size <= c->data + c->size) {
+        a->bytes += size - old_size;
+        c->used += size - old_size;
+        return p;
+    }
+    if (size <= old_size) {
+        return p;
+    }
+    void *n = arena_alloc(a, size);
+    memcpy(n, p, old_size);
+    return n;
+}
+
+struct arena_mark arena_get_mark(const struct arena *a) {
+    struct arena_mark m = {a->head, a->head ? a->head->next : NULL,
+                           a->head ? a->head->used : 0};
+    return m;
+}
+
+void arena_release(struct arena *a, struct arena_mark m) {
+    while (a->head != m.chunk) {
+        struct arena_chunk *c = a->head;
+        a->head = c->next;
+        free(c);
+    }
+    if (a->head) {
+        // Free the big items put behind the chunk since the mark
+        while (a->head->next != m.next) {
+            struct arena_chunk *c = a->head->next;
+            a->head->next = c->next;
+            free(c);
+        }
+        a->head->used = m.used;
+    }
+}
+
+void arena_destroy(struct arena *a) {
+    struct arena_mark m = {NULL, NULL, 0};
+    arena_release(a, m);
+}
@@ -0,0 +1,44 @@
+/* Region allocator for memory that lives as long as a shard query.  Items
+ * are carved out of large chunks and all of them are released at once,
+ * there is no per item free */
+#ifndef __ARENA_H
+#define __ARENA_H
+#include <stddef.h>
+#include <inttypes.h>
+
+#define ARENA_CHUNK_SIZE    (64 * 1024)
+#define ARENA_ALIGN         16
+// Allocations bigger than this get a chunk of their own
+#define ARENA_BIG_SIZE      (ARENA_CHUNK_SIZE / 4)
+
+struct arena_chunk {
+    struct arena_chunk *next;   // Previously filled chunk
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+    struct arena_chunk *head;   // Chunk we are allocating from
+    // Counters to trace how much a query allocates
+    uint32_t num_allocs;
+    uint32_t num_chunks;        // Chunks requested from malloc
+    size_t bytes;
+};
+
+/* Position in the arena, releasing to it frees everything allocated after */
+struct arena_mark {
+    struct arena_chunk *chunk;
+    struct arena_chunk *next;   // Chunk behind it, big items go in between
+    size_t used;
+};
+
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+void *arena_calloc(struct arena *a, size_t n, size_t size);
+void *arena_realloc(struct arena *a, void *p, size_t old_size, size_t size);
+struct arena_mark arena_get_mark(const struct arena *a);
+void arena_release(struct arena *a, struct arena_mark m);
+void arena_destroy(struct arena *a);
+
+#endif
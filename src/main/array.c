@@ -0,0 +1,392 @@
+#include "array.h"
+#include "platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ARRAY_X86 1
+#include <immintrin.h>
+#endif
+
+/********** Scalar kernels **********/
+
+static int scalar_intersect(const uint16_t *a, int la, const uint16_t *b, int lb, uint16_t *out) {
+    int i = 0, j = 0, count = 0;
+    while (i < la && j < lb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            out[count++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+static int scalar_intersect_card(const uint16_t *a, int la, const uint16_t *b, int lb) {
+    int i = 0, j = 0, count = 0;
+    while (i < la && j < lb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            count++;
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+static int scalar_difference(const uint16_t *a, int la, const uint16_t *b, int lb, uint16_t *out) {
+    int i = 0, j = 0, count = 0;
+    while (i < la && j < lb) {
+        if (a[i] < b[j]) {
+            out[count++] = a[i++];
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            i++;
+            j++;
+        }
+    }
+    if (i < la) {
+        memmove(out + count, a + i, (la - i) * sizeof(uint16_t));
+        count += la - i;
+    }
+    return count;
+}
+
+#ifdef ARRAY_X86
+
+/********** SSE4.2 kernels **********/
+/* Blocks of 8 items are compared all against all using pcmpestrm, matching
+ * items are then packed using a pshufb mask looked up from the match bits.
+ * Based on Schlegel et al, "Fast Sorted-Set Intersection using SIMD Instructions" */
+
+#define SSE_FN __attribute__((target("sse4.2,popcnt")))
+#define SSE_MODE (_SIDD_UWORD_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK)
+
+// pshufb masks packing the items selected by an 8 bit mask to the front
+static uint8_t shuffle_mask16[256][16];
+
+static void setup_shuffle_masks(void) {
+    for (int m = 0; m < 256; m++) {
+        int p = 0;
+        memset(shuffle_mask16[m], 0xFF, 16);
+        for (int i = 0; i < 8; i++) {
+            if (m & (1 << i)) {
+                shuffle_mask16[m][p++] = 2 * i;
+                shuffle_mask16[m][p++] = 2 * i + 1;
+            }
+        }
+    }
+}
+
+SSE_FN static inline int sse_match_mask(__m128i v_a, __m128i v_b, int lb) {
+    // Bit i is set when a[i] is present anywhere in b
+    return _mm_extract_epi32(_mm_cmpestrm(v_b, lb, v_a, 8, SSE_MODE), 0);
+}
+
+SSE_FN static inline void sse_pack(__m128i v, int mask, uint16_t *out) {
+    __m128i sm = _mm_loadu_si128((const __m128i *)shuffle_mask16[mask]);
+    _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(v, sm));
+}
+
+SSE_FN static int sse_intersect(const uint16_t *a, int la, const uint16_t *b, int lb, uint16_t *out) {
+    const int st_a = la & ~7, st_b = lb & ~7;
+    int i = 0, j = 0, count = 0;
+    if (st_a && st_b) {
+        __m128i v_a = _mm_loadu_si128((const __m128i *)a);
+        __m128i v_b = _mm_loadu_si128((const __m128i *)b);
+        while (true) {
+            const int mask = sse_match_mask(v_a, v_b, 8);
+            if (out) {
+                sse_pack(v_a, mask, out + count);
+            }
+            count += _mm_popcnt_u32(mask);
+            const uint16_t a_max = a[i + 7];
+            const uint16_t b_max = b[j + 7];
+            if (a_max <= b_max) {
+                i += 8;
+                if (i == st_a) break;
+                v_a = _mm_loadu_si128((const __m128i *)(a + i));
+            }
+            if (b_max <= a_max) {
+                j += 8;
+                if (j == st_b) break;
+                v_b = _mm_loadu_si128((const __m128i *)(b + j));
+            }
+        }
+    }
+    // Finish up the tail
+    if (out) {
+        return count + scalar_intersect(a + i, la - i, b + j, lb - j, out + count);
+    }
+    return count + scalar_intersect_card(a + i, la - i, b + j, lb - j);
+}
+
+SSE_FN static int sse_intersect_card(const uint16_t *a, int la, const uint16_t *b, int lb) {
+    return sse_intersect(a, la, b, lb, NULL);
+}
+
+SSE_FN static int sse_difference(const uint16_t *a, int la, const uint16_t *b, int lb, uint16_t *out) {
+    const int st_a = la & ~7, st_b = lb & ~7;
+    int i = 0, j = 0, count = 0;
+    if (st_a && st_b) {
+        __m128i v_a = _mm_loadu_si128((const __m128i *)a);
+        __m128i v_b = _mm_loadu_si128((const __m128i *)b);
+        // Items of the current a block found in any b block so far
+        int found = 0;
+        while (true) {
+            found |= sse_match_mask(v_a, v_b, 8);
+            const uint16_t a_max = a[i + 7];
+            const uint16_t b_max = b[j + 7];
+            if (a_max <= b_max) {
+                sse_pack(v_a, found ^ 0xFF, out + count);
+                count += _mm_popcnt_u32(found ^ 0xFF);
+                i += 8;
+                found = 0;
+                if (i == st_a) break;
+                v_a = _mm_loadu_si128((const __m128i *)(a + i));
+            }
+            if (b_max <= a_max) {
+                j += 8;
+                if (j == st_b) {
+                    // Compare the pending a block against what is left of b
+                    if (j < lb) {
+                        uint16_t tail[8] = {0};
+                        memcpy(tail, b + j, (lb - j) * sizeof(uint16_t));
+                        found |= sse_match_mask(v_a, _mm_loadu_si128((const __m128i *)tail), lb - j);
+                    }
+                    sse_pack(v_a, found ^ 0xFF, out + count);
+                    count += _mm_popcnt_u32(found ^ 0xFF);
+                    i += 8;
+                    break;
+                }
+                v_b = _mm_loadu_si128((const __m128i *)(b + j));
+            }
+        }
+    }
+    return count + scalar_difference(a + i, la - i, b + j, lb - j, out + count);
+}
+
+#endif
+
+static const struct array_ops kernels[AK_MAX] = {
+    {AK_SCALAR, "scalar", scalar_intersect, scalar_intersect_card, scalar_difference},
+#ifdef ARRAY_X86
+    {AK_SSE42, "sse4.2", sse_intersect, sse_intersect_card, sse_difference},
+#endif
+};
+
+// Scalar until init_array_kernels is called, so early users still work
+struct array_ops array_ops = {AK_SCALAR, "scalar", scalar_intersect,
+                              scalar_intersect_card, scalar_difference};
+
+bool array_kernel_supported(ARRAY_KERNEL k) {
+    switch (k) {
+        case AK_SCALAR:
+            return true;
+#ifdef ARRAY_X86
+        case AK_SSE42:
+            return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+#endif
+        default:
+            return false;
+    }
+}
+
+/* Switch to a given kernel, returns false if the cpu cannot run it.
+ * NOTE: Not thread safe, only call at startup or from benchmarks */
+bool array_kernel_select(ARRAY_KERNEL k) {
+    if (!array_kernel_supported(k)) {
+        return false;
+    }
+#ifdef ARRAY_X86
+    if (k == AK_SSE42) {
+        setup_shuffle_masks();
+    }
+#endif
+    array_ops = kernels[k];
+    return true;
+}
+
+/* Picks the best kernel the cpu supports */
+void init_array_kernels(void) {
+#ifdef ARRAY_X86
+    __builtin_cpu_init();
+#endif
+    for (int k = AK_MAX - 1; k >= AK_SCALAR; k--) {
+        if (array_kernel_select(k)) {
+            break;
+        }
+    }
+}
+
+/********** Galloping **********/
+
+/* Returns the first position after pos with a[position] >= min, or len if
+ * there is none. Probes at exponentially increasing distances and then
+ * binary searches the last interval */
+static inline int gallop(const uint16_t *a, int pos, int len, uint16_t min) {
+    int lower = pos + 1;
+    if (lower >= len || a[lower] >= min) {
+        return lower;
+    }
+    int span = 1;
+    while (lower + span < len && a[lower + span] < min) {
+        span <<= 1;
+    }
+    int upper = (lower + span < len) ? lower + span : len - 1;
+    if (a[upper] < min) {
+        return len;
+    }
+    // a[lower + span/2] < min <= a[upper]
+    lower += span >> 1;
+    while (lower + 1 != upper) {
+        int mid = (lower + upper) >> 1;
+        if (a[mid] == min) {
+            return mid;
+        } else if (a[mid] < min) {
+            lower = mid;
+        } else {
+            upper = mid;
+        }
+    }
+    return upper;
+}
+
+// small is much smaller than large, out may be NULL to just count
+static int gallop_intersect(const uint16_t *small, int ls, const uint16_t *large, int ll, uint16_t *out) {
+    int count = 0;
+    int pos = -1;
+    for (int i = 0; i < ls; i++) {
+        pos = gallop(large, pos, ll, small[i]);
+        if (pos == ll) break;
+        if (large[pos] == small[i]) {
+            if (out) out[count] = small[i];
+            count++;
+        } else {
+            // large[pos] may still match the next item
+            pos--;
+        }
+    }
+    return count;
+}
+
+static int gallop_difference(const uint16_t *a, int la, const uint16_t *b, int lb, uint16_t *out) {
+    int count = 0;
+    if (la < lb) {
+        // Few items in a, look each one up in b
+        int pos = -1;
+        for (int i = 0; i < la; i++) {
+            pos = gallop(b, pos, lb, a[i]);
+            if (pos == lb || b[pos] != a[i]) {
+                out[count++] = a[i];
+                // b[pos] may still match the next item
+                pos--;
+            }
+        }
+    } else {
+        // Few items in b, copy the runs of a between them
+        int start = 0;
+        for (int j = 0; j < lb && start < la; j++) {
+            int pos = gallop(a, start - 1, la, b[j]);
+            memmove(out + count, a + start, (pos - start) * sizeof(uint16_t));
+            count += pos - start;
+            start = (pos < la && a[pos] == b[j]) ? pos + 1 : pos;
+        }
+        if (start < la) {
+            memmove(out + count, a + start, (la - start) * sizeof(uint16_t));
+            count += la - start;
+        }
+    }
+    return count;
+}
+
+static inline bool skewed(int la, int lb) {
+    return la * ARRAY_GALLOP_RATIO < lb || lb * ARRAY_GALLOP_RATIO < la;
+}
+
+int array_intersect(const uint16_t *a, int la, const uint16_t *b, int lb, uint16_t *out) {
+    if (skewed(la, lb)) {
+        return la < lb ? gallop_intersect(a, la, b, lb, out) : gallop_intersect(b, lb, a, la, out);
+    }
+    return array_ops.intersect(a, la, b, lb, out);
+}
+
+int array_intersect_card(const uint16_t *a, int la, const uint16_t *b, int lb) {
+    if (skewed(la, lb)) {
+        return la < lb ? gallop_intersect(a, la, b, lb, NULL) : gallop_intersect(b, lb, a, la, NULL);
+    }
+    return array_ops.intersect_card(a, la, b, lb);
+}
+
+int array_difference(const uint16_t *a, int la, const uint16_t *b, int lb, uint16_t *out) {
+    if (la == 0) {
+        return 0;
+    }
+    if (lb == 0) {
+        if (a != out) memcpy(out, a, sizeof(uint16_t) * la);
+        return la;
+    }
+    if (skewed(la, lb)) {
+        return gallop_difference(a, la, b, lb, out);
+    }
+    return array_ops.difference(a, la, b, lb, out);
+}
+
+static int compare_items(const void *a, const void *b) {
+    return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+/* Sorts items and removes duplicates in place, returns the new length */
+int array_sort_unique(uint16_t *items, int len) {
+    int i = 1;
+    while (i < len && items[i-1] <= items[i]) i++;
+    if (i < len) {
+        if (len > ARRAY_SORT_BITSET_MIN) {
+            // Mark items in a bitset, it comes out sorted and unique
+            uint64_t seen[1024] = {0};
+            for (int j = 0; j < len; j++) {
+                seen[items[j] >> 6] |= 1ULL << (items[j] & 63);
+            }
+            int count = 0;
+            for (int w = 0; w < 1024; w++) {
+                uint64_t bits = seen[w];
+                while (bits) {
+                    items[count++] = 64 * w + __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                }
+            }
+            return count;
+        }
+        qsort(items, len, sizeof(uint16_t), compare_items);
+    }
+    int count = len ? 1 : 0;
+    for (i = 1; i < len; i++) {
+        if (items[i] != items[count-1]) {
+            items[count++] = items[i];
+        }
+    }
+    return count;
+}
+
+/* Branch free binary search, narrows down to the last item <= item */
+bool array_exists(const uint16_t *a, int len, uint16_t item) {
+    if (UNLIKELY(len == 0)) return false;
+    const uint16_t *base = a;
+    while (len > 1) {
+        int half = len >> 1;
+        base = (base[half] <= item) ? base + half : base;
+        len -= half;
+    }
+    return *base == item;
+}
+
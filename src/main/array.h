@@ -0,0 +1,44 @@
+/* Sorted uint16 array kernels used by array containers, vectorized
+ * versions are picked at startup based on what the cpu supports */
+#ifndef __ARRAY_H
+#define __ARRAY_H
+#include <stdbool.h>
+#include <inttypes.h>
+
+// When one array is this many times bigger than the other use galloping search
+#define ARRAY_GALLOP_RATIO  32
+// Output buffers of intersect / difference need room for these many extra items
+// as vectorized kernels write 8 items at a time
+#define ARRAY_SIMD_SLACK    8
+// Unsorted inputs bigger than this are sorted by marking them in a bitset
+#define ARRAY_SORT_BITSET_MIN   1024
+
+typedef enum array_kernel {
+    AK_SCALAR = 0,
+    AK_SSE42,       // SSE4.2 string compare with shuffle based compaction
+    AK_MAX
+} ARRAY_KERNEL;
+
+/* Kernels for arrays of similar size. intersect and difference
+ * return the number of items written to out */
+struct array_ops {
+    ARRAY_KERNEL kernel;
+    const char *name;
+    int (*intersect)(const uint16_t *a, int la, const uint16_t *b, int lb, uint16_t *out);
+    int (*intersect_card)(const uint16_t *a, int la, const uint16_t *b, int lb);
+    int (*difference)(const uint16_t *a, int la, const uint16_t *b, int lb, uint16_t *out);
+};
+
+extern struct array_ops array_ops;
+
+void init_array_kernels(void);
+bool array_kernel_supported(ARRAY_KERNEL k);
+bool array_kernel_select(ARRAY_KERNEL k);
+
+int array_intersect(const uint16_t *a, int la, const uint16_t *b, int lb, uint16_t *out);
+int array_intersect_card(const uint16_t *a, int la, const uint16_t *b, int lb);
+int array_difference(const uint16_t *a, int la, const uint16_t *b, int lb, uint16_t *out);
+bool array_exists(const uint16_t *a, int len, uint16_t item);
+int array_sort_unique(uint16_t *items, int len);
+
+#endif
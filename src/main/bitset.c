@@ -0,0 +1,342 @@
+#include "bitset.h"
+#include "platform.h"
+#include <stdio.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BITSET_X86 1
+#include <immintrin.h>
+#endif
+
+#define OP_NONE     0
+#define OP_AND      1
+#define OP_ANDNOT   2
+#define OP_OR       3
+
+/********** Scalar kernels **********/
+
+static int scalar_and_card(const uint64_t *a, const uint64_t *b) {
+    int card = 0;
+    for (int i=0; i<BITSET_WORDS; i+=2) {
+        card += __builtin_popcountll(a[i] & b[i]);
+        card += __builtin_popcountll(a[i+1] & b[i+1]);
+    }
+    return card;
+}
+
+static int scalar_and(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+    int card = 0;
+    for (int i=0; i<BITSET_WORDS; i++) {
+        out[i] = a[i] & b[i];
+        card += __builtin_popcountll(out[i]);
+    }
+    return card;
+}
+
+static int scalar_andnot(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+    int card = 0;
+    for (int i=0; i<BITSET_WORDS; i++) {
+        out[i] = a[i] & ~b[i];
+        card += __builtin_popcountll(out[i]);
+    }
+    return card;
+}
+
+static void scalar_or(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+    for (int i=0; i<BITSET_WORDS; i++) {
+        out[i] = a[i] | b[i];
+    }
+}
+
+static int scalar_card(const uint64_t *a) {
+    int card = 0;
+    for (int i=0; i<BITSET_WORDS; i+=4) {
+        card += __builtin_popcountll(a[i]);
+        card += __builtin_popcountll(a[i+1]);
+        card += __builtin_popcountll(a[i+2]);
+        card += __builtin_popcountll(a[i+3]);
+    }
+    return card;
+}
+
+static int scalar_extract(const uint64_t *words, int nwords, uint32_t base, uint32_t *out) {
+    int count = 0;
+    for (int i=0; i<nwords; i++) {
+        uint64_t w = words[i];
+        while (w) {
+            out[count++] = base + __builtin_ctzll(w);
+            w &= w - 1;
+        }
+        base += 64;
+    }
+    return count;
+}
+
+#ifdef BITSET_X86
+
+/********** AVX2 kernels **********/
+/* Harley-Seal carry save adder popcount as described by Mula, Kurz & Lemire,
+ * the bitwise op is applied while loading so result and count take one pass */
+
+#define AVX2_FN __attribute__((target("avx2")))
+#define AVX2_INLINE static inline __attribute__((target("avx2"), always_inline))
+
+AVX2_INLINE __m256i avx2_popcount(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_mask));
+    __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi32(v, 4), low_mask));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+AVX2_INLINE void avx2_csa(__m256i *h, __m256i *l, __m256i a, __m256i b, __m256i c) {
+    const __m256i u = _mm256_xor_si256(a, b);
+    *h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+    *l = _mm256_xor_si256(u, c);
+}
+
+AVX2_INLINE __m256i avx2_load(const __m256i *a, const __m256i *b, __m256i *out, int i, int op) {
+    __m256i v = _mm256_loadu_si256(a + i);
+    switch (op) {
+        case OP_AND:
+            v = _mm256_and_si256(v, _mm256_loadu_si256(b + i));
+            break;
+        case OP_ANDNOT:
+            v = _mm256_andnot_si256(_mm256_loadu_si256(b + i), v);
+            break;
+        case OP_OR:
+            v = _mm256_or_si256(v, _mm256_loadu_si256(b + i));
+            break;
+    }
+    if (out) {
+        _mm256_storeu_si256(out + i, v);
+    }
+    return v;
+}
+
+AVX2_INLINE int avx2_harley_seal(const uint64_t *a64, const uint64_t *b64, uint64_t *out64, int op) {
+    const __m256i *a = (const __m256i *)a64;
+    const __m256i *b = (const __m256i *)b64;
+    __m256i *out = (__m256i *)out64;
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256();
+    __m256i twos = _mm256_setzero_si256();
+    __m256i fours = _mm256_setzero_si256();
+    __m256i eights = _mm256_setzero_si256();
+    __m256i sixteens, twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+
+    // BITSET_WORDS / 4 = 256 vectors, 16 at a time
+    for (int i = 0; i < BITSET_WORDS / 4; i += 16) {
+        avx2_csa(&twos_a, &ones, ones, avx2_load(a, b, out, i, op), avx2_load(a, b, out, i + 1, op));
+        avx2_csa(&twos_b, &ones, ones, avx2_load(a, b, out, i + 2, op), avx2_load(a, b, out, i + 3, op));
+        avx2_csa(&fours_a, &twos, twos, twos_a, twos_b);
+        avx2_csa(&twos_a, &ones, ones, avx2_load(a, b, out, i + 4, op), avx2_load(a, b, out, i + 5, op));
+        avx2_csa(&twos_b, &ones, ones, avx2_load(a, b, out, i + 6, op), avx2_load(a, b, out, i + 7, op));
+        avx2_csa(&fours_b, &twos, twos, twos_a, twos_b);
+        avx2_csa(&eights_a, &fours, fours, fours_a, fours_b);
+        avx2_csa(&twos_a, &ones, ones, avx2_load(a, b, out, i + 8, op), avx2_load(a, b, out, i + 9, op));
+        avx2_csa(&twos_b, &ones, ones, avx2_load(a, b, out, i + 10, op), avx2_load(a, b, out, i + 11, op));
+        avx2_csa(&fours_a, &twos, twos, twos_a, twos_b);
+        avx2_csa(&twos_a, &ones, ones, avx2_load(a, b, out, i + 12, op), avx2_load(a, b, out, i + 13, op));
+        avx2_csa(&twos_b, &ones, ones, avx2_load(a, b, out, i + 14, op), avx2_load(a, b, out, i + 15, op));
+        avx2_csa(&fours_b, &twos, twos, twos_a, twos_b);
+        avx2_csa(&eights_b, &fours, fours, fours_a, fours_b);
+        avx2_csa(&sixteens, &eights, eights, eights_a, eights_b);
+        total = _mm256_add_epi64(total, avx2_popcount(sixteens));
+    }
+
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(avx2_popcount(eights), 3));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(avx2_popcount(fours), 2));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(avx2_popcount(twos), 1));
+    total = _mm256_add_epi64(total, avx2_popcount(ones));
+
+    return (int)(_mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1)
+               + _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3));
+}
+
+AVX2_FN static int avx2_and_card(const uint64_t *a, const uint64_t *b) {
+    return avx2_harley_seal(a, b, NULL, OP_AND);
+}
+
+AVX2_FN static int avx2_and(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+    return avx2_harley_seal(a, b, out, OP_AND);
+}
+
+AVX2_FN static int avx2_andnot(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+    return avx2_harley_seal(a, b, out, OP_ANDNOT);
+}
+
+AVX2_FN static void avx2_or(const uint64_t *a64, const uint64_t *b64, uint64_t *out64) {
+    const __m256i *a = (const __m256i *)a64;
+    const __m256i *b = (const __m256i *)b64;
+    __m256i *out = (__m256i *)out64;
+    for (int i = 0; i < BITSET_WORDS / 4; i++) {
+        avx2_load(a, b, out, i, OP_OR);
+    }
+}
+
+AVX2_FN static int avx2_card(const uint64_t *a) {
+    return avx2_harley_seal(a, NULL, NULL, OP_NONE);
+}
+
+// Positions of the set bits of every byte value
+static uint8_t extract_table[256][8];
+
+static void setup_extract_table(void) {
+    for (int v = 0; v < 256; v++) {
+        int p = 0;
+        for (int i = 0; i < 8; i++) {
+            if (v & (1 << i)) {
+                extract_table[v][p++] = i;
+            }
+        }
+    }
+}
+
+/* A byte at a time, the bit positions are looked up, widened and stored as
+ * 8 items of which only popcount(byte) are kept */
+AVX2_FN static int avx2_extract(const uint64_t *words, int nwords, uint32_t base, uint32_t *out) {
+    const uint32_t *start = out;
+    const __m256i step = _mm256_set1_epi32(8);
+    for (int i = 0; i < nwords; i++) {
+        uint64_t w = words[i];
+        if (!w) continue;
+        __m256i vbase = _mm256_set1_epi32(base + 64 * i);
+        for (int b = 0; b < 8; b++) {
+            uint8_t byte = w >> (8 * b);
+            __m256i pos = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)extract_table[byte]));
+            _mm256_storeu_si256((__m256i *)out, _mm256_add_epi32(vbase, pos));
+            out += __builtin_popcount(byte);
+            vbase = _mm256_add_epi32(vbase, step);
+        }
+    }
+    return out - start;
+}
+
+/********** AVX-512 kernels **********/
+
+#define AVX512_FN __attribute__((target("avx512f,avx512vpopcntdq")))
+#define AVX512_INLINE static inline __attribute__((target("avx512f,avx512vpopcntdq"), always_inline))
+
+AVX512_INLINE int avx512_op(const uint64_t *a, const uint64_t *b, uint64_t *out, int op) {
+    __m512i total = _mm512_setzero_si512();
+    for (int i = 0; i < BITSET_WORDS; i += 8) {
+        __m512i v = _mm512_loadu_si512(a + i);
+        switch (op) {
+            case OP_AND:
+                v = _mm512_and_si512(v, _mm512_loadu_si512(b + i));
+                break;
+            case OP_ANDNOT:
+                v = _mm512_andnot_si512(_mm512_loadu_si512(b + i), v);
+                break;
+        }
+        if (out) {
+            _mm512_storeu_si512(out + i, v);
+        }
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(v));
+    }
+    return (int)_mm512_reduce_add_epi64(total);
+}
+
+AVX512_FN static int avx512_and_card(const uint64_t *a, const uint64_t *b) {
+    return avx512_op(a, b, NULL, OP_AND);
+}
+
+AVX512_FN static int avx512_and(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+    return avx512_op(a, b, out, OP_AND);
+}
+
+AVX512_FN static int avx512_andnot(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+    return avx512_op(a, b, out, OP_ANDNOT);
+}
+
+AVX512_FN static void avx512_or(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+    for (int i = 0; i < BITSET_WORDS; i += 8) {
+        _mm512_storeu_si512(out + i, _mm512_or_si512(_mm512_loadu_si512(a + i),
+                                                     _mm512_loadu_si512(b + i)));
+    }
+}
+
+AVX512_FN static int avx512_card(const uint64_t *a) {
+    return avx512_op(a, NULL, NULL, OP_NONE);
+}
+
+AVX512_FN static int avx512_extract(const uint64_t *words, int nwords, uint32_t base, uint32_t *out) {
+    const uint32_t *start = out;
+    const __m512i step = _mm512_set1_epi32(16);
+    const __m512i seq = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    for (int i = 0; i < nwords; i++) {
+        uint64_t w = words[i];
+        if (!w) continue;
+        __m512i v = _mm512_add_epi32(_mm512_set1_epi32(base + 64 * i), seq);
+        for (int k = 0; k < 4; k++) {
+            __mmask16 m = w >> (16 * k);
+            _mm512_mask_compressstoreu_epi32(out, m, v);
+            out += __builtin_popcount(m);
+            v = _mm512_add_epi32(v, step);
+        }
+    }
+    return out - start;
+}
+
+#endif
+
+static const struct bitset_ops kernels[BK_MAX] = {
+    {BK_SCALAR, "scalar", scalar_and_card, scalar_and, scalar_andnot, scalar_or, scalar_card,
+     scalar_extract},
+#ifdef BITSET_X86
+    {BK_AVX2, "avx2", avx2_and_card, avx2_and, avx2_andnot, avx2_or, avx2_card, avx2_extract},
+    {BK_AVX512, "avx512", avx512_and_card, avx512_and, avx512_andnot, avx512_or, avx512_card,
+     avx512_extract},
+#endif
+};
+
+// Scalar until init_bitset_kernels is called, so early users still work
+struct bitset_ops bitset_ops = {BK_SCALAR, "scalar", scalar_and_card, scalar_and,
+                                scalar_andnot, scalar_or, scalar_card, scalar_extract};
+
+bool bitset_kernel_supported(BITSET_KERNEL k) {
+    switch (k) {
+        case BK_SCALAR:
+            return true;
+#ifdef BITSET_X86
+        case BK_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case BK_AVX512:
+            return __builtin_cpu_supports("avx512f") &&
+                   __builtin_cpu_supports("avx512vpopcntdq");
+#endif
+        default:
+            return false;
+    }
+}
+
+/* Switch to a given kernel, returns false if the cpu cannot run it.
+ * NOTE: Not thread safe, only call at startup or from benchmarks */
+bool bitset_kernel_select(BITSET_KERNEL k) {
+    if (!bitset_kernel_supported(k)) {
+        return false;
+    }
+#ifdef BITSET_X86
+    if (k == BK_AVX2) {
+        setup_extract_table();
+    }
+#endif
+    bitset_ops = kernels[k];
+    return true;
+}
+
+/* Picks the best kernel the cpu supports */
+void init_bitset_kernels(void) {
+#ifdef BITSET_X86
+    __builtin_cpu_init();
+#endif
+    for (int k = BK_MAX - 1; k >= BK_SCALAR; k--) {
+        if (bitset_kernel_select(k)) {
+            break;
+        }
+    }
+}
+
@@ -0,0 +1,42 @@
+/* Bitset container kernels, vectorized versions are picked at startup
+ * based on what the cpu supports */
+#ifndef __BITSET_H
+#define __BITSET_H
+#include <stdbool.h>
+#include <inttypes.h>
+
+// Number of 64 bit words in a bitset container
+#define BITSET_WORDS 1024
+// Output of extract needs room for these many extra items
+#define BITSET_EXTRACT_SLACK 8
+
+typedef enum bitset_kernel {
+    BK_SCALAR = 0,
+    BK_AVX2,        // AVX2 with Harley-Seal popcount
+    BK_AVX512,      // AVX-512 with VPOPCNTDQ
+    BK_MAX
+} BITSET_KERNEL;
+
+/* All kernels work on BITSET_WORDS words, pointers need not be aligned.
+ * The and / andnot / card variants return the cardinality of the result
+ * so callers do not need another pass to count bits. out may alias a.
+ * extract decodes the set bits of nwords words to base + bit position
+ * and returns the number of items written */
+struct bitset_ops {
+    BITSET_KERNEL kernel;
+    const char *name;
+    int (*and_card)(const uint64_t *a, const uint64_t *b);
+    int (*and)(const uint64_t *a, const uint64_t *b, uint64_t *out);
+    int (*andnot)(const uint64_t *a, const uint64_t *b, uint64_t *out);
+    void (*or)(const uint64_t *a, const uint64_t *b, uint64_t *out);
+    int (*card)(const uint64_t *a);
+    int (*extract)(const uint64_t *words, int nwords, uint32_t base, uint32_t *out);
+};
+
+extern struct bitset_ops bitset_ops;
+
+void init_bitset_kernels(void);
+bool bitset_kernel_supported(BITSET_KERNEL k);
+bool bitset_kernel_select(BITSET_KERNEL k);
+
+#endif
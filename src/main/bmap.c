@@ -1,4 +1,6 @@
 #include "bmap.h"
+#include "platform.h"
+#include "array.h"
 #include <string.h>
 #include <stdio.h>
 
@@ -11,18 +13,39 @@ static inline uint16_t lowbits(uint32_t i) {
     return (i & 0xFFFF);
 }
 
+static inline uint16_t bmap_cid(const struct bmap *b, int pos) {
+    return UNLIKELY(b->cids != NULL) ? b->cids[pos] : b->c[pos].buffer[ID];
+}
+
+// Returns container pos, a lazy bitmap loads it on first access
+static inline struct cont *bmap_cont(const struct bmap *b, int pos) {
+    if (UNLIKELY(!b->c[pos].buffer)) {
+        b->c[pos].buffer = b->fetch(b, pos);
+    }
+    return &b->c[pos];
+}
+
+/* Cardinality of container pos, taken from the header of a lazy bitmap
+ * if it has not been loaded */
+static inline uint32_t bmap_cont_card(const struct bmap *b, int pos) {
+    if (!b->c[pos].buffer && b->ccards) {
+        return b->ccards[pos] + 1;
+    }
+    return cont_cardinality(bmap_cont(b, pos));
+}
+
 static int binary_search(const struct bmap *b, uint16_t id) {
     int low = 0, high = b->num_c-1, middle;
     // Usually we add to the end, handle that
     if (b->num_c > 0) {
-        if (b->c[high].buffer[0] == id) return high;        
-        if (b->c[high].buffer[0] < id) return -b->num_c - 1;
+        if (bmap_cid(b, high) == id) return high;
+        if (bmap_cid(b, high) < id) return -b->num_c - 1;
     }
     while (low <= high) {
         middle = (low+high)/2;
-        if (b->c[middle].buffer[0] < id) {
+        if (bmap_cid(b, middle) < id) {
             low = middle+1;
-        } else if (b->c[middle].buffer[0] > id){
+        } else if (bmap_cid(b, middle) > id){
             high = middle-1;
         } else {
             return middle;
@@ -31,12 +54,21 @@ static int binary_search(const struct bmap *b, uint16_t id) {
     return -(low+1);
 }
 
-static void bmap_cont_remove(struct bmap *b, int pos) {
-    free(b->c[pos].buffer);
-    b->num_c--;
-    if (pos != b->num_c) {
-        memmove(&b->c[pos], &b->c[pos+1], (b->num_c-pos)*sizeof(struct cont));
+/* Keeps the cardinality in step with items added or removed, the prefix
+ * sums are rebuilt the next time they are needed */
+static inline void bmap_card_changed(struct bmap *b, int delta) {
+    b->card += delta;
+    free(b->prefix);
+    b->prefix = NULL;
+}
+
+/* Counts the items of a bitmap whose count is not known and keeps it */
+static void bmap_count(struct bmap *b) {
+    b->card = 0;
+    for (int i=0; i<b->num_c; i++) {
+        b->card += bmap_cont_card(b, i);
     }
+    b->card_valid = 1;
 }
 
 static int bmap_cont_add(struct bmap *b, struct cont *c) {
@@ -51,23 +83,13 @@ static int bmap_cont_add(struct bmap *b, struct cont *c) {
         memmove(b->c+pos+1, b->c+pos, (b->num_c-1-pos)*sizeof(struct cont));
     }
     b->c[pos].buffer = c->buffer;
+    bmap_card_changed(b, cont_cardinality(c));
     return pos;
 }
 
 static inline int bmap_advance(const struct bmap *b, uint16_t id, int pos) {
     while(++pos < b->num_c) {
-        if (b->c[pos].buffer[ID] >= id) return pos;
-    }
-    return pos;
-}
-
-static inline int bmap_advance_free(struct bmap *b, uint16_t id, int pos) {
-    while(pos < b->num_c) {
-        if (b->c[pos].buffer[ID] >= id) {
-            return pos;
-        } else {
-            bmap_cont_remove(b, pos);
-        }
+        if (bmap_cid(b, pos) >= id) return pos;
     }
     return pos;
 }
@@ -81,21 +103,7 @@ static inline void bmap_insert_container(struct bmap *b, int pos) {
 }
 
 static uint16_t *bmap_container_to_bitset(const struct bmap *b, int pos) {
-    if (cont_cardinality(&b->c[pos]) > CUTOFF) {
-        uint16_t *buffer = malloc((CUTOFF + 2) * sizeof(uint16_t));
-        memcpy(buffer, b->c[pos].buffer, (CUTOFF + 2) * sizeof(uint16_t));
-        return buffer;
-    }
-    uint16_t *buffer = calloc((CUTOFF + 2), sizeof(uint16_t));
-    buffer[ID] = b->c[pos].buffer[ID];
-    const struct cont *c = &b->c[pos];
-    int card = c->buffer[CARDINALITY];
-    buffer[CARDINALITY] = card;
-    uint16_t *buf = buffer+2;
-    for (int i=2; i<card+2; i++) {
-        buf[c->buffer[i]>>4] |= 1 << (c->buffer[i] & 0xF);
-    }
-    return buffer;
+    return cont_to_bitset(bmap_cont(b, pos));
 }
 
 // Assumes x1 is a bitset container
@@ -107,17 +115,17 @@ static inline void bmap_inplace_lazy_or(struct bmap *x1, const struct bmap *x2)
     int l1 = x1->num_c;
     int pos1 = 0, pos2 = 0;
     uint16_t s1 = x1->c[pos1].buffer[ID];
-    uint16_t s2 = x2->c[pos2].buffer[ID];
+    uint16_t s2 = bmap_cid(x2, pos2);
 
     while(true) {
         if (s1 == s2) {
-            cont_inplace_union(&x1->c[pos1], &x2->c[pos2]);
+            cont_inplace_union(&x1->c[pos1], bmap_cont(x2, pos2));
             ++pos1;
             ++pos2;
             if (pos1 == l1) break;
             if (pos2 == l2) break;
             s1 = x1->c[pos1].buffer[ID];
-            s2 = x2->c[pos2].buffer[ID];
+            s2 = bmap_cid(x2, pos2);
         } else if (s1 < s2) {
             pos1++;
             if (pos1 == l1) break;
@@ -129,7 +137,7 @@ static inline void bmap_inplace_lazy_or(struct bmap *x1, const struct bmap *x2)
             l1++;
             pos2++;
             if (pos2 == l2) break;
-            s2 = x2->c[pos2].buffer[ID];
+            s2 = bmap_cid(x2, pos2);
         }
     }
     // Copy x2 to x1
@@ -149,11 +157,11 @@ uint32_t bmap_and_cardinality(const struct bmap *a, const struct bmap *b) {
     const int length1 = a->num_c, length2 = b->num_c;
 
     while(pos1 < length1 && pos2 < length2) {
-        const uint16_t id1 = a->c[pos1].buffer[0];
-        const uint16_t id2 = b->c[pos2].buffer[0];
+        const uint16_t id1 = bmap_cid(a, pos1);
+        const uint16_t id2 = bmap_cid(b, pos2);
 
         if (id1 == id2) {
-            card += cont_and_cardinality(&a->c[pos1], &b->c[pos2]);
+            card += cont_and_cardinality(bmap_cont(a, pos1), bmap_cont(b, pos2));
             ++pos1;
             ++pos2;
         } else if (id1 < id2) {
@@ -165,15 +173,89 @@ uint32_t bmap_and_cardinality(const struct bmap *a, const struct bmap *b) {
     return card;
 }
 
+/* Sets cards[i] to the cardinality of a & b[i] for all count bitmaps in b
+ * in a single pass over a, without building any results.  Entries of b may
+ * be NULL, containers of lazy bitmaps are only loaded when a has them too */
+void bmap_and_cardinality_many(const struct bmap *a, struct bmap *const *b, int count, uint32_t *cards) {
+    int *pos = calloc(count, sizeof(int));
+    memset(cards, 0, count * sizeof(uint32_t));
+    for (int pa = 0; pa < a->num_c; pa++) {
+        const uint16_t id = bmap_cid(a, pa);
+        for (int i = 0; i < count; i++) {
+            const struct bmap *bi = b[i];
+            if (!bi) continue;
+            if (pos[i] < bi->num_c && bmap_cid(bi, pos[i]) < id) {
+                pos[i] = bmap_advance(bi, id, pos[i]);
+            }
+            if (pos[i] < bi->num_c && bmap_cid(bi, pos[i]) == id) {
+                cards[i] += cont_and_cardinality(bmap_cont(a, pa), bmap_cont(bi, pos[i]));
+            }
+        }
+    }
+    free(pos);
+}
+
+/* Cardinality of the union of count bitmaps, without building the union.
+ * Containers present in a single bitmap are just counted, the rest are
+ * or'ed into a scratch bitset one container id at a time */
+uint32_t bmap_or_cardinality(struct bmap *const *b, int count) {
+    uint32_t card = 0;
+    int *pos = calloc(count, sizeof(int));
+    struct cont scratch = {malloc((CUTOFF + 2) * sizeof(uint16_t))};
+    while (true) {
+        // Next smallest container id across all bitmaps
+        int next = -1, found = 0;
+        for (int i = 0; i < count; i++) {
+            if (pos[i] < b[i]->num_c) {
+                uint16_t id = bmap_cid(b[i], pos[i]);
+                if (next < 0 || id < next) {
+                    next = id;
+                    found = 1;
+                } else if (id == next) {
+                    found++;
+                }
+            }
+        }
+        if (next < 0) break;
+        if (found > 1) {
+            memset(scratch.buffer, 0, (CUTOFF + 2) * sizeof(uint16_t));
+        }
+        for (int i = 0; i < count; i++) {
+            if (pos[i] < b[i]->num_c && bmap_cid(b[i], pos[i]) == next) {
+                if (found == 1) {
+                    card += cont_cardinality(bmap_cont(b[i], pos[i]));
+                } else {
+                    cont_inplace_union(&scratch, bmap_cont(b[i], pos[i]));
+                }
+                pos[i]++;
+            }
+        }
+        if (found > 1) {
+            bitset_cont_cardinality(&scratch);
+            card += cont_cardinality(&scratch);
+        }
+    }
+    free(scratch.buffer);
+    free(pos);
+    return card;
+}
+
 struct bmap *bmap_duplicate(const struct bmap *a) {
     struct bmap *b = bmap_new();
     memcpy(b, a, sizeof(struct bmap));
     b->mdb_bmap = 0;
     b->needs_free = 1;
+    b->cids = NULL;
+    b->ccards = NULL;
+    b->fetch = NULL;
+    b->fetch_src = NULL;
+    b->prefix = NULL;
     b->c = malloc(b->num_c * sizeof(struct cont));
-    memcpy(b->c, a->c, b->num_c * sizeof(struct cont));
     for (int i = 0; i < b->num_c; i++) {
-        b->c[i].buffer = cont_duplicate(&a->c[i]);
+        b->c[i].buffer = cont_duplicate(bmap_cont(a, i));
+    }
+    if (!b->card_valid) {
+        bmap_count(b);
     }
     return b;
 }
@@ -182,27 +264,11 @@ struct bmap *convert_to_bitset_bmap(const struct bmap *f) {
     struct bmap *r = bmap_new();
     r->needs_free = 1;
     r->num_c = f->num_c;
+    r->card = f->card;
+    r->card_valid = f->card_valid;
     r->c = malloc(f->num_c * sizeof(struct cont));
-    memcpy(r->c, f->c, f->num_c*sizeof(struct cont));
     for (int i=0; i<f->num_c; i++) {
-        // THis is a bitset, just blindly copy it
-        if (cont_cardinality(&f->c[i]) > CUTOFF) {
-            r->c[i].buffer = malloc((CUTOFF+2) * sizeof(uint16_t));
-            memcpy(r->c[i].buffer, f->c[i].buffer, (CUTOFF+2)*sizeof(uint16_t));
-        } else {
-            // Array, build a new bitmap
-            uint16_t *buffer = calloc((CUTOFF+2), sizeof(uint16_t));
-            const struct cont *c = &f->c[i];
-            // Copy over id and cardinality
-            buffer[ID] = c->buffer[ID];
-            buffer[CARDINALITY] = c->buffer[CARDINALITY];
-            int card = buffer[CARDINALITY];
-            buffer = buffer+2;
-            for (int i=2; i<card+2; i++) {
-                buffer[c->buffer[i]>>4] |= 1 << (c->buffer[i] & 0xF);
-            }
-            r->c[i].buffer = buffer-2;
-        }
+        r->c[i].buffer = cont_to_bitset(bmap_cont(f, i));
     }
     return r;
 }
@@ -214,11 +280,11 @@ struct bmap *bmap_and(const struct bmap *a, const struct bmap *b) {
     const int length1 = a->num_c, length2 = b->num_c;
 
     while(pos1 < length1 && pos2 < length2) {
-        const uint16_t id1 = a->c[pos1].buffer[ID];
-        const uint16_t id2 = b->c[pos2].buffer[ID];
+        const uint16_t id1 = bmap_cid(a, pos1);
+        const uint16_t id2 = bmap_cid(b, pos2);
         // printf("id2 %d id2 %d\n", id1, id2);
         if (id1 == id2) {
-            struct cont *c = cont_and(&a->c[pos1],  &b->c[pos2]);
+            struct cont *c = cont_and(bmap_cont(a, pos1), bmap_cont(b, pos2));
             if (cont_cardinality(c) != 0) {
                 bmap_cont_add(r, c);
             } else {
@@ -251,11 +317,11 @@ struct bmap *bmap_andnot(const struct bmap *a, const struct bmap *b) {
     }
 
     while(pos1 < length1 && pos2 < length2) {
-        const uint16_t id1 = a->c[pos1].buffer[ID];
-        const uint16_t id2 = b->c[pos2].buffer[ID];
+        const uint16_t id1 = bmap_cid(a, pos1);
+        const uint16_t id2 = bmap_cid(b, pos2);
         // printf("id2 %d id2 %d\n", id1, id2);
         if (id1 == id2) {
-            struct cont *c = cont_andnot(&a->c[pos1],  &b->c[pos2]);
+            struct cont *c = cont_andnot(bmap_cont(a, pos1), bmap_cont(b, pos2));
             if (cont_cardinality(c) != 0) {
                 bmap_cont_add(r, c);
             } else {
@@ -268,7 +334,7 @@ struct bmap *bmap_andnot(const struct bmap *a, const struct bmap *b) {
             int next_pos1 = bmap_advance(a, id2, pos1);
             for (int i = pos1; i < next_pos1; i++) {
                 struct cont *copy = malloc(sizeof(struct cont));
-                copy->buffer = cont_duplicate(&a->c[i]);
+                copy->buffer = cont_duplicate(bmap_cont(a, i));
                 bmap_cont_add(r, copy);
                 free(copy);
             }
@@ -280,7 +346,7 @@ struct bmap *bmap_andnot(const struct bmap *a, const struct bmap *b) {
     if (pos2 == length2) {
         for (int i = pos1; i < length1; i++) {
             struct cont *copy = malloc(sizeof(struct cont));
-            copy->buffer = cont_duplicate(&a->c[i]);
+            copy->buffer = cont_duplicate(bmap_cont(a, i));
             bmap_cont_add(r, copy);
             free(copy);
         }
@@ -288,49 +354,14 @@ struct bmap *bmap_andnot(const struct bmap *a, const struct bmap *b) {
     return r;
 }
 
-void bmap_and_inplace(struct bmap *a, const struct bmap *b) {
-    int pos1 = 0, pos2 = 0;
-    int length1 = a->num_c, length2 = b->num_c;
-    while(pos1 < length1 && pos2 < length2) {
-        const uint16_t id1 = a->c[pos1].buffer[0];
-        const uint16_t id2 = b->c[pos2].buffer[0];
-        // printf("id2 %d id2 %d pos1 %d pos2 %d\n", id1, id2, pos1, pos2);
-        if (id1 == id2) {
-            cont_inplace_and(&a->c[pos1], &b->c[pos2]);
-            //printf("card1 %d card2 %d card3 %d\n", get_cont_cardinality(&a->c[pos1]), get_cont_cardinality(&b->c[pos2]), get_cont_cardinality(c));
-            //printf("a bitset %d b bitset %d \n", a->is_bitset, b->is_bitset);
-            if (cont_cardinality(&a->c[pos1]) == 0) {
-                bmap_cont_remove(a, pos1);
-                length1--;
-                pos1--;
-            }
-            ++pos1;
-            ++pos2;
-        } else if (id1 < id2) {
-            pos1 = bmap_advance_free(a, id2, pos1);
-            length1 = a->num_c;
-            // printf("advance free till id %d pos1 is %d\n", id2, pos1);
-        } else {
-            pos2 = bmap_advance(b, id1, pos2);
-            // printf("advance till id %d pos2 is %d\n", id1, pos2);
-        }
-    }
-
-    if (pos1 < a->num_c) {
-        for (int i=pos1; i<a->num_c; i++) {
-            free(a->c[i].buffer);
-        }
-        a->num_c = pos1;
-    }
-}
-
-
 void bmap_add(struct bmap *b, uint32_t item) {
     uint16_t id = highbits(item);
     uint16_t val = lowbits(item);
     int pos = binary_search(b, id);
     if (pos >= 0) {
-        cont_add(&b->c[pos], val);
+        if (cont_add(&b->c[pos], val)) {
+            bmap_card_changed(b, 1);
+        }
         return;
     }
     pos = -pos-1;
@@ -341,6 +372,7 @@ void bmap_add(struct bmap *b, uint32_t item) {
     }
     cont_init(&b->c[pos], id);
     cont_add(&b->c[pos], val);
+    bmap_card_changed(b, 1);
 }
 
 void bmap_remove(struct bmap *b, uint32_t item) {
@@ -348,7 +380,11 @@ void bmap_remove(struct bmap *b, uint32_t item) {
     uint16_t val = lowbits(item);
     int pos = binary_search(b, id);
     if (pos >= 0) {
+        uint32_t card = cont_cardinality(&b->c[pos]);
         bool remove = cont_remove(&b->c[pos], val);
+        if (remove || cont_cardinality(&b->c[pos]) != card) {
+            bmap_card_changed(b, -1);
+        }
         // If remove is true, the container itself has to be removed !
         if (remove) {
             b->num_c--;
@@ -360,17 +396,158 @@ void bmap_remove(struct bmap *b, uint32_t item) {
 }
 
 uint32_t bmap_cardinality(const struct bmap *b) {
+    if (LIKELY(b->card_valid)) {
+        return b->card;
+    }
+    // Not cached, b may be shared with a writer keeping card up to date
     uint32_t cardinality = 0;
     for (int i=0; i<b->num_c; i++) {
-        cardinality += cont_cardinality(&b->c[i]);
+        cardinality += bmap_cont_card(b, i);
     }
     return cardinality;
 }
 
+static const uint32_t *bmap_prefix(struct bmap *b) {
+    if (!b->prefix) {
+        uint32_t *prefix = malloc((b->num_c + 1) * sizeof(uint32_t));
+        uint32_t sum = 0;
+        for (int i=0; i<b->num_c; i++) {
+            prefix[i] = sum;
+            sum += bmap_cont_card(b, i);
+        }
+        prefix[b->num_c] = sum;
+        b->prefix = prefix;
+        b->card = sum;
+        b->card_valid = 1;
+    }
+    return b->prefix;
+}
+
+/* Sets item to the nth item of the bitmap counting from 0, returns false if
+ * the bitmap has n items or less.  Uses the prefix sums to find the container
+ * so sampling a bitmap need not walk it */
+bool bmap_select(struct bmap *b, uint32_t n, uint32_t *item) {
+    const uint32_t *prefix = bmap_prefix(b);
+    if (n >= prefix[b->num_c]) {
+        return false;
+    }
+    // Last container starting at or before n
+    int low = 0, high = b->num_c - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (prefix[middle] <= n) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    *item = ((uint32_t)bmap_cid(b, low) << 16) | cont_select(bmap_cont(b, low), n - prefix[low]);
+    return true;
+}
+
+/* Returns the number of items in the bitmap less than item, which is the
+ * position of item when it exists */
+uint32_t bmap_rank(struct bmap *b, uint32_t item) {
+    const uint32_t *prefix = bmap_prefix(b);
+    int pos = binary_search(b, highbits(item));
+    if (pos < 0) {
+        return prefix[-pos-1];
+    }
+    return prefix[pos] + cont_rank(bmap_cont(b, pos), lowbits(item));
+}
+
 void bmap_iterate(const struct bmap *b, bmap_iterator iter, void *ptr) {
     for (int i=0; i<b->num_c; i++) {
-        cont_iterate(&b->c[i], iter, ptr);
+        cont_iterate(bmap_cont(b, i), iter, ptr);
+    }
+}
+
+void bmap_cursor_init(struct bmap_cursor *cur, const struct bmap *b) {
+    cur->b = b;
+    cur->pos = 0;
+    cur->from = 0;
+}
+
+/* Decodes up to max items in ascending order into out, returns the
+ * number of items decoded which is 0 once the bitmap is done */
+int bmap_cursor_next(struct bmap_cursor *cur, uint32_t *out, int max) {
+    int count = 0;
+    while (count < max && cur->pos < cur->b->num_c) {
+        count += cont_decode(bmap_cont(cur->b, cur->pos), &cur->from, out + count, max - count);
+        if (cur->from > 0xFFFF) {
+            cur->pos++;
+            cur->from = 0;
+        }
+    }
+    return count;
+}
+
+/* Skips ahead so the next item decoded is the first one >= item, containers
+ * skipped over are not loaded. Never moves the cursor backwards */
+void bmap_cursor_advance_to(struct bmap_cursor *cur, uint32_t item) {
+    const struct bmap *b = cur->b;
+    uint16_t id = highbits(item);
+    if (cur->pos < b->num_c && bmap_cid(b, cur->pos) < id) {
+        cur->pos = bmap_advance(b, id, cur->pos);
+        cur->from = 0;
     }
+    if (cur->pos < b->num_c && bmap_cid(b, cur->pos) == id && cur->from < lowbits(item)) {
+        cur->from = lowbits(item);
+    }
+}
+
+void bmap_builder_init(struct bmap_builder *bb) {
+    bb->buckets = NULL;
+    bb->num_buckets = 0;
+}
+
+/* Appends to the bucket of the container, buckets are sorted and made unique
+ * once they get this big, so they never grow past twice a full container */
+#define BUCKET_COMPACT_SIZE (2 * 65536)
+
+void bmap_builder_add(struct bmap_builder *bb, uint32_t item) {
+    uint16_t id = highbits(item);
+    if (UNLIKELY(id >= bb->num_buckets)) {
+        int n = bb->num_buckets ? 2 * bb->num_buckets : 16;
+        if (n > 65536) n = 65536;
+        if (n <= id) n = id + 1;
+        bb->buckets = realloc(bb->buckets, n * sizeof(struct bmap_bucket));
+        memset(&bb->buckets[bb->num_buckets], 0, (n - bb->num_buckets) * sizeof(struct bmap_bucket));
+        bb->num_buckets = n;
+    }
+    struct bmap_bucket *bk = &bb->buckets[id];
+    if (UNLIKELY(bk->count == bk->size)) {
+        if (bk->size >= BUCKET_COMPACT_SIZE) {
+            bk->count = array_sort_unique(bk->items, bk->count);
+        } else {
+            bk->size = bk->size ? bk->size * 2 : 64;
+            bk->items = realloc(bk->items, bk->size * sizeof(uint16_t));
+        }
+    }
+    bk->items[bk->count++] = lowbits(item);
+}
+
+/* Returns the built bitmap, container types are picked once here.  The
+ * builder is left empty */
+struct bmap *bmap_builder_finish(struct bmap_builder *bb) {
+    struct bmap *b = bmap_new();
+    int num_c = 0;
+    for (int i = 0; i < bb->num_buckets; i++) {
+        num_c += (bb->buckets[i].count != 0);
+    }
+    b->c = malloc(num_c * sizeof(struct cont));
+    for (int i = 0; i < bb->num_buckets; i++) {
+        struct bmap_bucket *bk = &bb->buckets[i];
+        if (bk->count) {
+            int len = array_sort_unique(bk->items, bk->count);
+            b->c[b->num_c++].buffer = cont_from_sorted(i, bk->items, len);
+            b->card += len;
+        }
+        free(bk->items);
+    }
+    free(bb->buckets);
+    bmap_builder_init(bb);
+    return b;
 }
 
 void bmap_free_containers(struct bmap *b) {
@@ -379,9 +556,17 @@ void bmap_free_containers(struct bmap *b) {
             free(b->c[i].buffer);
         }
     }
+    free(b->fetch_src);
+    b->fetch_src = NULL;
+    b->cids = NULL;
+    b->ccards = NULL;
     free(b->c);
     b->c = NULL;
     b->num_c = 0;
+    free(b->prefix);
+    b->prefix = NULL;
+    b->card = 0;
+    b->card_valid = 1;
 }
 
 void bmap_free(struct bmap *b) {
@@ -392,6 +577,7 @@ void bmap_free(struct bmap *b) {
 
 struct bmap *bmap_new() {
     struct bmap *b = calloc(1, sizeof(struct bmap));
+    b->card_valid = 1;
     return b;
 }
 
@@ -420,6 +606,104 @@ void oper_total_free(struct oper *o) {
 }
 
 
+/* Cardinality estimate used to order intersections, containers of lazy bitmaps
+ * which are not loaded yet and have no stored cardinality count as full arrays */
+static inline uint32_t bmap_estimate_cont_card(const struct bmap *b, int pos) {
+    return (b->c[pos].buffer || b->ccards) ? bmap_cont_card(b, pos) : CUTOFF;
+}
+
+static uint32_t bmap_estimate_cardinality(const struct bmap *b) {
+    if (b->card_valid) {
+        return b->card;
+    }
+    uint32_t card = 0;
+    for (int i=0; i<b->num_c; i++) {
+        card += bmap_estimate_cont_card(b, i);
+    }
+    return card;
+}
+
+/* Multi way intersection.  Operands are ordered by cardinality, container ids
+ * are intersected across all operands first and only containers present in
+ * every operand are then intersected.  The containers of each id are in turn
+ * intersected smallest first */
+static struct bmap *bmap_and_many(struct bmap **in, int count) {
+    struct bmap *r = bmap_new();
+    r->needs_free = 1;
+
+    // Sort operands, there are only a handful so insertion sort it is
+    struct bmap **b = malloc(count * sizeof(struct bmap *));
+    uint32_t *est = malloc(count * sizeof(uint32_t));
+    for (int i=0; i<count; i++) {
+        uint32_t e = bmap_estimate_cardinality(in[i]);
+        int j = i;
+        for (; j > 0 && est[j-1] > e; j--) {
+            b[j] = b[j-1];
+            est[j] = est[j-1];
+        }
+        b[j] = in[i];
+        est[j] = e;
+    }
+
+    // Container positions in every operand for each container id common to all
+    int *match = malloc(b[0]->num_c * count * sizeof(int));
+    int *pos = calloc(count, sizeof(int));
+    int num_match = 0;
+    for (pos[0] = 0; pos[0] < b[0]->num_c; pos[0]++) {
+        uint16_t id = bmap_cid(b[0], pos[0]);
+        bool found = true;
+        for (int i=1; i<count && found; i++) {
+            if (pos[i] < b[i]->num_c && bmap_cid(b[i], pos[i]) < id) {
+                pos[i] = bmap_advance(b[i], id, pos[i]);
+            }
+            if (pos[i] == b[i]->num_c) {
+                goto ids_done;
+            }
+            found = (bmap_cid(b[i], pos[i]) == id);
+        }
+        if (found) {
+            memcpy(&match[num_match * count], pos, count * sizeof(int));
+            num_match++;
+        }
+    }
+ids_done:
+    free(pos);
+
+    // Containers are intersected in place into the first result
+    r->c = malloc(num_match * sizeof(struct cont));
+    int *order = malloc(count * sizeof(int));
+    for (int m=0; m<num_match; m++) {
+        const int *p = &match[m * count];
+        for (int i=0; i<count; i++) {
+            uint32_t e = bmap_estimate_cont_card(b[i], p[i]);
+            int j = i;
+            for (; j > 0 && est[j-1] > e; j--) {
+                order[j] = order[j-1];
+                est[j] = est[j-1];
+            }
+            order[j] = i;
+            est[j] = e;
+        }
+        struct cont *c = cont_and(bmap_cont(b[order[0]], p[order[0]]),
+                                  bmap_cont(b[order[1]], p[order[1]]));
+        for (int i=2; i<count && cont_cardinality(c); i++) {
+            cont_inplace_and(c, bmap_cont(b[order[i]], p[order[i]]));
+        }
+        if (cont_cardinality(c)) {
+            r->c[r->num_c++].buffer = c->buffer;
+            r->card += cont_cardinality(c);
+        } else {
+            free(c->buffer);
+        }
+        free(c);
+    }
+    free(order);
+    free(match);
+    free(est);
+    free(b);
+    return r;
+}
+
 void oper_add(struct oper *o, struct bmap *b) {
     if (b) {
         o->count++;
@@ -442,13 +726,8 @@ struct bmap *oper_and(const struct oper *o) {
         case 2:
             return bmap_and(o->b[0], o->b[1]);
             break;
-        default: {
-                struct bmap *r = bmap_and(o->b[0], o->b[1]);
-                for (int i=2; i<o->count; i++) {
-                    bmap_and_inplace(r, o->b[i]);
-                }
-                return r;
-            }
+        default:
+            return bmap_and_many(o->b, o->count);
     }
 }
 
@@ -489,15 +768,20 @@ struct bmap *oper_or(const struct oper *o) {
         bmap_inplace_lazy_or(r, o->b[i]);
     }
 
+    r->card = 0;
     for (int i=0; i<r->num_c; i++) {
         struct cont *c = &r->c[i];
         // Calculate cardinality
         bitset_cont_cardinality(c);
+        r->card += cont_cardinality(c);
         // convert bitset container to proper containers
         if (cont_cardinality(c) <= CUTOFF) {
             bitset_cont_to_array(c);
         }
     }
+    r->card_valid = 1;
+    free(r->prefix);
+    r->prefix = NULL;
     return r;
 }
 
@@ -506,7 +790,7 @@ struct bmap *oper_or(const struct oper *o) {
 uint32_t bmap_get_first(struct bmap *b) {
     uint32_t f = 0xFFFFFFFF;
     if (b->num_c) {
-        struct cont *c = &b->c[0];
+        struct cont *c = bmap_cont(b, 0);
         return ((uint32_t)c->buffer[0] << 16) | (uint32_t)cont_get_first(c);
     }
     return f;
@@ -515,8 +799,7 @@ uint32_t bmap_get_first(struct bmap *b) {
 uint32_t bmap_get_dumplen(const struct bmap *b) {
     uint32_t mlen = 1; // To store num of items
     for (int i=0; i<b->num_c; i++) {
-        mlen += 2; // id + cardinality
-        mlen += (cont_cardinality(&b->c[i]) > CUTOFF)?CUTOFF:b->c[i].buffer[1];
+        mlen += cont_size(&b->c[i]);
     }
     return mlen * sizeof(uint16_t);
 }
@@ -526,8 +809,7 @@ void bmap_dump(const struct bmap *b, uint16_t *buf) {
     buf[0] = b->num_c;
     buf++;
     for (int i=0; i<b->num_c; i++) {
-        int len = (cont_cardinality(&b->c[i]) > CUTOFF) ? CUTOFF : b->c[i].buffer[1];
-        len += 2; // id + card
+        int len = cont_size(&b->c[i]);
         memcpy(buf, b->c[i].buffer, len*sizeof(uint16_t));
         buf += len;
     }
@@ -535,26 +817,24 @@ void bmap_dump(const struct bmap *b, uint16_t *buf) {
 
 void bmap_load(struct bmap *b, const uint16_t *buf) {
     b->num_c = *buf;
+    free(b->prefix);
+    b->prefix = NULL;
     b->c = calloc(b->num_c, sizeof(struct cont));
     buf++;
     for (int i=0; i<b->num_c; i++) {
-        uint32_t card = buf[1];
-        if (card == 0) {
-            if (buf[2] == 0xFFFF) {
-                card = 65536;
-            }
-        }
-        int len = ((card > CUTOFF)?CUTOFF:buf[1])+2; // 2 for id and cardinality
+        const struct cont c = {(uint16_t *)buf};
+        int len = cont_size(&c);
         b->c[i].buffer = malloc(sizeof(uint16_t)*len);
         memcpy(b->c[i].buffer, buf, len*sizeof(uint16_t));
         buf += len;
     }
+    bmap_count(b);
 }
 
 bool bmap_exists(const struct bmap *b, uint32_t item) {
     int pos = binary_search(b, highbits(item));
     if (pos >= 0) {
-        return cont_exists(&b->c[pos], lowbits(item));
+        return cont_exists(bmap_cont(b, pos), lowbits(item));
     }
     return false;
 }
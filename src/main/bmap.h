@@ -3,11 +3,47 @@
 
 #include "cont.h"
 
+struct bmap;
+/* Returns the buffer of container pos of a lazy bitmap */
+typedef uint16_t *(*bmap_fetcher)(const struct bmap *b, int pos);
+
 struct bmap {
     struct cont *c;
     uint16_t num_c;
     uint8_t needs_free:1; // Does this bitset need to be freed at the end of a query?
     uint8_t mdb_bmap:1; // Is this bitmap a lmdb memory bitmap
+    uint8_t card_valid:1; // Is card up to date
+    uint32_t card;      // Number of items, maintained as items are added / removed
+    uint32_t *prefix;   // Items before each container, built on first rank / select
+    // Lazy bitmaps only know their container ids up front, a container
+    // buffer stays NULL till an operation first touches it
+    const uint16_t *cids;
+    const uint16_t *ccards; // Cardinality - 1 of each container if known up front
+    bmap_fetcher fetch;
+    void *fetch_src; // Used by fetch, freed along with the bitmap
+};
+
+// Suggested number of items to decode at a time with a cursor
+#define BMAP_BLOCK 256
+
+/* Walks a bitmap decoding items into blocks, see bmap_cursor_next */
+struct bmap_cursor {
+    const struct bmap *b;
+    int pos;        // Current container
+    uint32_t from;  // Next item to decode in the current container
+};
+
+// Items buffered for a container, see bmap_builder_add
+struct bmap_bucket {
+    uint16_t *items;
+    uint32_t count;
+    uint32_t size;
+};
+
+/* Builds a bitmap out of items added in any order, repeats included */
+struct bmap_builder {
+    struct bmap_bucket *buckets; // Indexed by container id
+    int num_buckets;
 };
 
 struct bmap *bmap_new();
@@ -17,9 +53,13 @@ void bmap_iterate(const struct bmap *b, bmap_iterator iter, void *ptr);
 void bmap_free(struct bmap *b);
 void bmap_free_containers(struct bmap *b);
 uint32_t bmap_cardinality(const struct bmap *b);
+bool bmap_select(struct bmap *b, uint32_t n, uint32_t *item);
+uint32_t bmap_rank(struct bmap *b, uint32_t item);
 struct bmap *bmap_and(const struct bmap *a, const struct bmap *b);
 struct bmap *bmap_andnot(const struct bmap *a, const struct bmap *b);
 uint32_t bmap_and_cardinality(const struct bmap *a, const struct bmap *b);
+void bmap_and_cardinality_many(const struct bmap *a, struct bmap *const *b, int count, uint32_t *cards);
+uint32_t bmap_or_cardinality(struct bmap *const *b, int count);
 struct bmap *convert_to_bitset_bmap(const struct bmap *f);
 struct bmap *bmap_duplicate(const struct bmap *b);
 uint32_t bmap_get_first(struct bmap *b);
@@ -27,6 +67,12 @@ uint32_t bmap_get_dumplen(const struct bmap *b);
 void bmap_dump(const struct bmap *b, uint16_t *buf); // Dump to buf
 void bmap_load(struct bmap *b, const uint16_t *buf); // Load from buf
 bool bmap_exists(const struct bmap *b, uint32_t item);
+void bmap_cursor_init(struct bmap_cursor *cur, const struct bmap *b);
+int bmap_cursor_next(struct bmap_cursor *cur, uint32_t *out, int max);
+void bmap_cursor_advance_to(struct bmap_cursor *cur, uint32_t item);
+void bmap_builder_init(struct bmap_builder *bb);
+void bmap_builder_add(struct bmap_builder *bb, uint32_t item);
+struct bmap *bmap_builder_finish(struct bmap_builder *bb);
 
 struct oper {
     int count;
@@ -1,22 +1,16 @@
 #include "cont.h"
+#include "array.h"
+#include "bitset.h"
 #include "platform.h"
 #include <stdio.h>
 #include <string.h>
 
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
 
-static bool exists_array(const struct cont *c, uint16_t item) {
-    int first = 0, last = c->buffer[CARDINALITY]-1, middle = (first+last)/2;
-    uint16_t *buffer = &c->buffer[2];
-    while (first <= last) {
-        if (buffer[middle] == item) return true;
-        if (buffer[middle] < item) {
-            first = middle+1;
-        } else {
-            last = middle-1;
-        }
-        middle = (first+last)/2;
-    }
-    return false;
+
+static inline bool exists_array(const struct cont *c, uint16_t item) {
+    return array_exists(&c->buffer[2], c->buffer[CARDINALITY], item);
 }
 
 static void array_to_bitset(struct cont *c) {
@@ -115,14 +109,14 @@ static void bitset_to_array(struct cont *c) {
     free(nb);
 }
 
-static inline bool cont_is_array(const struct cont *c) {
-    if (cont_cardinality(c) > CUTOFF) {
-        return false;
-    }
-    return true;
+static inline bool is_run(const struct cont *c) {
+    return c->buffer[CARDINALITY] == 0 && c->buffer[CARDINALITY+1] == RUN_MARKER;
 }
 
-static inline int cont_type(const struct cont *c) {
+int cont_type(const struct cont *c) {
+    if (UNLIKELY(is_run(c))) {
+        return RUN_CONT_TYPE;
+    }
     if (cont_cardinality(c) > CUTOFF) {
         return BITSET_CONT_TYPE;
     }
@@ -130,14 +124,7 @@ static inline int cont_type(const struct cont *c) {
 }
 
 static inline int bitset_bitset_and_cardinality(const struct cont *a, const struct cont *b) {
-    const uint64_t *al = (const uint64_t *)&a->buffer[2];
-    const uint64_t *bl = (const uint64_t *)&b->buffer[2];
-    int card = 0;
-    for (int i=0; i<1024; i+=2) {
-        card += __builtin_popcountll(al[i] & bl[i]);
-        card += __builtin_popcountll(al[i+1] & bl[i+1]);
-    }
-    return card;
+    return bitset_ops.and_card((const uint64_t *)&a->buffer[2], (const uint64_t *)&b->buffer[2]);
 }
 
 static inline int header_and_cardinality_size(int cardinality) {
@@ -170,16 +157,11 @@ void bitset_cont_to_array(struct cont *c) {
 
 static struct cont *bitset_bitset_andnot(const struct cont *a, const struct cont *b) {
     struct cont *c = malloc(sizeof(struct cont));
-    c->buffer = calloc((CUTOFF+2), sizeof(uint16_t));
-    const uint64_t *al = (const uint64_t *)&a->buffer[2];
-    const uint64_t *bl = (const uint64_t *)&b->buffer[2];
-    uint64_t *cl = (uint64_t *)&c->buffer[2];
-    for (int i = 0; i < 1024; i+=2) {
-        cl[i] = (al[i] & ~bl[i]);
-        cl[i+1] = (al[i+1] & ~bl[i+1]);
-    }
+    c->buffer = malloc((CUTOFF+2) * sizeof(uint16_t));
     c->buffer[ID] = a->buffer[ID];
-    bitset_cont_cardinality(c);
+    c->buffer[CARDINALITY] = bitset_ops.andnot((const uint64_t *)&a->buffer[2],
+                                               (const uint64_t *)&b->buffer[2],
+                                               (uint64_t *)&c->buffer[2]);
     // convert bitset container to proper containers
     if (cont_cardinality(c) <= CUTOFF) {
         bitset_cont_to_array(c);
@@ -190,132 +172,40 @@ static struct cont *bitset_bitset_andnot(const struct cont *a, const struct cont
 
 static struct cont *bitset_bitset_and(const struct cont *a, const struct cont *b) {
     struct cont *c = malloc(sizeof(struct cont));
-    int cardinality = bitset_bitset_and_cardinality(a, b);
-    const uint64_t *al = (const uint64_t *)&a->buffer[2];
-    const uint64_t *bl = (const uint64_t *)&b->buffer[2];
-
-    // printf("b b and card %d\n", cardinality);
-    if (cardinality > CUTOFF) {
-        c->buffer = malloc((CUTOFF+2) * sizeof(uint16_t));
-        uint64_t *cl = (uint64_t *)&c->buffer[2];
-        for (int i=0; i<1024; i+=2) {
-            cl[i] = (al[i] & bl[i]);
-            cl[i+1] = (al[i+1] & bl[i+1]);
-        }
-    } else {
-        c->buffer = malloc(header_and_cardinality_size(cardinality) * sizeof(uint16_t));
-        int pos = 2;
-        int base = 0;
-        for (int i=0; i<BCUTOFF; i++) {
-            uint64_t w = al[i] & bl[i];
-            while (w != 0) {
-                uint64_t t = w & (~w + 1);
-                int r = __builtin_ctzll(w);
-                c->buffer[pos++] = base + r;
-                w ^= t;
-            }
-            base += 64;
-        }
-    }
-
+    // Do the and and count in a single pass, convert to array if it is small enough
+    c->buffer = malloc((CUTOFF+2) * sizeof(uint16_t));
     c->buffer[ID] = a->buffer[ID];
-    c->buffer[CARDINALITY] = cardinality;
-    if (cardinality == 0) {
-        c->buffer[CARDINALITY + 1] = 0;
+    c->buffer[CARDINALITY] = bitset_ops.and((const uint64_t *)&a->buffer[2],
+                                            (const uint64_t *)&b->buffer[2],
+                                            (uint64_t *)&c->buffer[2]);
+    if (cont_cardinality(c) <= CUTOFF) {
+        bitset_cont_to_array(c);
     }
     return c;
 }
 
-static int difference_uint16(const uint16_t *a1, int length1, const uint16_t *a2,
-                      int length2, uint16_t *a_out) {
-    int out_card = 0;
-    int k1 = 0, k2 = 0;
-    if (length1 == 0) {
-        return 0;
-    }
-    if (length2 == 0) {
-        if (a1 != a_out) memcpy(a_out, a1, sizeof(uint16_t) * length1);
-        return length1;
-    }
-    uint16_t s1 = a1[k1];
-    uint16_t s2 = a2[k2];
-    while (true) {
-        if (s1 < s2) {
-            a_out[out_card++] = s1;
-            ++k1;
-            if (k1 >= length1) {
-                break;
-            }
-            s1 = a1[k1];
-        } else if (s1 == s2) {
-            ++k1;
-            ++k2;
-            if (k1 >= length1) {
-                break;
-            }
-            if (k2 >= length2) {
-                memmove(a_out + out_card, a1 + k1,
-                        sizeof(uint16_t) * (length1 - k1));
-                return out_card + length1 - k1;
-            }
-            s1 = a1[k1];
-            s2 = a2[k2];
-        } else {  // if (val1>val2)
-            ++k2;
-            if (k2 >= length2) {
-                memmove(a_out + out_card, a1 + k1,
-                        sizeof(uint16_t) * (length1 - k1));
-                return out_card + length1 - k1;
-            }
-            s2 = a2[k2];
-        }
-    }
-    return out_card;
-}
-
-
-static inline int array_advance(const struct cont *b, int len, uint16_t val, int pos) {
-    while(++pos < len) {
-        if (b->buffer[pos] >= val) return pos;
-    }
-    return pos;
-}
-
 static struct cont *array_array_andnot(const struct cont *a, const struct cont *b) {
     struct cont *c = malloc(sizeof(struct cont));
-    c->buffer = calloc(cont_cardinality(a) + 2, sizeof(uint16_t));
+    c->buffer = malloc((cont_cardinality(a) + 2 + ARRAY_SIMD_SLACK) * sizeof(uint16_t));
     c->buffer[ID] = a->buffer[ID];
-    c->buffer[CARDINALITY] = difference_uint16(&a->buffer[2], 
-                               cont_cardinality(a), &b->buffer[2], 
-                               cont_cardinality(b), &c->buffer[2]);
+    c->buffer[CARDINALITY] = array_difference(&a->buffer[2], cont_cardinality(a),
+                                              &b->buffer[2], cont_cardinality(b),
+                                              &c->buffer[2]);
+    if (c->buffer[CARDINALITY] == 0) {
+        c->buffer[CARDINALITY + 1] = 0;
+    }
     return c;
 }
 
 static struct cont *array_array_and(const struct cont *a, const struct cont *b) {
-    const int l1 = a->buffer[CARDINALITY]+2;
-    const int l2 = b->buffer[CARDINALITY]+2;
+    const int l1 = a->buffer[CARDINALITY];
+    const int l2 = b->buffer[CARDINALITY];
     struct cont *c = malloc(sizeof(struct cont));
-    c->buffer = malloc(sizeof(uint16_t) * ((l1 < l2) ? l1 : l2));
+    c->buffer = malloc(sizeof(uint16_t) * (((l1 < l2) ? l1 : l2) + 2 + ARRAY_SIMD_SLACK));
     c->buffer[ID] = a->buffer[ID];
-    c->buffer[CARDINALITY] = 0;
-    c->buffer[CARDINALITY+1] = 0;
-
-    int pos1 = 2;
-    int pos2 = 2;
-    int pos  = 2;
-    while (pos1 < l1 && pos2 < l2) {
-        const uint16_t v1 = a->buffer[pos1];
-        const uint16_t v2 = b->buffer[pos2];
-        if (v1 == v2) {
-            c->buffer[CARDINALITY]++;
-            c->buffer[pos++] = v1;
-            ++pos1;
-            ++pos2;
-        } else if (v1 < v2) {
-            pos1 = array_advance(a, l1, v2, pos1);
-        } else {
-            pos2 = array_advance(b, l2, v1, pos2);
-        }
+    c->buffer[CARDINALITY] = array_intersect(&a->buffer[2], l1, &b->buffer[2], l2, &c->buffer[2]);
+    if (c->buffer[CARDINALITY] == 0) {
+        c->buffer[CARDINALITY + 1] = 0;
     }
     return c;
 }
@@ -384,6 +274,562 @@ static struct cont *bitset_array_and(const struct cont *a, const struct cont *b)
     return c;
 }
 
+/********** Run containers **********/
+
+// Size of a container with the given cardinality when stored as an array / bitset
+static inline uint32_t plain_size(uint32_t card) {
+    return (card > CUTOFF) ? CUTOFF + 2 : header_and_cardinality_size(card);
+}
+
+static inline uint32_t run_size(int nruns) {
+    return RUN_DATA + 2 * nruns;
+}
+
+static uint16_t *run_buffer_new(uint16_t id, int nruns) {
+    uint16_t *buffer = malloc(run_size(nruns) * sizeof(uint16_t));
+    buffer[ID] = id;
+    buffer[CARDINALITY] = 0;
+    buffer[CARDINALITY+1] = RUN_MARKER;
+    buffer[RUN_NRUNS] = nruns;
+    buffer[RUN_CARD] = 0;
+    return buffer;
+}
+
+/* Bit range helpers, ranges are [start, end) */
+static inline uint64_t range_first_mask(uint32_t start) {
+    return ~0ULL << (start & 63);
+}
+
+static inline uint64_t range_last_mask(uint32_t end) {
+    return ~0ULL >> ((-end) & 63);
+}
+
+static void bitset_set_range(uint64_t *w, uint32_t start, uint32_t end) {
+    uint32_t first = start >> 6, last = (end - 1) >> 6;
+    if (first == last) {
+        w[first] |= range_first_mask(start) & range_last_mask(end);
+        return;
+    }
+    w[first] |= range_first_mask(start);
+    for (uint32_t i = first + 1; i < last; i++) {
+        w[i] = ~0ULL;
+    }
+    w[last] |= range_last_mask(end);
+}
+
+static void bitset_clear_range(uint64_t *w, uint32_t start, uint32_t end) {
+    uint32_t first = start >> 6, last = (end - 1) >> 6;
+    if (first == last) {
+        w[first] &= ~(range_first_mask(start) & range_last_mask(end));
+        return;
+    }
+    w[first] &= ~range_first_mask(start);
+    for (uint32_t i = first + 1; i < last; i++) {
+        w[i] = 0;
+    }
+    w[last] &= ~range_last_mask(end);
+}
+
+static void bitset_copy_range(uint64_t *dst, const uint64_t *src, uint32_t start, uint32_t end) {
+    uint32_t first = start >> 6, last = (end - 1) >> 6;
+    if (first == last) {
+        dst[first] |= src[first] & range_first_mask(start) & range_last_mask(end);
+        return;
+    }
+    dst[first] |= src[first] & range_first_mask(start);
+    for (uint32_t i = first + 1; i < last; i++) {
+        dst[i] = src[i];
+    }
+    dst[last] |= src[last] & range_last_mask(end);
+}
+
+static int bitset_range_cardinality(const uint64_t *w, uint32_t start, uint32_t end) {
+    uint32_t first = start >> 6, last = (end - 1) >> 6;
+    if (first == last) {
+        return __builtin_popcountll(w[first] & range_first_mask(start) & range_last_mask(end));
+    }
+    int card = __builtin_popcountll(w[first] & range_first_mask(start));
+    for (uint32_t i = first + 1; i < last; i++) {
+        card += __builtin_popcountll(w[i]);
+    }
+    return card + __builtin_popcountll(w[last] & range_last_mask(end));
+}
+
+/* Returns the last run starting at or before item, -1 if there is none */
+static int run_search(const struct cont *c, uint16_t item) {
+    const uint16_t *runs = &c->buffer[RUN_DATA];
+    int low = 0, high = c->buffer[RUN_NRUNS] - 1, found = -1;
+    while (low <= high) {
+        int middle = (low + high) >> 1;
+        if (runs[2*middle] <= item) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
+
+static inline bool exists_run(const struct cont *c, uint16_t item) {
+    int i = run_search(c, item);
+    return (i >= 0) && (item - c->buffer[RUN_DATA + 2*i] <= c->buffer[RUN_DATA + 2*i + 1]);
+}
+
+// Assumes item does not exist in the container
+static void run_add(struct cont *c, uint16_t item) {
+    int n = c->buffer[RUN_NRUNS];
+    int i = run_search(c, item);
+    uint16_t *runs = &c->buffer[RUN_DATA];
+    c->buffer[RUN_CARD]++;
+    // Extend the previous run, merging it with the next one if they now touch
+    if (i >= 0 && runs[2*i] + runs[2*i+1] + 1 == item) {
+        runs[2*i+1]++;
+        if (i + 1 < n && runs[2*(i+1)] == item + 1) {
+            runs[2*i+1] += runs[2*(i+1)+1] + 1;
+            memmove(&runs[2*(i+1)], &runs[2*(i+2)], (n - i - 2) * 2 * sizeof(uint16_t));
+            c->buffer[RUN_NRUNS]--;
+        }
+        return;
+    }
+    // Extend the next run backwards
+    if (i + 1 < n && runs[2*(i+1)] == item + 1) {
+        runs[2*(i+1)]--;
+        runs[2*(i+1)+1]++;
+        return;
+    }
+    // Start a new run
+    c->buffer = realloc(c->buffer, run_size(n + 1) * sizeof(uint16_t));
+    runs = &c->buffer[RUN_DATA];
+    memmove(&runs[2*(i+2)], &runs[2*(i+1)], (n - i - 1) * 2 * sizeof(uint16_t));
+    runs[2*(i+1)] = item;
+    runs[2*(i+1)+1] = 0;
+    c->buffer[RUN_NRUNS]++;
+}
+
+// Assumes item exists and is not the last item in the container
+static void run_remove(struct cont *c, uint16_t item) {
+    int n = c->buffer[RUN_NRUNS];
+    int i = run_search(c, item);
+    uint16_t *runs = &c->buffer[RUN_DATA];
+    uint16_t start = runs[2*i];
+    uint16_t end = start + runs[2*i+1];
+    c->buffer[RUN_CARD]--;
+    if (start == end) {
+        memmove(&runs[2*i], &runs[2*(i+1)], (n - i - 1) * 2 * sizeof(uint16_t));
+        c->buffer[RUN_NRUNS]--;
+    } else if (item == start) {
+        runs[2*i]++;
+        runs[2*i+1]--;
+    } else if (item == end) {
+        runs[2*i+1]--;
+    } else {
+        // Split the run in two
+        c->buffer = realloc(c->buffer, run_size(n + 1) * sizeof(uint16_t));
+        runs = &c->buffer[RUN_DATA];
+        memmove(&runs[2*(i+2)], &runs[2*(i+1)], (n - i - 1) * 2 * sizeof(uint16_t));
+        runs[2*i+1] = item - start - 1;
+        runs[2*(i+1)] = item + 1;
+        runs[2*(i+1)+1] = end - item - 1;
+        c->buffer[RUN_NRUNS]++;
+    }
+}
+
+static int array_num_runs(const struct cont *c) {
+    int card = c->buffer[CARDINALITY];
+    const uint16_t *a = &c->buffer[2];
+    int runs = card ? 1 : 0;
+    for (int i = 1; i < card; i++) {
+        if (a[i] != a[i-1] + 1) runs++;
+    }
+    return runs;
+}
+
+static int bitset_num_runs(const struct cont *c) {
+    const uint64_t *w = (const uint64_t *)&c->buffer[2];
+    int runs = 0;
+    for (int i = 0; i < BCUTOFF - 1; i++) {
+        // Count the ends of runs, a run continuing into the next word does not end
+        runs += __builtin_popcountll(w[i] & ~(w[i] >> 1)) - ((w[i] >> 63) & w[i+1] & 1);
+    }
+    return runs + __builtin_popcountll(w[BCUTOFF-1] & ~(w[BCUTOFF-1] >> 1));
+}
+
+/* Converts an array / bitset container to a run container */
+static void cont_to_run(struct cont *c, int nruns) {
+    uint32_t card = cont_cardinality(c);
+    uint16_t *nb = run_buffer_new(c->buffer[ID], nruns);
+    uint16_t *runs = &nb[RUN_DATA];
+    int r = 0;
+    if (card > CUTOFF) {
+        const uint64_t *w = (const uint64_t *)&c->buffer[2];
+        int i = 0;
+        uint64_t cur = w[0];
+        while (true) {
+            while (cur == 0 && i < BCUTOFF - 1) cur = w[++i];
+            if (cur == 0) break;
+            uint32_t start = 64 * i + __builtin_ctzll(cur);
+            // Set all bits below the run start, then find the first zero
+            uint64_t ones = cur | (cur - 1);
+            while (ones == ~0ULL && i < BCUTOFF - 1) ones = w[++i];
+            if (ones == ~0ULL) {
+                runs[2*r] = start;
+                runs[2*r+1] = 64 * BCUTOFF - start - 1;
+                r++;
+                break;
+            }
+            uint32_t end = 64 * i + __builtin_ctzll(~ones);
+            runs[2*r] = start;
+            runs[2*r+1] = end - start - 1;
+            r++;
+            cur = ones & (ones + 1);
+        }
+    } else {
+        const uint16_t *a = &c->buffer[2];
+        for (int i = 0; i < card; i++) {
+            if (r && runs[2*(r-1)] + runs[2*(r-1)+1] + 1 == a[i]) {
+                runs[2*(r-1)+1]++;
+            } else {
+                runs[2*r] = a[i];
+                runs[2*r+1] = 0;
+                r++;
+            }
+        }
+    }
+    nb[RUN_CARD] = card - 1;
+    free(c->buffer);
+    c->buffer = nb;
+}
+
+/* Writes a run container out as a bitset into words, which should be zeroed */
+static inline void run_fill_bitset(const struct cont *c, uint64_t *words) {
+    const uint16_t *runs = &c->buffer[RUN_DATA];
+    for (int i = 0; i < c->buffer[RUN_NRUNS]; i++) {
+        bitset_set_range(words, runs[2*i], runs[2*i] + runs[2*i+1] + 1);
+    }
+}
+
+/* Converts a run container to an array or bitset based on its cardinality */
+static void run_to_plain(struct cont *c) {
+    uint32_t card = cont_cardinality(c);
+    uint16_t *nb;
+    if (card > CUTOFF) {
+        nb = calloc(CUTOFF + 2, sizeof(uint16_t));
+        run_fill_bitset(c, (uint64_t *)&nb[2]);
+    } else {
+        nb = malloc(header_and_cardinality_size(card) * sizeof(uint16_t));
+        const uint16_t *runs = &c->buffer[RUN_DATA];
+        int p = 2;
+        for (int i = 0; i < c->buffer[RUN_NRUNS]; i++) {
+            uint32_t end = runs[2*i] + runs[2*i+1];
+            for (uint32_t v = runs[2*i]; v <= end; v++) {
+                nb[p++] = v;
+            }
+        }
+    }
+    nb[ID] = c->buffer[ID];
+    nb[CARDINALITY] = card;
+    free(c->buffer);
+    c->buffer = nb;
+}
+
+/* Fixes up a run container built by an operation, an empty result becomes an
+ * empty array and runs are dropped if they take more space than the plain form */
+static void run_finish(struct cont *c, int nruns, uint32_t card) {
+    if (card == 0) {
+        c->buffer = realloc(c->buffer, header_and_cardinality_size(0) * sizeof(uint16_t));
+        c->buffer[CARDINALITY] = 0;
+        c->buffer[CARDINALITY+1] = 0;
+        return;
+    }
+    c->buffer[RUN_NRUNS] = nruns;
+    c->buffer[RUN_CARD] = card - 1;
+    if (run_size(nruns) > plain_size(card)) {
+        run_to_plain(c);
+    }
+}
+
+static struct cont *run_duplicate_plain(const struct cont *a) {
+    struct cont *c = malloc(sizeof(struct cont));
+    c->buffer = cont_duplicate(a);
+    run_to_plain(c);
+    return c;
+}
+
+static struct cont *run_run_and(const struct cont *a, const struct cont *b) {
+    const int na = a->buffer[RUN_NRUNS], nb = b->buffer[RUN_NRUNS];
+    const uint16_t *ra = &a->buffer[RUN_DATA], *rb = &b->buffer[RUN_DATA];
+    struct cont *c = malloc(sizeof(struct cont));
+    c->buffer = run_buffer_new(a->buffer[ID], na + nb);
+    uint16_t *runs = &c->buffer[RUN_DATA];
+    int i = 0, j = 0, r = 0;
+    uint32_t card = 0;
+    while (i < na && j < nb) {
+        uint32_t ae = ra[2*i] + ra[2*i+1], be = rb[2*j] + rb[2*j+1];
+        uint32_t start = MAX(ra[2*i], rb[2*j]), end = MIN(ae, be);
+        if (start <= end) {
+            runs[2*r] = start;
+            runs[2*r+1] = end - start;
+            card += end - start + 1;
+            r++;
+        }
+        if (ae < be) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    run_finish(c, r, card);
+    return c;
+}
+
+static int run_run_and_cardinality(const struct cont *a, const struct cont *b) {
+    const int na = a->buffer[RUN_NRUNS], nb = b->buffer[RUN_NRUNS];
+    const uint16_t *ra = &a->buffer[RUN_DATA], *rb = &b->buffer[RUN_DATA];
+    int i = 0, j = 0, card = 0;
+    while (i < na && j < nb) {
+        uint32_t ae = ra[2*i] + ra[2*i+1], be = rb[2*j] + rb[2*j+1];
+        uint32_t start = MAX(ra[2*i], rb[2*j]), end = MIN(ae, be);
+        if (start <= end) {
+            card += end - start + 1;
+        }
+        if (ae < be) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    return card;
+}
+
+/* Keeps the items of array b that are (or with invert, are not) in run a */
+static int run_array_filter(const struct cont *a, const struct cont *b, uint16_t *out, bool invert) {
+    const int na = a->buffer[RUN_NRUNS], nb = b->buffer[CARDINALITY];
+    const uint16_t *ra = &a->buffer[RUN_DATA], *vb = &b->buffer[2];
+    int i = 0, count = 0;
+    for (int k = 0; k < nb; k++) {
+        while (i < na && ra[2*i] + ra[2*i+1] < vb[k]) i++;
+        bool in = (i < na) && (ra[2*i] <= vb[k]);
+        if (in != invert) {
+            if (out) out[count] = vb[k];
+            count++;
+        }
+    }
+    return count;
+}
+
+static struct cont *run_array_and(const struct cont *a, const struct cont *b) {
+    struct cont *c = malloc(sizeof(struct cont));
+    c->buffer = malloc(header_and_cardinality_size(b->buffer[CARDINALITY]) * sizeof(uint16_t));
+    c->buffer[ID] = a->buffer[ID];
+    c->buffer[CARDINALITY] = run_array_filter(a, b, &c->buffer[2], false);
+    if (c->buffer[CARDINALITY] == 0) {
+        c->buffer[CARDINALITY+1] = 0;
+    }
+    return c;
+}
+
+static struct cont *run_bitset_and(const struct cont *a, const struct cont *b) {
+    const uint16_t *runs = &a->buffer[RUN_DATA];
+    struct cont *c = malloc(sizeof(struct cont));
+    c->buffer = calloc(CUTOFF + 2, sizeof(uint16_t));
+    c->buffer[ID] = a->buffer[ID];
+    for (int i = 0; i < a->buffer[RUN_NRUNS]; i++) {
+        bitset_copy_range((uint64_t *)&c->buffer[2], (const uint64_t *)&b->buffer[2],
+                          runs[2*i], runs[2*i] + runs[2*i+1] + 1);
+    }
+    bitset_cont_cardinality(c);
+    if (cont_cardinality(c) <= CUTOFF) {
+        bitset_cont_to_array(c);
+    }
+    return c;
+}
+
+static int run_bitset_and_cardinality(const struct cont *a, const struct cont *b) {
+    const uint16_t *runs = &a->buffer[RUN_DATA];
+    int card = 0;
+    for (int i = 0; i < a->buffer[RUN_NRUNS]; i++) {
+        card += bitset_range_cardinality((const uint64_t *)&b->buffer[2],
+                                         runs[2*i], runs[2*i] + runs[2*i+1] + 1);
+    }
+    return card;
+}
+
+static struct cont *run_run_andnot(const struct cont *a, const struct cont *b) {
+    const int na = a->buffer[RUN_NRUNS], nb = b->buffer[RUN_NRUNS];
+    const uint16_t *ra = &a->buffer[RUN_DATA], *rb = &b->buffer[RUN_DATA];
+    struct cont *c = malloc(sizeof(struct cont));
+    c->buffer = run_buffer_new(a->buffer[ID], na + nb);
+    uint16_t *runs = &c->buffer[RUN_DATA];
+    int j = 0, r = 0;
+    uint32_t card = 0;
+    for (int i = 0; i < na; i++) {
+        uint32_t cur = ra[2*i], end = ra[2*i] + ra[2*i+1];
+        while (j < nb && rb[2*j] + rb[2*j+1] < cur) j++;
+        // Cut out every b run overlapping this a run, the last one may
+        // overlap the next a run too so j is not moved past it
+        for (int k = j; k < nb && rb[2*k] <= end; k++) {
+            if (rb[2*k] > cur) {
+                runs[2*r] = cur;
+                runs[2*r+1] = rb[2*k] - 1 - cur;
+                card += rb[2*k] - cur;
+                r++;
+            }
+            cur = MAX(cur, (uint32_t)rb[2*k] + rb[2*k+1] + 1);
+        }
+        if (cur <= end) {
+            runs[2*r] = cur;
+            runs[2*r+1] = end - cur;
+            card += end - cur + 1;
+            r++;
+        }
+    }
+    run_finish(c, r, card);
+    return c;
+}
+
+static struct cont *array_run_andnot(const struct cont *a, const struct cont *b) {
+    struct cont *c = malloc(sizeof(struct cont));
+    c->buffer = malloc(header_and_cardinality_size(a->buffer[CARDINALITY]) * sizeof(uint16_t));
+    c->buffer[ID] = a->buffer[ID];
+    c->buffer[CARDINALITY] = run_array_filter(b, a, &c->buffer[2], true);
+    if (c->buffer[CARDINALITY] == 0) {
+        c->buffer[CARDINALITY+1] = 0;
+    }
+    return c;
+}
+
+static struct cont *bitset_run_andnot(const struct cont *a, const struct cont *b) {
+    const uint16_t *runs = &b->buffer[RUN_DATA];
+    struct cont *c = malloc(sizeof(struct cont));
+    c->buffer = cont_duplicate(a);
+    for (int i = 0; i < b->buffer[RUN_NRUNS]; i++) {
+        bitset_clear_range((uint64_t *)&c->buffer[2], runs[2*i], runs[2*i] + runs[2*i+1] + 1);
+    }
+    bitset_cont_cardinality(c);
+    if (cont_cardinality(c) <= CUTOFF) {
+        bitset_cont_to_array(c);
+    }
+    return c;
+}
+
+/* Run minus array / bitset, done on the plain form of the run container */
+static struct cont *run_plain_andnot(const struct cont *a, const struct cont *b) {
+    struct cont *tmp = run_duplicate_plain(a);
+    struct cont *c = cont_andnot(tmp, b);
+    cont_free(tmp);
+    return c;
+}
+
+/* Picks the smallest representation for a container, run containers
+ * are only used when they are strictly smaller */
+void cont_optimize(struct cont *c) {
+    uint32_t card = cont_cardinality(c);
+    if (UNLIKELY(card == 0)) return;
+    switch (cont_type(c)) {
+        case RUN_CONT_TYPE:
+            if (run_size(c->buffer[RUN_NRUNS]) >= plain_size(card)) {
+                run_to_plain(c);
+            }
+            break;
+        case ARRAY_CONT_TYPE: {
+                int nruns = array_num_runs(c);
+                if (run_size(nruns) < plain_size(card)) {
+                    cont_to_run(c, nruns);
+                }
+            }
+            break;
+        case BITSET_CONT_TYPE: {
+                int nruns = bitset_num_runs(c);
+                if (run_size(nruns) < plain_size(card)) {
+                    cont_to_run(c, nruns);
+                }
+            }
+            break;
+    }
+}
+
+/* Builds a container buffer out of len sorted unique items, picking the
+ * smallest representation up front */
+uint16_t *cont_from_sorted(uint16_t id, const uint16_t *items, int len) {
+    int nruns = len ? 1 : 0;
+    for (int i = 1; i < len; i++) {
+        if (items[i] != items[i-1] + 1) nruns++;
+    }
+    uint16_t *buffer;
+    if (len && run_size(nruns) < plain_size(len)) {
+        buffer = run_buffer_new(id, nruns);
+        uint16_t *runs = &buffer[RUN_DATA];
+        int r = -1;
+        for (int i = 0; i < len; i++) {
+            if (i && items[i] == items[i-1] + 1) {
+                runs[2*r+1]++;
+            } else {
+                r++;
+                runs[2*r] = items[i];
+                runs[2*r+1] = 0;
+            }
+        }
+        buffer[RUN_CARD] = len - 1;
+    } else if (len > CUTOFF) {
+        buffer = calloc(CUTOFF + 2, sizeof(uint16_t));
+        for (int i = 0; i < len; i++) {
+            buffer[(items[i]>>4)+2] |= 1 << (items[i] & 0xF);
+        }
+        buffer[CARDINALITY] = len;
+    } else {
+        buffer = malloc(header_and_cardinality_size(len) * sizeof(uint16_t));
+        memcpy(&buffer[2], items, len * sizeof(uint16_t));
+        buffer[CARDINALITY] = len;
+        if (!len) {
+            buffer[CARDINALITY+1] = 0;
+        }
+    }
+    buffer[ID] = id;
+    return buffer;
+}
+
+/* Number of uint16_t words used by the container including its header */
+uint32_t cont_size(const struct cont *c) {
+    switch (cont_type(c)) {
+        case RUN_CONT_TYPE:
+            return run_size(c->buffer[RUN_NRUNS]);
+        case BITSET_CONT_TYPE:
+            return CUTOFF + 2;
+        default:
+            return header_and_cardinality_size(c->buffer[CARDINALITY]);
+    }
+}
+
+/* Returns a new bitset buffer holding the items of any container type */
+uint16_t *cont_to_bitset(const struct cont *c) {
+    uint16_t *buffer;
+    switch (cont_type(c)) {
+        case BITSET_CONT_TYPE:
+            buffer = malloc((CUTOFF + 2) * sizeof(uint16_t));
+            memcpy(buffer, c->buffer, (CUTOFF + 2) * sizeof(uint16_t));
+            return buffer;
+        case RUN_CONT_TYPE:
+            buffer = calloc(CUTOFF + 2, sizeof(uint16_t));
+            run_fill_bitset(c, (uint64_t *)&buffer[2]);
+            buffer[ID] = c->buffer[ID];
+            buffer[CARDINALITY] = cont_cardinality(c);
+            return buffer;
+        default: {
+                buffer = calloc(CUTOFF + 2, sizeof(uint16_t));
+                buffer[ID] = c->buffer[ID];
+                int card = c->buffer[CARDINALITY];
+                buffer[CARDINALITY] = card;
+                uint16_t *buf = buffer + 2;
+                for (int i = 2; i < card + 2; i++) {
+                    buf[c->buffer[i]>>4] |= 1 << (c->buffer[i] & 0xF);
+                }
+            }
+            return buffer;
+    }
+}
+
+
 struct cont *cont_and(const struct cont *a, const struct cont *b) {
     //printf("Cont and for pair %d\n", CONT_PAIR(cont_type(a), cont_type(b)));
     switch(CONT_PAIR(cont_type(a), cont_type(b))) {
@@ -399,6 +845,21 @@ struct cont *cont_and(const struct cont *a, const struct cont *b) {
         case CONT_PAIR(ARRAY_CONT_TYPE, BITSET_CONT_TYPE):
             return bitset_array_and(a, b);
             break;
+        case CONT_PAIR(RUN_CONT_TYPE, RUN_CONT_TYPE):
+            return run_run_and(a, b);
+            break;
+        case CONT_PAIR(RUN_CONT_TYPE, ARRAY_CONT_TYPE):
+            return run_array_and(a, b);
+            break;
+        case CONT_PAIR(ARRAY_CONT_TYPE, RUN_CONT_TYPE):
+            return run_array_and(b, a);
+            break;
+        case CONT_PAIR(RUN_CONT_TYPE, BITSET_CONT_TYPE):
+            return run_bitset_and(a, b);
+            break;
+        case CONT_PAIR(BITSET_CONT_TYPE, RUN_CONT_TYPE):
+            return run_bitset_and(b, a);
+            break;
     }
     return NULL;
 }
@@ -417,11 +878,65 @@ struct cont *cont_andnot(const struct cont *a, const struct cont *b) {
         case CONT_PAIR(ARRAY_CONT_TYPE, BITSET_CONT_TYPE):
             return array_bitset_andnot(a, b);
             break;
+        case CONT_PAIR(RUN_CONT_TYPE, RUN_CONT_TYPE):
+            return run_run_andnot(a, b);
+            break;
+        case CONT_PAIR(ARRAY_CONT_TYPE, RUN_CONT_TYPE):
+            return array_run_andnot(a, b);
+            break;
+        case CONT_PAIR(BITSET_CONT_TYPE, RUN_CONT_TYPE):
+            return bitset_run_andnot(a, b);
+            break;
+        case CONT_PAIR(RUN_CONT_TYPE, ARRAY_CONT_TYPE):
+        case CONT_PAIR(RUN_CONT_TYPE, BITSET_CONT_TYPE):
+            return run_plain_andnot(a, b);
+            break;
     }
     return NULL;
 }
 
+/* Intersects a with b leaving the result in a, which must own its buffer.
+ * Array and bitset / bitset results reuse the buffer of a */
 void cont_inplace_and(struct cont *a, const struct cont *b) {
+    int ta = cont_type(a), tb = cont_type(b);
+    if (ta == ARRAY_CONT_TYPE) {
+        uint16_t *items = &a->buffer[2];
+        int card = a->buffer[CARDINALITY];
+        switch (tb) {
+            case ARRAY_CONT_TYPE: {
+                    // Vector kernels write past the result, so use scratch space
+                    uint16_t tmp[CUTOFF + ARRAY_SIMD_SLACK];
+                    card = array_intersect(items, card, &b->buffer[2], b->buffer[CARDINALITY], tmp);
+                    memcpy(items, tmp, card * sizeof(uint16_t));
+                }
+                break;
+            case BITSET_CONT_TYPE: {
+                    int count = 0;
+                    for (int i=0; i<card; i++) {
+                        items[count] = items[i];
+                        count += exists_bitset(b, items[i]);
+                    }
+                    card = count;
+                }
+                break;
+            case RUN_CONT_TYPE:
+                card = run_array_filter(b, a, items, false);
+                break;
+        }
+        a->buffer[CARDINALITY] = card;
+        if (card == 0) {
+            a->buffer[CARDINALITY+1] = 0;
+        }
+        return;
+    }
+    if (ta == BITSET_CONT_TYPE && tb == BITSET_CONT_TYPE) {
+        uint64_t *words = (uint64_t *)&a->buffer[2];
+        a->buffer[CARDINALITY] = bitset_ops.and(words, (const uint64_t *)&b->buffer[2], words);
+        if (cont_cardinality(a) <= CUTOFF) {
+            bitset_cont_to_array(a);
+        }
+        return;
+    }
     struct cont *nc = cont_and((const struct cont *)a, b);
     free(a->buffer);
     a->buffer = nc->buffer;
@@ -435,54 +950,34 @@ static void array_cont_inplace_union(struct cont *a, const struct cont *b) {
 }
 
 void bitset_cont_inplace_union(struct cont *a, const struct cont *b) {
-    for (int i=2; i<CUTOFF+2; i++) {
-        a->buffer[i] |= b->buffer[i];
-    }
+    bitset_ops.or((const uint64_t *)&a->buffer[2], (const uint64_t *)&b->buffer[2],
+                  (uint64_t *)&a->buffer[2]);
 }
 
+// Assumes a is a bitset container, cardinality of a is not maintained
 void cont_inplace_union(struct cont *a, const struct cont *b) {
-    if (cont_is_array(b)) {
-        array_cont_inplace_union(a, b);
-    } else {
-        bitset_cont_inplace_union(a, b);
+    switch (cont_type(b)) {
+        case ARRAY_CONT_TYPE:
+            array_cont_inplace_union(a, b);
+            break;
+        case BITSET_CONT_TYPE:
+            bitset_cont_inplace_union(a, b);
+            break;
+        case RUN_CONT_TYPE:
+            run_fill_bitset(b, (uint64_t *)&a->buffer[2]);
+            break;
     }
 }
 
 static int array_array_and_cardinality(const struct cont *a, const struct cont *b) {
-    const int l1 = a->buffer[CARDINALITY];
-    const int l2 = b->buffer[CARDINALITY];
-
-    int pos1 = 2;
-    int pos2 = 2;
-    int result = 0;
-
-    while (pos1 < l1+2 && pos2 < l2+2) {
-        const uint16_t v1 = a->buffer[pos1];
-        const uint16_t v2 = b->buffer[pos2];
-        if (v1 == v2) {
-            ++result;
-            ++pos1;
-            ++pos2;
-        } else if (v1 < v2) {
-            pos1 = array_advance(a, l1+2, v2, pos1);
-        } else {
-            pos2 = array_advance(b, l2+2, v1, pos2);
-        }
-    }
-    return result;
+    return array_intersect_card(&a->buffer[2], a->buffer[CARDINALITY],
+                                &b->buffer[2], b->buffer[CARDINALITY]);
 }
 
 uint16_t *cont_duplicate(const struct cont *c) {
-    uint16_t *buffer;
-    if (cont_is_array(c)) {
-        int len = header_and_cardinality_size(c->buffer[CARDINALITY]) * sizeof(uint16_t);
-        buffer = malloc(len);
-        memcpy(buffer, c->buffer, len);
-    } else {
-        int len = (2 + CUTOFF) * sizeof(uint16_t);
-        buffer = malloc(len);
-        memcpy(buffer, c->buffer, len);
-    }
+    int len = cont_size(c) * sizeof(uint16_t);
+    uint16_t *buffer = malloc(len);
+    memcpy(buffer, c->buffer, len);
     return buffer;
 }
 
@@ -510,6 +1005,21 @@ uint32_t cont_and_cardinality(const struct cont *a, const struct cont *b) {
         case CONT_PAIR(ARRAY_CONT_TYPE, BITSET_CONT_TYPE):
             return bitset_array_and_cardinality(a, b);
             break;
+        case CONT_PAIR(RUN_CONT_TYPE, RUN_CONT_TYPE):
+            return run_run_and_cardinality(a, b);
+            break;
+        case CONT_PAIR(RUN_CONT_TYPE, ARRAY_CONT_TYPE):
+            return run_array_filter(a, b, NULL, false);
+            break;
+        case CONT_PAIR(ARRAY_CONT_TYPE, RUN_CONT_TYPE):
+            return run_array_filter(b, a, NULL, false);
+            break;
+        case CONT_PAIR(RUN_CONT_TYPE, BITSET_CONT_TYPE):
+            return run_bitset_and_cardinality(a, b);
+            break;
+        case CONT_PAIR(BITSET_CONT_TYPE, RUN_CONT_TYPE):
+            return run_bitset_and_cardinality(b, a);
+            break;
     }
     return 0;
 }
@@ -518,6 +1028,20 @@ uint32_t cont_and_cardinality(const struct cont *a, const struct cont *b) {
 // Removes item from container and returns true when container is empty
 bool cont_remove(struct cont *c, uint16_t item) {
     uint32_t card = cont_cardinality(c);
+    if (UNLIKELY(is_run(c))) {
+        if (!exists_run(c, item)) return false;
+        if (card == 1) {
+            free(c->buffer);
+            c->buffer = NULL;
+            return true;
+        }
+        run_remove(c, item);
+        // Splitting runs may make a plain container smaller
+        if (run_size(c->buffer[RUN_NRUNS]) > plain_size(card - 1)) {
+            run_to_plain(c);
+        }
+        return false;
+    }
     if (card > CUTOFF) {
         if (!exists_bitset(c, item)) return false;
         bitset_remove(c, item);
@@ -543,24 +1067,42 @@ bool cont_remove(struct cont *c, uint16_t item) {
 uint32_t cont_cardinality(const struct cont *c) {
     if (c->buffer[CARDINALITY] == 0) {
         if (c->buffer[CARDINALITY+1] == 0xFFFF) return 65536;
+        if (c->buffer[CARDINALITY+1] == RUN_MARKER) return c->buffer[RUN_CARD] + 1;
     }
     return c->buffer[CARDINALITY];
 }
 
-void cont_add(struct cont *c, const uint16_t item) {
+/* Returns true if item was not already in the container */
+bool cont_add(struct cont *c, const uint16_t item) {
     // If it already exists, just bail out
     // Move this down in the if case to speedup
     uint32_t card = cont_cardinality(c);
+    if (UNLIKELY(is_run(c))) {
+        if (exists_run(c, item)) return false;
+        run_add(c, item);
+        if (run_size(c->buffer[RUN_NRUNS]) > plain_size(card + 1)) {
+            run_to_plain(c);
+        }
+        return true;
+    }
     if (card == CUTOFF) {
-        if (exists_array(c, item)) return;
+        if (exists_array(c, item)) return false;
+        // Dense arrays, eg., sequential docids, are smaller as runs than as a bitset
+        int nruns = array_num_runs(c);
+        if (run_size(nruns + 1) < CUTOFF + 2) {
+            cont_to_run(c, nruns);
+            run_add(c, item);
+            return true;
+        }
         array_to_bitset(c);
     }
     if (card < CUTOFF) {
         array_add(c, item);
-    } else {
-        if (exists_bitset(c, item)) return;
-        bitset_add(c, item);
+        return cont_cardinality(c) != card;
     }
+    if (exists_bitset(c, item)) return false;
+    bitset_add(c, item);
+    return true;
 }
 
 bool cont_init(struct cont *c, const uint16_t id) {
@@ -576,21 +1118,21 @@ bool cont_init(struct cont *c, const uint16_t id) {
 }
 
 void bitset_cont_cardinality(struct cont *c) {
-    int card = 0;
-    const uint64_t *a = (const uint64_t *)&c->buffer[2];                                       
-    for (int i=0; i<1024; i+=4) {                                                              
-        card += __builtin_popcountll(a[i]);                                  
-        card += __builtin_popcountll(a[i+1]);                                
-        card += __builtin_popcountll(a[i+2]);                                
-        card += __builtin_popcountll(a[i+3]);                                
-    }                                                                                          
-    c->buffer[CARDINALITY] = card;
-}       
+    c->buffer[CARDINALITY] = bitset_ops.card((const uint64_t *)&c->buffer[2]);
+}
 
 void cont_iterate(const struct cont *c, bmap_iterator iter, void *param) {
     uint32_t base = c->buffer[ID] << 16;
 
-    if (cont_is_array(c)) {
+    if (UNLIKELY(is_run(c))) {
+        const uint16_t *runs = &c->buffer[RUN_DATA];
+        for (int i=0; i<c->buffer[RUN_NRUNS]; i++) {
+            uint32_t end = base + runs[2*i] + runs[2*i+1];
+            for (uint32_t v = base + runs[2*i]; v <= end; v++) {
+                iter(v, param);
+            }
+        }
+    } else if (cont_cardinality(c) <= CUTOFF) {
         for (int i=2; i<c->buffer[CARDINALITY]+2; i++) {
             iter(c->buffer[i] + base, param);
         }
@@ -609,6 +1151,101 @@ void cont_iterate(const struct cont *c, bmap_iterator iter, void *param) {
     }
 }
 
+static int array_decode(const struct cont *c, uint32_t *from, uint32_t base, uint32_t *out, int max) {
+    const uint16_t *a = &c->buffer[2];
+    int card = c->buffer[CARDINALITY];
+    // First item >= from
+    int low = 0, high = card;
+    while (*from && low < high) {
+        int middle = (low + high) >> 1;
+        if (a[middle] < *from) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    int n = MIN(max, card - low);
+    for (int i = 0; i < n; i++) {
+        out[i] = base | a[low + i];
+    }
+    *from = (low + n < card) ? a[low + n] : 65536;
+    return n;
+}
+
+static int run_decode(const struct cont *c, uint32_t *from, uint32_t base, uint32_t *out, int max) {
+    const uint16_t *runs = &c->buffer[RUN_DATA];
+    const int nruns = c->buffer[RUN_NRUNS];
+    int i = MAX(run_search(c, *from), 0);
+    int count = 0;
+    for (; i < nruns; i++) {
+        uint32_t v = MAX(*from, runs[2*i]);
+        uint32_t end = runs[2*i] + runs[2*i+1];
+        while (v <= end && count < max) {
+            out[count++] = base | v++;
+        }
+        if (count == max) {
+            if (v <= end) {
+                *from = v;
+            } else {
+                *from = (i + 1 < nruns) ? runs[2*(i+1)] : 65536;
+            }
+            return count;
+        }
+    }
+    *from = 65536;
+    return count;
+}
+
+static int bitset_decode(const struct cont *c, uint32_t *from, uint32_t base, uint32_t *out, int max) {
+    const uint64_t *words = (const uint64_t *)&c->buffer[2];
+    int w = *from >> 6;
+    uint64_t word = words[w] & (~0ULL << (*from & 63));
+    int count = 0;
+    while (true) {
+        // The current word, which may be partial, is done a bit at a time
+        while (word && count < max) {
+            out[count++] = base + 64 * w + __builtin_ctzll(word);
+            word &= word - 1;
+        }
+        if (word) {
+            *from = 64 * w + __builtin_ctzll(word);
+            return count;
+        }
+        // Whole words which surely fit go to the extract kernel
+        int end = ++w, n = 0;
+        while (end < BITSET_WORDS) {
+            int pc = __builtin_popcountll(words[end]);
+            if (count + n + pc + BITSET_EXTRACT_SLACK > max) break;
+            n += pc;
+            end++;
+        }
+        if (end > w) {
+            count += bitset_ops.extract(words + w, end - w, base + 64 * w, out + count);
+            w = end;
+        }
+        if (w == BITSET_WORDS) {
+            *from = 65536;
+            return count;
+        }
+        word = words[w];
+    }
+}
+
+/* Decodes up to max items >= *from into out as full 32 bit values. *from is
+ * moved to the next item to decode, it is 65536 once the container is done.
+ * Returns the number of items written */
+int cont_decode(const struct cont *c, uint32_t *from, uint32_t *out, int max) {
+    uint32_t base = c->buffer[ID] << 16;
+    switch (cont_type(c)) {
+        case RUN_CONT_TYPE:
+            return run_decode(c, from, base, out, max);
+        case BITSET_CONT_TYPE:
+            return bitset_decode(c, from, base, out, max);
+        default:
+            return array_decode(c, from, base, out, max);
+    }
+}
+
 void cont_free(struct cont *c) {
     free(c->buffer);
     free(c);
@@ -633,6 +1270,9 @@ uint16_t cont_get_first(const struct cont *c) {
     uint32_t card = cont_cardinality(c);
     uint16_t item = 0;
     if (UNLIKELY(card == 0)) return item;
+    if (is_run(c)) {
+        return c->buffer[RUN_DATA];
+    }
     if (card <= CUTOFF) {
         // Array container
         return c->buffer[2];
@@ -662,6 +1302,9 @@ uint16_t cont_get_first(const struct cont *c) {
 bool cont_exists(const struct cont *c, uint16_t item) {
     uint32_t card = cont_cardinality(c);
     if (!card) return false;
+    if (UNLIKELY(is_run(c))) {
+        return exists_run(c, item);
+    }
     if (card <= CUTOFF) {
         return exists_array(c,item);
     } else {
@@ -669,6 +1312,57 @@ bool cont_exists(const struct cont *c, uint16_t item) {
     }
 }
 
+/* Returns the nth item of the container counting from 0, n has to be less
+ * than the cardinality */
+uint16_t cont_select(const struct cont *c, uint32_t n) {
+    uint32_t card = cont_cardinality(c);
+    if (UNLIKELY(is_run(c))) {
+        const uint16_t *runs = &c->buffer[RUN_DATA];
+        for (int r = 0; ; r++) {
+            uint32_t len = runs[2*r+1] + 1;
+            if (n < len) return runs[2*r] + n;
+            n -= len;
+        }
+    }
+    if (card <= CUTOFF) {
+        return c->buffer[n+2];
+    }
+    const uint64_t *words = (const uint64_t *)&c->buffer[2];
+    for (int i = 0; ; i++) {
+        uint32_t count = __builtin_popcountll(words[i]);
+        if (n < count) {
+            uint64_t w = words[i];
+            while (n--) w &= w - 1;
+            return 64 * i + __builtin_ctzll(w);
+        }
+        n -= count;
+    }
+}
+
+/* Returns the number of items in the container less than item */
+uint32_t cont_rank(const struct cont *c, uint16_t item) {
+    uint32_t card = cont_cardinality(c);
+    if (UNLIKELY(is_run(c))) {
+        const uint16_t *runs = &c->buffer[RUN_DATA];
+        uint32_t rank = 0;
+        for (int r = 0; r < c->buffer[RUN_NRUNS] && runs[2*r] < item; r++) {
+            uint32_t len = runs[2*r+1] + 1;
+            rank += MIN(len, (uint32_t)(item - runs[2*r]));
+        }
+        return rank;
+    }
+    if (card <= CUTOFF) {
+        int i = binary_search((struct cont *)c, item);
+        return i >= 0 ? i : -i-1;
+    }
+    const uint64_t *words = (const uint64_t *)&c->buffer[2];
+    uint32_t rank = 0;
+    for (int i = 0; i < (item >> 6); i++) {
+        rank += __builtin_popcountll(words[i]);
+    }
+    return rank + __builtin_popcountll(words[item >> 6] & ((1ULL << (item & 63)) - 1));
+}
+
 void cont_invert(struct cont *c, const struct cont *input) {
     for (int i=2; i<CUTOFF+2; i++) {
         if (input->buffer[i]) {
@@ -13,6 +13,16 @@
 
 #define BITSET_CONT_TYPE 1
 #define ARRAY_CONT_TYPE  2
+#define RUN_CONT_TYPE    3
+
+/* Run containers are marked with a cardinality of 0 followed by RUN_MARKER.
+ * Empty arrays have a 0 and full bitsets a 0xFFFF there, so this does not
+ * clash with either.  Layout is
+ * [ID][0][RUN_MARKER][number of runs][cardinality - 1][start, length - 1]... */
+#define RUN_MARKER  0xFFFE
+#define RUN_NRUNS   3
+#define RUN_CARD    4
+#define RUN_DATA    5
 
 // macro for pairing container type codes
 #define CONT_PAIR(c1, c2) (4 * (c1) + (c2))
@@ -26,10 +36,16 @@ struct cont {
 
 struct cont *cont_new(uint16_t id);
 bool cont_init(struct cont *c, const uint16_t id);
-void cont_add(struct cont *c, const uint16_t id);
+bool cont_add(struct cont *c, const uint16_t id);
 uint32_t cont_cardinality(const struct cont *c);
+int cont_type(const struct cont *c);
+uint32_t cont_size(const struct cont *c);
+void cont_optimize(struct cont *c);
+uint16_t *cont_to_bitset(const struct cont *c);
+uint16_t *cont_from_sorted(uint16_t id, const uint16_t *items, int len);
 bool cont_remove(struct cont *c, const uint16_t item);
 void cont_iterate(const struct cont *c, bmap_iterator iter, void *param);
+int cont_decode(const struct cont *c, uint32_t *from, uint32_t *out, int max);
 void cont_free(struct cont *);
 struct cont *cont_and(const struct cont *a, const struct cont *b);
 struct cont *cont_andnot(const struct cont *a, const struct cont *b);
@@ -39,6 +55,8 @@ void bitset_cont_inplace_union(struct cont *a, const struct cont *b);
 uint32_t cont_and_cardinality(const struct cont *a, const struct cont *b);
 uint16_t *cont_duplicate(const struct cont *c);
 bool cont_exists(const struct cont *c, uint16_t item);
+uint16_t cont_select(const struct cont *c, uint32_t n);
+uint32_t cont_rank(const struct cont *c, uint16_t item);
 void cont_invert(struct cont *c, const struct cont *input);
 void bitset_cont_to_array(struct cont *c);
 
@@ -30,10 +30,13 @@ void dump_query(struct query *q) {
 }
 
 void dump_termresult(termresult_t *tr) {
-    printf("Term twid : %u\n", tr->twid);
-    printf("Num wids  : %u\n", kh_size(tr->wordids));
+    printf("Num twids : %u\n", kh_size(tr->twids));
     uint32_t wid;
     int dist;
+    kh_foreach(tr->twids, wid, dist, {
+        printf("twid : %u, dist %d\n", wid, dist);
+    });
+    printf("Num wids  : %u\n", kh_size(tr->wordids));
     kh_foreach(tr->wordids, wid, dist, {
         printf("wid : %u, dist %d\n", wid, dist);
     });
@@ -63,4 +66,9 @@ void trace_query(const char *msg, struct timeval *start) {
     gettimeofday(&stop, NULL);
     printf("%s %f\n", msg, timedifference_msec(*start, stop));
 }
+
+void trace_arena(int shard_idx, const struct arena *a) {
+    printf("Shard %d arena allocs %u bytes %zu chunks %u\n", shard_idx, a->num_allocs,
+            a->bytes, a->num_chunks);
+}
 #endif
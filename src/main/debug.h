@@ -3,6 +3,7 @@
 #include "word.h"
 #include "query.h"
 #include "dtrie.h"
+#include "arena.h"
 
 // #define DUMP_ENABLE 1
 // #define TRACE_QUERY 1
@@ -21,8 +22,10 @@ void dump_bmap(struct bmap *b);
 
 #ifdef TRACE_QUERY
 void trace_query(const char *msg, struct timeval *start);
+void trace_arena(int shard_idx, const struct arena *a);
 #else
 #define trace_query(msg, start) ;
+#define trace_arena(shard_idx, a) ;
 #endif
 
 
@@ -11,17 +11,17 @@ KSORT_INIT(sort_positions, int, positions_lt)
 // Fill positions in which the given word is present.  Field & position values are 
 // converted to a single int 
 // TODO: Fill only positions for fields requested
-static int *fill_positions(wid_info_t *info, uint8_t *head, int *p, int *len) {
+static int *fill_positions(struct arena *a, wid_info_t *info, uint8_t *head, int *p, int *len) {
     int *ret;
     int plen = *len;
     if (info->is_position) {
-        ret = realloc(p, (plen + 1) * sizeof(int));
+        ret = arena_realloc(a, p, plen * sizeof(int), (plen + 1) * sizeof(int));
         ret[plen] = (info->priority << 16) + info->offset;
         *len = plen + 1;
     } else {
         uint8_t *c = head + info->offset;
         int freq = *c;
-        ret = realloc(p, (plen + freq) * sizeof(int));
+        ret = arena_realloc(a, p, plen * sizeof(int), (plen + freq) * sizeof(int));
         c++;
         while (freq > 0) {
             int priority = *c;
@@ -130,6 +130,9 @@ static inline void rank_three_terms(struct docrank *rank, struct squery *sq, uin
     int typos[2] = {0xFF, 0xFF};
     int *positions[3] = {0, 0, 0};
     int plength[3] = {0, 0, 0};
+    // Positions only live while ranking this document
+    struct arena *arena = &sq->sqres->arena;
+    struct arena_mark mark = arena_get_mark(arena);
     // First set exact matches and typos
     for (int i = 0; i < num_words; i++) {
         if (sq->sqres->exact_docid_map[i]) {
@@ -161,7 +164,7 @@ static inline void rank_three_terms(struct docrank *rank, struct squery *sq, uin
                 }
             }
             // Now dump positions for this term / word
-            positions[mterm] = fill_positions(&info[i], dpos, positions[mterm], &plength[mterm]);
+            positions[mterm] = fill_positions(arena, &info[i], dpos, positions[mterm], &plength[mterm]);
         }
     }
 
@@ -203,9 +206,7 @@ static inline void rank_three_terms(struct docrank *rank, struct squery *sq, uin
         }
         rank->proximity = mindiff;
     }
-    for (int i = 0; i < num_terms; i++) {
-        free(positions[i]);
-    }
+    arena_release(arena, mark);
 }
 
 static inline int term_to_word_idx(int term, int num_terms) {
@@ -224,6 +225,8 @@ static inline void rank_many_terms(struct docrank *rank, struct squery *sq, uint
     int *positions[num_words];
     int plength[num_words];
     int proximity[num_words];
+    struct arena *arena = &sq->sqres->arena;
+    struct arena_mark mark = arena_get_mark(arena);
 
     // First set exact matches and typos
     for (int i = 0; i < num_words; i++) {
@@ -266,13 +269,13 @@ static inline void rank_many_terms(struct docrank *rank, struct squery *sq, uint
                 typos[widx] = dist;
             }
             // Now dump positions for this term / word
-            positions[widx] = fill_positions(&info[i], dpos, positions[widx], &plength[widx]);
+            positions[widx] = fill_positions(arena, &info[i], dpos, positions[widx], &plength[widx]);
             if ((mterm % 2) == 1) {
                 proximity[widx] = 1;
                 // anew -> gets filled in both a and new, ignore last term match
                 if (mterm != (num_terms - 1)) {
                     typos[widx + 1] = 0;
-                    positions[widx + 1] = fill_positions(&info[i], dpos, 
+                    positions[widx + 1] = fill_positions(arena, &info[i], dpos, 
                             positions[widx + 1], &plength[widx + 1]);
                 }
             }
@@ -322,9 +325,7 @@ add_prox:
         }
     }
 
-    for (int i = 0; i < num_words; i++) {
-        free(positions[i]);
-    }
+    arena_release(arena, mark);
 }
 
 #if 0
@@ -411,13 +412,8 @@ static inline void perform_doc_processing(struct squery *sq, struct docrank *ran
     }
 }
 
-static inline void perform_doc_rank(struct squery *sq, struct docrank *rank) {
-    MDB_val key, mdata;
-    key.mv_size = sizeof(uint32_t);
-    int rc;
-    key.mv_data = &rank->docid;
-    struct sindex *si = sq->shard->sindex;
-    if ((rc = mdb_get(sq->txn, si->docid2data_dbi, &key, &mdata)) != 0) {
+static inline void perform_doc_rank(struct squery *sq, struct docrank *rank, int rc, MDB_val *mdata) {
+    if (rc != 0) {
         // Push this result down, we could not read this docdata from mdb
         M_ERR("Failed to read docdata for %u", rank->docid);
         rank->typos = 0xFF;
@@ -427,8 +423,8 @@ static inline void perform_doc_rank(struct squery *sq, struct docrank *rank) {
         return;
     }
     if ((sq->q->cfg.hits_per_page > 0) && (sq->q->num_words > 0)) {
-        uint32_t offset = *(uint32_t *)mdata.mv_data;
-        uint8_t *wpos = (uint8_t *)mdata.mv_data;
+        uint32_t offset = *(uint32_t *)mdata->mv_data;
+        uint8_t *wpos = (uint8_t *)mdata->mv_data;
         wpos += offset;
         calculate_rank(rank, sq, wpos);
     } else {
@@ -439,40 +435,88 @@ static inline void perform_doc_rank(struct squery *sq, struct docrank *rank) {
         rank->typos = 0;
     }
     // Perform further processing for facets / aggregations
-    perform_doc_processing(sq, rank, mdata.mv_data);
+    perform_doc_processing(sq, rank, mdata->mv_data);
+}
+
+/* Ranks a block of at most BMAP_BLOCK documents.  Document data of the whole block
+ * is looked up and prefetched first, so the ranking of one document is not
+ * stalled waiting on its data */
+static void perform_block_rank(struct squery *sq, struct docrank *ranks, const uint32_t *docids, int n) {
+    MDB_val mdata[BMAP_BLOCK];
+    int rc[BMAP_BLOCK];
+    struct sindex *si = sq->si;
+    for (int i = 0; i < n; i++) {
+        ranks[i].docid = docids[i];
+        rc[i] = sindex_get_docdata(si, sq->txn, docids[i], &mdata[i]);
+        if (LIKELY(rc[i] == 0)) {
+            __builtin_prefetch(mdata[i].mv_data);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        perform_doc_rank(sq, &ranks[i], rc[i], &mdata[i]);
+    }
+}
+
+static void perform_doc_rank_single(struct squery *sq, struct docrank *rank) {
+    perform_block_rank(sq, rank, &rank->docid, 1);
 }
 
-static void calculate_agg(uint32_t val, void *rptr) {
-    struct squery *sq = rptr;
-    sq->sqres->agg->consume(sq->sqres->agg, sq, val, NULL);
+static void calculate_agg(struct squery *sq, const struct bmap *docid_map) {
+    struct bmap_cursor cur;
+    uint32_t docids[BMAP_BLOCK];
+    int n;
+    bmap_cursor_init(&cur, docid_map);
+    while ((n = bmap_cursor_next(&cur, docids, BMAP_BLOCK)) > 0) {
+        for (int i = 0; i < n; i++) {
+            sq->sqres->agg->consume(sq->sqres->agg, sq, docids[i], NULL);
+        }
+    }
 }
 
-static void setup_ranks(uint32_t val, void *rptr) {
-    struct rank_iter *iter = rptr;
-    struct docrank *rank = &iter->ranks[iter->rankpos++];
-    rank->docid = val;
-    perform_doc_rank(iter->sq, rank);
+static void setup_ranks(struct rank_iter *iter, const struct bmap *docid_map) {
+    struct bmap_cursor cur;
+    uint32_t docids[BMAP_BLOCK];
+    int n;
+    bmap_cursor_init(&cur, docid_map);
+    while ((n = bmap_cursor_next(&cur, docids, BMAP_BLOCK)) > 0) {
+        perform_block_rank(iter->sq, &iter->ranks[iter->rankpos], docids, n);
+        iter->rankpos += n;
+    }
 }
 
-static void setup_zero_typo_ranks(uint32_t val, void *rptr) {
-    struct rank_iter *iter = rptr;
-    struct docrank *rank = &iter->ranks[iter->rankpos++];
-    rank->docid = val;
-    // Ranking is performed using document words / positions
-    perform_doc_rank(iter->sq, rank);
-    bmap_add(iter->dbmap, val);
+static void setup_zero_typo_ranks(struct rank_iter *iter, const struct bmap *docid_map) {
+    struct bmap_cursor cur;
+    uint32_t docids[BMAP_BLOCK];
+    int n;
+    bmap_cursor_init(&cur, docid_map);
+    while ((n = bmap_cursor_next(&cur, docids, BMAP_BLOCK)) > 0) {
+        // Ranking is performed using document words / positions
+        perform_block_rank(iter->sq, &iter->ranks[iter->rankpos], docids, n);
+        iter->rankpos += n;
+        for (int i = 0; i < n; i++) {
+            bmap_add(iter->dbmap, docids[i]);
+        }
+    }
 }
 
-static void setup_skip_ranks(uint32_t val, void *rptr) {
-    struct rank_iter *iter = rptr;
-    if (iter->skip_counter++ % iter->skip_count == 0) {
-        if (!bmap_exists(iter->dbmap, val)) {
-            struct docrank *rank = &iter->ranks[iter->rankpos++];
-            rank->docid = val;
+/* Ranks every skip_count document which has not been ranked already.  Documents
+ * are picked with bmap_select, so the bitmap is not decoded in full */
+static void setup_skip_ranks(struct rank_iter *iter, struct bmap *docid_map) {
+    uint32_t docids[BMAP_BLOCK];
+    uint32_t docid;
+    int picked = 0;
+    for (uint32_t n = 0; bmap_select(docid_map, n, &docid); n += iter->skip_count) {
+        if (bmap_exists(iter->dbmap, docid)) continue;
+        docids[picked++] = docid;
+        if (picked == BMAP_BLOCK) {
             // Ranking is performed using document words / positions
-            perform_doc_rank(iter->sq, rank);
+            perform_block_rank(iter->sq, &iter->ranks[iter->rankpos], docids, picked);
+            iter->rankpos += picked;
+            picked = 0;
         }
     }
+    perform_block_rank(iter->sq, &iter->ranks[iter->rankpos], docids, picked);
+    iter->rankpos += picked;
 }
 
 static struct docrank *perform_fast_ranking(struct squery *sq, struct bmap *docid_map, 
@@ -489,7 +533,7 @@ static struct docrank *perform_fast_ranking(struct squery *sq, struct bmap *doci
     struct bmap *dbmap = bmap_new();
 
     // Allocate enough space with buffer for ranks
-    struct docrank *ranks = malloc((MAX_HITS_LIMIT + fcount + 10) * sizeof(struct docrank));
+    struct docrank *ranks = arena_alloc(&sq->sqres->arena, (MAX_HITS_LIMIT + fcount + 10) * sizeof(struct docrank));
 
     // Get the preferred result document ids, first prefer all documents
     struct bmap *rmap = docid_map;
@@ -506,7 +550,7 @@ static struct docrank *perform_fast_ranking(struct squery *sq, struct bmap *doci
     if (zt_card) {
         // If documents with zero typos is less than max possible hits, include all documents
         if (zt_card <= MAX_HITS_LIMIT) {
-            bmap_iterate(sq->sqres->zero_typo_docid_map, setup_zero_typo_ranks, &riter);
+            setup_zero_typo_ranks(&riter, sq->sqres->zero_typo_docid_map);
             rankpos = riter.rankpos;
         } else {
             // If we have many documents with zero typos, prefer that
@@ -517,7 +561,7 @@ static struct docrank *perform_fast_ranking(struct squery *sq, struct bmap *doci
     // Now prefer items by ranking order
     MDB_cursor *cursor;
     MDB_val key, data;
-    struct sindex *si = sq->shard->sindex;
+    struct sindex *si = sq->si;
     MDB_cursor_op op = sq->q->cfg.rank_asc? MDB_LAST:MDB_FIRST;
     MDB_cursor_op op2 = sq->q->cfg.rank_asc? MDB_PREV:MDB_NEXT;
     mdb_cursor_open(sq->txn, si->num_dbi[sq->q->cfg.rank_by], &cursor);
@@ -532,7 +576,7 @@ static struct docrank *perform_fast_ranking(struct squery *sq, struct bmap *doci
             if (bmap_exists(dbmap, docid)) continue;
             // Add this document
             ranks[rankpos].docid = docid;
-            perform_doc_rank(sq, &ranks[rankpos]);
+            perform_doc_rank_single(sq, &ranks[rankpos]);
             // Keep track of this document
             bmap_add(dbmap, docid);
             rankpos++;
@@ -546,14 +590,13 @@ static struct docrank *perform_fast_ranking(struct squery *sq, struct bmap *doci
 
     // Rest of the documents are picked in a sequential order skipping entries
     riter.skip_count = (totalcount / fcount) + 1;
-    riter.skip_counter = 0;
-    bmap_iterate(rmap, setup_skip_ranks, &riter);
+    setup_skip_ranks(&riter, rmap);
     bmap_free(dbmap);
     *resultcount = (riter.rankpos - 1);
 
     // If we have aggregates, do it on all documents
     if (sq->sqres->agg) {
-        bmap_iterate(docid_map, calculate_agg, sq);
+        calculate_agg(sq, docid_map);
     }
 
     return ranks;
@@ -568,20 +611,21 @@ struct docrank *perform_ranking(struct squery *sq, struct bmap *docid_map, uint3
     sq->fast_rank = !q->cfg.full_scan;
 
     // TODO: When aggregation is implemented and enabled, handle fastscan
-    if (sq->fast_rank && totalcount > q->cfg.full_scan_threshold && q->cfg.rank_by >= 0) {
+    // In memory indexes have no sorted numbers to scan and are small anyway
+    if (sq->fast_rank && totalcount > q->cfg.full_scan_threshold && q->cfg.rank_by >= 0 && !sq->si->mem) {
         M_INFO("Performing fast ranking");
         return perform_fast_ranking(sq, docid_map, resultcount);
     }
 
     sq->fast_rank = false;
     struct rank_iter riter;
-    struct docrank *ranks = malloc(totalcount * sizeof(struct docrank));
+    struct docrank *ranks = arena_alloc(&sq->sqres->arena, totalcount * sizeof(struct docrank));
     riter.sq = sq;
     riter.rankpos = 0;
     riter.ranks = ranks;
     riter.dbmap = NULL;
 
-    bmap_iterate(docid_map, setup_ranks, &riter);
+    setup_ranks(&riter, docid_map);
 
     return ranks;
 }
@@ -14,17 +14,47 @@
 #include "dtrie.h"
 #include "mlog.h"
 #include "common.h"
+#include "ksort.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Set to back trie maps with huge pages
+static bool dt_hugepages = false;
 
 /* Size of node for a given type */
 static const int node_size[NS_MAX] = {0, 16,  32,  64, 128, 256, 512, 1024, 4096};
 /* Number of nodes of a given type which will fit in a page */
 static const int node_nums[NS_MAX] = {0, 256, 128, 64, 32,  16,  8,   4,    1};
 
+// Size of a child entry, its chr and node id
+#define CHILD_SIZE  (sizeof(chr_t) + sizeof(struct dnode_id))
+// Big nodes are binary searched down to this many chars, which are then scanned
+#define SCAN_SIZE   16
+
+// Free node maps are stored in lmdb with these ids
+#define FREEMAP_ID(type)    IDPRIORITY(0xFFFFFFFF, (type))
+#define HOTMAP_ID(type)     IDPRIORITY(0xFFFFFFFF, (NS_MAX + (type)))
+
+static inline int node_ascii_size(uint32_t type) {
+    return (type >= NS_ASCII_MIN) ? ASCII_MAX : 0;
+}
+
+static inline uint8_t *node_ascii(struct dnode *n) {
+    return n->data;
+}
+
+static inline chr_t *node_chars(struct dnode *n) {
+    return (chr_t *)(n->data + node_ascii_size(n->type));
+}
+
+static inline struct dnode_id *node_nids(struct dnode *n) {
+    return (struct dnode_id *)(node_chars(n) + n->num_child);
+}
 
 static inline uint32_t *get_widpos(struct dnode *n) {
-    uint8_t *pos = (uint8_t *)n;
-    pos += (sizeof(struct dnode) + (n->num_child * sizeof(struct dnode_ptr)));
-    return (uint32_t *)pos;
+    return (uint32_t *)(node_nids(n) + n->num_child);
 }
 
 static inline void set_wid(struct dnode *n, uint32_t wid) {
@@ -77,10 +107,10 @@ static inline uint32_t get_twid(struct dnode *n) {
 
 static inline void dump_node(struct dnode *n) {
     printf("\nNode %p type %u numchild %d wid %d twid %d\n", n, n->type, n->num_child, n->has_wid, n->has_twid);
-    struct dnode_ptr *np = n->child;
+    chr_t *chars = node_chars(n);
+    struct dnode_id *nids = node_nids(n);
     for (int i=0; i<n->num_child; i++) {
-        struct dnode_ptr *tnp = &np[i];
-        printf("Chr %c offset %u\n", (unsigned char)tnp->c, tnp->nid.offset);
+        printf("Chr %c offset %u\n", (unsigned char)chars[i], nids[i].offset);
     }
     if (n->has_wid) {
         printf("wid : %u ", get_wid(n));
@@ -91,6 +121,19 @@ static inline void dump_node(struct dnode *n) {
     printf("\n");
 }
 
+/* Rebuilds the ascii index of a big node.  Children are sorted, so the ascii
+ * ones are always the first few */
+static void build_ascii_index(struct dnode *n) {
+    uint8_t *ascii = node_ascii(n);
+    chr_t *chars = node_chars(n);
+    memset(ascii, 0, ASCII_MAX);
+    for (int i = 0; i < n->num_child && chars[i] < ASCII_MAX; i++) {
+        if (chars[i] >= 0) {
+            ascii[chars[i]] = i + 1;
+        }
+    }
+}
+
 
 static void init_node(struct dtrie *dt, uint8_t *ptr, NTYPE type) {
     if (LIKELY(type < NS_MAX)) {
@@ -107,39 +150,79 @@ static inline struct dnode *get_node_from_nodeid(struct dtrie *dt, struct dnode_
     return (struct dnode *) nptr;
 }
 
-static struct dnode *create_new_node(struct dtrie *dt, NTYPE type, struct dnode_id *nid) {
+/* Free nodes of the upper levels are tracked separately, so that they are
+ * only reused by nodes of the upper levels */
+static inline struct bmap *node_freemap(struct dtrie *dt, NTYPE type, bool hot) {
+    if (hot) {
+        dt->hotmap_dirty[type] = 1;
+        return &dt->hotmaps[type];
+    }
+    dt->freemap_dirty[type] = 1;
+    return &dt->freemaps[type];
+}
+
+/* Makes sure the trie file holds at least @pages pages.  The file grows by as
+ * many pages as it already has, within DT_GROW_MIN and DT_GROW_MAX, so that a
+ * bulk load does not extend it a page at a time.  In memory tries have no file,
+ * their pages are there already */
+static bool dtrie_reserve(struct dtrie *dt, uint32_t pages) {
+    if (LIKELY(pages <= dt->file_pages)) return true;
+    uint32_t max_pages = MAPSIZE / PSIZE;
+    if (pages > max_pages) {
+        M_ERR("Trie %s is full", dt->path);
+        return false;
+    }
+    uint32_t grow = MIN(MAX(dt->file_pages, DT_GROW_MIN), DT_GROW_MAX);
+    uint32_t target = MIN(MAX(pages, dt->file_pages + grow), max_pages);
+    off_t from = (off_t)dt->file_pages * PSIZE;
+    off_t len = (off_t)(target - dt->file_pages) * PSIZE;
+    if (dt->fd < 0) {
+        dt->file_pages = target;
+        return true;
+    }
+    int rc = -1;
+#ifdef __linux__
+    // Allocate the blocks up front, it falls back to just setting the size
+    // on filesystems that cannot
+    rc = posix_fallocate(dt->fd, from, len);
+#endif
+    if (rc != 0 && ftruncate(dt->fd, from + len) != 0) {
+        M_ERR("Failed to grow trie %s to %u pages", dt->path, target);
+        return false;
+    }
+    dt->file_pages = target;
+    return true;
+}
+
+static struct dnode *create_new_node(struct dtrie *dt, NTYPE type, struct dnode_id *nid, bool hot) {
     if (LIKELY(type < NS_MAX)) {
-        // Use a new page and increment used page count
-        nid->offset = (PSIZE * dt->meta->num_pages);
-        dt->meta->num_pages++;
-        // Initialize the page
-        // TODO: Is this the way to do this?
-        lseek(dt->fd, (PSIZE*(dt->meta->num_pages+1))-1, SEEK_SET);
-        if (write(dt->fd, "", 1) < 0) {
-            printf("!!!!!!!!!!!!!!!!!!!!! Failed to init node\n");
+        // Use a new page and increment used page count, the file always
+        // has a page more than what is used
+        if (!dtrie_reserve(dt, dt->meta->num_pages + 2)) {
             return NULL;
         }
-        dt->meta->free_nodes[type] = node_nums[type];
+        nid->offset = (PSIZE * dt->meta->num_pages);
+        dt->meta->num_pages++;
+        dt->meta->free_nodes[type] += node_nums[type];
 
         // Add every child page other than first to the free bmap for that type
         // we know first is going to bem used right away
+        struct bmap *freemap = node_freemap(dt, type, hot);
         uint32_t offset = nid->offset;
         for (int i = 1; i < node_nums[type]; i++) {
             offset += node_size[type];
-            bmap_add(&dt->freemaps[type], offset);
+            bmap_add(freemap, offset);
         }
-        dt->freemap_dirty[type] = 1;
 
     } else {
         int ns = type - NS_MAX;
         printf("*************** Creating big node of size %d\n", ns);
-        nid->offset = (PSIZE * dt->meta->num_pages);
-        dt->meta->num_pages += ns;
-        lseek(dt->fd, (PSIZE*(dt->meta->num_pages+1))-1, SEEK_SET);
-        if (write(dt->fd, "", 1) < 0) {
-            printf("!!!!! Failed to init page\n");
+        if (!dtrie_reserve(dt, dt->meta->num_pages + ns + 1)) {
             return NULL;
         }
+        nid->offset = (PSIZE * dt->meta->num_pages);
+        dt->meta->num_pages += ns;
+        dt->meta->free_nodes[type]++;
     }
 
     // Reset offset to top child page
@@ -157,36 +240,62 @@ static struct dnode *create_new_node(struct dtrie *dt, NTYPE type, struct dnode_
 
 /* Gets a free node for a given type.  If first looks at the freemap for the type
  * and uses free nodes if any.  Else setups a page of nodes and returns the first 
- * node */
-static struct dnode *get_free_node(struct dtrie *dt, NTYPE type, struct dnode_id *nid) {
+ * node.  hot nodes are the ones in the upper levels of the trie.  NULL if the
+ * trie cannot grow */
+static struct dnode *get_free_node(struct dtrie *dt, NTYPE type, struct dnode_id *nid, bool hot) {
+    struct dnode *n = NULL;
     // Check if there are any free pages of this type
     // if so use it.  
     if (LIKELY(type < NS_MAX)) {
-        uint32_t foffset = bmap_get_first(&dt->freemaps[type]);
+        struct bmap *freemap = hot ? &dt->hotmaps[type] : &dt->freemaps[type];
+        uint32_t foffset = bmap_get_first(freemap);
         // We have a free page
         if (foffset != 0xFFFFFFFF) {
             nid->offset = foffset;
             // Remove the id from freemap
-            bmap_remove(&dt->freemaps[type], foffset);
-            dt->freemap_dirty[type] = 1;
+            bmap_remove(node_freemap(dt, type, hot), foffset);
             uint8_t *nptr = (uint8_t *)get_node_from_nodeid(dt, nid);
             init_node(dt, nptr, type);
-            return (struct dnode *)nptr;
+            n = (struct dnode *)nptr;
         }
     }
 
     // If nothing exists add a new page
-    struct dnode *n = create_new_node(dt, type, nid);
+    if (!n) {
+        n = create_new_node(dt, type, nid, hot);
+        if (!n) return NULL;
+    }
+    // Readers cannot see the node till the next publish, it can be changed in place
+    int ret;
+    kh_put(NODESET, dt->fresh, nid->offset, &ret);
     return n;
 }
 
-static int binary_search(struct dnode *n, struct dnode_ptr *np, const chr_t c) {
+/* Frees a node that is no longer linked in the trie.  Nodes readers may still
+ * be looking at are retired instead, they are freed once reclaimed */
+static void free_node(struct dtrie *dt, uint32_t offset, uint32_t type, bool hot) {
+    // Do not bother about mega nodes, they are very very rare
+    if (UNLIKELY(type >= NS_MAX)) return;
+    khiter_t k = kh_get(NODESET, dt->fresh, offset);
+    if (k != kh_end(dt->fresh)) {
+        kh_del(NODESET, dt->fresh, k);
+        bmap_add(node_freemap(dt, type, hot), offset);
+    } else {
+        struct retired_node r = {offset, type, hot};
+        kv_push(struct retired_node, dt->retired, r);
+    }
+    dt->meta->free_nodes[type]++;
+    dt->meta->used_nodes[type]--;
+}
+
+static int binary_search(struct dnode *n, const chr_t c) {
+    const chr_t *chars = node_chars(n);
     int low = 0, high = n->num_child-1, middle;
     while (low <= high) {
         middle = (low+high)/2;
-        if (np[middle].c < c) {
+        if (chars[middle] < c) {
             low = middle+1;
-        } else if (np[middle].c > c){
+        } else if (chars[middle] > c){
             high = middle-1;
         } else {
             return middle;
@@ -195,27 +304,58 @@ static int binary_search(struct dnode *n, struct dnode_ptr *np, const chr_t c) {
     return -(low+1);
 }
 
-static inline struct dnode_id *binary_search_nodeid(struct dnode *n, chr_t c) {
-    struct dnode_ptr *np = n->child;
-    int pos = binary_search(n, np, c);
-    if (pos >= 0) {
-        return &np[pos].nid;
+/* Scans len chars for c, 4 at a time with sse2 */
+static inline int scan_chars(const chr_t *chars, int len, const chr_t c) {
+    int i = 0;
+#ifdef __SSE2__
+    __m128i key = _mm_set1_epi32(c);
+    for (; i + 4 <= len; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(chars + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
     }
-    return NULL;
+#endif
+    for (; i < len; i++) {
+        if (chars[i] == c) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Finds the position of the child for c, -1 if there is none */
+static inline int find_child(struct dnode *n, const chr_t c) {
+    if (n->type >= NS_ASCII_MIN && c >= 0 && c < ASCII_MAX) {
+        return node_ascii(n)[c] - 1;
+    }
+    const chr_t *chars = node_chars(n);
+    int low = 0, high = n->num_child;
+    while (high - low > SCAN_SIZE) {
+        int middle = (low+high)/2;
+        if (chars[middle] <= c) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    int pos = scan_chars(chars + low, high - low, c);
+    return (pos >= 0) ? low + pos : -1;
 }
 
 static struct dnode *node_get_child(struct dtrie *dt, struct dnode *n, chr_t c, struct dnode_id *cnid) {
-    struct dnode_id *nid = binary_search_nodeid(n, c);
-    if (nid) {
-        *cnid = *nid;
-        return get_node_from_nodeid(dt, nid);
+    int pos = find_child(n, c);
+    if (pos >= 0) {
+        *cnid = node_nids(n)[pos];
+        return get_node_from_nodeid(dt, cnid);
     }
     return NULL;
 }
 
 /* Gets the size of a node. Some nodes may have a twid or wid, handles that */ 
 static inline int get_node_size(struct dnode *n) {
-    int s =  sizeof(struct dnode) +  (n->num_child * sizeof(struct dnode_ptr));
+    int s =  sizeof(struct dnode) + node_ascii_size(n->type) + (n->num_child * CHILD_SIZE);
     if (n->has_wid) {
         s += sizeof(uint32_t);
     }
@@ -225,14 +365,17 @@ static inline int get_node_size(struct dnode *n) {
     return s;
 }
 
+static inline int type_size(uint32_t type) {
+    if (LIKELY(type < NS_MAX)) {
+        return node_size[type];
+    }
+    return PSIZE * (type - NS_MAX);
+}
+
 // Can a child ptr be added to this node?
 static inline bool can_child_be_added(struct dnode *n) {
-    int size = get_node_size(n) + sizeof(struct dnode_ptr);
-    if (LIKELY(n->type < NS_MAX)) {
-        return size <= node_size[n->type];
-    } else {
-        return size <= (PSIZE * (n->type - NS_MAX));
-    }
+    int size = get_node_size(n) + CHILD_SIZE;
+    return size <= type_size(n->type);
 }
 
 static inline int node_wid_size(struct dnode *n) {
@@ -246,12 +389,9 @@ static inline int node_wid_size(struct dnode *n) {
     return s;
 }
 
-// Given a node, insert a node_ptr to point to a child node
+// Given a node, insert a child chr and node id in their sorted position
 static void insert_nodeid_in_node(struct dnode *n, struct dnode_id *nid, chr_t c) {
-    // Binary search and put chr_t in the correct place together with its nid.
-    // Increase numchild ++
-    struct dnode_ptr *np = n->child;
-    int pos = binary_search(n, np, c);
+    int pos = binary_search(n, c);
     // It should never exist in case of a store pid in page!
     if (pos >= 0) {
         // TODO: proper warning !
@@ -260,95 +400,136 @@ static void insert_nodeid_in_node(struct dnode *n, struct dnode_id *nid, chr_t c
         return;
     }
     pos = -pos-1;
+    int num = n->num_child;
+    chr_t *chars = node_chars(n);
+    uint8_t *nids = (uint8_t *)(chars + num);
+    // Working from the end, move node ids after pos and the wids up by two
+    // entries, node ids till pos by one and chars after pos by one
+    memmove(nids + (pos + 2) * sizeof(struct dnode_id),
+            nids + pos * sizeof(struct dnode_id),
+            (num - pos) * sizeof(struct dnode_id) + node_wid_size(n));
+    memmove(nids + sizeof(chr_t), nids, pos * sizeof(struct dnode_id));
+    memmove(chars + pos + 1, chars + pos, (num - pos) * sizeof(chr_t));
     n->num_child++;
-    if (n->num_child-1 > pos) {
-        memmove(np+pos+1, np+pos, ((n->num_child-1-pos)*sizeof(struct dnode_ptr)) + node_wid_size(n));
-    } else {
-        memmove(np+pos+1, np+pos, node_wid_size(n));
+    chars[pos] = c;
+    node_nids(n)[pos].offset = nid->offset;
+    // Ascii children after pos moved, which can only be if c is ascii too
+    if (n->type >= NS_ASCII_MIN && c < ASCII_MAX) {
+        build_ascii_index(n);
     }
-    struct dnode_ptr *tnp = &np[pos];
-    tnp->c = c;
-    tnp->nid.offset = nid->offset;
 }
 
 // Replace the node in a node for char c with nid
 static void replace_nodeid_in_node(struct dnode *n, struct dnode_id *nid, chr_t c) {
-    // Binary search and put chr in the correct place.
-    struct dnode_ptr *np = n->child;
-    int pos = binary_search(n, np, c);
+    int pos = find_child(n, c);
     // It should always exist in case of a replace pid in page!
     if (pos < 0) {
         // TODO: proper warning !
         M_ERR("\n\n\nSOMETHING IS WRONG during replace !! \n\n\n");
         return;
     }
-    struct dnode_ptr *tnp = &np[pos];
-    tnp->c = c;
-    tnp->nid.offset = nid->offset;
+    node_nids(n)[pos].offset = nid->offset;
+}
+
+/* Links new_node in place of the node at iter */
+static void relink_node(struct node_iter *iter, struct dnode *new_node, struct dnode_id *nid) {
+    if (LIKELY(iter->parent)) {
+        replace_nodeid_in_node(iter->parent, nid, iter->c);
+    } else {
+        iter->trie->meta->root_offset = nid->offset;
+        iter->trie->root = new_node;
+    }
+    iter->node = new_node;
+    iter->nid = *nid;
 }
 
-static void upsize_node(struct node_iter *iter) {
+static bool upsize_node(struct node_iter *iter) {
     struct dnode *n = iter->node;
+    bool hot = iter->depth <= DT_HOT_DEPTH;
     // Nope wont fit, copy the data into a bigger page
     NTYPE type = n->type + 1;
     if (type == NS_MAX) {
         type += 2;
     }
     struct dnode_id new_node_id;
-    struct dnode *new_node = get_free_node(iter->trie, type, &new_node_id);
-    int size = get_node_size(n);
+    struct dnode *new_node = get_free_node(iter->trie, type, &new_node_id, hot);
+    if (!new_node) return false;
     uint32_t offset = iter->nid.offset;
-    // Copy node
-    memcpy(new_node, n, size);
-    // n is no longer in use, just new_node
-    // Add current node to free list, we don't use it anymore
-    // Do not bother about mega nodes, they are very very rare
-    if (LIKELY(type < NS_MAX)) {
-        bmap_add(&iter->trie->freemaps[n->type], offset);
-        iter->trie->freemap_dirty[n->type] = 1;
-        iter->trie->meta->free_nodes[n->type]++;
-        iter->trie->meta->used_nodes[n->type]--;
-    }
-
+    // Copy the header and everything after the ascii index, the new node
+    // may have an ascii index where the old one did not
+    int size = get_node_size(n) - sizeof(struct dnode) - node_ascii_size(n->type);
+    memcpy(new_node, n, sizeof(struct dnode));
     // Type alone is different
     new_node->type = type;
-    // Now set parent to point to the new node
-    if (LIKELY(iter->parent)) {
-        replace_nodeid_in_node(iter->parent, &new_node_id, iter->c);
-    } else {
-        iter->trie->meta->root_offset = new_node_id.offset;
-        iter->trie->root = new_node;
+    memcpy(node_chars(new_node), node_chars(n), size);
+    if (type >= NS_ASCII_MIN) {
+        build_ascii_index(new_node);
     }
-    iter->node = new_node;
+    // n is no longer in use, just new_node
+    free_node(iter->trie, offset, n->type, hot);
+    relink_node(iter, new_node, &new_node_id);
+    return true;
+}
+
+/* Makes sure the node at iter can be changed in place.  A node readers can
+ * see is copied and the copy linked instead, so the parent must already be
+ * writable */
+static bool node_writable(struct node_iter *iter) {
+    struct dtrie *dt = iter->trie;
+    if (kh_get(NODESET, dt->fresh, iter->nid.offset) != kh_end(dt->fresh)) {
+        return true;
+    }
+    struct dnode *n = iter->node;
+    bool hot = iter->depth <= DT_HOT_DEPTH;
+    struct dnode_id new_node_id;
+    struct dnode *new_node = get_free_node(dt, n->type, &new_node_id, hot);
+    if (!new_node) return false;
+    memcpy(new_node, n, get_node_size(n));
+    free_node(dt, iter->nid.offset, n->type, hot);
+    relink_node(iter, new_node, &new_node_id);
+    return true;
 }
 
 // This changes node size or splits nodes or adds new nodes.
-static void add_nodeid_under_node(struct node_iter *iter, const chr_t c, struct dnode_id *nid) {
+static bool add_nodeid_under_node(struct node_iter *iter, const chr_t c, struct dnode_id *nid) {
     struct dnode *n = iter->node;
 
     if (can_child_be_added(n)) {
-        return insert_nodeid_in_node(n, nid, c);
+        insert_nodeid_in_node(n, nid, c);
+        return true;
     }
 
     // It will not fit, let us upsize it
-    upsize_node(iter);
+    if (!upsize_node(iter)) return false;
 
-    return insert_nodeid_in_node(iter->node, nid, c);
+    insert_nodeid_in_node(iter->node, nid, c);
+    return true;
 }
 
-
-static void node_add_child(struct node_iter *iter, chr_t c) {
+/* Adds a new child node for c.  A child which cannot be linked goes back to
+ * the free nodes, it was never seen by readers */
+static bool node_add_child(struct node_iter *iter, chr_t c) {
     struct dnode_id nid;
-    struct dnode *n = get_free_node(iter->trie, NS_DEFAULT, &nid);
+    bool hot = iter->depth + 1 <= DT_HOT_DEPTH;
+    struct dnode *n = get_free_node(iter->trie, NS_DEFAULT, &nid, hot);
+    if (!n) return false;
     // Adds the chr_t c under 
-    add_nodeid_under_node(iter, c, &nid);
+    if (!add_nodeid_under_node(iter, c, &nid)) {
+        free_node(iter->trie, nid.offset, NS_DEFAULT, hot);
+        return false;
+    }
     iter->parent = iter->node;
     iter->node = n;
     iter->nid = nid;
+    iter->depth++;
+    return true;
 }
 
-/* Adds all nodes to make the word @str.  Nodes are added only if they do not exist already */
+/* Adds all nodes to make the word @str.  Nodes are added only if they do not exist already.
+ * Every node on the path is made writable, as the last one always changes.  NULL if
+ * the trie is out of space, the nodes added till then stay without a word */
 static struct dnode *add_path_nodes(struct node_iter *iter, const chr_t *str, int slen, uint32_t *twids) {
+    if (!node_writable(iter)) return NULL;
     // Take one chr_t at a time
     for (int i=0; i<slen; i++) {
         struct dnode_id cnid;
@@ -360,37 +541,72 @@ static struct dnode *add_path_nodes(struct node_iter *iter, const chr_t *str, in
             iter->node = next;
             iter->nid = cnid;
             iter->c = str[i];
+            iter->depth++;
+            if (!node_writable(iter)) return NULL;
         } else {
             // The node does not exist, let us add it, this updates the node_iter 
             // to continue traversal
-            node_add_child(iter, str[i]);
+            if (!node_add_child(iter, str[i])) return NULL;
             iter->c = str[i];
-            if (i < LEVLIMIT) {
+            if (i < iter->trie->twid_levels) {
                 set_twid(iter->node, ++iter->trie->meta->tword_count);
             }
         }
-        if (i < LEVLIMIT) {
+        if (i < DT_MAX_LEVELS) {
             twids[i] = get_twid(iter->node);
         }
     }
     return iter->node;
 }
+/* Gets the page and node utilization of the trie, for every node type */
+void dtrie_get_stats(struct dtrie *dt, struct dtrie_stats *st) {
+    memset(st, 0, sizeof(struct dtrie_stats));
+    RDLOCK(&dt->trie_lock);
+    if (!dt->map) {
+        UNLOCK(&dt->trie_lock);
+        return;
+    }
+    st->num_pages = dt->meta->num_pages;
+    st->file_pages = dt->file_pages;
+    st->word_count = dt->meta->word_count;
+    st->tword_count = dt->meta->tword_count;
+    for (int i = 0; i < kv_size(dt->retired); i++) {
+        st->types[kv_A(dt->retired, i).type].retired++;
+    }
+    for (struct dtrie_garbage *g = dt->garbage; g; g = g->next) {
+        for (int i = 0; i < g->num_nodes; i++) {
+            st->types[g->nodes[i].type].retired++;
+        }
+    }
+    for (int i = 1; i < NS_MAX; i++) {
+        struct dtrie_type_stats *ts = &st->types[i];
+        ts->node_size = node_size[i];
+        ts->used = dt->meta->used_nodes[i];
+        ts->free = bmap_cardinality(&dt->freemaps[i]) + bmap_cardinality(&dt->hotmaps[i]);
+        // Every node of a page is either used, free or retired
+        ts->pages = (ts->used + ts->free + ts->retired + node_nums[i] - 1) / node_nums[i];
+    }
+    for (int i = NS_MAX; i < NS_MAX * 10; i++) {
+        st->big_nodes += dt->meta->used_nodes[i];
+    }
+    UNLOCK(&dt->trie_lock);
+}
 
 void dump_dtrie_stats(struct dtrie *dt) {
-    printf("Num pages : %u Num words : %u Gwords : %u\n", dt->meta->num_pages, dt->meta->word_count, dt->meta->tword_count);
-    printf("\nUsed pages : \n");
-    for (int i=0; i<NS_MAX; i++) {
-        printf("Type %d Count %u\n", i, dt->meta->used_nodes[i]);
+    struct dtrie_stats st;
+    dtrie_get_stats(dt, &st);
+    printf("Num pages : %u File pages : %u Num words : %u Gwords : %u Big nodes : %u\n",
+           st.num_pages, st.file_pages, st.word_count, st.tword_count, st.big_nodes);
+    for (int i = 1; i < NS_MAX; i++) {
+        struct dtrie_type_stats *ts = &st.types[i];
+        printf("Type %d Size %4u Pages %u Used %u Free %u Retired %u\n", i, ts->node_size,
+               ts->pages, ts->used, ts->free, ts->retired);
     }
-    printf("\nFree pages : \n");
-    for (int i=0; i<NS_MAX; i++) {
-        printf("Type %d Count %u\n", i, dt->meta->free_nodes[i]);
-    }
-    printf("Size of node %lu ptr %lu\n", sizeof(struct dnode), sizeof(struct dnode_ptr));
+    printf("Size of node %lu child %lu\n", sizeof(struct dnode), CHILD_SIZE);
 }
 
-static struct dnode *lookup_word_node(struct dtrie *dt, const chr_t *str, int slen) {
-    struct dnode *current = dt->root;
+static struct dnode *lookup_word_node(struct dtrie *dt, struct dnode *root, const chr_t *str, int slen) {
+    struct dnode *current = root;
     struct dnode_id nid;
     for (int i=0; i<slen; i++) {
         struct dnode *next = node_get_child(dt, current, str[i], &nid);
@@ -413,29 +629,70 @@ static uint32_t word_exists_under_root(struct dtrie *dt, const chr_t *str, int s
         } else {
             return 0;
         }
-        if (i < LEVLIMIT) {
+        if (i < DT_MAX_LEVELS) {
             twids[i] = get_twid(current);
         }
     }
     return get_wid(current);
 }
 
+/* Readers only hold the map lock and look at the published root, so writers
+ * never block them */
 static inline bool read_lock_trie(struct dtrie *dt) {
-    RDLOCK(&dt->trie_lock);
+    RDLOCK(&dt->map_lock);
     if (!dt->map) {
-        UNLOCK(&dt->trie_lock);
+        UNLOCK(&dt->map_lock);
         return false;
     }
     return true;
 }
 
+static inline struct dnode *read_root(struct dtrie *dt) {
+    return (struct dnode *)(dt->map + __atomic_load_n(&dt->read_offset, __ATOMIC_ACQUIRE));
+}
+
+/* The frozen trie readers should use instead of the nodes, if any */
+static inline struct ftrie *read_frozen(struct dtrie *dt) {
+    return __atomic_load_n(&dt->frozen, __ATOMIC_ACQUIRE);
+}
+
+// In memory tries are never frozen
+static bool frozen_path(struct dtrie *dt, char *path) {
+    if (dt->fd < 0) return false;
+    return snprintf(path, PATH_MAX, "%s.frozen", dt->path) < PATH_MAX;
+}
+
+static void unlink_frozen(struct dtrie *dt) {
+    char path[PATH_MAX];
+    if (frozen_path(dt, path)) {
+        unlink(path);
+    }
+}
+
+/* Checks if a word exists, including words added by the current write batch.
+ * Only to be used by writers */
 uint32_t dtrie_exists(struct dtrie *dt, const chr_t *str, int slen, uint32_t *twids) {
-    if (!read_lock_trie(dt)) return 0;
-    uint32_t wid = word_exists_under_root(dt, str, slen, twids);
+    RDLOCK(&dt->trie_lock);
+    uint32_t wid = 0;
+    if (dt->map) {
+        wid = word_exists_under_root(dt, str, slen, twids);
+    }
     UNLOCK(&dt->trie_lock);
     return wid;
 }
 
+/* Called before the first word of a write batch is added */
+static void mark_written(struct dtrie *dt) {
+    if (!dt->written) {
+        dt->written = true;
+        // Readers keep the frozen trie till this batch is published, but
+        // it must not be loaded again
+        if (dt->frozen) {
+            unlink_frozen(dt);
+        }
+    }
+}
+
 // Can wid be set without going over size limits
 static inline bool can_add_wid_for_node(struct dnode *n) {
     int size = get_node_size(n) + sizeof(uint32_t);
@@ -448,7 +705,8 @@ static inline bool can_add_wid_for_node(struct dnode *n) {
 
 
 /* Inserts a word into the trie.  If word already exists, just returns the word id for the
- * existing word entry.  The first 3 top level wordids are set in twids */
+ * existing word entry, 0 if the trie is out of space.  The twids of the first DT_MAX_LEVELS nodes of the word are set in
+ * twids, 0 for a node without one.  New nodes get a twid up to twid_levels deep */
 uint32_t dtrie_insert(struct dtrie *dt, const chr_t *str, int slen, uint32_t *twids) {
     // First grab a write lock
     WRLOCK(&dt->trie_lock);
@@ -460,19 +718,32 @@ uint32_t dtrie_insert(struct dtrie *dt, const chr_t *str, int slen, uint32_t *tw
     iter.node = dt->root;
     iter.parent = NULL;
     iter.nid.offset = dt->meta->root_offset;
-    uint32_t wid = 0;
+    iter.depth = 0;
+    uint32_t wid = word_exists_under_root(dt, str, slen, twids);
+    if (wid) {
+        UNLOCK(&dt->trie_lock);
+        return wid;
+    }
+    mark_written(dt);
 
     /* Add all path nodes required to satisfy this word.  For eg., for the
      * word 'best' we end up adding 4 nodes b, e, s, t and return the node 
      * for the final chr 't'.  Some or all of the nodes may already exist */
     struct dnode *node = add_path_nodes(&iter, str, slen, twids);
+    if (!node) {
+        UNLOCK(&dt->trie_lock);
+        return 0;
+    }
     if (node->has_wid) {
         wid = get_wid(node);
     } else {
         // Let us see if setting wid is ok for this node
         if (!can_add_wid_for_node(node)) {
             // If we cannot, let us upsize it
-            upsize_node(&iter);
+            if (!upsize_node(&iter)) {
+                UNLOCK(&dt->trie_lock);
+                return 0;
+            }
             node = iter.node;
         }
         wid =  ++dt->meta->word_count;
@@ -483,8 +754,214 @@ uint32_t dtrie_insert(struct dtrie *dt, const chr_t *str, int slen, uint32_t *tw
     return wid;
 }
 
+// A node on the path of the word being inserted by a batch
+struct path_node {
+    struct dnode *node;
+    struct dnode_id nid;
+    chr_t c;
+};
+
+typedef struct dtrie_word *dtrie_word_p;
+
+static inline bool dtrie_word_lt(const struct dtrie_word *a, const struct dtrie_word *b) {
+    int len = MIN(a->length, b->length);
+    for (int i = 0; i < len; i++) {
+        if (a->chars[i] != b->chars[i]) {
+            return a->chars[i] < b->chars[i];
+        }
+    }
+    return a->length < b->length;
+}
+
+KSORT_INIT(dtword, dtrie_word_p, dtrie_word_lt)
+
+static void path_iter(struct dtrie *dt, struct path_node *path, int depth, struct node_iter *iter) {
+    iter->trie = dt;
+    iter->node = path[depth].node;
+    iter->nid = path[depth].nid;
+    iter->c = path[depth].c;
+    iter->parent = depth ? path[depth - 1].node : NULL;
+    iter->depth = depth;
+}
+
+/* Inserts a batch of words, setting the wid and twids of every word.  The words
+ * are sorted first, so that each word only walks down from the nodes it shares
+ * with the word before it, all under a single lock.  Like dtrie_insert, nodes
+ * are made writable only for words that are not in the trie yet.  False if the trie
+ * ran out of space, the words from there on get no ids */
+bool dtrie_insert_batch(struct dtrie *dt, struct dtrie_word **words, int num_words) {
+    ks_introsort(dtword, num_words, words);
+    WRLOCK(&dt->trie_lock);
+    kvec_t(struct path_node) path;
+    kv_init(path);
+    struct path_node root = {dt->root, {dt->meta->root_offset}, 0};
+    kv_push(struct path_node, path, root);
+    // Path nodes up to this depth were made writable
+    int writable = -1;
+    struct dtrie_word *prev = NULL;
+    bool ok = true;
+    for (int w = 0; w < num_words && ok; w++) {
+        struct dtrie_word *word = words[w];
+        int depth = 0;
+        if (prev) {
+            int len = MIN(prev->length, word->length);
+            while (depth < len && prev->chars[depth] == word->chars[depth]) {
+                depth++;
+            }
+        }
+        kv_size(path) = depth + 1;
+        writable = MIN(writable, depth);
+        // Walk down the nodes that already exist
+        while (depth < word->length) {
+            struct dnode_id cnid;
+            struct dnode *next = node_get_child(dt, kv_A(path, depth).node, word->chars[depth], &cnid);
+            if (!next) break;
+            struct path_node pn = {next, cnid, word->chars[depth]};
+            kv_push(struct path_node, path, pn);
+            depth++;
+        }
+
+        struct dnode *node = kv_A(path, depth).node;
+        word->added = (depth < word->length) || !node->has_wid;
+        if (word->added) {
+            mark_written(dt);
+            struct node_iter iter;
+            for (int i = writable + 1; i <= depth; i++) {
+                path_iter(dt, path.a, i, &iter);
+                if (!node_writable(&iter)) {
+                    ok = false;
+                    break;
+                }
+                kv_A(path, i).node = iter.node;
+                kv_A(path, i).nid = iter.nid;
+            }
+            if (!ok) break;
+            // Add the missing nodes, a parent moves if it has to be upsized
+            path_iter(dt, path.a, depth, &iter);
+            for (int i = depth; i < word->length; i++) {
+                struct dnode_id nid;
+                bool hot = i + 1 <= DT_HOT_DEPTH;
+                struct dnode *n = get_free_node(dt, NS_DEFAULT, &nid, hot);
+                if (!n) {
+                    ok = false;
+                    break;
+                }
+                if (!add_nodeid_under_node(&iter, word->chars[i], &nid)) {
+                    free_node(dt, nid.offset, NS_DEFAULT, hot);
+                    ok = false;
+                    break;
+                }
+                kv_A(path, i).node = iter.node;
+                kv_A(path, i).nid = iter.nid;
+                if (i < dt->twid_levels) {
+                    set_twid(n, ++dt->meta->tword_count);
+                }
+                struct path_node pn = {n, nid, word->chars[i]};
+                kv_push(struct path_node, path, pn);
+                path_iter(dt, path.a, i + 1, &iter);
+            }
+            if (!ok) break;
+            if (!can_add_wid_for_node(iter.node)) {
+                if (!upsize_node(&iter)) {
+                    ok = false;
+                    break;
+                }
+                kv_A(path, word->length).node = iter.node;
+                kv_A(path, word->length).nid = iter.nid;
+            }
+            set_wid(iter.node, ++dt->meta->word_count);
+            writable = word->length;
+        }
+        word->wid = get_wid(kv_A(path, word->length).node);
+        for (int i = 0; i < word->length && i < DT_MAX_LEVELS; i++) {
+            word->twids[i] = get_twid(kv_A(path, i + 1).node);
+        }
+        prev = word;
+    }
+    kv_destroy(path);
+    UNLOCK(&dt->trie_lock);
+    return ok;
+}
+
+static void garbage_put(struct dtrie_garbage *g) {
+    if (__atomic_sub_fetch(&g->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(g->nodes);
+        ftrie_free(g->frozen);
+        free(g);
+    }
+}
+
+/* Marks the nodes retired by a batch as safe to reuse, to be called once no
+ * reader can be walking the root the batch replaced */
+void dtrie_reclaim(struct dtrie_garbage *g) {
+    __atomic_store_n(&g->safe, 1, __ATOMIC_RELEASE);
+    garbage_put(g);
+}
+
+/* Returns retired nodes to the free maps, only those of batches marked safe
+ * by dtrie_reclaim unless all is set */
+static void put_garbage_nodes(struct dtrie *dt, bool all) {
+    struct dtrie_garbage **gp = &dt->garbage;
+    while (*gp) {
+        struct dtrie_garbage *g = *gp;
+        if (!all && !__atomic_load_n(&g->safe, __ATOMIC_ACQUIRE)) {
+            gp = &g->next;
+            continue;
+        }
+        for (int i = 0; i < g->num_nodes; i++) {
+            struct retired_node *r = &g->nodes[i];
+            bmap_add(node_freemap(dt, r->type, r->hot), r->offset);
+        }
+        *gp = g->next;
+        garbage_put(g);
+    }
+}
+
+static bool has_safe_garbage(struct dtrie *dt) {
+    for (struct dtrie_garbage *g = dt->garbage; g; g = g->next) {
+        if (__atomic_load_n(&g->safe, __ATOMIC_ACQUIRE)) return true;
+    }
+    return false;
+}
+
 void dtrie_write_start(struct dtrie *dt) {
+    WRLOCK(&dt->trie_lock);
     memset(&dt->freemap_dirty[0], 0, sizeof(dt->freemap_dirty));
+    memset(&dt->hotmap_dirty[0], 0, sizeof(dt->hotmap_dirty));
+    // Reclaimed nodes can be used again.  A slow reader may still be walking
+    // a root from before they were retired, taking the map lock waits for
+    // every reader which started before it
+    if (has_safe_garbage(dt)) {
+        WRLOCK(&dt->map_lock);
+        UNLOCK(&dt->map_lock);
+        put_garbage_nodes(dt, false);
+    }
+    UNLOCK(&dt->trie_lock);
+}
+
+/* Publishes the writer root to readers.  Returns the nodes retired since the
+ * last publish and the frozen trie if words were added, if any */
+static struct dtrie_garbage *dtrie_publish(struct dtrie *dt) {
+    __atomic_store_n(&dt->read_offset, dt->meta->root_offset, __ATOMIC_RELEASE);
+    kh_clear(NODESET, dt->fresh);
+    bool drop_frozen = dt->written && dt->frozen;
+    dt->written = false;
+    if (kv_size(dt->retired) == 0 && !drop_frozen) {
+        return NULL;
+    }
+    struct dtrie_garbage *g = calloc(1, sizeof(struct dtrie_garbage));
+    g->refs = 2;
+    g->nodes = dt->retired.a;
+    g->num_nodes = kv_size(dt->retired);
+    kv_init(dt->retired);
+    if (drop_frozen) {
+        // Readers go back to the nodes, with the root published above
+        g->frozen = dt->frozen;
+        __atomic_store_n(&dt->frozen, NULL, __ATOMIC_RELEASE);
+    }
+    g->next = dt->garbage;
+    dt->garbage = g;
+    return g;
 }
 
 static void store_freemap(struct bmap *b, uint64_t fid, MDB_dbi dbi, MDB_txn *txn) {
@@ -503,77 +980,148 @@ static void store_freemap(struct bmap *b, uint64_t fid, MDB_dbi dbi, MDB_txn *tx
     bmap_dump(b, buf);
 }
 
+static void load_freemap(struct bmap *b, uint64_t fid, MDB_dbi dbi, MDB_txn *txn) {
+    MDB_val key, data;
+    key.mv_size = sizeof(uint64_t);
+    key.mv_data = &fid;
+    int rc = mdb_get(txn, dbi, &key, &data);
+    if (rc == 0) {
+        uint16_t *buf = data.mv_data;
+        bmap_load(b, buf);
+    }
+}
+
 static void dtrie_load_freemaps(struct dtrie *dt, MDB_dbi dbi, MDB_txn *txn) {
     for (int i = 0; i < NS_MAX; i++) {
-        uint64_t fid = IDPRIORITY(0xFFFFFFFF, i);
-        MDB_val key, data;
-        key.mv_size = sizeof(uint64_t);
-        key.mv_data = &fid;
-        int rc = mdb_get(txn, dbi, &key, &data);
-        if (rc == 0) {
-            uint16_t *buf = data.mv_data;
-            bmap_load(&dt->freemaps[i], buf);
-        }
+        load_freemap(&dt->freemaps[i], FREEMAP_ID(i), dbi, txn);
+        load_freemap(&dt->hotmaps[i], HOTMAP_ID(i), dbi, txn);
     }
 }
 
-void dtrie_write_end(struct dtrie *dt, MDB_dbi dbi, MDB_txn *txn) {
+/* Stores the free maps and publishes the words added to readers.  The nodes
+ * retired by this batch are returned, dtrie_reclaim has to be called on
+ * them once running readers are done */
+static void dtrie_store_freemaps(struct dtrie *dt, MDB_dbi dbi, MDB_txn *txn) {
     for (int i = 0; i < NS_MAX; i++) {
         if (dt->freemap_dirty[i]) {
-            uint64_t fid = IDPRIORITY(0xFFFFFFFF, i);
-            store_freemap(&dt->freemaps[i], fid, dbi, txn);
+            store_freemap(&dt->freemaps[i], FREEMAP_ID(i), dbi, txn);
+        }
+        if (dt->hotmap_dirty[i]) {
+            store_freemap(&dt->hotmaps[i], HOTMAP_ID(i), dbi, txn);
         }
     }
 }
 
+/* The free maps are stored with txn, an in memory trie has none */
+struct dtrie_garbage *dtrie_write_end(struct dtrie *dt, MDB_dbi dbi, MDB_txn *txn) {
+    WRLOCK(&dt->trie_lock);
+    if (txn) {
+        dtrie_store_freemaps(dt, dbi, txn);
+    }
+    struct dtrie_garbage *g = dtrie_publish(dt);
+    UNLOCK(&dt->trie_lock);
+    return g;
+}
+
 void dtrie_clear(struct dtrie *dt) {
     WRLOCK(&dt->trie_lock);
+    WRLOCK(&dt->map_lock);
     munmap(dt->map, MAPSIZE);
     dt->map = NULL;
-    close(dt->fd);
-    dt->fd = -1;
-    unlink(dt->path);
+    unlink_frozen(dt);
+    if (dt->fd >= 0) {
+        close(dt->fd);
+        dt->fd = -1;
+        unlink(dt->path);
+    }
+    ftrie_free(dt->frozen);
+    dt->frozen = NULL;
+    UNLOCK(&dt->map_lock);
     UNLOCK(&dt->trie_lock);
 }
 
-void dtrie_free(struct dtrie *dt) {
+/* Frees the trie.  No reader is left, so all retired nodes are free again,
+ * the free maps are stored with txn unless it is NULL */
+void dtrie_free(struct dtrie *dt, MDB_dbi dbi, MDB_txn *txn) {
     WRLOCK(&dt->trie_lock);
+    WRLOCK(&dt->map_lock);
+    memset(&dt->freemap_dirty[0], 0, sizeof(dt->freemap_dirty));
+    memset(&dt->hotmap_dirty[0], 0, sizeof(dt->hotmap_dirty));
+    put_garbage_nodes(dt, true);
+    if (dt->map && txn) {
+        dtrie_store_freemaps(dt, dbi, txn);
+    }
     for (int i=1; i<NS_MAX; i++) {
         bmap_free_containers(&dt->freemaps[i]);
+        bmap_free_containers(&dt->hotmaps[i]);
     }
     free(dt->freemaps);
+    free(dt->hotmaps);
+    kh_destroy(NODESET, dt->fresh);
+    kv_destroy(dt->retired);
+    ftrie_free(dt->frozen);
     if (dt->map) {
         munmap(dt->map, MAPSIZE);
     }
     if (dt->fd >= 0) {
         close(dt->fd);
     }
+    UNLOCK(&dt->map_lock);
     UNLOCK(&dt->trie_lock);
+    DESTROYLOCK(&dt->map_lock);
     DESTROYLOCK(&dt->trie_lock);
     free(dt);
 }
 
-/* Creates a new dtrie or loads an existing dtrie on path */
-struct dtrie *dtrie_new(const char *path, MDB_dbi dbi, MDB_txn *txn) {
+/* Has tries opened from now on ask for huge pages */
+void dtrie_set_hugepages(bool enable) {
+    dt_hugepages = enable;
+}
 
-    struct dtrie *dt = NULL;
-    int fd = open(path, O_RDWR | O_CREAT, (mode_t)0600);
-    if (fd < 0) {
-        goto file_error;
+/* Maps the trie file on path, setting its size and fd.  MAP_FAILED if it
+ * cannot be opened */
+static void *dtrie_map_file(const char *path, int *fd, int *size) {
+    *fd = open(path, O_RDWR | O_CREAT, (mode_t)0600);
+    if (*fd < 0) {
+        return MAP_FAILED;
     }
 
-    int size = lseek(fd, 0, SEEK_END);
-    if (size < 0) {
-        goto file_error;
+    *size = lseek(*fd, 0, SEEK_END);
+    if (*size < 0) {
+        return MAP_FAILED;
     }
 
-    if (size < (PSIZE * (NS_MAX + 2))) {
-        if (ftruncate(fd, (PSIZE * (NS_MAX + 2))) != 0) {
-            goto file_error;
+    if (*size < (PSIZE * (NS_MAX + 2))) {
+        if (ftruncate(*fd, (PSIZE * (NS_MAX + 2))) != 0) {
+            return MAP_FAILED;
         }
     }
 
-    void *map = mmap(NULL, MAPSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    void *map = mmap(NULL, MAPSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, *fd, 0);
+#ifdef MADV_HUGEPAGE
+    // Lookups jump all over the trie, huge pages save on TLB misses
+    if (map != MAP_FAILED && dt_hugepages && madvise(map, MAPSIZE, MADV_HUGEPAGE) != 0) {
+        M_INFO("Huge pages not available for trie %s", path);
+    }
+#endif
+    return map;
+}
+
+/* Opens the trie file on path, setting up the trie header if it is new.  A
+ * NULL path sets up a new trie in anonymous memory instead */
+static struct dtrie *dtrie_open(const char *path) {
+
+    struct dtrie *dt = NULL;
+    int fd = -1;
+    int size = 0;
+    void *map;
+    if (path) {
+        map = dtrie_map_file(path, &fd, &size);
+    } else {
+        // Pages are zero filled as they are first touched
+        map = mmap(NULL, MAPSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        path = "";
+    }
     if (map == MAP_FAILED) {
         goto file_error;
     }
@@ -586,10 +1134,13 @@ struct dtrie *dtrie_new(const char *path, MDB_dbi dbi, MDB_txn *txn) {
     pthread_rwlockattr_setkind_np(&dt->rwlockattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
 #endif
     pthread_rwlock_init(&dt->trie_lock, &dt->rwlockattr);
+    pthread_rwlock_init(&dt->map_lock, &dt->rwlockattr);
 
     strcpy(dt->path, path);
     dt->fd = fd;
     dt->map = map;
+    dt->file_pages = MAX(size, PSIZE * (NS_MAX + 2)) / PSIZE;
+    dt->twid_levels = LEVLIMIT;
     /* The default root is after meta page and free maps for all node sizes */
     dt->root = (struct dnode *)(dt->map + (PSIZE * (NS_MAX + 1)));
     struct dt_meta *meta = map;
@@ -615,10 +1166,10 @@ struct dtrie *dtrie_new(const char *path, MDB_dbi dbi, MDB_txn *txn) {
         // Already exists, just point root to root_offset
         dt->root = (struct dnode *)(dt->map + dt->meta->root_offset);
     }
+    dt->read_offset = dt->meta->root_offset;
     dt->freemaps = calloc(NS_MAX, sizeof(struct bmap));
-    // Load freemaps
-    dtrie_load_freemaps(dt, dbi, txn);
-
+    dt->hotmaps = calloc(NS_MAX, sizeof(struct bmap));
+    dt->fresh = kh_init(NODESET);
     return dt;
 
 file_error:
@@ -629,6 +1180,220 @@ file_error:
     return NULL;
 }
 
+// Version 1 nodes have their child chars and node ids interleaved
+struct PACKED dnode_ptr_v1 {
+    chr_t c;
+    struct dnode_id nid;
+};
+
+/* Smallest node type which can hold a node with num_child children and nwids wids */
+static NTYPE node_type_for(int num_child, int nwids) {
+    int size = sizeof(struct dnode) + num_child * CHILD_SIZE + nwids * sizeof(uint32_t);
+    for (NTYPE t = NS_DEFAULT; t < NS_MAX; t++) {
+        if (size + node_ascii_size(t) <= node_size[t]) {
+            return t;
+        }
+    }
+    return NS_MAX + (size + ASCII_MAX + PSIZE - 1) / PSIZE;
+}
+
+/* Copies the version 1 node on and everything under it to the node at iter.
+ * All the children of a node are allocated before going deeper, so that
+ * siblings end up next to each other.  False if the new trie cannot grow */
+static bool migrate_node(struct node_iter *iter, struct dtrie *ot, struct dnode *on) {
+    struct dnode_ptr_v1 *child = (struct dnode_ptr_v1 *)on->data;
+    uint32_t *wpos = (uint32_t *)(child + on->num_child);
+    if (on->has_wid) {
+        set_wid(iter->node, *wpos++);
+    }
+    if (on->has_twid) {
+        set_twid(iter->node, *wpos);
+    }
+    bool hot = iter->depth + 1 <= DT_HOT_DEPTH;
+    for (int i = 0; i < on->num_child; i++) {
+        struct dnode *oc = get_node_from_nodeid(ot, &child[i].nid);
+        struct dnode_id nid;
+        if (!get_free_node(iter->trie, node_type_for(oc->num_child, oc->has_wid + oc->has_twid), &nid, hot) ||
+                !add_nodeid_under_node(iter, child[i].c, &nid)) {
+            return false;
+        }
+    }
+    for (int i = 0; i < on->num_child; i++) {
+        struct node_iter citer;
+        citer.trie = iter->trie;
+        citer.parent = iter->node;
+        citer.c = child[i].c;
+        citer.depth = iter->depth + 1;
+        citer.node = node_get_child(iter->trie, iter->node, child[i].c, &citer.nid);
+        if (!migrate_node(&citer, ot, get_node_from_nodeid(ot, &child[i].nid))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Rebuilds a version 1 trie in the current node layout.  Word ids do not
+ * change.  The new trie is written next to the old one and replaces it once
+ * it is complete */
+static struct dtrie *dtrie_migrate(struct dtrie *ot, MDB_dbi dbi, MDB_txn *txn) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s.migrate", ot->path) >= sizeof(path)) {
+        return NULL;
+    }
+    unlink(path);
+    struct dtrie *dt = dtrie_open(path);
+    if (!dt) {
+        return NULL;
+    }
+    M_INFO("Migrating dtrie %s from version %u", ot->path, ot->meta->version);
+    dt->meta->word_count = ot->meta->word_count;
+    dt->meta->tword_count = ot->meta->tword_count;
+
+    struct node_iter iter;
+    iter.trie = dt;
+    iter.node = dt->root;
+    iter.parent = NULL;
+    iter.nid.offset = dt->meta->root_offset;
+    iter.depth = 0;
+    // Nobody can be reading the new trie yet, the root can be changed in place
+    int ret;
+    kh_put(NODESET, dt->fresh, iter.nid.offset, &ret);
+    if (!migrate_node(&iter, ot, ot->root)) {
+        M_ERR("Failed to migrate dtrie %s", ot->path);
+        dtrie_clear(dt);
+        dtrie_free(dt, dbi, NULL);
+        return NULL;
+    }
+
+    // The stored free maps were for the old trie, replace all of them
+    for (int i = NS_DEFAULT; i < NS_MAX; i++) {
+        dt->freemap_dirty[i] = 1;
+        dt->hotmap_dirty[i] = 1;
+    }
+    struct dtrie_garbage *g = dtrie_write_end(dt, dbi, txn);
+    if (g) {
+        dtrie_reclaim(g);
+    }
+
+    if (msync(dt->map, (size_t)PSIZE * dt->meta->num_pages, MS_SYNC) != 0 ||
+            rename(path, ot->path) != 0) {
+        M_ERR("Failed to migrate dtrie %s", ot->path);
+        dtrie_clear(dt);
+        dtrie_free(dt, dbi, NULL);
+        return NULL;
+    }
+    strcpy(dt->path, ot->path);
+    return dt;
+}
+
+/* Loads the frozen trie saved by dtrie_freeze, as long as no words were
+ * added after it */
+static void dtrie_load_frozen(struct dtrie *dt) {
+    char path[PATH_MAX];
+    if (!frozen_path(dt, path)) {
+        return;
+    }
+    struct ftrie *f = ftrie_open(path);
+    if (!f) {
+        return;
+    }
+    if (f->header->word_count != dt->meta->word_count ||
+            f->header->tword_count != dt->meta->tword_count) {
+        M_INFO("Dropping out of date frozen trie %s", path);
+        ftrie_free(f);
+        unlink(path);
+        return;
+    }
+    dt->frozen = f;
+}
+
+/* Creates a new dtrie or loads an existing dtrie on path */
+struct dtrie *dtrie_new(const char *path, MDB_dbi dbi, MDB_txn *txn) {
+    struct dtrie *dt = dtrie_open(path);
+    if (!dt) {
+        return NULL;
+    }
+    if (dt->meta->version == DT_VERSION_1) {
+        struct dtrie *ndt = dtrie_migrate(dt, dbi, txn);
+        // The free maps stored now are those of the migrated trie
+        dtrie_free(dt, dbi, NULL);
+        return ndt;
+    }
+    // Load freemaps
+    dtrie_load_freemaps(dt, dbi, txn);
+    dtrie_load_frozen(dt);
+    return dt;
+}
+
+/* Creates a new trie which is only kept in memory, for indexes which are not
+ * stored.  Its free maps are not stored either, write it with a NULL txn */
+struct dtrie *dtrie_new_memory(void) {
+    return dtrie_open(NULL);
+}
+
+// A node waiting to be added to the frozen trie and its char
+struct freeze_item {
+    uint32_t offset;
+    chr_t c;
+};
+
+/* Builds a frozen trie out of the published root and has readers use it
+ * till words are added again.  Writers wait till it is done.  Fails if the
+ * current write batch has added words, as it is about to be out of date */
+bool dtrie_freeze(struct dtrie *dt) {
+    WRLOCK(&dt->trie_lock);
+    bool ok = false;
+    char path[PATH_MAX];
+    if (!dt->map || dt->written || !frozen_path(dt, path)) {
+        goto done;
+    }
+    if (dt->frozen) {
+        ok = true;
+        goto done;
+    }
+    struct ftrie_builder *b = ftrie_builder_new();
+    // Breadth first, children of a node get consecutive ids
+    kvec_t(struct freeze_item) queue;
+    kv_init(queue);
+    struct freeze_item root = {dt->read_offset, 0};
+    kv_push(struct freeze_item, queue, root);
+    for (size_t i = 0; i < kv_size(queue); i++) {
+        struct freeze_item item = kv_A(queue, i);
+        struct dnode_id nid = {item.offset};
+        struct dnode *d = get_node_from_nodeid(dt, &nid);
+        ftrie_builder_add(b, item.c, d->num_child, get_wid(d), get_twid(d));
+        const chr_t *chars = node_chars(d);
+        const struct dnode_id *nids = node_nids(d);
+        for (int j = 0; j < d->num_child; j++) {
+            struct freeze_item child = {nids[j].offset, chars[j]};
+            kv_push(struct freeze_item, queue, child);
+        }
+    }
+    kv_destroy(queue);
+    if (ftrie_builder_write(b, path, dt->meta->word_count, dt->meta->tword_count)) {
+        struct ftrie *f = ftrie_open(path);
+        if (f) {
+            __atomic_store_n(&dt->frozen, f, __ATOMIC_RELEASE);
+            ok = true;
+        }
+    } else {
+        M_ERR("Failed to write frozen trie %s", path);
+    }
+    ftrie_builder_free(b);
+
+done:
+    UNLOCK(&dt->trie_lock);
+    return ok;
+}
+
+/* Bytes taken by the trie nodes and by the frozen trie, 0 if not frozen */
+void dtrie_sizes(struct dtrie *dt, uint64_t *size, uint64_t *frozen_size) {
+    RDLOCK(&dt->trie_lock);
+    *size = dt->map ? (uint64_t)dt->meta->num_pages * PSIZE : 0;
+    *frozen_size = dt->frozen ? dt->frozen->size : 0;
+    UNLOCK(&dt->trie_lock);
+}
+
 /* Adds / Updates the result with a wid -> distance mapping */
 static void add_wordid_to_result(termresult_t *tr, uint32_t wid, int distance) {
     khiter_t k;
@@ -639,76 +1404,172 @@ static void add_wordid_to_result(termresult_t *tr, uint32_t wid, int distance) {
     }
 }
 
+/* Adds / Updates the result with a twid -> distance mapping, all words under
+ * the twid match with that distance */
+static void add_twid_to_result(termresult_t *tr, uint32_t twid, int distance) {
+    khiter_t k;
+    int d = kh_get_val(WID2TYPOS, tr->twids, twid, 0xFF);
+    if (distance < d) {
+        kh_set(WID2TYPOS, tr->twids, twid, distance);
+    }
+}
+
 static void node_walk(struct dtrie *dt, struct dnode *d, termresult_t *tr, int distance) {
-    // See if we have a twid and use that if it exists
-    // tr->twid = get_twid(d);
-    /*if (!tr->twid)*/ 
-    {
-        // Add wid if any in the current node
-        uint32_t wid = get_wid(d);
-        if (wid) {
-            //printf("PWORDID %u\n", wid);
-            add_wordid_to_result(tr, wid, distance);
+    // See if we have a twid and use that if it exists, the words under
+    // it need not be walked
+    uint32_t twid = get_twid(d);
+    if (twid) {
+        add_twid_to_result(tr, twid, distance);
+        return;
+    }
+    // Add wid if any in the current node
+    uint32_t wid = get_wid(d);
+    if (wid) {
+        add_wordid_to_result(tr, wid, distance);
+    }
+    struct dnode_id *nids = node_nids(d);
+    for (int i = 0; i < d->num_child; i++) {
+        struct dnode *dc = get_node_from_nodeid(dt, &nids[i]);
+        node_walk(dt, dc, tr, distance);
+    }
+}
+
+static bool fnode_lookup_word(const struct ftrie *f, const chr_t *str, int slen, struct fnode *n) {
+    ftrie_root(f, n);
+    for (int i = 0; i < slen; i++) {
+        struct fnode next;
+        if (!ftrie_find_child(f, n, str[i], &next)) {
+            return false;
         }
-        for (int i = 0; i < d->num_child; i++) {
-            struct dnode *dc = get_node_from_nodeid(dt, &d->child[i].nid);
-            node_walk(dt, dc, tr, distance);
+        *n = next;
+    }
+    return true;
+}
+
+/* Adds all wids under a frozen trie node.  Being breadth first, the nodes
+ * of a subtree at a level and their wids are consecutive */
+static void fnode_walk(const struct ftrie *f, const struct fnode *n, termresult_t *tr, int distance) {
+    uint32_t twid = ftrie_twid(f, n->id);
+    if (twid) {
+        add_twid_to_result(tr, twid, distance);
+        return;
+    }
+    uint32_t first = n->id, last = n->id + 1;
+    while (first < last) {
+        int count;
+        const uint32_t *wids = ftrie_range_wids(f, first, last, &count);
+        for (int i = 0; i < count; i++) {
+            add_wordid_to_result(tr, wids[i], distance);
         }
-    } 
+        ftrie_range_children(f, &first, &last);
+    }
 }
 
-/* Looksup toplevel word id, only to be used when word len is <= LEVLIMIT
- * If it is a prefix match, we set the twid. The words containing this twid
- * can be retrieve by the caller.  If it is not a prefix match, 
- * we add wid if we find any */
-static void lookup_twid(struct dtrie *dt, term_t *t, termresult_t *tr) {
-    if (!read_lock_trie(dt)) return;
-    // First lookup the node for this word
-    struct dnode *d = lookup_word_node(dt, t->word->chars, t->word->length);
-    if (d) {
-        if (t->prefix) {
-            // For a prefix search, just set twid
-            tr->twid = get_twid(d);
-        } else {
-            // It is not a prefix search, do not set the twid
-            // instead add wid if any in the node
-            uint32_t wid = get_wid(d);
-            if (wid) {
-                add_wordid_to_result(tr, wid, 0);
-            }
+/* Finds the wid and twid of the node for a word, returns false if there is
+ * no such node.  Only to be called by readers */
+static bool lookup_word_ids(struct dtrie *dt, const chr_t *str, int slen, uint32_t *wid, uint32_t *twid) {
+    struct ftrie *f = read_frozen(dt);
+    if (f) {
+        struct fnode n;
+        if (!fnode_lookup_word(f, str, slen, &n)) {
+            return false;
         }
+        *wid = ftrie_wid(f, n.id);
+        *twid = ftrie_twid(f, n.id);
+        return true;
     }
-    UNLOCK(&dt->trie_lock);
+    struct dnode *d = lookup_word_node(dt, read_root(dt), str, slen);
+    if (!d) {
+        return false;
+    }
+    *wid = get_wid(d);
+    *twid = get_twid(d);
+    return true;
 }
 
+/* Looks up a term without typos.  Prefix matches are words under the node of
+ * the term, found by its twid if it has one */
 static void lookup_notypo(struct dtrie *dt, term_t *t, termresult_t *tr) {
     if (!read_lock_trie(dt)) return;
-    struct dnode *d = lookup_word_node(dt, t->word->chars, t->word->length);
-    if (d) {
-        if (t->prefix) {
+    if (!t->prefix) {
+        // It is not a prefix search, do not set the twid
+        // instead add wid if any in the node
+        uint32_t wid, twid;
+        if (lookup_word_ids(dt, t->word->chars, t->word->length, &wid, &twid) && wid) {
+            add_wordid_to_result(tr, wid, 0);
+        }
+        UNLOCK(&dt->map_lock);
+        return;
+    }
+    struct ftrie *f = read_frozen(dt);
+    if (f) {
+        struct fnode n;
+        if (fnode_lookup_word(f, t->word->chars, t->word->length, &n)) {
+            fnode_walk(f, &n, tr, 0);
+        }
+    } else {
+        struct dnode *d = lookup_word_node(dt, read_root(dt), t->word->chars, t->word->length);
+        if (d) {
             node_walk(dt, d, tr, 0);
-        } else {
-            // It is not a prefix search, do not set the twid
-            // instead add wid if any in the node
-            uint32_t wid = get_wid(d);
-            if (wid) {
-                add_wordid_to_result(tr, wid, 0);
-            }
         }
     }
-    UNLOCK(&dt->trie_lock);
+    UNLOCK(&dt->map_lock);
 }
 
+// Query words up to this length use the bit parallel typo lookup
+#define LEV_BITS        64
+// Slots in the character -> match mask table of a compiled query word
+#define LEV_PEQ_SIZE    128
+
+struct lev_peq {
+    chr_t c;
+    uint64_t mask;
+};
+
 struct lev_data {
     struct dtrie *dt;
+    const struct ftrie *ft; // Set when walking the frozen trie
     word_t *word;
     term_t *t;
     termresult_t *tr;
     int maxdist;
+    // Compiled query word for the bit parallel lookup, a bit is set in the
+    // mask of a character for every position it occurs in the word
+    struct lev_peq peq[LEV_PEQ_SIZE];
+    uint64_t last;  // Bit of the last character of the word
 };
 
+/* Bit parallel Damerau-Levenshtein (optimal string alignment) column of the
+ * query word against the path to a trie node, as described by Hyyro.  Bit i
+ * of vp / vn is set when the distance goes up / down by one from word
+ * position i to i+1 */
+struct lev_state {
+    uint64_t vp;
+    uint64_t vn;
+    uint64_t d0;    // Diagonal zero deltas, needed for transpositions
+    uint64_t pm;    // Match mask of the character leading to this node
+    int dist;       // Distance of the whole word to the path
+};
+
+/* Adds the words under a node that is within maxdist of the query word.
+ * walked is the best distance this subtree was already walked with by
+ * an ancestor, there is nothing to add if we are not any closer */
+static void lev_add_node(struct lev_data *ld, struct dnode *d, int dist, int *walked) {
+    if (ld->t->prefix) {
+        if (dist < *walked) {
+            node_walk(ld->dt, d, ld->tr, dist);
+            *walked = dist;
+        }
+    } else {
+        uint32_t wid = get_wid(d);
+        if (wid) {
+            add_wordid_to_result(ld->tr, wid, dist);
+        }
+    }
+}
+
 static void node_lev(struct lev_data *ld, struct dnode *d, int *prev_row, int *pprev_row, 
-                            chr_t c, chr_t pc, int depth) {
+                            chr_t c, chr_t pc, int depth, int walked) {
 
     int size = ld->word->length + 1;
     int *current_row = prev_row + size;
@@ -731,19 +1592,9 @@ static void node_lev(struct lev_data *ld, struct dnode *d, int *prev_row, int *p
     }
     uint8_t dist = current_row[size-1];
     if (dist <= ld->maxdist) {
-        if (ld->t->prefix) {
-            if (depth >= (size-1)) {
-                node_walk(ld->dt, d, ld->tr, dist);
-                return;
-            } else {
-                node_walk(ld->dt, d, ld->tr, dist);
-            }
-        } else  {
-            uint32_t wid = get_wid(d);
-            if (wid) {
-                //printf("PWORDID %u\n", wid);
-                add_wordid_to_result(ld->tr, wid, dist);
-            }
+        lev_add_node(ld, d, dist, &walked);
+        if (ld->t->prefix && depth >= (size-1)) {
+            return;
         }
     }
 
@@ -751,66 +1602,244 @@ static void node_lev(struct lev_data *ld, struct dnode *d, int *prev_row, int *p
     for (int i = 0; i < size; i++) {
         if (current_row[i] <= ld->maxdist) {
             for (int i = 0; i < d->num_child; i++) {
-                struct dnode*nd = get_node_from_nodeid(ld->dt, &d->child[i].nid);
-                node_lev(ld, nd, current_row, prev_row, d->child[i].c, c, depth+1);
+                struct dnode*nd = get_node_from_nodeid(ld->dt, &node_nids(d)[i]);
+                node_lev(ld, nd, current_row, prev_row, node_chars(d)[i], c, depth+1, walked);
             }
             break;
         }
     }
 }
 
+static inline int lev_peq_slot(chr_t c) {
+    return (c * 0x9E3779B1u) >> 25;
+}
+
+/* Compiles the query word into per character match masks */
+static void lev_compile(struct lev_data *ld) {
+    memset(ld->peq, 0, sizeof(ld->peq));
+    const chr_t *str = ld->word->chars;
+    for (int i = 0; i < ld->word->length; i++) {
+        // A word has at most 64 distinct characters, the table never fills up
+        int s = lev_peq_slot(str[i]);
+        while (ld->peq[s].mask && ld->peq[s].c != str[i]) {
+            s = (s + 1) & (LEV_PEQ_SIZE - 1);
+        }
+        ld->peq[s].c = str[i];
+        ld->peq[s].mask |= 1ULL << i;
+    }
+    ld->last = 1ULL << (ld->word->length - 1);
+}
+
+static inline uint64_t lev_match(const struct lev_data *ld, chr_t c) {
+    int s = lev_peq_slot(c);
+    while (ld->peq[s].mask) {
+        if (ld->peq[s].c == c) return ld->peq[s].mask;
+        s = (s + 1) & (LEV_PEQ_SIZE - 1);
+    }
+    return 0;
+}
+
+/* Advances the column of the parent node by the character c */
+static inline void lev_step(const struct lev_data *ld, const struct lev_state *p,
+                            struct lev_state *s, chr_t c) {
+    uint64_t pm = lev_match(ld, c);
+    uint64_t tr = (((~p->d0) & pm) << 1) & p->pm;
+    uint64_t d0 = (((pm & p->vp) + p->vp) ^ p->vp) | pm | p->vn | tr;
+    uint64_t hp = p->vn | ~(d0 | p->vp);
+    uint64_t hn = d0 & p->vp;
+    s->dist = p->dist + ((hp & ld->last) != 0) - ((hn & ld->last) != 0);
+    uint64_t x = (hp << 1) | 1;
+    s->vn = x & d0;
+    s->vp = (hn << 1) | ~(x | d0);
+    s->d0 = d0;
+    s->pm = pm;
+}
+
+/* Checks if any word position is within maxdist of the path at depth, if
+ * not no node under this one can be */
+static bool lev_can_match(const struct lev_data *ld, const struct lev_state *s, int depth) {
+    // Distance at word position i is never below |i - depth|
+    int lb = MAX(depth - ld->maxdist, 0);
+    int rb = MIN(depth + ld->maxdist, ld->word->length);
+    if (lb > rb) return false;
+    uint64_t low = lb ? (~0ULL >> (LEV_BITS - lb)) : 0;
+    int dist = depth + __builtin_popcountll(s->vp & low) - __builtin_popcountll(s->vn & low);
+    for (int i = lb; ; i++) {
+        if (dist <= ld->maxdist) return true;
+        if (i == rb) return false;
+        dist += ((s->vp >> i) & 1) - ((s->vn >> i) & 1);
+    }
+}
+
+static void node_lev_bits(struct lev_data *ld, struct dnode *d, const struct lev_state *p,
+                          chr_t c, int depth, int walked) {
+    struct lev_state s;
+    lev_step(ld, p, &s, c);
+    if (s.dist <= ld->maxdist) {
+        lev_add_node(ld, d, s.dist, &walked);
+        if (ld->t->prefix && depth >= ld->word->length) {
+            return;
+        }
+    }
+    if (!lev_can_match(ld, &s, depth)) return;
+    chr_t *chars = node_chars(d);
+    struct dnode_id *nids = node_nids(d);
+    for (int i = 0; i < d->num_child; i++) {
+        struct dnode *nd = get_node_from_nodeid(ld->dt, &nids[i]);
+        node_lev_bits(ld, nd, &s, chars[i], depth+1, walked);
+    }
+}
+
+/* The typo lookups again, over the frozen trie */
+static void flev_add_node(struct lev_data *ld, const struct fnode *n, int dist, int *walked) {
+    if (ld->t->prefix) {
+        if (dist < *walked) {
+            fnode_walk(ld->ft, n, ld->tr, dist);
+            *walked = dist;
+        }
+    } else {
+        uint32_t wid = ftrie_wid(ld->ft, n->id);
+        if (wid) {
+            add_wordid_to_result(ld->tr, wid, dist);
+        }
+    }
+}
+
+static void fnode_lev(struct lev_data *ld, const struct fnode *n, int *prev_row, int *pprev_row,
+                      chr_t c, chr_t pc, int depth, int walked) {
+
+    int size = ld->word->length + 1;
+    int *current_row = prev_row + size;
+    const chr_t *str = ld->word->chars;
+
+    current_row[0] = prev_row[0] + 1;
+    memset(&current_row[1], 0x0F, (size-1)*sizeof(unsigned int));
+    int lb = MAX((depth - ld->maxdist), 1);
+    int rb = MIN((depth + ld->maxdist + 1), size);
+    for (int i=lb; i<rb; i++) {
+        int ins_del = MIN(current_row[i-1]+1, prev_row[i]+1);
+        int repl = (str[i-1] == c)?prev_row[i-1]:(prev_row[i-1]+1);
+        current_row[i] = MIN(ins_del, repl);
+        if (i > 1 && depth > 1) {
+            if (str[i-1] == pc && str[i-2] == c) {
+                current_row[i] = MIN(current_row[i], str[i-1]==c? pprev_row[i-2]: pprev_row[i-2]+1);
+            }
+        }
+    }
+    uint8_t dist = current_row[size-1];
+    if (dist <= ld->maxdist) {
+        flev_add_node(ld, n, dist, &walked);
+        if (ld->t->prefix && depth >= (size-1)) {
+            return;
+        }
+    }
+
+    for (int i = 0; i < size; i++) {
+        if (current_row[i] <= ld->maxdist) {
+            struct fnode child;
+            int num_child = ftrie_first_child(ld->ft, n, &child);
+            for (int j = 0; j < num_child; j++) {
+                if (j) {
+                    ftrie_next_child(ld->ft, &child);
+                }
+                fnode_lev(ld, &child, current_row, prev_row, ftrie_label(ld->ft, child.id), c,
+                          depth+1, walked);
+            }
+            break;
+        }
+    }
+}
+
+static void fnode_lev_bits(struct lev_data *ld, const struct fnode *n, const struct lev_state *p,
+                           chr_t c, int depth, int walked) {
+    struct lev_state s;
+    lev_step(ld, p, &s, c);
+    if (s.dist <= ld->maxdist) {
+        flev_add_node(ld, n, s.dist, &walked);
+        if (ld->t->prefix && depth >= ld->word->length) {
+            return;
+        }
+    }
+    if (!lev_can_match(ld, &s, depth)) return;
+    struct fnode child;
+    int num_child = ftrie_first_child(ld->ft, n, &child);
+    for (int i = 0; i < num_child; i++) {
+        if (i) {
+            ftrie_next_child(ld->ft, &child);
+        }
+        fnode_lev_bits(ld, &child, &s, ftrie_label(ld->ft, child.id), depth+1, walked);
+    }
+}
 
 static void lookup_typo(struct dtrie *dt, term_t *t, termresult_t *tr) {
     if (!read_lock_trie(dt)) return;
-    // Set the max distance based on word length
-    // TODO: Make word distance configurable and send during lookup request
     int wlen = t->word->length;
-    // TODO: Make it configurable
-    int maxdist = (wlen > 3) ? ((wlen > 7) ? 2 : 1) : 0;
     // Do a Dam-Levenshtein lookup
     struct lev_data ld;
-    ld.maxdist = maxdist;
+    ld.maxdist = t->maxdist;
     ld.dt = dt;
     ld.word = t->word;
     ld.tr = tr;
     ld.t = t;
-    int *current_row = malloc(((wlen + 1) * (wlen + 2) * 2) * sizeof(int));
-
-    for (int i = 0; i <= wlen; i++) {
-        current_row[i] = i;
+    ld.ft = read_frozen(dt);
+
+    struct dnode *root = read_root(dt);
+    struct fnode froot, fchild;
+    int num_child = root->num_child;
+    if (ld.ft) {
+        ftrie_root(ld.ft, &froot);
+        num_child = ftrie_first_child(ld.ft, &froot, &fchild);
     }
-
-    struct dnode *root = dt->root;
-    for (int i = 0; i < root->num_child; i++) {
-        struct dnode *d = get_node_from_nodeid(dt, &root->child[i].nid);
-        node_lev(&ld, d, current_row, NULL, root->child[i].c, 0, 1);
+    if (wlen <= LEV_BITS) {
+        lev_compile(&ld);
+        // Column of the empty path, every word position is one more than the last
+        struct lev_state s = {.vp = ~0ULL, .vn = 0, .d0 = 0, .pm = 0, .dist = wlen};
+        for (int i = 0; i < num_child; i++) {
+            if (ld.ft) {
+                if (i) {
+                    ftrie_next_child(ld.ft, &fchild);
+                }
+                fnode_lev_bits(&ld, &fchild, &s, ftrie_label(ld.ft, fchild.id), 1, 0xFF);
+                continue;
+            }
+            struct dnode *d = get_node_from_nodeid(dt, &node_nids(root)[i]);
+            node_lev_bits(&ld, d, &s, node_chars(root)[i], 1, 0xFF);
+        }
+    } else {
+        int *current_row = malloc(((wlen + 1) * (wlen + 2) * 2) * sizeof(int));
+        for (int i = 0; i <= wlen; i++) {
+            current_row[i] = i;
+        }
+        for (int i = 0; i < num_child; i++) {
+            if (ld.ft) {
+                if (i) {
+                    ftrie_next_child(ld.ft, &fchild);
+                }
+                fnode_lev(&ld, &fchild, current_row, NULL, ftrie_label(ld.ft, fchild.id), 0, 1, 0xFF);
+                continue;
+            }
+            struct dnode *d = get_node_from_nodeid(dt, &node_nids(root)[i]);
+            node_lev(&ld, d, current_row, NULL, node_chars(root)[i], 0, 1, 0xFF);
+        }
+        free(current_row);
     }
 
-    free(current_row);
-    UNLOCK(&dt->trie_lock);
+    UNLOCK(&dt->map_lock);
 }
 
 uint32_t dtrie_lookup_exact(struct dtrie *dt, word_t *word) {
-    uint32_t ret = 0;
+    uint32_t ret = 0, twid;
     if (!read_lock_trie(dt)) return ret;
-    struct dnode *d = lookup_word_node(dt, word->chars, word->length);
-    if (d) {
-        // NOTE: get_wid can return 0 if we do not have an exact match
-        ret = get_wid(d);
-    }
-    UNLOCK(&dt->trie_lock);
+    // NOTE: wid can be 0 if we do not have an exact match
+    lookup_word_ids(dt, word->chars, word->length, &ret, &twid);
+    UNLOCK(&dt->map_lock);
     return ret;
 }
 
 struct termresult *dtrie_lookup_term(struct dtrie *dt, term_t *t) {
     struct termresult *tr = calloc(1, sizeof(struct termresult));
     tr->wordids = kh_init(WID2TYPOS);
-
-    word_t *w = t->word;
-    if (t->prefix && w->length <= LEVLIMIT) {
-        lookup_twid(dt, t, tr);
-        return tr;
-    }
+    tr->twids = kh_init(WID2TYPOS);
 
     // If typos are not allowed, do a notypo lookup
     if (!t->typos) {
@@ -825,6 +1854,7 @@ struct termresult *dtrie_lookup_term(struct dtrie *dt, term_t *t) {
 void termresult_free(struct termresult *t) {
     if (t) {
         kh_destroy(WID2TYPOS, t->wordids);
+        kh_destroy(WID2TYPOS, t->twids);
         free(t);
     }
 }
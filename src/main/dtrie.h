@@ -7,15 +7,32 @@
 #include "platform.h"
 #include "word.h"
 #include "khash.h"
+#include "kvec.h"
+#include "ftrie.h"
 #include <lmdb.h>
 
 #define DT_MAGIC    0xBEDEADFE
-#define DT_VERSION  0x00000001
+#define DT_VERSION  0x00000002
+// Version 1 tries interleave child chars and node ids, they are migrated on load
+#define DT_VERSION_1    0x00000001
 #define PSIZE       4096
 #define CHMAX       0xFFFFFFFF
 #define LEVLIMIT    3
+// Most levels of nodes that can be given top-level word ids, twid arrays
+// passed to dtrie_insert / dtrie_exists hold this many
+#define DT_MAX_LEVELS   8
+// Nodes up to this depth are allocated from their own pages, so that the
+// upper levels every lookup goes through share pages
+#define DT_HOT_DEPTH    LEVLIMIT
+// The trie file grows by at least / at most these many pages at a time
+#define DT_GROW_MIN     16
+#define DT_GROW_MAX     16384
+// Ascii children of nodes this big or bigger are directly indexed
+#define NS_ASCII_MIN    NS_1K
+#define ASCII_MAX       128
 
 KHASH_MAP_INIT_INT(WID2TYPOS, int);
+KHASH_MAP_INIT_INT(NODESET, char); // Used as a set of node offsets
 
 typedef enum node_type{
     NS_DEFAULT = 1, // 16
@@ -35,18 +52,17 @@ struct PACKED dnode_id {
     uint32_t offset;
 };
 
-struct PACKED dnode_ptr {
-    chr_t c;
-    struct dnode_id nid;
-};
-
-// Nodes may store word ids (wid), top-level word ids (twid)
+/* Nodes may store word ids (wid), top-level word ids (twid).  The node header
+ * is followed by the sorted child chars, the node ids of the children in the
+ * same order and finally the wid and twid if present.  Keeping the chars
+ * together lets a lookup compare several of them at a time.  Nodes of
+ * NS_ASCII_MIN and bigger start with the position + 1 of every ascii child */
 struct PACKED dnode {
     uint32_t type:4;
     uint32_t has_wid:1;
     uint32_t has_twid:1;
     uint32_t num_child:26;
-    struct dnode_ptr child[0];
+    uint8_t data[0];
 };
 
 /* First page stores dt_meta */
@@ -61,30 +77,93 @@ struct dt_meta {
     uint32_t free_nodes[NS_MAX*10];
 };
 
+// A node replaced by a copy, which readers may still be looking at
+struct retired_node {
+    uint32_t offset;
+    uint8_t type;
+    uint8_t hot;
+};
+
+/* Nodes retired by a write batch.  They go back to the free maps once
+ * dtrie_reclaim has been called on it and the readers running at the start
+ * of the next batch are done, or when the trie is freed */
+struct dtrie_garbage {
+    int refs;       // Held by the trie and by whoever calls dtrie_reclaim
+    int safe;       // Set by dtrie_reclaim
+    struct retired_node *nodes;
+    int num_nodes;
+    struct ftrie *frozen;   // Frozen trie the batch made out of date
+    struct dtrie_garbage *next;
+};
+
+/* Writers never change a node that readers can reach.  A node is copied
+ * before it is changed, unless it was allocated in the current write
+ * batch.  The writer root is published to readers at dtrie_write_end.
+ * Once frozen, readers use the frozen trie till a batch adds words */
 struct dtrie {
     int fd;
     uint8_t *map;
     char path[PATH_MAX];
     struct dt_meta *meta;
-    struct dnode *root; // The root node
+    struct dnode *root; // The root node writers work on
+    uint32_t read_offset;   // Offset of the root readers use
     struct bmap *freemaps;
     int freemap_dirty[NS_MAX];
-    pthread_rwlock_t trie_lock;
+    struct bmap *hotmaps;   // Free nodes in pages of the upper levels
+    int hotmap_dirty[NS_MAX];
+    khash_t(NODESET) *fresh;    // Nodes allocated in the current write batch
+    kvec_t(struct retired_node) retired;
+    struct dtrie_garbage *garbage;  // Retired nodes waiting to be reclaimed
+    struct ftrie *frozen;   // Copy of the published root, if frozen
+    bool written;           // Words were added in the current write batch
+    int twid_levels;        // Nodes added up to this depth get a twid
+    uint32_t file_pages;    // Pages allocated in the file, at least a page more than used
+    pthread_rwlock_t trie_lock; // Serializes writers
+    pthread_rwlock_t map_lock;  // Held by readers, so the map stays around
     pthread_rwlockattr_t rwlockattr;
 };
 
+/* Node utilization of a node type */
+struct dtrie_type_stats {
+    uint32_t node_size;
+    uint32_t pages;     // Pages split into nodes of this type
+    uint32_t used;
+    uint32_t free;      // Free to be reused
+    uint32_t retired;   // Waiting on readers to be freed
+};
+
+struct dtrie_stats {
+    uint32_t num_pages;     // Used, including the meta and freemap pages
+    uint32_t file_pages;
+    uint32_t word_count;
+    uint32_t tword_count;
+    uint32_t big_nodes;     // Nodes spanning several pages
+    struct dtrie_type_stats types[NS_MAX];
+};
+
+/* A word for dtrie_insert_batch, which sets its ids */
+struct dtrie_word {
+    const chr_t *chars;
+    int length;
+    uint32_t wid;
+    uint32_t twids[DT_MAX_LEVELS];  // Of the first nodes of the word, 0 for none
+    bool added;                     // The word is new to the trie
+};
+
 struct node_iter {
     struct dtrie *trie;
     struct dnode *node;
     struct dnode *parent;
     struct dnode_id nid;
     chr_t c;
+    int depth;
 };
 
 typedef struct search_term {
     word_t *word;
     uint8_t prefix:1;
     uint8_t typos:1;
+    uint8_t maxdist;    // Max typos allowed when typos is set
 } term_t;
 
 /**
@@ -92,22 +171,29 @@ typedef struct search_term {
  * in dtrie for a given shard index
  */
 typedef struct termresult {
-    uint32_t twid;
+    khash_t(WID2TYPOS) *twids;  // Twids whose words all match, with their distance
     khash_t(WID2TYPOS) *wordids;
 } termresult_t;
 
 struct dtrie *dtrie_new(const char *path, MDB_dbi dbi, MDB_txn *txn);
+struct dtrie *dtrie_new_memory(void);
 uint32_t dtrie_insert(struct dtrie *dt, const chr_t *str, int slen, uint32_t *twids);
 uint32_t dtrie_exists(struct dtrie *dt, const chr_t *str, int slen, uint32_t *twids);
+bool dtrie_insert_batch(struct dtrie *dt, struct dtrie_word **words, int num_words);
 void dump_dtrie_stats(struct dtrie *dt);
+void dtrie_get_stats(struct dtrie *dt, struct dtrie_stats *st);
+void dtrie_set_hugepages(bool enable);
 void dtrie_write_start(struct dtrie *dt);
 // TODO: Get rid of the lmdb here.. this should be handled outside of dtrie
-void dtrie_write_end(struct dtrie *dt, MDB_dbi dbi, MDB_txn *txn);
-void dtrie_free(struct dtrie *dt);
+struct dtrie_garbage *dtrie_write_end(struct dtrie *dt, MDB_dbi dbi, MDB_txn *txn);
+void dtrie_reclaim(struct dtrie_garbage *g);
+void dtrie_free(struct dtrie *dt, MDB_dbi dbi, MDB_txn *txn);
 struct termresult *dtrie_lookup_term(struct dtrie *dt, term_t *t);
 void termresult_free(struct termresult *t);
 uint32_t dtrie_lookup_exact(struct dtrie *dt, word_t *word);
 void dtrie_clear(struct dtrie *dt);
+bool dtrie_freeze(struct dtrie *dt);
+void dtrie_sizes(struct dtrie *dt, uint64_t *size, uint64_t *frozen_size);
 
 #endif
 
@@ -4,11 +4,12 @@
 
 static void (*filter_callback[F_ERROR+1]) (struct sindex *in, struct filter *, 
              MDB_txn *txn, struct bmap *docs);
+static void mem_num_filter(struct sindex *si, struct filter *f);
 
 static inline void bool_eq_filter(struct sindex *si, struct filter *f, 
         MDB_txn *txn, struct bmap *docs) {
     uint64_t bhid = IDPRIORITY(f->numval, f->s->i_priority);
-    f->fr_bmap = mbmap_load_bmap(txn, si->boolid2bmap_dbi, bhid);
+    f->fr_bmap = sindex_load_bmap(si, txn, SI_BOOLID2BMAP, bhid);
     if (!f->fr_bmap) {
         f->fr_bmap = bmap_new();
     }
@@ -24,7 +25,7 @@ static inline void str_eq_filter(struct sindex *si, struct filter *f,
     }
     uint32_t facet_id = farmhash32(f->strval, strlen(f->strval));
     uint64_t fhid = IDPRIORITY(facet_id, f->s->f_priority);
-    f->fr_bmap = mbmap_load_bmap(txn, si->facetid2bmap_dbi, fhid);
+    f->fr_bmap = sindex_load_bmap(si, txn, SI_FACETID2BMAP, fhid);
     if (!f->fr_bmap) {
         f->fr_bmap = bmap_new();
     }
@@ -32,7 +33,12 @@ static inline void str_eq_filter(struct sindex *si, struct filter *f,
 
 static inline void num_eq_filter(struct sindex *in, struct filter *f, 
         MDB_txn *txn, struct bmap *docs) {
-    f->fr_bmap = bmap_new();
+    if (in->mem) {
+        mem_num_filter(in, f);
+        return;
+    }
+    struct bmap_builder bb;
+    bmap_builder_init(&bb);
 
     // Iterate num_dbi for the particular field and add matching items
     MDB_val key, data;
@@ -47,12 +53,13 @@ static inline void num_eq_filter(struct sindex *in, struct filter *f,
         uint64_t *dd = data.mv_data;
         if (*kd == f->numval) {
             // Iterate till we got the same key and fill up the bitmap
-            bmap_add(f->fr_bmap, (uint32_t) *dd);
+            bmap_builder_add(&bb, (uint32_t) *dd);
         } else {
             break;
         }
     }
     mdb_cursor_close(cursor);
+    f->fr_bmap = bmap_builder_finish(&bb);
 }
 
 /* Equal filter, based on filter field type choose appropriate filter */
@@ -143,11 +150,41 @@ static inline bool check_double_oper(FILTER_TYPE f, double a, double b) {
     }
 }
 
+/* Number filters of an in memory index, which checks all its numbers as they
+ * are not sorted */
+static void mem_num_filter(struct sindex *si, struct filter *f) {
+    struct bmap_builder bb;
+    bmap_builder_init(&bb);
+    doc_numbers_t *nums = &si->mem->nums[f->s->i_priority];
+    for (size_t i = 0; i < kv_size(*nums); i++) {
+        double v = kv_A(*nums, i).value;
+        bool match;
+        if (f->type == F_RANGE) {
+            match = check_double_oper(f->numcmp2, v, f->numval2) &&
+                    check_double_oper(f->numcmp1, v, f->numval);
+        } else if (f->type == F_EQ || f->type == F_NE) {
+            match = (v == f->numval);
+        } else {
+            match = check_double_oper(f->type, v, f->numval);
+        }
+        if (match) {
+            bmap_builder_add(&bb, kv_A(*nums, i).docid);
+        }
+    }
+    f->fr_bmap = bmap_builder_finish(&bb);
+}
+
 static void num_filter(struct sindex *si, struct filter *f, MDB_txn *txn, struct bmap *docs) {
     if (f->field_type != F_NUMBER) return;
+    if (si->mem) {
+        mem_num_filter(si, f);
+        return;
+    }
 
     bool gt = (f->type == F_GT || f->type == F_GTE);
-    f->fr_bmap = bmap_new();
+    // Docids come out in value order, the builder sorts them once at the end
+    struct bmap_builder bb;
+    bmap_builder_init(&bb);
     double val = f->numval;
     MDB_val key, data;
     key.mv_size = sizeof(double);
@@ -161,16 +198,22 @@ static void num_filter(struct sindex *si, struct filter *f, MDB_txn *txn, struct
         double *kd = key.mv_data;
         uint64_t *dd = data.mv_data;
         if (check_double_oper(f->type, *kd, f->numval)) {
-            bmap_add(f->fr_bmap, (uint32_t) *dd);
+            bmap_builder_add(&bb, (uint32_t) *dd);
         } else break;
     }
     mdb_cursor_close(cursor);
+    f->fr_bmap = bmap_builder_finish(&bb);
 }
 
 static void num_range_filter(struct sindex *si, struct filter *f, MDB_txn *txn, struct bmap *docs) {
     if (f->field_type != F_NUMBER) return;
+    if (si->mem) {
+        mem_num_filter(si, f);
+        return;
+    }
 
-    f->fr_bmap = bmap_new();
+    struct bmap_builder bb;
+    bmap_builder_init(&bb);
     double val = f->numval2;
     MDB_val key, data;
     key.mv_size = sizeof(double);
@@ -185,12 +228,12 @@ static void num_range_filter(struct sindex *si, struct filter *f, MDB_txn *txn,
         uint64_t *dd = data.mv_data;
         if (check_double_oper(f->numcmp2, *kd, f->numval2)) {
             if (check_double_oper(f->numcmp1, *kd, f->numval)) {
-                bmap_add(f->fr_bmap, (uint32_t) *dd);
+                bmap_builder_add(&bb, (uint32_t) *dd);
             } else break;
         }
     }
-
     mdb_cursor_close(cursor);
+    f->fr_bmap = bmap_builder_finish(&bb);
 }
 
 
@@ -0,0 +1,406 @@
+/* Frozen Trie
+ * Compact read only trie built from a dtrie, see ftrie.h for the layout.
+ * Finding the children of a node takes a select on the louds bits, their
+ * siblings are then found by scanning for the next zero.
+ * */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include "platform.h"
+#include "ftrie.h"
+#include "mlog.h"
+
+#define WORD_BITS   64
+#define BLOCK_WORDS (FT_RANK_BLOCK / WORD_BITS)
+
+static inline uint32_t num_words(uint32_t num_bits) {
+    return num_bits / WORD_BITS + 1;
+}
+
+static inline uint32_t num_blocks(uint32_t num_bits) {
+    return num_bits / FT_RANK_BLOCK + 1;
+}
+
+static inline uint64_t align8(uint64_t offset) {
+    return (offset + 7) & ~7ULL;
+}
+
+/* Ones in [0, pos) */
+static uint32_t bits_rank(const struct ft_bits *b, uint32_t pos) {
+    uint32_t block = pos / FT_RANK_BLOCK;
+    uint32_t r = b->rank[block];
+    for (uint32_t w = block * BLOCK_WORDS; w < pos / WORD_BITS; w++) {
+        r += __builtin_popcountll(b->words[w]);
+    }
+    if (pos % WORD_BITS) {
+        r += __builtin_popcountll(b->words[pos / WORD_BITS] & ((1ULL << (pos % WORD_BITS)) - 1));
+    }
+    return r;
+}
+
+static inline bool bits_get(const struct ft_bits *b, uint32_t pos) {
+    return (b->words[pos / WORD_BITS] >> (pos % WORD_BITS)) & 1;
+}
+
+/* Position of the nth zero, n starting at 0 */
+static uint32_t bits_select0(const struct ft_bits *b, uint32_t n) {
+    uint32_t block = b->select[n / FT_SELECT_SAMPLE];
+    uint32_t blocks = num_blocks(b->num_bits);
+    // The sample only points to the block of an earlier zero
+    while (block + 1 < blocks && (block + 1) * FT_RANK_BLOCK - b->rank[block + 1] <= n) {
+        block++;
+    }
+    uint32_t zeros = block * FT_RANK_BLOCK - b->rank[block];
+    uint32_t w = block * BLOCK_WORDS;
+    for (;; w++) {
+        int c = __builtin_popcountll(~b->words[w]);
+        if (zeros + c > n) break;
+        zeros += c;
+    }
+    // Find the byte of the zero, then the zero in it
+    uint64_t z = ~b->words[w];
+    uint32_t pos = w * WORD_BITS;
+    uint32_t k = n - zeros;
+    for (;;) {
+        uint32_t c = __builtin_popcountll(z & 0xFF);
+        if (k < c) break;
+        k -= c;
+        z >>= 8;
+        pos += 8;
+    }
+    for (; k; k--) {
+        z &= z - 1;
+    }
+    return pos + __builtin_ctzll(z);
+}
+
+/* Position of the first zero at or after pos */
+static inline uint32_t bits_next0(const struct ft_bits *b, uint32_t pos) {
+    uint32_t w = pos / WORD_BITS;
+    uint64_t z = ~b->words[w] & (~0ULL << (pos % WORD_BITS));
+    while (!z) {
+        z = ~b->words[++w];
+    }
+    return w * WORD_BITS + __builtin_ctzll(z);
+}
+
+static void push_bit(uint64_t **words, size_t *n, size_t *m, uint32_t pos, int bit) {
+    if (pos % WORD_BITS == 0) {
+        if (*n == *m) {
+            *m = *m ? *m << 1 : 16;
+            *words = realloc(*words, *m * sizeof(uint64_t));
+        }
+        (*words)[(*n)++] = 0;
+    }
+    if (bit) {
+        (*words)[pos / WORD_BITS] |= 1ULL << (pos % WORD_BITS);
+    }
+}
+
+struct ftrie_builder *ftrie_builder_new(void) {
+    struct ftrie_builder *b = calloc(1, sizeof(struct ftrie_builder));
+    return b;
+}
+
+/* Adds the next node in breadth first order, starting with the root.  label
+ * is the char of the node under its parent */
+void ftrie_builder_add(struct ftrie_builder *b, chr_t label, int num_child, uint32_t wid, uint32_t twid) {
+    uint32_t id = b->num_nodes++;
+    for (int i = 0; i <= num_child; i++) {
+        push_bit(&b->louds.a, &b->louds.n, &b->louds.m, b->num_bits++, i < num_child);
+    }
+    push_bit(&b->widbits.a, &b->widbits.n, &b->widbits.m, id, wid != 0);
+    if (wid) {
+        kv_push(uint32_t, b->wids, wid);
+    }
+    if (twid) {
+        while (kv_size(b->twids) <= id) {
+            kv_push(uint32_t, b->twids, 0);
+        }
+        kv_A(b->twids, id) = twid;
+    }
+    kv_push(chr_t, b->labels, label);
+    if (label > b->max_label) {
+        b->max_label = label;
+    }
+}
+
+/* Bytes taken by the bits, with a spare word so the last partial word
+ * can always be read */
+static uint64_t bits_size(uint32_t num_bits) {
+    return align8(num_words(num_bits) * sizeof(uint64_t));
+}
+
+static uint64_t rank_size(uint32_t num_bits) {
+    return align8(num_blocks(num_bits) * sizeof(uint32_t));
+}
+
+/* Copies the bits and writes the rank samples after them */
+static void write_bits(uint8_t *map, uint64_t bits_offset, uint64_t rank_offset,
+                       const uint64_t *words, size_t n, uint32_t num_bits) {
+    uint64_t *out = (uint64_t *)(map + bits_offset);
+    memcpy(out, words, n * sizeof(uint64_t));
+    uint32_t *rank = (uint32_t *)(map + rank_offset);
+    uint32_t ones = 0;
+    for (uint32_t w = 0; w < num_words(num_bits); w++) {
+        if (w % BLOCK_WORDS == 0) {
+            rank[w / BLOCK_WORDS] = ones;
+        }
+        ones += __builtin_popcountll(out[w]);
+    }
+}
+
+/* Writes the frozen trie to a temporary file first and renames it to path,
+ * so path is either missing or complete */
+bool ftrie_builder_write(struct ftrie_builder *b, const char *path, uint32_t word_count,
+                         uint32_t tword_count) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+        return false;
+    }
+    uint32_t num_zeros = b->num_nodes;
+    struct ft_header h = {0};
+    h.magic = FT_MAGIC;
+    h.version = FT_VERSION;
+    h.word_count = word_count;
+    h.tword_count = tword_count;
+    h.num_nodes = b->num_nodes;
+    h.num_wids = kv_size(b->wids);
+    h.num_twids = kv_size(b->twids);
+    h.label_size = b->max_label <= 0xFF ? 1 : (b->max_label <= 0xFFFF ? 2 : 4);
+    h.louds = align8(sizeof(struct ft_header));
+    h.louds_rank = h.louds + bits_size(b->num_bits);
+    h.louds_select = h.louds_rank + rank_size(b->num_bits);
+    h.widbits = h.louds_select + align8((num_zeros / FT_SELECT_SAMPLE + 1) * sizeof(uint32_t));
+    h.widbits_rank = h.widbits + bits_size(b->num_nodes);
+    h.wids = h.widbits_rank + rank_size(b->num_nodes);
+    h.twids = h.wids + align8(h.num_wids * sizeof(uint32_t));
+    h.labels = h.twids + align8(h.num_twids * sizeof(uint32_t));
+    h.size = h.labels + align8((uint64_t)b->num_nodes * h.label_size);
+
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600);
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, h.size) != 0) {
+        goto write_error;
+    }
+    uint8_t *map = mmap(NULL, h.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        goto write_error;
+    }
+    memcpy(map, &h, sizeof(h));
+    write_bits(map, h.louds, h.louds_rank, b->louds.a, kv_size(b->louds), b->num_bits);
+    write_bits(map, h.widbits, h.widbits_rank, b->widbits.a, kv_size(b->widbits), b->num_nodes);
+
+    // Block of every FT_SELECT_SAMPLE th zero
+    uint32_t *select = (uint32_t *)(map + h.louds_select);
+    uint32_t zeros = 0;
+    for (uint32_t i = 0; i < b->num_bits; i++) {
+        if (!(kv_A(b->louds, i / WORD_BITS) & (1ULL << (i % WORD_BITS)))) {
+            if (zeros % FT_SELECT_SAMPLE == 0) {
+                select[zeros / FT_SELECT_SAMPLE] = i / FT_RANK_BLOCK;
+            }
+            zeros++;
+        }
+    }
+    if (h.num_wids) {
+        memcpy(map + h.wids, b->wids.a, h.num_wids * sizeof(uint32_t));
+    }
+    if (h.num_twids) {
+        memcpy(map + h.twids, b->twids.a, h.num_twids * sizeof(uint32_t));
+    }
+    for (uint32_t i = 0; i < b->num_nodes; i++) {
+        chr_t c = kv_A(b->labels, i);
+        switch (h.label_size) {
+            case 1:
+                map[h.labels + i] = c;
+                break;
+            case 2:
+                ((uint16_t *)(map + h.labels))[i] = c;
+                break;
+            default:
+                ((uint32_t *)(map + h.labels))[i] = c;
+                break;
+        }
+    }
+    bool synced = msync(map, h.size, MS_SYNC) == 0;
+    munmap(map, h.size);
+    if (!synced || rename(tmp, path) != 0) {
+        goto write_error;
+    }
+    close(fd);
+    return true;
+
+write_error:
+    close(fd);
+    unlink(tmp);
+    return false;
+}
+
+void ftrie_builder_free(struct ftrie_builder *b) {
+    kv_destroy(b->louds);
+    kv_destroy(b->widbits);
+    kv_destroy(b->wids);
+    kv_destroy(b->twids);
+    kv_destroy(b->labels);
+    free(b);
+}
+
+static bool section_ok(const struct ft_header *h, uint64_t offset, uint64_t size) {
+    return offset >= sizeof(struct ft_header) && offset <= h->size && size <= h->size - offset;
+}
+
+/* Maps a frozen trie, returns NULL if there is none or it is not usable */
+struct ftrie *ftrie_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct ft_header)) {
+        close(fd);
+        return NULL;
+    }
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the file is closed
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    const struct ft_header *h = (const struct ft_header *)map;
+    uint32_t n = h->num_nodes;
+    if (h->magic != FT_MAGIC || h->version != FT_VERSION || h->size != st.st_size || n == 0
+        || (h->label_size != 1 && h->label_size != 2 && h->label_size != 4)
+        // A node has a 0 and every node but the root a 1
+        || !section_ok(h, h->louds, bits_size(2 * n - 1))
+        || !section_ok(h, h->louds_rank, rank_size(2 * n - 1))
+        || !section_ok(h, h->louds_select, (n / FT_SELECT_SAMPLE + 1) * sizeof(uint32_t))
+        || !section_ok(h, h->widbits, bits_size(n))
+        || !section_ok(h, h->widbits_rank, rank_size(n))
+        || !section_ok(h, h->wids, (uint64_t)h->num_wids * sizeof(uint32_t))
+        || !section_ok(h, h->twids, (uint64_t)h->num_twids * sizeof(uint32_t))
+        || !section_ok(h, h->labels, (uint64_t)n * h->label_size)) {
+        M_ERR("Invalid frozen trie %s", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    struct ftrie *f = calloc(1, sizeof(struct ftrie));
+    f->map = map;
+    f->size = st.st_size;
+    f->header = h;
+    f->louds.words = (const uint64_t *)(map + h->louds);
+    f->louds.num_bits = 2 * n - 1;
+    f->louds.rank = (const uint32_t *)(map + h->louds_rank);
+    f->louds.select = (const uint32_t *)(map + h->louds_select);
+    f->louds.num_zeros = n;
+    f->widbits.words = (const uint64_t *)(map + h->widbits);
+    f->widbits.num_bits = n;
+    f->widbits.rank = (const uint32_t *)(map + h->widbits_rank);
+    f->wids = (const uint32_t *)(map + h->wids);
+    f->twids = (const uint32_t *)(map + h->twids);
+    f->labels = map + h->labels;
+    return f;
+}
+
+void ftrie_free(struct ftrie *f) {
+    if (f) {
+        munmap(f->map, f->size);
+        free(f);
+    }
+}
+
+chr_t ftrie_label(const struct ftrie *f, uint32_t id) {
+    switch (f->header->label_size) {
+        case 1:
+            return f->labels[id];
+        case 2:
+            return ((const uint16_t *)f->labels)[id];
+        default:
+            return ((const uint32_t *)f->labels)[id];
+    }
+}
+
+uint32_t ftrie_wid(const struct ftrie *f, uint32_t id) {
+    if (bits_get(&f->widbits, id)) {
+        return f->wids[bits_rank(&f->widbits, id)];
+    }
+    return 0;
+}
+
+uint32_t ftrie_twid(const struct ftrie *f, uint32_t id) {
+    return id < f->header->num_twids ? f->twids[id] : 0;
+}
+
+/* Fills the span of node id */
+static inline void node_span(const struct ftrie *f, uint32_t id, struct fnode *n) {
+    n->id = id;
+    n->start = id ? bits_select0(&f->louds, id - 1) + 1 : 0;
+    n->end = bits_next0(&f->louds, n->start);
+}
+
+void ftrie_root(const struct ftrie *f, struct fnode *n) {
+    node_span(f, 0, n);
+}
+
+/* Sets c to the first child of n and returns the number of children */
+int ftrie_first_child(const struct ftrie *f, const struct fnode *n, struct fnode *c) {
+    int num_child = n->end - n->start;
+    if (num_child) {
+        // Every node before n has ended with a 0, the rest are its 1s
+        node_span(f, n->start - n->id + 1, c);
+    }
+    return num_child;
+}
+
+/* Moves c to its next sibling, the caller knows how many there are */
+void ftrie_next_child(const struct ftrie *f, struct fnode *c) {
+    c->id++;
+    c->start = c->end + 1;
+    c->end = bits_next0(&f->louds, c->start);
+}
+
+bool ftrie_find_child(const struct ftrie *f, const struct fnode *n, chr_t c, struct fnode *child) {
+    uint32_t first = n->start - n->id + 1;
+    int low = 0, high = (int)(n->end - n->start) - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        chr_t mc = ftrie_label(f, first + middle);
+        if (mc < c) {
+            low = middle + 1;
+        } else if (mc > c) {
+            high = middle - 1;
+        } else {
+            node_span(f, first + middle, child);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Wids of the nodes [first, last), they are stored in node id order */
+const uint32_t *ftrie_range_wids(const struct ftrie *f, uint32_t first, uint32_t last, int *count) {
+    uint32_t from = bits_rank(&f->widbits, first);
+    *count = bits_rank(&f->widbits, last) - from;
+    return f->wids + from;
+}
+
+/* Id of the first child of node id, or where it would be */
+static inline uint32_t first_child_id(const struct ftrie *f, uint32_t id) {
+    uint32_t start = id ? bits_select0(&f->louds, id - 1) + 1 : 0;
+    return start - id + 1;
+}
+
+/* Moves the nodes [first, last) to all their children, which are the
+ * nodes of the next level under them.  Walks a subtree a level at a time */
+void ftrie_range_children(const struct ftrie *f, uint32_t *first, uint32_t *last) {
+    uint32_t next_first = first_child_id(f, *first);
+    *last = first_child_id(f, *last);
+    *first = next_first;
+}
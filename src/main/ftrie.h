@@ -0,0 +1,105 @@
+/* Frozen Trie
+ * A read only, compact copy of a dtrie.  The shape of the trie is a LOUDS
+ * bit vector, every node in breadth first order writes a 1 for each child
+ * followed by a 0.  Children of a node are then consecutive node ids and
+ * everything else is a plain array indexed by node id.  The root is node 0.
+ * */
+#ifndef __FTRIE_H
+#define __FTRIE_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include "word.h"
+#include "kvec.h"
+
+#define FT_MAGIC    0xF2EEF2EE
+#define FT_VERSION  0x00000001
+// A rank sample is kept for every block of these many bits
+#define FT_RANK_BLOCK   512
+// A select sample is kept for every these many zeros
+#define FT_SELECT_SAMPLE    256
+
+/* Header of a frozen trie file, the sections follow in the order of
+ * their offsets, each 8 byte aligned */
+struct ft_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t word_count;    // Of the dtrie it was built from
+    uint32_t tword_count;
+    uint32_t num_nodes;
+    uint32_t num_wids;      // Nodes with a wid
+    uint32_t num_twids;     // Nodes below this id may have a twid
+    uint32_t label_size;    // Bytes per child char, 1, 2 or 4
+    uint64_t size;          // Of the whole file
+    uint64_t louds;         // Offsets of the sections
+    uint64_t louds_rank;
+    uint64_t louds_select;
+    uint64_t widbits;
+    uint64_t widbits_rank;
+    uint64_t wids;
+    uint64_t twids;
+    uint64_t labels;
+};
+
+/* A bit vector with rank samples, and select samples for the zeros if
+ * it needs them */
+struct ft_bits {
+    const uint64_t *words;
+    uint32_t num_bits;
+    const uint32_t *rank;   // Ones before every block
+    const uint32_t *select; // Block of every FT_SELECT_SAMPLE th zero
+    uint32_t num_zeros;
+};
+
+struct ftrie {
+    uint8_t *map;
+    uint64_t size;
+    const struct ft_header *header;
+    struct ft_bits louds;
+    struct ft_bits widbits;
+    const uint32_t *wids;
+    const uint32_t *twids;
+    const uint8_t *labels;
+};
+
+/* A node and its span in the louds bits, the ones of its children are at
+ * [start, end) and the 0 ending them is at end */
+struct fnode {
+    uint32_t id;
+    uint32_t start;
+    uint32_t end;
+};
+
+/* Collects the nodes of a trie in breadth first order and writes them out
+ * as a frozen trie */
+struct ftrie_builder {
+    kvec_t(uint64_t) louds;
+    uint32_t num_bits;
+    kvec_t(uint64_t) widbits;
+    kvec_t(uint32_t) wids;
+    kvec_t(uint32_t) twids;
+    kvec_t(chr_t) labels;
+    chr_t max_label;
+    uint32_t num_nodes;
+};
+
+struct ftrie_builder *ftrie_builder_new(void);
+void ftrie_builder_add(struct ftrie_builder *b, chr_t label, int num_child, uint32_t wid, uint32_t twid);
+bool ftrie_builder_write(struct ftrie_builder *b, const char *path, uint32_t word_count,
+                         uint32_t tword_count);
+void ftrie_builder_free(struct ftrie_builder *b);
+
+struct ftrie *ftrie_open(const char *path);
+void ftrie_free(struct ftrie *f);
+
+void ftrie_root(const struct ftrie *f, struct fnode *n);
+int ftrie_first_child(const struct ftrie *f, const struct fnode *n, struct fnode *c);
+void ftrie_next_child(const struct ftrie *f, struct fnode *c);
+bool ftrie_find_child(const struct ftrie *f, const struct fnode *n, chr_t c, struct fnode *child);
+chr_t ftrie_label(const struct ftrie *f, uint32_t id);
+uint32_t ftrie_wid(const struct ftrie *f, uint32_t id);
+uint32_t ftrie_twid(const struct ftrie *f, uint32_t id);
+const uint32_t *ftrie_range_wids(const struct ftrie *f, uint32_t first, uint32_t last, int *count);
+void ftrie_range_children(const struct ftrie *f, uint32_t *first, uint32_t *last);
+
+#endif
@@ -3,16 +3,12 @@
 
 #include "query.h"
 
-/* Used to track start and end position of char * for every unicode code point */
-typedef struct char_se {
-    uint32_t start;
-    uint32_t end;
-} char_se_t;
-
-/* A token contains a word and start and end positions for every unicode cp in the word */
+/* A token of the string being highlighted.  Its chars and offsets are in the
+ * token stream of the string */
 typedef struct token {
-    word_t *word;
-    kvec_t(struct char_se*) se;
+    word_t word;
+    uint32_t start;         // Byte offset of the token in the string
+    const uint32_t *ends;   // Byte offset every char of the token ends at
     bool is_match;
     uint8_t match_len;
 } token_t;
@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <h2o.h>
 #include "index.h"
 #include "utils.h"
@@ -181,12 +182,65 @@ static void index_add_documents(struct index *in, json_t *j) {
     }
 }
 
+/* Merges the segments of all shards of an index, once the merges queued
+ * for them are done */
+static void index_merge_segments(struct index *in) {
+    for (int i = 0; i < in->num_shards; i++) {
+        struct shard *s = kv_A(in->shards, i);
+        wait_for_workers(&s->segment->merges);
+        shard_merge_segment(s);
+    }
+}
+
+static void index_merge_job(void *data) {
+    struct shard *s = data;
+    shard_merge_segment(s);
+    worker_done(&s->segment->merges);
+}
+
+/* Queues a merge of the segment of a shard on the merge pool, unless one is
+ * queued already.  Merges are queued by the index job thread and the app
+ * timer */
+static void index_queue_merge(struct index *in, struct shard *s) {
+    if (!segment_claim_merge(s->segment)) return;
+    pthread_mutex_lock(&in->mpool_lock);
+    if (!in->mpool) {
+        in->mpool = threadpool_create(1, JOB_QUEUE_LEN, 0);
+    }
+    int rc = threadpool_add(in->mpool, index_merge_job, s, 0);
+    pthread_mutex_unlock(&in->mpool_lock);
+    if (rc != 0) {
+        index_merge_job(s);
+    }
+}
+
+/* Queues merges of the segments whose oldest write is SEGMENT_MERGE_SECS old,
+ * so a trickle of writes is merged in batches too */
+void index_merge_aged_segments(struct index *in) {
+    for (int i = 0; i < in->num_shards; i++) {
+        struct shard *s = kv_A(in->shards, i);
+        if (segment_aged(s->segment)) {
+            index_queue_merge(in, s);
+        }
+    }
+}
+
+/* Deletes, replaces and updates of a single document are written to the segment
+ * of its shard.  Everything else works with the shard data and index directly */
+static inline bool is_segment_job(JOB_TYPE type) {
+    return type == JOB_DELETE || type == JOB_REPLACE || type == JOB_UPDATE;
+}
+
 /* This is where any modifications to the index happen.  It happens one at a time
  * no two index jobs can ever run simultaneously and is controlled by the threadpool */
 static void index_work_job(void *data) {
     struct in_job *job = data;
     struct index *in = job->index;
     if (in) {
+        // Writes still in the segments happened before this job
+        if (!is_segment_job(job->type)) {
+            index_merge_segments(in);
+        }
         switch (job->type) {
             case JOB_ADD:
                 index_add_documents(in, job->j);
@@ -206,13 +260,39 @@ static void index_work_job(void *data) {
                 shard_update_document(s, job->j, job->j2);
                 }
                 break;
+            case JOB_BULK: {
+                struct timeval start, stop;
+                gettimeofday(&start, NULL);
+                index_add_documents(in, job->j);
+                gettimeofday(&stop, NULL);
+                job->batch->took = timedifference_msec(start, stop);
+                M_INFO("Bulk batch from line %lu committed %d documents to %s in %.1fms",
+                        job->batch->first_line, job->batch->num_docs, in->name, job->batch->took);
+                }
+                break;
             default:
                 break;
         }
+        if (is_segment_job(job->type)) {
+            // Segments are merged in the background once they hold enough
+            // writes, or by the app timer once their writes are old enough.
+            // Writes arriving while a merge runs are merged together next.  A
+            // full segment holds up the jobs till it is merged
+            struct shard *s = kv_A(in->shards, job->id);
+            int written = segment_num_written(s->segment);
+            if (written >= SEGMENT_MERGE_DOCS) {
+                index_queue_merge(in, s);
+            }
+            if (written >= SEGMENT_MAX_DOCS) {
+                wait_for_workers(&s->segment->merges);
+            }
+        }
         ATOMIC_DEC(&in->job_count);
     }
     if (job->j) json_decref(job->j);
     if (job->j2) json_decref(job->j2);
+    // The bulk load waiting on the batch owns it
+    if (job->batch) worker_done(job->batch->worker);
     free(job);
 }
 
@@ -231,10 +311,12 @@ static int index_add_job(struct index *in, struct in_job *job) {
             UNLOCK(&in->wpool_lock);
         }
     }
+    // Counted before it is added, so a running job never sees a count
+    // lower than the jobs queued
+    ATOMIC_INC(&in->job_count);
     int r = threadpool_add(in->wpool, index_work_job, job, 0);
-    // Job added successfully
-    if (r == 0) {
-        ATOMIC_INC(&in->job_count);
+    if (r != 0) {
+        ATOMIC_DEC(&in->job_count);
     }
     return r;
 }
@@ -305,16 +387,173 @@ static char *index_data_callback(h2o_req_t *req, void *data) {
     return api_success(req);
 }
 
+/* Queues a batch of a bulk load as a job.  Once BULK_MAX_PENDING batches are
+ * queued this waits for the oldest to be committed, and a full job queue is
+ * waited out too, which keeps the documents parsed ahead bounded */
+static bool index_bulk_add_batch(struct index *in, struct worker *worker,
+                                 json_t *docs, struct bulk_batch *batch) {
+    wait_for_workers_below(worker, BULK_MAX_PENDING);
+    struct in_job *job = in_job_new(in, JOB_BULK);
+    job->j = docs;
+    job->batch = batch;
+    batch->worker = worker;
+    batch->num_docs = json_array_size(docs);
+    worker_add(worker);
+    int r;
+    while ((r = index_add_job(in, job)) == threadpool_queue_full) {
+        usleep(1000);
+    }
+    if (r != 0) {
+        M_ERR("Failed to queue a bulk batch of %s %d", in->name, r);
+        worker_done(worker);
+        json_decref(docs);
+        free(job);
+        return false;
+    }
+    return true;
+}
+
+/* A bulk load running on bulk_pool */
+struct bulk_load {
+    struct index *in;
+    struct api_async *async;
+};
+
+/* Documents are bulk loaded as newline delimited json, one document per line.
+ * Documents are parsed a line at a time and committed in batches of
+ * BULK_BATCH_DOCS as JOB_BULK jobs, so the whole load is never parsed at once.
+ * Unlike the other document jobs, the response is sent once all batches are
+ * committed, with the progress of every batch and the lines which failed to
+ * parse.  The load stops early if the client goes away or the index is closed */
+static void index_bulk_load(void *data) {
+    struct bulk_load *bl = data;
+    struct index *in = bl->in;
+    struct worker worker;
+    worker_init(&worker, 0);
+    kvec_t(struct bulk_batch *) batches;
+    kv_init(batches);
+
+    json_t *jerrors = json_array();
+    size_t num_errors = 0;
+    size_t num_docs = 0;
+    bool failed = false;
+
+    json_t *docs = json_array();
+    size_t first_line = 1;
+    size_t pos = 0;
+    bool done = false;
+    for (size_t line = 1; !done && !failed; line++) {
+        // The body belongs to the request, which is only read while locked
+        h2o_req_t *req = api_async_lock(bl->async);
+        if (!req || in->bulk_stop) {
+            api_async_unlock(bl->async);
+            M_INFO("Bulk load of %s stopped at line %lu", in->name, line);
+            failed = true;
+            break;
+        }
+        const char *p = req->entity.base + pos;
+        const char *end = req->entity.base + req->entity.len;
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        pos = eol + 1 - req->entity.base;
+        done = eol + 1 >= end;
+        const char *c = p;
+        while (c < eol && isspace((unsigned char)*c)) c++;
+        bool blank = c == eol;
+        json_t *j = NULL;
+        json_error_t error;
+        if (!blank) {
+            j = json_loadb(c, eol - c, JSON_ALLOW_NUL, &error);
+        }
+        api_async_unlock(bl->async);
+
+        if (j && json_is_object(j)) {
+            if (json_array_size(docs) == 0) first_line = line;
+            json_array_append_new(docs, j);
+            num_docs++;
+        } else if (!blank) {
+            if (num_errors < BULK_MAX_ERRORS) {
+                json_t *je = json_object();
+                json_object_set_new(je, J_B_LINE, json_integer(line));
+                json_object_set_new(je, J_B_MESSAGE, json_string(j ? "Not a document" : error.text));
+                json_array_append_new(jerrors, je);
+            }
+            num_errors++;
+            if (j) json_decref(j);
+        }
+        // Queue every full batch, and whatever is left once the body is done
+        if (json_array_size(docs) == BULK_BATCH_DOCS || (done && json_array_size(docs))) {
+            struct bulk_batch *batch = calloc(1, sizeof(struct bulk_batch));
+            batch->first_line = first_line;
+            kv_push(struct bulk_batch *, batches, batch);
+            failed = !index_bulk_add_batch(in, &worker, docs, batch);
+            docs = json_array();
+        }
+    }
+    json_decref(docs);
+    wait_for_workers(&worker);
+    worker_destroy(&worker);
+
+    json_t *j = json_object();
+    json_object_set_new(j, J_R_SUCCESS, json_boolean(!failed && num_errors == 0));
+    json_object_set_new(j, J_NUM_DOCS, json_integer(num_docs));
+    json_t *jbatches = json_array();
+    for (int i = 0; i < kv_size(batches); i++) {
+        struct bulk_batch *batch = kv_A(batches, i);
+        json_t *jb = json_object();
+        json_object_set_new(jb, J_B_FIRST_LINE, json_integer(batch->first_line));
+        json_object_set_new(jb, J_NUM_DOCS, json_integer(batch->num_docs));
+        json_object_set_new(jb, J_R_TOOK, json_integer(batch->took + 0.99));
+        json_array_append_new(jbatches, jb);
+        free(batch);
+    }
+    kv_destroy(batches);
+    json_object_set_new(j, J_B_BATCHES, jbatches);
+    json_object_set_new(j, J_B_NUM_ERRORS, json_integer(num_errors));
+    json_object_set_new(j, J_B_ERRORS, jerrors);
+    char *response = json_dumps(j, JSON_PRESERVE_ORDER|JSON_INDENT(4));
+    json_decref(j);
+    api_async_respond(bl->async, failed ? HTTP_SERVER_ERROR : HTTP_OK, response);
+    free(bl);
+    worker_done(&in->bulk_loads);
+}
+
+/* Bulk loads wait on their batches, so they run on bulk_pool and respond from
+ * there, instead of holding up the thread serving requests */
+static char *index_bulk_callback(h2o_req_t *req, void *data) {
+    struct index *in = data;
+    struct bulk_load *bl = malloc(sizeof(struct bulk_load));
+    bl->in = in;
+    bl->async = api_async_new(req);
+    worker_add(&in->bulk_loads);
+    if (threadpool_add(bulk_pool, index_bulk_load, bl, 0) != 0) {
+        worker_done(&in->bulk_loads);
+        api_async_respond(bl->async, HTTP_TOO_MANY, strdup(J_FAILURE));
+        free(bl);
+    }
+    return NULL;
+}
+
+/* Jobs queued for an index, including merges of segments running in the
+ * background */
+static int index_num_jobs(struct index *in) {
+    int num_jobs = in->job_count;
+    for (int i = 0; i < in->num_shards; i++) {
+        num_jobs += kv_A(in->shards, i)->segment->merges.pending;
+    }
+    return num_jobs;
+}
+
 static json_t *index_get_info_json(struct index *in) {
     json_t *j = json_object();
     json_object_set_new(j, J_NAME, json_string(in->name));
-    json_object_set_new(j, J_NUM_JOBS, json_integer(in->job_count));
+    json_object_set_new(j, J_NUM_JOBS, json_integer(index_num_jobs(in)));
     json_t *ja = json_array();
     size_t total_docs = 0;
     for (int i = 0; i < in->num_shards; i++) {
         struct shard *s = kv_A(in->shards, i);
         json_t *js = json_object();
-        size_t shard_docs = bmap_cardinality(s->sdata->used_bmap);
+        size_t shard_docs = shard_num_documents(s);
         char shard_name[32];
         snprintf(shard_name, sizeof(shard_name), "shard-%d", i);
         json_object_set_new(js, J_NAME, json_string(shard_name));
@@ -331,13 +570,13 @@ static json_t *index_get_info_json(struct index *in) {
 static json_t *index_get_stats_json(struct index *in) {
     json_t *j = json_object();
     json_object_set_new(j, J_NAME, json_string(in->name));
-    json_object_set_new(j, J_NUM_JOBS, json_integer(in->job_count));
+    json_object_set_new(j, J_NUM_JOBS, json_integer(index_num_jobs(in)));
     json_t *ja = json_array();
     size_t total_docs = 0;
     for (int i = 0; i < in->num_shards; i++) {
         struct shard *s = kv_A(in->shards, i);
         json_t *js = json_object();
-        size_t shard_docs = bmap_cardinality(s->sdata->used_bmap);
+        size_t shard_docs = shard_num_documents(s);
         char shard_name[32];
         snprintf(shard_name, sizeof(shard_name), "shard-%d", i);
         json_object_set_new(js, J_NAME, json_string(shard_name));
@@ -573,6 +812,19 @@ static const char *parse_query_settings(struct json_t *j, struct query_cfg *qcfg
         if (strcmp(J_S_FULLSCAN_THRES, key) == 0) {
             qcfg->full_scan_threshold = json_number_value(value);
         }
+        // minWordSizefor1Typo / minWordSizefor2Typos, also allowed per query
+        if (strcmp(J_S_MIN_WORD_1TYPO, key) == 0) {
+            if (!json_is_integer(value) || json_integer_value(value) <= LEVLIMIT || json_integer_value(value) > 255) {
+                return "minWordSizefor1Typo should be a number between 4 and 255";
+            }
+            qcfg->min_word_1typo = json_integer_value(value);
+        }
+        if (strcmp(J_S_MIN_WORD_2TYPOS, key) == 0) {
+            if (!json_is_integer(value) || json_integer_value(value) <= LEVLIMIT || json_integer_value(value) > 255) {
+                return "minWordSizefor2Typos should be a number between 4 and 255";
+            }
+            qcfg->min_word_2typos = json_integer_value(value);
+        }
         // getFields
         if (strcmp(J_S_GET_FIELDS, key) == 0 ) {
             if (json_is_array(value)) {
@@ -626,6 +878,9 @@ static const char *parse_query_settings(struct json_t *j, struct query_cfg *qcfg
     if (qcfg->full_scan_threshold < MAX_HITS_LIMIT * 5) {
         return "Full scan threshold cannot be less than 5000";
     }
+    if (qcfg->min_word_1typo > qcfg->min_word_2typos) {
+        return "minWordSizefor1Typo cannot be more than minWordSizefor2Typos";
+    }
     return NULL;
 }
 
@@ -641,6 +896,10 @@ static const char *index_load_json_settings(struct index *in, json_t *j, int *c)
         if ((strcmp(J_S_FACETFIELDS, key) == 0) && !is_json_string_array(value)) {
             return "facetFields should be a string array";
         }
+        if ((strcmp(J_S_PREFIX_LEVELS, key) == 0) && (!json_is_integer(value) ||
+                json_integer_value(value) < 1 || json_integer_value(value) > DT_MAX_LEVELS)) {
+            return "prefixLevels should be a number between 1 and 8";
+        }
         if ((strcmp(J_S_HITS_PER_PAGE, key) == 0) && !json_is_number(value)) {
             return "hitsPerPage should be a number";
         }
@@ -673,6 +932,22 @@ static const char *index_load_json_settings(struct index *in, json_t *j, int *c)
         if ((strcmp(J_S_HIGHLIGHT_SOURCE, key) == 0) && !json_is_boolean(value)) {
             return "highlightFields should be a boolean";
         }
+        if ((strcmp(J_S_MIN_WORD_1TYPO, key) == 0) && (!json_is_integer(value) ||
+                json_integer_value(value) <= LEVLIMIT || json_integer_value(value) > 255)) {
+            return "minWordSizefor1Typo should be a number between 4 and 255";
+        }
+        if ((strcmp(J_S_MIN_WORD_2TYPOS, key) == 0) && (!json_is_integer(value) ||
+                json_integer_value(value) <= LEVLIMIT || json_integer_value(value) > 255)) {
+            return "minWordSizefor2Typos should be a number between 4 and 255";
+        }
+    }
+    // Either typo word size can be changed alone, check them against the current one
+    json_t *jtypo1 = json_object_get(j, J_S_MIN_WORD_1TYPO);
+    json_t *jtypo2 = json_object_get(j, J_S_MIN_WORD_2TYPOS);
+    int min_word_1typo = jtypo1 ? json_integer_value(jtypo1) : in->cfg.qcfg->min_word_1typo;
+    int min_word_2typos = jtypo2 ? json_integer_value(jtypo2) : in->cfg.qcfg->min_word_2typos;
+    if (min_word_1typo > min_word_2typos) {
+        return "minWordSizefor1Typo cannot be more than minWordSizefor2Typos";
     }
     // Now do the actual parsing of settings
     int changed = 0;
@@ -683,6 +958,10 @@ static const char *index_load_json_settings(struct index *in, json_t *j, int *c)
         if (strcmp(J_S_FACETFIELDS, key) == 0) {
             changed |= cfg_set_list_fields(&in->cfg.facet_fields, value);
         }
+        // Only prefixes added to the trie afterwards get the new depth
+        if (strcmp(J_S_PREFIX_LEVELS, key) == 0) {
+            in->cfg.prefix_levels = json_integer_value(value);
+        }
     }
     *c = changed;
 
@@ -744,6 +1023,9 @@ static char *index_settings_to_json(const struct index *in) {
     json_object_set_new(jo, J_S_MAX_FACET_RESULTS, json_integer(qcfg->max_facet_results));
     json_object_set_new(jo, J_S_FULLSCAN, json_boolean(qcfg->full_scan));
     json_object_set_new(jo, J_S_FULLSCAN_THRES, json_integer(qcfg->full_scan_threshold));
+    json_object_set_new(jo, J_S_MIN_WORD_1TYPO, json_integer(qcfg->min_word_1typo));
+    json_object_set_new(jo, J_S_MIN_WORD_2TYPOS, json_integer(qcfg->min_word_2typos));
+    json_object_set_new(jo, J_S_PREFIX_LEVELS, json_integer(in->cfg.prefix_levels));
 
     // Save rules
     json_t *jr = json_array();
@@ -860,6 +1142,28 @@ static char *index_stats_callback(h2o_req_t *req, void *data) {
     return response;
 }
 
+/* Freezes the trie of every shard, a shard which is being written to is not
+ * frozen */
+static char *index_freeze_callback(h2o_req_t *req, void *data) {
+    struct index *in = data;
+    json_t *j = json_object();
+    json_object_set_new(j, J_NAME, json_string(in->name));
+    json_t *ja = json_array();
+    for (int i = 0; i < in->num_shards; i++) {
+        struct shard *s = kv_A(in->shards, i);
+        json_t *js = json_object();
+        char shard_name[32];
+        snprintf(shard_name, sizeof(shard_name), "shard-%d", i);
+        json_object_set_new(js, J_NAME, json_string(shard_name));
+        shard_freeze(s, js);
+        json_array_append_new(ja, js);
+    }
+    json_object_set_new(j, J_SHARDS, ja);
+    char *response = json_dumps(j, JSON_PRESERVE_ORDER|JSON_INDENT(4));
+    json_decref(j);
+    return response;
+}
+
 static char *index_mapping_callback(h2o_req_t *req, void *data) {
     struct index *in = data;
     char *response = mapping_to_json_str(in->mapping);
@@ -882,6 +1186,10 @@ static char *index_delete_callback(h2o_req_t *req, void *data) {
 }
 
 static void index_destroy_threadpool(struct index *in) {
+    // Bulk loads queue jobs till they are done, so they are stopped first
+    in->bulk_stop = true;
+    wait_for_workers(&in->bulk_loads);
+    in->bulk_stop = false;
     WRLOCK(&in->wpool_lock);
     if (in->wpool) {
         M_INFO("Destroying threadpool for index %s", in->name);
@@ -890,6 +1198,13 @@ static void index_destroy_threadpool(struct index *in) {
         in->wpool = NULL;
     }
     UNLOCK(&in->wpool_lock);
+    // The job thread is gone, merges queued from now on start the pool again
+    pthread_mutex_lock(&in->mpool_lock);
+    if (in->mpool) {
+        threadpool_destroy(in->mpool, threadpool_graceful);
+        in->mpool = NULL;
+    }
+    pthread_mutex_unlock(&in->mpool_lock);
 }
 
 // TODO: This should be a clear job as requests may be in progress?
@@ -1268,9 +1583,13 @@ const struct api_path apipaths[] = {
     {"DELETE", NULL, KA_DELETE, index_delete_callback},
     // Clear Index
     {"POST", URL_CLEAR, KA_DELETE, index_clear_callback},
+    // Freeze the tries of the index
+    {"POST", URL_FREEZE, KA_S_CONFIG, index_freeze_callback},
     // Bulk
     // Query Index
     {"POST", URL_QUERY, KA_QUERY, index_query_callback},
+    // Bulk load newline delimited documents
+    {"POST", URL_BULK, KA_ADD, index_bulk_callback},
     // Get a single document
     {"GET", URL_MULTI, KA_BROWSE, index_get_document_callback},
     // delete document
@@ -1367,6 +1686,8 @@ static struct query_cfg *query_config_new(void) {
     qcfg->hits_per_page = DEF_HITS_PER_PAGE;
     qcfg->max_facet_results = DEF_FACET_RESULTS;
     qcfg->full_scan_threshold = DEF_FULLSCAN_THRES;
+    qcfg->min_word_1typo = DEF_MIN_WORD_1TYPO;
+    qcfg->min_word_2typos = DEF_MIN_WORD_2TYPOS;
     qcfg->max_hits = DEF_MAX_HITS;
     qcfg->rank_by = -1;         // Rank by no fields
     qcfg->rank_sort = false;    // Apply ranking finally
@@ -1385,6 +1706,8 @@ struct index *index_new(const char *name, struct app *a, int num_shards) {
     in->num_shards = num_shards;
     in->time_created = get_utc_seconds();
     in->fctx = flakeid_ctx_create_with_spoof(NULL);
+    worker_init(&in->bulk_loads, 0);
+    pthread_mutex_init(&in->mpool_lock, NULL);
     in->mapping = mapping_new(in);
     kv_init(in->shards);
 
@@ -1392,6 +1715,7 @@ struct index *index_new(const char *name, struct app *a, int num_shards) {
     in->cfg.configured = false;
     kv_init(in->cfg.index_fields);
     kv_init(in->cfg.facet_fields);
+    in->cfg.prefix_levels = DEF_PREFIX_LEVELS;
 
     // Setup default query config
     in->cfg.qcfg = query_config_new();
@@ -1423,6 +1747,11 @@ struct index *index_new(const char *name, struct app *a, int num_shards) {
         update_shard_mappings(in);
     }
 
+    // Writes the last run did not merge are merged before anything is served
+    for (int i = 0; i < in->num_shards; i++) {
+        shard_replay_segment(kv_A(in->shards, i));
+    }
+
     // Register the handlers for the app
     setup_index_handlers(in, a->appid, a->apikey, true);
 
@@ -1450,6 +1779,8 @@ void index_free(struct index *in) {
     setup_index_handlers(in, in->app->appid, in->app->apikey, false);
     // Destroy the threadpool if running
     index_destroy_threadpool(in);
+    // Writes still in the segments are not lost
+    index_merge_segments(in);
     // Remove flake id context
     flakeid_ctx_destroy(in->fctx);
     // Free all the shards
@@ -1464,6 +1795,8 @@ void index_free(struct index *in) {
     free_kvec_strings(&in->cfg.index_fields);
     free_kvec_strings(&in->cfg.facet_fields);
     free_query_cfg(in->cfg.qcfg);
+    worker_destroy(&in->bulk_loads);
+    pthread_mutex_destroy(&in->mpool_lock);
     free(in);
 }
 
@@ -11,10 +11,16 @@
 #include "mapping.h"
 #include "query.h"
 #include "keys.h"
+#include "workers.h"
 
 #define MAX_INDEX_NAME      128
 #define DEFAULT_NUM_SHARDS  1
 #define JOB_QUEUE_LEN       4096
+// Bulk loads are committed in batches of documents, only a few of which
+// are parsed ahead of the one being committed
+#define BULK_BATCH_DOCS     1000
+#define BULK_MAX_PENDING    2
+#define BULK_MAX_ERRORS     100
 
 // Index default query settings
 #define DEF_HITS_PER_PAGE   20
@@ -22,6 +28,10 @@
 #define MAX_HITS_LIMIT      1000
 #define DEF_FACET_RESULTS   10
 #define DEF_FULLSCAN_THRES  25000
+#define DEF_MIN_WORD_1TYPO  4
+#define DEF_MIN_WORD_2TYPOS 8
+// Index default top-level word id depth, see the prefixLevels setting
+#define DEF_PREFIX_LEVELS   LEVLIMIT
 
 typedef enum jobtype {
     JOB_ADD,
@@ -39,6 +49,7 @@ struct index_cfg {
     bool configured;
     kvec_t(char *) index_fields; 
     kvec_t(char *) facet_fields; 
+    int prefix_levels;      // Prefixes up to this length match through a twid
     struct query_cfg *qcfg; // Default query configuration
 };
 
@@ -67,6 +78,21 @@ struct index {
     threadpool_t *wpool;
     pthread_rwlock_t wpool_lock;
     uint16_t job_count;
+    // Merges segments in the background, see index_queue_merge
+    threadpool_t *mpool;
+    pthread_mutex_t mpool_lock;
+
+    // Bulk loads running on bulk_pool, stopped when the index is closed
+    struct worker bulk_loads;
+    volatile bool bulk_stop;
+};
+
+/* A batch of documents of a bulk load, committed by a JOB_BULK job */
+struct bulk_batch {
+    struct worker *worker;  // Done once the batch is committed
+    size_t first_line;
+    int num_docs;
+    float took;             // Time taken to commit the batch
 };
 
 /* An index job, which can be of one of the above jobtypes
@@ -77,6 +103,7 @@ struct in_job {
     json_t *j2;
     JOB_TYPE type;
     uint32_t id;
+    struct bulk_batch *batch;
 };
 
 
@@ -89,5 +116,6 @@ struct schema *get_field_schema(struct index *in, const char *key);
 void index_apply_key(struct index *in, struct key *k, KEY_ACCESS access);
 void index_delete_key(struct index *in, struct key *k);
 char *index_json_query(struct index *in, json_t *jq, int *status);
+void index_merge_aged_segments(struct index *in);
 
 #endif
@@ -11,6 +11,8 @@
 #include "api.h"
 #include "analyzer.h"
 #include "filter.h"
+#include "array.h"
+#include "bitset.h"
 
 #pragma GCC diagnostic ignored "-Wformat-truncation="
 //#define SINGLE_THREAD_SEARCH_POOL 1
@@ -18,6 +20,8 @@
 struct marlin *marlin;
 threadpool_t *index_pool;
 threadpool_t *search_pool;
+threadpool_t *analyze_pool;
+threadpool_t *bulk_pool;
 
 /**
  * Marlin uses a number of threadpools to perform its operations.
@@ -42,6 +46,13 @@ static void setup_thread_pools(void) {
         ((marlin->num_processors * 3)/2) + 1, 
 #endif
         marlin->num_processors * 256, 0);
+    /* Analyze pool is used by index pool tasks to analyze large batches of
+     * documents in parallel.  Its tasks never wait on other tasks, so index
+     * pool tasks can safely wait on them */
+    analyze_pool = threadpool_create(marlin->num_processors, marlin->num_processors * 256, 0);
+    /* Bulk pool parses bulk loads and waits for their batches to be committed by
+     * the index jobs.  Nothing waits on its tasks, which only finish */
+    bulk_pool = threadpool_create(marlin->num_processors, marlin->num_processors * 256, 0);
 }
 
 // Load marlin settings
@@ -84,6 +95,9 @@ void load_settings(const char *settings_path) {
         marlin->num_threads = sysconf(_SC_NPROCESSORS_ONLN);
     }
     marlin->num_processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (json_object_get(js, TRIE_HUGEPAGES)) {
+        dtrie_set_hugepages(json_boolean_value(json_object_get(js, TRIE_HUGEPAGES)));
+    }
     /* Setup necessary thread pools */
     setup_thread_pools();
     json_decref(js);
@@ -266,6 +280,9 @@ void init_marlin(void) {
     mkdir(marlin->db_path, 0775);
 
     // Initializations
+    init_bitset_kernels();
+    init_array_kernels();
+    M_INFO("Using %s bitset and %s array kernels", bitset_ops.name, array_ops.name);
     init_analyzers();
     init_filters();
 
@@ -286,8 +303,11 @@ void init_marlin(void) {
 
 void shutdown_marlin(void) {
     M_INFO("Shutting down !");
+    // Bulk loads still commit through the other pools
+    threadpool_destroy(bulk_pool, threadpool_graceful);
     threadpool_destroy(index_pool, 0);
     threadpool_destroy(search_pool, 0);
+    threadpool_destroy(analyze_pool, 0);
     // Deregister callbacks
     deregister_api_callback(marlin->appid, marlin->apikey, "GET", URL_MARLIN);
     deregister_api_callback(marlin->appid, marlin->apikey, "GET", URL_APPS);
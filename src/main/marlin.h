@@ -22,6 +22,8 @@ struct marlin {
 extern struct marlin *marlin;
 extern threadpool_t *index_pool;
 extern threadpool_t *search_pool;
+extern threadpool_t *analyze_pool;
+extern threadpool_t *bulk_pool;
 
 void load_settings(const char *settings_path);
 void init_marlin(void);
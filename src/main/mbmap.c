@@ -39,6 +39,22 @@ static inline uint16_t lowbits(uint32_t i) {
     return (i & 0xFFFF);
 }
 
+// Number of uint16_t words in a versioned header
+static inline size_t header_words(uint16_t num_c) {
+    return 2 * (size_t)num_c + 4;
+}
+
+/* Returns the container cardinalities stored in a header, NULL for headers
+ * written before they were stored */
+static const uint16_t *header_cards(const MDB_val *data) {
+    const uint16_t *buf = data->mv_data;
+    uint16_t num_c = *buf;
+    if (data->mv_size < header_words(num_c) * sizeof(uint16_t) || buf[num_c+1] != MBMAP_VERSION) {
+        return NULL;
+    }
+    return buf + num_c + 4;
+}
+
 static int binary_search(struct mbmap *b, uint16_t id) {
     int low = 0, high = b->num_c-1;
     // Usually we add to the end, handle that
@@ -122,15 +138,15 @@ void mbmap_remove(struct mbmap *b, uint32_t item, MDB_txn *txn, MDB_dbi dbi) {
         bool remove = cont_remove(&b->c[pos].cont, val);
         // If remove is true, the container itself has to be removed !
         if (remove) {
-            // Delete from mdb
+            // Delete from mdb, unless the mbmap is only kept in memory
             uint64_t bid = b->id + b->c[pos].id + 1;
             MDB_val key;
             key.mv_size = sizeof(bid);
             key.mv_data = &bid;
-            if (mdb_del(txn, dbi, &key, NULL) != 0) {
+            if (txn && mdb_del(txn, dbi, &key, NULL) != 0) {
                 M_ERR("Failed to deallocate data for mbmap");
             }
- 
+
             b->write_header = true;
             b->num_c--;
             if (pos != b->num_c) {
@@ -164,22 +180,72 @@ void mbmap_load(struct mbmap *b, MDB_txn *txn, MDB_dbi dbi) {
         rsize += data.mv_size;
         load++;
 #endif
+        const uint16_t *cards = header_cards(&data);
         for (int i=0; i<b->num_c; i++) {
             b->c[i].id = *buf;
+            if (cards) {
+                b->c[i].card = cards[i] + 1;
+            }
             buf++;
-       }
+        }
+        if (UNLIKELY(!cards)) {
+            // Old header, count the containers once and write a new header on save
+            for (int i=0; i<b->num_c; i++) {
+                uint64_t bid = b->id + b->c[i].id + 1;
+                key.mv_size = sizeof(bid);
+                key.mv_data = &bid;
+                if (mdb_get(txn, dbi, &key, &data) == 0) {
+                    const struct cont c = {data.mv_data};
+                    b->c[i].card = cont_cardinality(&c);
+                } else {
+                    M_ERR("Failed to load mbmap container bid %"PRIu64" to count it", bid);
+                }
+            }
+            b->write_header = true;
+        }
     }
 }
 
 uint32_t mbmap_get_cardinality(struct mbmap *b) {
     uint32_t cardinality = 0;
-    // printf("num_c is %u\n", b->num_c);
     for (int i=0; i<b->num_c; i++) {
-        //cardinality += get_cont_cardinality(&b->c[i].cont);
+        if (b->c[i].cont.buffer) {
+            cardinality += cont_cardinality(&b->c[i].cont);
+        } else {
+            cardinality += b->c[i].card;
+        }
     }
     return cardinality;
 }
 
+static void mbmap_write_header(struct mbmap *b, MDB_txn *txn, MDB_dbi dbi) {
+    uint64_t id = b->id;
+    MDB_val key, data;
+    key.mv_size = sizeof(id);
+    key.mv_data = &id;
+    data.mv_size = sizeof(uint16_t) * header_words(b->num_c);
+#ifdef DUMP_MDB_STATS
+    wsize += data.mv_size;
+    whead++;
+#endif
+    int rc = mdb_put(txn, dbi, &key, &data, MDB_RESERVE);
+    if (rc != 0) {
+        M_ERR("MDB reserve failure mbmap save %s", mdb_strerror(rc));
+        return;
+    }
+    uint16_t *buf = data.mv_data;
+    uint32_t total = mbmap_get_cardinality(b);
+    buf[0] = b->num_c;
+    buf[b->num_c+1] = MBMAP_VERSION;
+    buf[b->num_c+2] = total & 0xFFFF;
+    buf[b->num_c+3] = total >> 16;
+    uint16_t *cards = buf + b->num_c + 4;
+    for (int i=0; i<b->num_c; i++) {
+        buf[i+1] = b->c[i].id;
+        cards[i] = b->c[i].card - 1;
+    }
+}
+
 bool mbmap_save(struct mbmap *b, MDB_txn *txn, MDB_dbi dbi) {
     uint64_t id = 0;
     MDB_val key, data;
@@ -196,40 +262,16 @@ bool mbmap_save(struct mbmap *b, MDB_txn *txn, MDB_dbi dbi) {
 #ifdef DUMP_MDB_STATS
     save++;
 #endif
-    // Write header if required
-    if (UNLIKELY(b->write_header)) {
-        id = b->id;
-        data.mv_size = sizeof(uint16_t) * (b->num_c + 1);
-#ifdef DUMP_MDB_STATS
-        wsize += data.mv_size;
-        whead++;
-#endif
-        int rc = mdb_put(txn, dbi, &key, &data, MDB_RESERVE);
-        if (rc != 0) {
-            M_ERR("MDB reserve failure mbmap save %s", mdb_strerror(rc));
-        } else {
-            uint16_t *buf = data.mv_data;
-            *buf = b->num_c;
-            buf++;
-            for (int i=0; i<b->num_c; i++) {
-                *buf = b->c[i].id;
-                buf++;
-            }
-        }
-    } 
-#ifdef DUMP_MDB_STATS
-    else {
-        shead++;
-    }
-#endif
+    // Any container written changes the cardinalities in the header
+    bool write_header = b->write_header;
     for (int i=0; i<b->num_c; i++) {
         // If a buffer is valid, dump it
         if (UNLIKELY(b->c[i].cont.buffer)) {
             // 0 is taken for header, rest are store with id + 1
             id = b->id + b->c[i].id + 1;
-            int len = (cont_cardinality(&b->c[i].cont) > CUTOFF)?CUTOFF:b->c[i].cont.buffer[1];
-            len += 2; // id + card
-            data.mv_size = sizeof(uint16_t) * len;
+            // Switch to / from a run container if that is smaller on disk
+            cont_optimize(&b->c[i].cont);
+            data.mv_size = sizeof(uint16_t) * cont_size(&b->c[i].cont);
 #ifdef DUMP_MDB_STATS
             wsize += data.mv_size;
             wdata++;
@@ -239,6 +281,8 @@ bool mbmap_save(struct mbmap *b, MDB_txn *txn, MDB_dbi dbi) {
             if (rc != 0) {
                 M_ERR("MDB failure mbmap save %s", mdb_strerror(rc));
             }
+            b->c[i].card = cont_cardinality(&b->c[i].cont);
+            write_header = true;
         } 
 #ifdef DUMP_MDB_STATS
         else {
@@ -246,10 +290,49 @@ bool mbmap_save(struct mbmap *b, MDB_txn *txn, MDB_dbi dbi) {
         }
 #endif
     }
+    if (write_header) {
+        mbmap_write_header(b, txn, dbi);
+    }
+#ifdef DUMP_MDB_STATS
+    else {
+        shead++;
+    }
+#endif
     return true;
 }
 
 
+// Where containers of a lazy bitmap are loaded from
+struct mbmap_src {
+    MDB_txn *txn;
+    MDB_dbi dbi;
+    uint64_t id;
+};
+
+// Empty container handed out when a container fails to load
+static uint16_t empty_cont[3];
+
+static uint16_t *mbmap_fetch_container(const struct bmap *b, int pos) {
+    const struct mbmap_src *src = b->fetch_src;
+    uint64_t bcid = src->id + b->cids[pos] + 1;
+    MDB_val key, data;
+    key.mv_size = sizeof(bcid);
+    key.mv_data = &bcid;
+    int rc = mdb_get(src->txn, src->dbi, &key, &data);
+    if (rc != 0) {
+        M_ERR("Could not load buffer data dbi %d bcid %"PRIu64" id %"PRIu64" cid %u numc %u %s", src->dbi, bcid, src->id, b->cids[pos], b->num_c, mdb_strerror(rc));
+        return empty_cont;
+    }
+#ifdef DUMP_MDB_STATS
+    rsize += data.mv_size;
+#endif
+    return data.mv_data;
+}
+
+/* Loads only the header of a mbmap, containers are read from lmdb the first
+ * time an operation touches them. So an intersection with a small set only
+ * reads the containers it overlaps. The bitmap, like its containers, is only
+ * valid as long as txn is */
 struct bmap *mbmap_load_bmap(MDB_txn *txn, MDB_dbi dbi, uint64_t id) {
     MDB_val key, data;
     key.mv_size = sizeof(id);
@@ -257,24 +340,26 @@ struct bmap *mbmap_load_bmap(MDB_txn *txn, MDB_dbi dbi, uint64_t id) {
     int rc = 0;
     if ((rc = mdb_get(txn, dbi, &key, &data)) == 0) {
         struct bmap *b = bmap_new();
-        uint16_t *buf = data.mv_data;
+        const uint16_t *buf = data.mv_data;
         // TODO: Verify mv_size !
         b->num_c = *buf;
-        buf++;
         b->mdb_bmap = 1;
-        b->c = calloc(b->num_c, sizeof(struct cont));
-        for (int i=0; i<b->num_c; i++) {
-            uint16_t cid = *buf;
-            buf++;
-            uint64_t bcid = id + cid + 1;
-            key.mv_data = &bcid;
-            MDB_val data2;
-            if ((rc = mdb_get(txn, dbi, &key, &data2)) == 0) {
-                b->c[i].buffer = data2.mv_data;
-            } else {
-                M_ERR("Could not load buffer data dbi %d bcid %"PRIu64" id %"PRIu64" cid %u numc %u %s", dbi, bcid, id, cid, b->num_c, mdb_strerror(rc));
-            }
+        const uint16_t *cards = header_cards(&data);
+        if (cards) {
+            b->ccards = cards;
+            b->card = buf[b->num_c+2] | ((uint32_t)buf[b->num_c+3] << 16);
+        } else {
+            // Old headers have no cardinalities, count on first use
+            b->card_valid = 0;
         }
+        b->c = calloc(b->num_c, sizeof(struct cont));
+        b->cids = buf + 1;
+        b->fetch = mbmap_fetch_container;
+        struct mbmap_src *src = malloc(sizeof(struct mbmap_src));
+        src->txn = txn;
+        src->dbi = dbi;
+        src->id = id;
+        b->fetch_src = src;
         return b;
     } else {
         // M_INFO("Failed to load mbmap %s\n", mdb_strerror(rc));
@@ -282,6 +367,20 @@ struct bmap *mbmap_load_bmap(MDB_txn *txn, MDB_dbi dbi, uint64_t id) {
     return NULL;
 }
 
+/* Copies a mbmap which has all its containers in memory to a bitmap, NULL if
+ * it is empty like a mbmap which is not stored */
+struct bmap *mbmap_to_bmap(struct mbmap *b) {
+    if (b->num_c == 0) return NULL;
+    struct bmap *r = bmap_new();
+    r->needs_free = 1;
+    r->num_c = b->num_c;
+    r->card = mbmap_get_cardinality(b);
+    r->c = malloc(b->num_c * sizeof(struct cont));
+    for (int i = 0; i < b->num_c; i++) {
+        r->c[i].buffer = cont_duplicate(&b->c[i].cont);
+    }
+    return r;
+}
 
 void mbmap_free(struct mbmap *b) {
     for (int i=0; i<b->num_c; i++) {
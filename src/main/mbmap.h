@@ -4,8 +4,14 @@
 #include "bmap.h"
 #include "lmdb.h"
 
+/* Header layout in uint16_t words : num_c, the container ids, MBMAP_VERSION,
+ * the total cardinality in two words (low first) and the cardinality - 1 of
+ * each container.  Headers written before the version stop after the ids */
+#define MBMAP_VERSION   1
+
 struct mcont {
     uint16_t id;
+    uint32_t card;  // Cardinality of the container, kept up to date on save
     struct cont cont;
 };
 
@@ -22,6 +28,7 @@ void mbmap_remove(struct mbmap *b, uint32_t item, MDB_txn *txn, MDB_dbi dbi);
 void mbmap_load(struct mbmap *b, MDB_txn *txn, MDB_dbi dbi);
 bool mbmap_save(struct mbmap *b, MDB_txn *txn, MDB_dbi dbi);
 struct bmap *mbmap_load_bmap(MDB_txn *txn, MDB_dbi dbi, uint64_t id);
+struct bmap *mbmap_to_bmap(struct mbmap *b);
 uint32_t mbmap_get_cardinality(struct mbmap *b);
 void mbmap_free(struct mbmap *b);
 void mbmap_stats_dump();
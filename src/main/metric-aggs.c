@@ -47,11 +47,10 @@ static void consume_card_agg(struct agg *a, struct squery *sq, uint32_t docid, v
 static json_t *card_agg_as_json(struct agg *a) {
     struct agg_card *ac = (struct agg_card *)a;
     json_t *j = json_object();
-    if (ac->oper) {
-        bmap_free(ac->bmap);
-        ac->bmap = oper_or(ac->oper);
-    }
-    json_object_set_new(j, JA_VALUE, json_integer(bmap_cardinality(ac->bmap)));
+    // Merged shard results only need counting, not an actual union
+    uint32_t card = ac->oper ? bmap_or_cardinality(ac->oper->b, ac->oper->count)
+                             : bmap_cardinality(ac->bmap);
+    json_object_set_new(j, JA_VALUE, json_integer(card));
     return j;
 }
 
@@ -104,6 +103,11 @@ struct agg *parse_card_agg(const char *name, json_t *j, struct index *in) {
 
 static double get_num_value(struct squery *sq, uint32_t docid, void *data, int priority) {
     double val = -DBL_MAX;
+    // In memory indexes have no aggregations index, their docdata has the values
+    MDB_val docdata;
+    if (!data && sq->si->mem && sindex_get_docdata(sq->si, sq->txn, docid, &docdata) == 0) {
+        data = docdata.mv_data;
+    }
     if (data) {
         uint8_t *pos = data;
         double *dpos = (double *)(pos + sizeof(uint32_t));
@@ -127,7 +131,7 @@ static double get_num_value(struct squery *sq, uint32_t docid, void *data, int p
             key.mv_data = (void *)&docgrp_id;
             // If it already exists, we need not write so set a NULL value to 
             // avoid looking up mdb everytime we encounter this facetid
-            if (mdb_get(sq->txn, sq->shard->sindex->idnum2dbl_dbi, &key, &mdata) == 0) {
+            if (mdb_get(sq->txn, sq->si->idnum2dbl_dbi, &key, &mdata) == 0) {
                 grpd = mdata.mv_data;
             }
             kh_value(kh, k) = grpd;
@@ -36,6 +36,23 @@ static void explain_rank(struct query *q, json_t *j, struct docrank *r) {
     json_object_set_new(j, "_explain", e);
 }
 
+/* Memory the shard queries allocated from their arenas, summed over shards */
+static json_t *explain_arena(struct squery *sq, int num_shards) {
+    uint32_t allocs = 0, chunks = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < num_shards; i++) {
+        const struct arena *a = &sq[i].sqres->arena;
+        allocs += a->num_allocs;
+        chunks += a->num_chunks;
+        bytes += a->bytes;
+    }
+    json_t *e = json_object();
+    json_object_set_new(e, J_R_ALLOCS, json_integer(allocs));
+    json_object_set_new(e, J_R_BYTES, json_integer(bytes));
+    json_object_set_new(e, J_R_CHUNKS, json_integer(chunks));
+    return e;
+}
+
 static struct facet_count *process_facet_results(struct squery *sq, int f, int *count) {
     struct query *q = sq[0].q;
     struct facet_count *fc;
@@ -99,7 +116,7 @@ static json_t *form_facet_result(struct query *q, struct squery *sq, F_TYPE type
     for (int i = 0; i < count; i++) {
         // Retrieve the actual facet string from the shard
         struct shard *s = kv_A(q->in->shards, fc[i].shard_id);
-        char *fstr = sindex_lookup_facet(s->sindex, fc[i].facet_id);
+        char *fstr = shard_lookup_facet(s, fc[i].facet_id);
         // This should never happen
         if (!fstr) {
             M_ERR("Failed to lookup facet for facet_id %u on shard %d\n", fc->facet_id, fc->shard_id);
@@ -309,6 +326,18 @@ static struct json_t *hit_query_processing(struct json_t *hit, struct query *q)
     return new_hit;
 }
 
+/* A hit from the segment carries the docid of the segment shard, it gets
+ * the docid of the document in the shard instead if it has one already */
+static void set_segment_hit_docid(const struct shard *s, json_t *hit) {
+    const char *id = json_string_value(json_object_get(hit, J_ID));
+    uint32_t docid;
+    if (id && sdata_get_docid(s->sdata, id, &docid)) {
+        json_object_set_new(hit, J_DOCID, json_integer(docid));
+    } else {
+        json_object_del(hit, J_DOCID);
+    }
+}
+
 static json_t *form_result(struct query *q, struct squery *sq) {
     json_t *j = json_object();
     // Process response within shardquery
@@ -384,10 +413,15 @@ static json_t *form_result(struct query *q, struct squery *sq) {
 
     for (int i=page_s; i<page_e; i++) {
         struct shard *s = kv_A(q->in->shards, ranks[i].shard_id);
-        char *o = sdata_get_document_byid(s->sdata, ranks[i].docid);
+        bool segment_hit = (ranks[i].docid >= SEGMENT_DOCID_BASE);
+        char *o = segment_hit ? sqresult_segment_document(sq[ranks[i].shard_id].sqres, ranks[i].docid)
+                              : sdata_get_document_byid(s->sdata, ranks[i].docid);
         if (o) {
             json_error_t error;
             json_t *hit = json_loads(o, 0, &error);
+            if (segment_hit) {
+                set_segment_hit_docid(s, hit);
+            }
             // process hit to highlight and or filter fields
             hit = hit_query_processing(hit, q);
             if (hit) {
@@ -463,9 +497,13 @@ char *execute_query(struct query *q) {
     trace_query("Got results in ", &start);
 
     json_t *j = form_result(q, sq);
+    if (q->explain) {
+        json_object_set_new(j, J_R_ARENA, explain_arena(sq, in->num_shards));
+    }
 
     trace_query("Formed result in ", &start);
     for (int i = 0; i < in->num_shards; i++) {
+        trace_arena(i, &sq[i].sqres->arena);
         sqresult_free(q, sq[i].sqres);
     }
     free(sq);
@@ -483,6 +521,20 @@ char *execute_query(struct query *q) {
     return response;
 }
 
+/* If typos are allowed by the query and the word is above the min typo check
+ * length, enable search with typos.  The number of typos allowed depends on
+ * the word length */
+static void set_term_typos(const struct query *q, term_t *t) {
+    int len = t->word->length;
+    if ((q->cfg.typos != TYPO_OK) || (len <= LEVLIMIT)) return;
+    if (len >= q->cfg.min_word_2typos) {
+        t->maxdist = 2;
+    } else if (len >= q->cfg.min_word_1typo) {
+        t->maxdist = 1;
+    }
+    t->typos = (t->maxdist > 0);
+}
+
 /* Generates query terms for a given query.  THis is specific to the ranking model 
  * used, so this will get moved in the near future
  * TODO: move it to the appropriate ranking model */
@@ -498,11 +550,7 @@ void generate_query_terms(struct query *q) {
         if (q->cfg.prefix != PREFIX_NONE) {
             t->prefix = 1;
         }
-        // If typos are allowed by the query and if we are above the min typo check
-        // length, enable search with typos
-        if ((q->cfg.typos == TYPO_OK) && (t->word->length > LEVLIMIT)) {
-            t->typos = 1;
-        }
+        set_term_typos(q, t);
         if (q->text[strlen(q->text) - 1] == ' ') {
             t->prefix = 0;
         }
@@ -526,11 +574,7 @@ void generate_query_terms(struct query *q) {
                     t->prefix = 1;
                 }
             }
-            // If typos are allowed by the query and if we are above the min typo check
-            // length, enable search with typos
-            if ((q->cfg.typos == TYPO_OK) && (t->word->length > LEVLIMIT)) {
-                t->typos = 1;
-            }
+            set_term_typos(q, t);
             kv_push(term_t *, q->terms, t);
         }
 
@@ -570,10 +614,7 @@ void generate_query_terms(struct query *q) {
         // Now create a term for the current word
         term_t *t = calloc(1, sizeof(term_t));
         t->word = worddup(kv_A(q->words, i));
-        // If typos are ok, set it
-        if ((q->cfg.typos == TYPO_OK) && (t->word->length > LEVLIMIT)) {
-            t->typos = 1;
-        }
+        set_term_typos(q, t);
         // If the query needs a prefix search, do that
         if (q->cfg.prefix == PREFIX_ALL) {
             t->prefix = 1;
@@ -58,6 +58,8 @@ struct query_cfg {
     bool rank_asc;      // Rank by ascending or descending order
     bool full_scan;     // Do we want to scan all documents before a result?
     uint32_t full_scan_threshold; // Threshold under which a full scan is performed
+    uint8_t min_word_1typo;   // Min word length to allow 1 typo
+    uint8_t min_word_2typos;  // Min word length to allow 2 typos
     SORT_RULE  rank_algo[R_MAX + 1]; // Ranking algorithm
 
     struct field *get_fields;
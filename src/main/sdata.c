@@ -97,6 +97,25 @@ static char *jcompress(const char *src, int *compressed_len) {
 #endif
 }
 
+/* Stores the json of a document under its docid */
+static void sdata_store_document(struct sdata *sd, uint32_t docid, json_t *j) {
+    json_object_set_new(j, J_DOCID, json_integer(docid));
+    char *jdata = json_dumps(j, JSON_PRESERVE_ORDER|JSON_COMPACT);
+    int compressed_len;
+    char *compressed_data = jcompress(jdata, &compressed_len);
+
+    // Update SID2JSON
+    MDB_val key, data;
+    key.mv_size = sizeof(uint32_t);
+    key.mv_data = &docid;
+    data.mv_size = compressed_len;
+    data.mv_data = compressed_data;
+    mdb_put(sd->txn, sd->docid2json_dbi, &key, &data, 0);
+
+    free(jdata);
+    free(compressed_data);
+}
+
 static void sdata_add_document(struct sdata *sd, json_t *j) {
     // Make sure it is a valid object before trying to add it
     if (!j) return;
@@ -108,29 +127,16 @@ static void sdata_add_document(struct sdata *sd, json_t *j) {
     bmap_add(sd->used_bmap, new_docid);
     mbmap_add(sd->used_mbmap, new_docid, sd->txn, sd->usedfree_dbi);
 
-    json_object_set_new(j, J_DOCID, json_integer(new_docid));
-    char *jdata = json_dumps(j, JSON_PRESERVE_ORDER|JSON_COMPACT);
-    int compressed_len;
-    char *compressed_data = jcompress(jdata, &compressed_len);
-
-    // Update SID2JSON
-    MDB_val key, data;
-    key.mv_size = sizeof(uint32_t);
-    key.mv_data = &new_docid;
-    data.mv_size = compressed_len;
-    data.mv_data = compressed_data;
-    mdb_put(sd->txn, sd->docid2json_dbi, &key, &data, 0);
+    sdata_store_document(sd, new_docid, j);
 
     // Update document id to docid
+    MDB_val key, data;
     const char *id = json_string_value(json_object_get(j, J_ID));
     key.mv_data = (void *)id;
     key.mv_size = strlen(id) + 1;
     data.mv_size = sizeof(uint32_t);
     data.mv_data = &new_docid;
     mdb_put(sd->txn, sd->id2docid_dbi, &key, &data, 0);
-
-    free(jdata);
-    free(compressed_data);
 }
 
 static void start_document_update(struct sdata *sd) {
@@ -200,6 +206,21 @@ char *sdata_get_document_byid(const struct sdata *sd, uint32_t docid) {
     return resp;
 }
 
+/* Looks up the docid of a document id, false if there is no such document */
+bool sdata_get_docid(const struct sdata *sd, const char *id, uint32_t *docid) {
+    MDB_txn *txn;
+    mdb_txn_begin(sd->env, NULL, MDB_RDONLY, &txn);
+    MDB_val key, data;
+    key.mv_data = (void *)id;
+    key.mv_size = strlen(id) + 1;
+    bool found = (mdb_get(txn, sd->id2docid_dbi, &key, &data) == 0);
+    if (found) {
+        *docid = *(uint32_t *)data.mv_data;
+    }
+    mdb_txn_abort(txn);
+    return found;
+}
+
 char *sdata_get_document(const struct sdata *sd, const char *id) {
     MDB_txn *txn;
     mdb_txn_begin(sd->env, NULL, MDB_RDONLY, &txn);
@@ -232,10 +253,8 @@ char *sdata_get_document(const struct sdata *sd, const char *id) {
     return resp;
 }
 
-uint32_t sdata_delete_document(struct sdata *sd, const char *id) {
-    // We are probably going to update
-    start_document_update(sd);
-
+/* Removes a document, assumes an update is in progress */
+static uint32_t sdata_remove_document(struct sdata *sd, const char *id) {
     // First get the docid from document id
     uint32_t docid = 0;
     MDB_val key, data;
@@ -262,11 +281,53 @@ uint32_t sdata_delete_document(struct sdata *sd, const char *id) {
         bmap_add(sd->free_bmap, docid);
         mbmap_add(sd->used_mbmap, docid, sd->txn, sd->usedfree_dbi);
     } 
+    return docid;
+}
 
+uint32_t sdata_delete_document(struct sdata *sd, const char *id) {
+    // We are probably going to update
+    start_document_update(sd);
+    uint32_t docid = sdata_remove_document(sd, id);
     end_document_update(sd);
     return docid;
 }
 
+/* Looks up the docid of a document id.  Assumes an update is in progress */
+static bool sdata_lookup_docid(struct sdata *sd, const char *id, uint32_t *docid) {
+    MDB_val key, data;
+    key.mv_data = (void *)id;
+    key.mv_size = strlen(id) + 1;
+    if (mdb_get(sd->txn, sd->id2docid_dbi, &key, &data) == 0) {
+        *docid = *(uint32_t *)data.mv_data;
+        return true;
+    }
+    return false;
+}
+
+/* Writes a batch of documents in a single transaction.  The docid of the current
+ * document of every id is stored in docids (0 if there is none).  A new version
+ * in docs replaces the current document in place and keeps its docid, a NULL
+ * one removes the current document */
+void sdata_write_documents(struct sdata *sd, const char **ids, json_t **docs,
+                           uint32_t *docids, int num_docs) {
+    uint32_t docid = sd->last_docid;
+    start_document_update(sd);
+    for (int i = 0; i < num_docs; i++) {
+        if (docs[i] && sdata_lookup_docid(sd, ids[i], &docids[i])) {
+            sdata_store_document(sd, docids[i], docs[i]);
+        } else {
+            docids[i] = sdata_remove_document(sd, ids[i]);
+            if (docs[i]) {
+                sdata_add_document(sd, docs[i]);
+            }
+        }
+    }
+    if (docid != sd->last_docid) {
+        save_last_docid(sd);
+    }
+    end_document_update(sd);
+}
+
 void sdata_free(struct sdata *sd) {
     mdb_dbi_close(sd->env, sd->id2docid_dbi);
     mdb_dbi_close(sd->env, sd->docid2json_dbi);
@@ -31,6 +31,9 @@ void sdata_delete(struct sdata *sd);
 void sdata_clear(struct sdata *sd);
 char *sdata_get_document(const struct sdata *sd, const char *id);
 char *sdata_get_document_byid(const struct sdata *sd, uint32_t docid);
+bool sdata_get_docid(const struct sdata *sd, const char *id, uint32_t *docid);
 uint32_t sdata_delete_document(struct sdata *sd, const char *id);
+void sdata_write_documents(struct sdata *sd, const char **ids, json_t **docs,
+                           uint32_t *docids, int num_docs);
 
 #endif
@@ -0,0 +1,279 @@
+/* Shard Segment - An in memory write buffer in front of the shard data and index.
+ *
+ * Deletes, replaces and updates of single documents are written to the segment
+ * of their shard instead of running a write transaction each.  A document
+ * written again before the segment is merged just replaces its previous
+ * version, so a merge writes every document once however often it changed.
+ * See shard_write_segment and shard_merge_segment in shard.c */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "segment.h"
+#include "common.h"
+#include "platform.h"
+
+#pragma GCC diagnostic ignored "-Wformat-truncation="
+
+static void segment_docs_init(struct segment_docs *sd) {
+    sd->kh_docs = kh_init(SEGDOCS);
+    kv_init(sd->docs);
+}
+
+static void segment_docs_clear(struct segment_docs *sd) {
+    for (int i = 0; i < kv_size(sd->docs); i++) {
+        struct segment_doc *d = &kv_A(sd->docs, i);
+        if (d->j) json_decref(d->j);
+        free(d->id);
+    }
+    kv_size(sd->docs) = 0;
+    kh_clear(SEGDOCS, sd->kh_docs);
+}
+
+static void segment_docs_destroy(struct segment_docs *sd) {
+    segment_docs_clear(sd);
+    kv_destroy(sd->docs);
+    kh_destroy(SEGDOCS, sd->kh_docs);
+}
+
+static struct segment_doc *segment_docs_find(struct segment_docs *sd, const char *id) {
+    khiter_t k = kh_get(SEGDOCS, sd->kh_docs, id);
+    if (k == kh_end(sd->kh_docs)) return NULL;
+    return &kv_A(sd->docs, kh_value(sd->kh_docs, k));
+}
+
+static void segment_docids_clear(struct segment *seg) {
+    char *id;
+    kh_foreach_value(seg->kh_docids, id, {
+        free(id);
+    });
+    kh_clear(SEGDOCIDS, seg->kh_docids);
+    seg->last_docid = SEGMENT_DOCID_BASE;
+}
+
+static void segment_close_wal(struct segment *seg) {
+    if (seg->wal_fd >= 0) {
+        close(seg->wal_fd);
+        seg->wal_fd = -1;
+    }
+}
+
+/* Creates the segment of the shard in path, indexed by si.  The logs of the
+ * segment are kept in path too */
+struct segment *segment_new(struct sindex *si, const char *path) {
+    struct segment *seg = calloc(1, sizeof(struct segment));
+    pthread_rwlock_init(&seg->lock, NULL);
+    pthread_mutex_init(&seg->merge_lock, NULL);
+    segment_docs_init(&seg->docs);
+    segment_docs_init(&seg->merging);
+    seg->sindex = si;
+    seg->kh_docids = kh_init(SEGDOCIDS);
+    seg->last_docid = SEGMENT_DOCID_BASE;
+    seg->docids = bmap_new();
+    seg->masked = bmap_new();
+    seg->wal_fd = -1;
+    snprintf(seg->wal_path, sizeof(seg->wal_path), "%s/%s", path, SEGMENT_WAL_FILE);
+    snprintf(seg->merge_wal_path, sizeof(seg->merge_wal_path), "%s/%s", path, SEGMENT_MERGE_WAL_FILE);
+    worker_init(&seg->merges, 0);
+    return seg;
+}
+
+/* Drops all documents of the segment along with its logs, the segment index
+ * is cleared by the caller.  Assumes the write lock is held */
+void segment_clear(struct segment *seg) {
+    segment_docs_clear(&seg->docs);
+    segment_docs_clear(&seg->merging);
+    segment_docids_clear(seg);
+    bmap_free(seg->docids);
+    seg->docids = bmap_new();
+    bmap_free(seg->masked);
+    seg->masked = bmap_new();
+    segment_close_wal(seg);
+    unlink(seg->wal_path);
+    unlink(seg->merge_wal_path);
+}
+
+/* Frees the segment, its index is freed by the caller */
+void segment_free(struct segment *seg) {
+    segment_docs_destroy(&seg->docs);
+    segment_docs_destroy(&seg->merging);
+    segment_docids_clear(seg);
+    kh_destroy(SEGDOCIDS, seg->kh_docids);
+    bmap_free(seg->docids);
+    bmap_free(seg->masked);
+    segment_close_wal(seg);
+    worker_destroy(&seg->merges);
+    pthread_mutex_destroy(&seg->merge_lock);
+    pthread_rwlock_destroy(&seg->lock);
+    free(seg);
+}
+
+/* Appends a write to the log of the segment, a line with the document id and
+ * the document, which is null for a delete.  The log is not synced, like the
+ * shard data it survives the process but not the machine going down.
+ * Assumes the write lock is held */
+void segment_log(struct segment *seg, const char *id, const json_t *j) {
+    if (seg->wal_fd < 0) {
+        seg->wal_fd = open(seg->wal_path, O_WRONLY | O_APPEND | O_CREAT, (mode_t)0664);
+        if (seg->wal_fd < 0) {
+            M_ERR("Failed to open segment log %s", seg->wal_path);
+            return;
+        }
+    }
+    json_t *r = json_object();
+    json_object_set_new(r, J_ID, json_string(id));
+    json_object_set(r, J_DOC, j ? (json_t *)j : json_null());
+    char *line = json_dumps(r, JSON_PRESERVE_ORDER|JSON_COMPACT);
+    json_decref(r);
+    size_t len = strlen(line);
+    // The record and its newline go in one write, a torn one ends the log
+    line = realloc(line, len + 1);
+    line[len++] = '\n';
+    if (write(seg->wal_fd, line, len) != len) {
+        M_ERR("Failed to log write of %s to segment log %s", id, seg->wal_path);
+    }
+    free(line);
+}
+
+/* Writes the latest version of a document, NULL if it is deleted, and returns
+ * its docid in the segment index.  A document keeps its docid till it is
+ * merged.  The segment takes over the reference to j.  Assumes the write lock
+ * is held */
+uint32_t segment_put(struct segment *seg, const char *id, json_t *j) {
+    struct segment_docs *sd = &seg->docs;
+    struct segment_doc *d = segment_docs_find(sd, id);
+    if (d) {
+        if (d->j) json_decref(d->j);
+        d->j = j;
+    } else {
+        struct segment_doc *md = segment_docs_find(&seg->merging, id);
+        struct segment_doc nd = {strdup(id), j, md ? md->docid : 0};
+        if (!md) {
+            nd.docid = ++seg->last_docid;
+            int ret;
+            khiter_t k = kh_put(SEGDOCIDS, seg->kh_docids, nd.docid, &ret);
+            kh_value(seg->kh_docids, k) = strdup(id);
+        }
+        if (kv_size(sd->docs) == 0) {
+            seg->first_write = time(NULL);
+        }
+        kv_push(struct segment_doc, sd->docs, nd);
+        int ret;
+        khiter_t k = kh_put(SEGDOCS, sd->kh_docs, nd.id, &ret);
+        kh_value(sd->kh_docs, k) = kv_size(sd->docs) - 1;
+        d = &kv_A(sd->docs, kv_size(sd->docs) - 1);
+    }
+    if (j) {
+        bmap_add(seg->docids, d->docid);
+    } else {
+        bmap_remove(seg->docids, d->docid);
+    }
+    return d->docid;
+}
+
+/* Finds the latest version of a document written to the segment, which is
+ * the one being merged if it was not written since.  The document is not
+ * copied, so the lock has to be held while it is used */
+struct segment_doc *segment_find(struct segment *seg, const char *id) {
+    struct segment_doc *d = segment_docs_find(&seg->docs, id);
+    return d ? d : segment_docs_find(&seg->merging, id);
+}
+
+/* Returns the json of a document written to the segment, NULL if it is
+ * deleted.  found is set when the segment holds the document at all */
+char *segment_get_document(struct segment *seg, const char *id, bool *found) {
+    char *doc = NULL;
+    RDLOCK(&seg->lock);
+    struct segment_doc *d = segment_find(seg, id);
+    *found = (d != NULL);
+    if (d && d->j) {
+        doc = json_dumps(d->j, JSON_PRESERVE_ORDER|JSON_COMPACT);
+    }
+    UNLOCK(&seg->lock);
+    return doc;
+}
+
+/* Returns the json of the document with docid in the segment index, NULL if
+ * it is deleted.  Assumes the read lock is held */
+char *segment_get_document_byid(struct segment *seg, uint32_t docid) {
+    khiter_t k = kh_get(SEGDOCIDS, seg->kh_docids, docid);
+    if (k == kh_end(seg->kh_docids)) return NULL;
+    struct segment_doc *d = segment_find(seg, kh_value(seg->kh_docids, k));
+    if (!d || !d->j) return NULL;
+    return json_dumps(d->j, JSON_PRESERVE_ORDER|JSON_COMPACT);
+}
+
+/* Number of documents written to the segment and not merged yet */
+int segment_size(const struct segment *seg) {
+    return kv_size(seg->docs.docs) + kv_size(seg->merging.docs);
+}
+
+/* Number of documents written since the last merge started */
+int segment_num_written(struct segment *seg) {
+    RDLOCK(&seg->lock);
+    int num = kv_size(seg->docs.docs);
+    UNLOCK(&seg->lock);
+    return num;
+}
+
+/* True once the oldest document written since the last merge started is
+ * SEGMENT_MERGE_SECS old */
+bool segment_aged(struct segment *seg) {
+    RDLOCK(&seg->lock);
+    bool aged = kv_size(seg->docs.docs) && time(NULL) - seg->first_write >= SEGMENT_MERGE_SECS;
+    UNLOCK(&seg->lock);
+    return aged;
+}
+
+/* Moves the documents written so far to merging along with their log, false
+ * if there are none.  Assumes the write lock is held */
+bool segment_start_merge(struct segment *seg) {
+    if (kv_size(seg->docs.docs) == 0) return false;
+    struct segment_docs sd = seg->merging;
+    seg->merging = seg->docs;
+    seg->docs = sd;
+    if (seg->wal_fd >= 0) {
+        segment_close_wal(seg);
+        if (rename(seg->wal_path, seg->merge_wal_path) != 0) {
+            M_ERR("Failed to move segment log %s", seg->wal_path);
+        }
+    }
+    return true;
+}
+
+/* Drops the documents which were merged and their log, the shard holds them
+ * now.  Those not written since give up their docids.  Assumes the write lock
+ * is held */
+void segment_end_merge(struct segment *seg) {
+    for (int i = 0; i < kv_size(seg->merging.docs); i++) {
+        struct segment_doc *d = &kv_A(seg->merging.docs, i);
+        if (segment_docs_find(&seg->docs, d->id)) continue;
+        khiter_t k = kh_get(SEGDOCIDS, seg->kh_docids, d->docid);
+        if (k != kh_end(seg->kh_docids)) {
+            free(kh_value(seg->kh_docids, k));
+            kh_del(SEGDOCIDS, seg->kh_docids, k);
+        }
+        bmap_remove(seg->docids, d->docid);
+    }
+    segment_docs_clear(&seg->merging);
+    unlink(seg->merge_wal_path);
+    if (kv_size(seg->docs.docs) == 0) {
+        segment_docids_clear(seg);
+    }
+}
+
+/* True if the caller is to queue a merge of the segment, which is when it
+ * holds documents and no merge is queued yet.  The merge is counted in
+ * merges till it is done */
+bool segment_claim_merge(struct segment *seg) {
+    bool claimed = false;
+    WRLOCK(&seg->lock);
+    if (!seg->merge_queued && kv_size(seg->docs.docs)) {
+        seg->merge_queued = true;
+        worker_add(&seg->merges);
+        claimed = true;
+    }
+    UNLOCK(&seg->lock);
+    return claimed;
+}
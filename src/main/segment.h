@@ -0,0 +1,87 @@
+#ifndef __SEGMENT_H_
+#define __SEGMENT_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <jansson.h>
+#include "khash.h"
+#include "kvec.h"
+#include "bmap.h"
+#include "workers.h"
+
+// A segment this large holds up the writes to it till it is merged
+#define SEGMENT_MAX_DOCS    1024
+// A segment is merged once it holds this many writes, or once its oldest
+// write is this old
+#define SEGMENT_MERGE_DOCS  (SEGMENT_MAX_DOCS / 4)
+#define SEGMENT_MERGE_SECS  1
+// Documents of the segment index get docids from here on, so they never
+// collide with the docids of the shard they are written to
+#define SEGMENT_DOCID_BASE  0x80000000
+
+struct sindex;
+
+/* A document written to a segment, a NULL j marks a deleted document */
+struct segment_doc {
+    char *id;
+    json_t *j;
+    uint32_t docid;     // Of the document in the segment index
+};
+
+KHASH_MAP_INIT_STR(SEGDOCS, int) // Document id to its position in the segment
+KHASH_MAP_INIT_INT(SEGDOCIDS, char *) // Docid in the segment index to document id
+
+struct segment_docs {
+    khash_t(SEGDOCS) *kh_docs;
+    kvec_t(struct segment_doc) docs;    // In the order they were first written
+};
+
+/* The segment of a shard.  Single document writes land here and only the
+ * latest version of every document written is kept, till the segment is
+ * merged into the shard data and index in one write transaction each.
+ *
+ * The segment index keeps those latest versions in memory, queries run on it
+ * along with the shard, leaving out the docids of the shard in masked.  A
+ * merge moves the documents to merging first, documents written while it
+ * runs go to docs again.  Everything here is written under the write lock
+ * and read under the read lock.
+ *
+ * Every write is appended to the log of the segment before it is applied.  A
+ * merge moves the log aside and removes it once the shard is written, the logs
+ * left by a run which did not merge everything are merged on open */
+struct segment {
+    pthread_rwlock_t lock;
+    pthread_mutex_t merge_lock;     // Held by the merge running
+    struct segment_docs docs;
+    struct segment_docs merging;
+    struct sindex *sindex;
+    khash_t(SEGDOCIDS) *kh_docids;
+    uint32_t last_docid;
+    struct bmap *docids;        // Docids of the documents not deleted
+    struct bmap *masked;        // Docids of the documents above in the shard
+    time_t first_write;         // Of the documents in docs
+    int wal_fd;
+    char wal_path[PATH_MAX];
+    char merge_wal_path[PATH_MAX];
+    struct worker merges;       // Merges queued on the index merge pool
+    bool merge_queued;
+};
+
+struct segment *segment_new(struct sindex *si, const char *path);
+void segment_free(struct segment *seg);
+void segment_clear(struct segment *seg);
+void segment_log(struct segment *seg, const char *id, const json_t *j);
+uint32_t segment_put(struct segment *seg, const char *id, json_t *j);
+struct segment_doc *segment_find(struct segment *seg, const char *id);
+char *segment_get_document(struct segment *seg, const char *id, bool *found);
+char *segment_get_document_byid(struct segment *seg, uint32_t docid);
+int segment_size(const struct segment *seg);
+int segment_num_written(struct segment *seg);
+bool segment_aged(struct segment *seg);
+bool segment_start_merge(struct segment *seg);
+void segment_end_merge(struct segment *seg);
+bool segment_claim_merge(struct segment *seg);
+
+#endif
@@ -37,6 +37,7 @@ void shard_set_mapping(struct shard *s, const struct mapping *m) {
     // Set current index for removal and create a new sindex and
     // set mapping.
     sindex_set_mapping(s->sindex, m);
+    sindex_set_mapping(s->segment->sindex, m);
 }
 
 /* Adds one or more documents to a shard */
@@ -62,10 +63,20 @@ void shard_free(struct shard *s) {
     if (s->sindex) {
         sindex_free(s->sindex);
     }
+    if (s->segment) {
+        sindex_free(s->segment->sindex);
+        segment_free(s->segment);
+    }
     free(s);
 }
 
 void shard_clear(struct shard *s) {
+    // Writes not merged yet are gone too
+    struct segment *seg = s->segment;
+    WRLOCK(&seg->lock);
+    segment_clear(seg);
+    sindex_clear(seg->sindex, 0);
+    UNLOCK(&seg->lock);
     // Clear the shard data
     sdata_clear(s->sdata);
     // Now clear the search index
@@ -73,6 +84,10 @@ void shard_clear(struct shard *s) {
 }
 
 void shard_delete(struct shard *s) {
+    // The segment logs live in the shard folder, they go first
+    WRLOCK(&s->segment->lock);
+    segment_clear(s->segment);
+    UNLOCK(&s->segment->lock);
     // NOTE: Delete and set the pointers for sdata and sindex to NULL
     // so a shard_free which comes later on does not try to free it again
     // FIrst delete the shard data
@@ -96,20 +111,83 @@ void shard_delete(struct shard *s) {
     rmdir(path);
 }
 
-/* Get the document with id from shard data */
+/* Get the document with id from shard data.  Writes not merged yet are
+ * visible right away */
 char *shard_get_document(const struct shard *s, const char *id) {
+    bool found;
+    char *doc = segment_get_document(s->segment, id, &found);
+    if (found) return doc;
     return sdata_get_document(s->sdata, id);
 }
 
-/* Delete the given document from a shard */
+/* Looks up a facet string of the shard, facets of documents which are only
+ * in the segment so far are found in the segment index */
+char *shard_lookup_facet(const struct shard *s, uint32_t facet_id) {
+    char *fstr = sindex_lookup_facet(s->sindex, facet_id);
+    if (!fstr) {
+        RDLOCK(&s->segment->lock);
+        fstr = sindex_lookup_facet(s->segment->sindex, facet_id);
+        UNLOCK(&s->segment->lock);
+    }
+    return fstr;
+}
+
+/* Number of documents of the shard, counting those in the segment in place of
+ * the versions they mask */
+size_t shard_num_documents(const struct shard *s) {
+    struct segment *seg = s->segment;
+    RDLOCK(&seg->lock);
+    const struct bmap *used = s->sdata->used_bmap;
+    size_t num_docs = bmap_cardinality(used) - bmap_and_cardinality(used, seg->masked) +
+                      bmap_cardinality(seg->docids);
+    UNLOCK(&seg->lock);
+    return num_docs;
+}
+
+/* Writes the latest version of a document to the segment, NULL if it is
+ * deleted, and indexes it in the segment index in place of the version
+ * there.  The docid of the document in this shard is masked from queries
+ * till the segment is merged.  The write is logged first, unless it is read
+ * back from the log.  The segment takes over the reference to j */
+static void write_segment(struct shard *s, const char *id, json_t *j, bool log) {
+    struct segment *seg = s->segment;
+    WRLOCK(&seg->lock);
+    if (log) {
+        segment_log(seg, id, j);
+    }
+    struct segment_doc *sd = segment_find(seg, id);
+    json_t *old = (sd && sd->j) ? json_incref(sd->j) : NULL;
+    uint32_t docid = segment_put(seg, id, j);
+    if (old || j) {
+        // The segment index stores its own docid in the copy
+        json_t *copy = NULL;
+        if (j) {
+            copy = json_deep_copy(j);
+            json_object_set_new(copy, J_DOCID, json_integer(docid));
+        }
+        struct sindex_write w = {old, copy, docid};
+        sindex_write_documents(seg->sindex, &w, 1);
+        if (copy) json_decref(copy);
+    }
+    if (old) json_decref(old);
+    uint32_t sdocid;
+    if (sdata_get_docid(s->sdata, id, &sdocid)) {
+        bmap_add(seg->masked, sdocid);
+    }
+    UNLOCK(&seg->lock);
+}
+
+static void shard_write_segment(struct shard *s, const char *id, json_t *j) {
+    write_segment(s, id, j, true);
+}
+
+/* Delete the given document from a shard.  Like replaces and updates, the
+ * delete is only written to the segment till it is merged */
 bool shard_delete_document(struct shard *s, const json_t *j) {
     const char *id = json_string_value(json_object_get(j, J_ID));
     if (!id) return false;
-    uint32_t docid = sdata_delete_document(s->sdata, id);
-    if (docid) {
-        sindex_delete_document(s->sindex, j, docid);
-    }
-    return !!docid;
+    shard_write_segment(s, id, NULL);
+    return true;
 }
 
 void shard_update_stats(struct shard *s, struct json_t *result) {
@@ -119,32 +197,188 @@ void shard_update_stats(struct shard *s, struct json_t *result) {
     bmap_free(docids);
 }
 
+void shard_freeze(struct shard *s, struct json_t *result) {
+    sindex_freeze(s->sindex, result);
+}
+
 bool shard_replace_document(struct shard *s, struct json_t *newj, const struct json_t *oldj) {
-    // If we have an existing document to replace, delete that
-    if (oldj) {
-        const char *id = json_string_value(json_object_get(oldj, J_ID));
-        if (!id) return false;
-        uint32_t docid = sdata_delete_document(s->sdata, id);
-        if (docid) {
-            sindex_delete_document(s->sindex, oldj, docid);
-        }
-    }
-    shard_add_documents(s, newj);
+    const char *id = json_string_value(json_object_get(newj, J_ID));
+    if (!id) return false;
+    shard_write_segment(s, id, json_incref(newj));
     return true;
 }
 
+/* Updates the latest version of a document, which is the one in the segment if
+ * it was written since the last merge.  oldj is only used for its id, as
+ * writes queued before this one may have changed the document since */
 bool shard_update_document(struct shard *s, struct json_t *newj, struct json_t *oldj) {
     const char *id = json_string_value(json_object_get(oldj, J_ID));
     if (!id) return false;
-    uint32_t docid = sdata_delete_document(s->sdata, id);
-    if (docid) {
-        sindex_delete_document(s->sindex, oldj, docid);
+    json_t *j = NULL;
+    // Documents are only added to the segment by this thread, one which is
+    // not in it is not being merged either
+    RDLOCK(&s->segment->lock);
+    struct segment_doc *sd = segment_find(s->segment, id);
+    if (sd && sd->j) j = json_deep_copy(sd->j);
+    UNLOCK(&s->segment->lock);
+    if (!sd) {
+        char *doc = sdata_get_document(s->sdata, id);
+        json_error_t error;
+        if (doc) j = json_loads(doc, 0, &error);
+        free(doc);
     }
-    json_object_update(oldj, newj);
-    shard_add_documents(s, oldj);
+    // The document was deleted since
+    if (!j) return false;
+    json_object_update(j, newj);
+    shard_write_segment(s, id, j);
     return true;
 }
 
+/* Removes the merged documents from the segment index, except those written
+ * again since, and masks the docids of the documents still in the segment.
+ * Assumes the write lock is held */
+static void shard_end_merge(struct shard *s) {
+    struct segment *seg = s->segment;
+    int num_docs = kv_size(seg->merging.docs);
+    if (kv_size(seg->docs.docs) == 0) {
+        // Nothing was written since, the index starts over
+        sindex_clear(seg->sindex, 0);
+    } else {
+        struct sindex_write *writes = malloc(num_docs * sizeof(struct sindex_write));
+        int n = 0;
+        for (int i = 0; i < num_docs; i++) {
+            struct segment_doc *sd = &kv_A(seg->merging.docs, i);
+            if (sd->j && kh_get(SEGDOCS, seg->docs.kh_docs, sd->id) == kh_end(seg->docs.kh_docs)) {
+                writes[n].old = sd->j;
+                writes[n].j = NULL;
+                writes[n].docid = sd->docid;
+                n++;
+            }
+        }
+        if (n) {
+            sindex_write_documents(seg->sindex, writes, n);
+        }
+        free(writes);
+    }
+    segment_end_merge(seg);
+
+    bmap_free(seg->masked);
+    seg->masked = bmap_new();
+    for (int i = 0; i < kv_size(seg->docs.docs); i++) {
+        uint32_t docid;
+        if (sdata_get_docid(s->sdata, kv_A(seg->docs.docs, i).id, &docid)) {
+            bmap_add(seg->masked, docid);
+        }
+    }
+}
+
+/* Merges the documents written to the segment into the shard, in a single sdata
+ * and sindex write each.  A document which is stored already keeps its docid
+ * and only the fields of it which changed are reindexed.  Documents written
+ * while a merge runs are merged next, till the segment is empty.
+ *
+ * Queries read the shard index while it is written, so the docids of the
+ * merged documents stay masked and the segment index keeps them till the
+ * write is done.  Only one merge of a segment runs at a time */
+void shard_merge_segment(struct shard *s) {
+    struct segment *seg = s->segment;
+    pthread_mutex_lock(&seg->merge_lock);
+    for (;;) {
+        WRLOCK(&seg->lock);
+        if (!segment_start_merge(seg)) {
+            seg->merge_queued = false;
+            UNLOCK(&seg->lock);
+            break;
+        }
+        int num_docs = kv_size(seg->merging.docs);
+        const char **ids = malloc(num_docs * sizeof(char *));
+        json_t **docs = malloc(num_docs * sizeof(json_t *));
+        uint32_t *docids = malloc(num_docs * sizeof(uint32_t));
+        struct sindex_write *writes = malloc(num_docs * sizeof(struct sindex_write));
+        for (int i = 0; i < num_docs; i++) {
+            struct segment_doc *sd = &kv_A(seg->merging.docs, i);
+            ids[i] = sd->id;
+            // Documents in the segment are still being read, write copies
+            docs[i] = sd->j ? json_deep_copy(sd->j) : NULL;
+            char *old = sdata_get_document(s->sdata, sd->id);
+            json_error_t error;
+            writes[i].old = old ? json_loads(old, 0, &error) : NULL;
+            writes[i].j = docs[i];
+            free(old);
+        }
+
+        // The documents of the shard and its docids change along with the
+        // mask, new documents are masked before they are indexed
+        sdata_write_documents(s->sdata, ids, docs, docids, num_docs);
+        for (int i = 0; i < num_docs; i++) {
+            writes[i].docid = docids[i];
+            if (docs[i]) {
+                bmap_add(seg->masked, json_integer_value(json_object_get(docs[i], J_DOCID)));
+            }
+        }
+        UNLOCK(&seg->lock);
+
+        sindex_write_documents(s->sindex, writes, num_docs);
+        M_DBG("Merged %d documents into shard %d", num_docs, s->shard_id);
+
+        WRLOCK(&seg->lock);
+        shard_end_merge(s);
+        UNLOCK(&seg->lock);
+
+        for (int i = 0; i < num_docs; i++) {
+            if (docs[i]) json_decref(docs[i]);
+            if (writes[i].old) json_decref((json_t *)writes[i].old);
+        }
+        free(ids);
+        free(docs);
+        free(docids);
+        free(writes);
+    }
+    pthread_mutex_unlock(&seg->merge_lock);
+}
+
+/* Applies the writes of a segment log, till a line which is torn or cannot
+ * be parsed */
+static void replay_segment_log(struct shard *s, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    char *line = NULL;
+    size_t size = 0;
+    int count = 0;
+    while (getline(&line, &size, f) > 0) {
+        json_error_t error;
+        json_t *r = json_loads(line, 0, &error);
+        const char *id = json_string_value(json_object_get(r, J_ID));
+        json_t *doc = json_object_get(r, J_DOC);
+        if (!id || !doc) {
+            M_ERR("Segment log %s ends in a torn write after %d writes", path, count);
+            json_decref(r);
+            break;
+        }
+        write_segment(s, id, json_is_object(doc) ? json_incref(doc) : NULL, false);
+        json_decref(r);
+        count++;
+    }
+    free(line);
+    fclose(f);
+    M_INFO("Replayed %d writes of segment log %s", count, path);
+}
+
+/* Merges the writes logged to the segment by the last run which it did not
+ * merge, before the shard is used.  A log which was being merged goes first,
+ * its writes are older.  The shard mapping is set already */
+void shard_replay_segment(struct shard *s) {
+    struct segment *seg = s->segment;
+    replay_segment_log(s, seg->merge_wal_path);
+    shard_merge_segment(s);
+    unlink(seg->merge_wal_path);
+    if (rename(seg->wal_path, seg->merge_wal_path) == 0) {
+        replay_segment_log(s, seg->merge_wal_path);
+        shard_merge_segment(s);
+        unlink(seg->merge_wal_path);
+    }
+}
+
 struct shard *shard_new(struct index *in, uint16_t shard_id) {
     struct shard *s = calloc(1, sizeof(struct shard));
     s->index = in;
@@ -166,6 +400,7 @@ struct shard *shard_new(struct index *in, uint16_t shard_id) {
     s->sdata = sdata_new(s);
     // Create / load shard search index for this shard
     s->sindex = sindex_new(s);
+    s->segment = segment_new(sindex_new_memory(s), s->base_path);
     return s;
 }
 
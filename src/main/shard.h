@@ -4,6 +4,7 @@
 #include "index.h"
 #include "sdata.h"
 #include "sindex.h"
+#include "segment.h"
 
 struct shard {
     uint16_t shard_id;
@@ -12,6 +13,7 @@ struct shard {
     struct index *index;
     struct sdata *sdata;
     struct sindex *sindex;
+    struct segment *segment;    // Single document writes not merged yet
 };
 
 struct shard *shard_new(struct index *in, uint16_t shard_id);
@@ -21,10 +23,15 @@ void shard_delete(struct shard *s);
 void shard_clear(struct shard *s);
 void shard_set_mapping(struct shard *s, const struct mapping *m);
 char *shard_get_document(const struct shard *s, const char *id);
+char *shard_lookup_facet(const struct shard *s, uint32_t facet_id);
 bool shard_delete_document(struct shard *s, const struct json_t *j);
 bool shard_replace_document(struct shard *s, struct json_t *newj, const struct json_t *oldj);
 bool shard_update_document(struct shard *s, struct json_t *newj, struct json_t *oldj);
+void shard_merge_segment(struct shard *s);
+void shard_replay_segment(struct shard *s);
+size_t shard_num_documents(const struct shard *s);
 void shard_update_stats(struct shard *s, struct json_t *result);
+void shard_freeze(struct shard *s, struct json_t *result);
 struct bmap *shard_get_all_docids(struct shard *s);
 
 #endif
@@ -8,41 +8,43 @@
 #include "mbmap.h"
 #include "analyzer.h"
 #include "ksort.h"
+#include "workers.h"
 
 #pragma GCC diagnostic ignored "-Wformat-truncation="
 
+// Documents of a batch are analyzed in parallel in parts of at least these many
+#define ANALYZE_PART_DOCS   256
+
 #define wid2bmap_add(dbi, kh, txn, keyid, vid, priority) {  \
-    uint64_t hid = IDPRIORITY(keyid, priority);             \
-    struct mbmap *map;                                      \
-    khiter_t k = kh_get(WID2MBMAP, kh, hid);                \
-    if (LIKELY(k != kh_end(kh))) {                          \
-        map = kh_val(kh, k);                              \
-    } else {                                                \
-        map = mbmap_new(hid);                            \
-        mbmap_load(map, txn, dbi);     \
-        int ret = 0;                                        \
-        k = kh_put(WID2MBMAP, kh, hid, &ret);              \
-        kh_value(kh, k) = map;                              \
-    }                                                       \
+    struct mbmap *map = id2mbmap(dbi, kh, txn, keyid, priority); \
     mbmap_add(map, vid, txn, dbi);                          \
 }
 
 #define wid2bmap_remove(dbi, kh, txn, keyid, vid, priority) {  \
-    uint64_t hid = IDPRIORITY(keyid, priority);             \
-    struct mbmap *map;                                      \
-    khiter_t k = kh_get(WID2MBMAP, kh, hid);                \
-    if (LIKELY(k != kh_end(kh))) {                          \
-        map = kh_val(kh, k);                              \
-    } else {                                                \
-        map = mbmap_new(hid);                            \
-        mbmap_load(map, txn, dbi);     \
-        int ret = 0;                                        \
-        k = kh_put(WID2MBMAP, kh, hid, &ret);              \
-        kh_value(kh, k) = map;                              \
-    }                                                       \
+    struct mbmap *map = id2mbmap(dbi, kh, txn, keyid, priority); \
     mbmap_remove(map, vid, txn, dbi);                       \
 }
 
+/* Returns the bitmap of the write cache for keyid with the given priority,
+ * loading it on first use */
+static struct mbmap *id2mbmap(MDB_dbi dbi, khash_t(WID2MBMAP) *kh, MDB_txn *txn,
+                              uint32_t keyid, int priority) {
+    uint64_t hid = IDPRIORITY(keyid, priority);
+    khiter_t k = kh_get(WID2MBMAP, kh, hid);
+    if (LIKELY(k != kh_end(kh))) {
+        return kh_val(kh, k);
+    }
+    struct mbmap *map = mbmap_new(hid);
+    // Bitmaps of an in memory index are all in kh already
+    if (txn) {
+        mbmap_load(map, txn, dbi);
+    }
+    int ret = 0;
+    k = kh_put(WID2MBMAP, kh, hid, &ret);
+    kh_value(kh, k) = map;
+    return map;
+}
+
 
 typedef struct {
     wid_pos_t *wp;
@@ -63,21 +65,27 @@ static int double_compare(const MDB_val *a, const MDB_val *b) {
         *(double *)b->mv_data > *(double *)a->mv_data;
 }
 
-static void get_doc_stats(uint32_t docid, void *data) {
-    int rc;
-    struct sindex_stats *s = data;
+static void get_doc_stats(struct sindex_stats *s, const struct bmap *docids) {
+    struct bmap_cursor cur;
+    uint32_t block[BMAP_BLOCK];
     MDB_val key, mdata;
+    int n;
     key.mv_size = sizeof(uint32_t);
-    key.mv_data = &docid;
-    if ((rc = mdb_get(s->txn, s->si->docid2data_dbi, &key, &mdata)) == 0) {
-        uint32_t size = mdata.mv_size;
-        if (size > s->max) {
-            s->max = size;
-        }
-        if (size < s->min) {
-            s->min = size;
+    bmap_cursor_init(&cur, docids);
+    while ((n = bmap_cursor_next(&cur, block, BMAP_BLOCK)) > 0) {
+        for (int i = 0; i < n; i++) {
+            key.mv_data = &block[i];
+            if (mdb_get(s->txn, s->si->docid2data_dbi, &key, &mdata) == 0) {
+                uint32_t size = mdata.mv_size;
+                if (size > s->max) {
+                    s->max = size;
+                }
+                if (size < s->min) {
+                    s->min = size;
+                }
+                s->sum += size;
+            }
         }
-        s->sum += size;
     }
 }
 
@@ -88,27 +96,87 @@ void sindex_update_stats(struct sindex *si, struct bmap *docids, json_t *result)
     stats.sum = 0;
     stats.si = si;
     mdb_txn_begin(si->env, NULL, MDB_RDONLY, &stats.txn);
-    bmap_iterate(docids, get_doc_stats, &stats);
+    get_doc_stats(&stats, docids);
     mdb_txn_abort(stats.txn);
     json_object_set_new(result, J_MIN_DD, json_integer(stats.min));
     json_object_set_new(result, J_MAX_DD, json_integer(stats.max));
     json_object_set_new(result, J_SUM_DD, json_integer(stats.sum));
     json_object_set_new(result, J_AVG_DD, json_real(stats.sum * 1.0/bmap_cardinality(docids)));
+
+    // Trie pages and how well the nodes of every type use them
+    struct dtrie_stats ts;
+    dtrie_get_stats(si->trie, &ts);
+    json_t *jt = json_object();
+    json_object_set_new(jt, J_NUM_WORDS, json_integer(ts.word_count));
+    json_object_set_new(jt, J_NUM_TWORDS, json_integer(ts.tword_count));
+    json_object_set_new(jt, J_PAGES, json_integer(ts.num_pages));
+    json_object_set_new(jt, J_FILE_PAGES, json_integer(ts.file_pages));
+    json_object_set_new(jt, J_BIG_NODES, json_integer(ts.big_nodes));
+    json_t *ja = json_array();
+    for (int i = 1; i < NS_MAX; i++) {
+        struct dtrie_type_stats *t = &ts.types[i];
+        uint32_t nodes = t->used + t->free + t->retired;
+        json_t *jn = json_object();
+        json_object_set_new(jn, J_NODE_SIZE, json_integer(t->node_size));
+        json_object_set_new(jn, J_PAGES, json_integer(t->pages));
+        json_object_set_new(jn, J_USED, json_integer(t->used));
+        json_object_set_new(jn, J_FREE, json_integer(t->free));
+        json_object_set_new(jn, J_RETIRED, json_integer(t->retired));
+        json_object_set_new(jn, J_UTILIZATION, json_real(nodes ? t->used * 1.0 / nodes : 0));
+        json_array_append_new(ja, jn);
+    }
+    json_object_set_new(jt, J_NODE_TYPES, ja);
+    json_object_set_new(result, J_TRIE, jt);
+}
+
+/* Freezes the trie so queries use a compact copy of it, till words are
+ * added again.  Sets if it worked and the sizes of both tries */
+void sindex_freeze(struct sindex *si, json_t *result) {
+    bool frozen = dtrie_freeze(si->trie);
+    uint64_t size, frozen_size;
+    dtrie_sizes(si->trie, &size, &frozen_size);
+    json_object_set_new(result, J_FROZEN, json_boolean(frozen));
+    json_object_set_new(result, J_TRIE_SIZE, json_integer(size));
+    json_object_set_new(result, J_FROZEN_SIZE, json_integer(frozen_size));
+}
+
+static void batch_words_init(struct batch_words *b) {
+    b->kh_words = kh_init(WORDDICT);
+    kv_init(b->words);
+    kv_init(b->tokens);
+    arena_init(&b->arena);
+}
+
+static void batch_words_free(struct batch_words *b) {
+    kh_destroy(WORDDICT, b->kh_words);
+    kv_destroy(b->words);
+    kv_destroy(b->tokens);
+    arena_destroy(&b->arena);
 }
 
 static void si_write_start(struct sindex *si) {
     // Prepares the write cache
     si->wc = calloc(1, sizeof(struct write_cache));
 
-    // Setup all khashes
-    si->wc->kh_facetid2str = kh_init(FACETID2STR);
-    si->wc->kh_boolid2bmap = kh_init(WID2MBMAP);
-    si->wc->kh_facetid2bmap = kh_init(WID2MBMAP);
-    si->wc->kh_wid2bmap = kh_init(WID2MBMAP);
-    si->wc->kh_twid2bmap = kh_init(WID2MBMAP);
-    si->wc->kh_twid2widbmap = kh_init(WID2MBMAP);
+    // Setup all khashes, an in memory index writes to those it keeps
+    if (si->mem) {
+        si->wc->kh_facetid2str = si->mem->kh_facetid2str;
+        si->wc->kh_boolid2bmap = si->mem->kh_boolid2bmap;
+        si->wc->kh_facetid2bmap = si->mem->kh_facetid2bmap;
+        si->wc->kh_wid2bmap = si->mem->kh_wid2bmap;
+        si->wc->kh_twid2bmap = si->mem->kh_twid2bmap;
+        si->wc->kh_twid2widbmap = si->mem->kh_twid2widbmap;
+    } else {
+        si->wc->kh_facetid2str = kh_init(FACETID2STR);
+        si->wc->kh_boolid2bmap = kh_init(WID2MBMAP);
+        si->wc->kh_facetid2bmap = kh_init(WID2MBMAP);
+        si->wc->kh_wid2bmap = kh_init(WID2MBMAP);
+        si->wc->kh_twid2bmap = kh_init(WID2MBMAP);
+        si->wc->kh_twid2widbmap = kh_init(WID2MBMAP);
+    }
     si->wc->kh_phrasebmap = kh_init(WID2MBMAP);
     si->wc->kh_idnum2dbl = kh_init(IDNUM2DBL);
+    batch_words_init(&si->wc->words);
  
     // Setup per obj data
     struct doc_data *od = &si->wc->od;
@@ -122,8 +190,16 @@ static void si_write_start(struct sindex *si) {
     if (si->map->num_facets) {
         od->facet_data = calloc(si->map->num_facets, sizeof(kvec_t(uint32_t)));
     }
-
+    od->changed_strings = calloc(si->map->num_strings + si->map->num_numbers +
+                                 si->map->num_facets + 1, sizeof(bool));
+    od->changed_numbers = od->changed_strings + si->map->num_strings;
+    od->changed_facets = od->changed_numbers + si->map->num_numbers;
+    od->kh_usedtwid = kh_init(UNIQWID);
+
+    // Prefixes added by this batch get twids up to the configured depth
+    si->trie->twid_levels = si->shard->index->cfg.prefix_levels;
     dtrie_write_start(si->trie);
+    if (si->mem) return;
     // Begin the write transaction
     mdb_txn_begin(si->env, NULL, 0, &si->txn);
     mdb_txn_begin(si->env, NULL, MDB_RDONLY, &si->read_txn);
@@ -154,6 +230,17 @@ static inline void store_id2mbmap(struct sindex *si, struct mbmap *b, MDB_dbi db
     mbmap_free(b);
 }
 
+/* Stores the bitmaps of the write cache in kh, unless the index keeps them in
+ * memory */
+static void store_id2mbmaps(struct sindex *si, khash_t(WID2MBMAP) *kh, MDB_dbi dbi) {
+    if (si->mem) return;
+    struct mbmap *mbmap;
+    kh_foreach_value(kh, mbmap, {
+        store_id2mbmap(si, mbmap, dbi);
+    });
+    kh_destroy(WID2MBMAP, kh);
+}
+
 static void store_facetid2str(struct sindex *si, uint32_t id, char *str) {
     MDB_val key, data;
     data.mv_size = strlen(str)+1;
@@ -183,38 +270,14 @@ static void store_idnum2dbl(struct sindex *si, uint64_t id, double *d) {
 
 static void si_write_end(struct sindex *si) {
 
+    // Store bool id, facet id, twid to wid, twid and wid to docid mappings
+    store_id2mbmaps(si, si->wc->kh_boolid2bmap, si->boolid2bmap_dbi);
+    store_id2mbmaps(si, si->wc->kh_facetid2bmap, si->facetid2bmap_dbi);
+    store_id2mbmaps(si, si->wc->kh_twid2widbmap, si->twid2widbmap_dbi);
+    store_id2mbmaps(si, si->wc->kh_twid2bmap, si->twid2bmap_dbi);
+    store_id2mbmaps(si, si->wc->kh_wid2bmap, si->wid2bmap_dbi);
+    // Store phrase to docid mapping, which is never kept in memory
     struct mbmap *mbmap;
-
-    // Store bool id to bmap mapping
-    kh_foreach_value(si->wc->kh_boolid2bmap, mbmap, {
-        store_id2mbmap(si, mbmap, si->boolid2bmap_dbi);
-    });
-    kh_destroy(WID2MBMAP, si->wc->kh_boolid2bmap);
-
-    // Store facet id to bmap mapping
-    kh_foreach_value(si->wc->kh_facetid2bmap, mbmap, {
-        store_id2mbmap(si, mbmap, si->facetid2bmap_dbi);
-    });
-    kh_destroy(WID2MBMAP, si->wc->kh_facetid2bmap);
-
-    // Store twid to wid mapping
-    kh_foreach_value(si->wc->kh_twid2widbmap, mbmap, {
-        store_id2mbmap(si, mbmap, si->twid2widbmap_dbi);
-    });
-    kh_destroy(WID2MBMAP, si->wc->kh_twid2widbmap);
-
-    // Store twid to docid mapping
-    kh_foreach_value(si->wc->kh_twid2bmap, mbmap, {
-        store_id2mbmap(si, mbmap, si->twid2bmap_dbi);
-    });
-    kh_destroy(WID2MBMAP, si->wc->kh_twid2bmap);
-
-    // Store wid to docid mapping
-    kh_foreach_value(si->wc->kh_wid2bmap, mbmap, {
-        store_id2mbmap(si, mbmap, si->wid2bmap_dbi);
-    });
-    kh_destroy(WID2MBMAP, si->wc->kh_wid2bmap);
-    // Store phrase to docid mapping
     kh_foreach_value(si->wc->kh_phrasebmap, mbmap, {
         store_id2mbmap(si, mbmap, si->phrase_dbi);
     });
@@ -224,14 +287,16 @@ static void si_write_end(struct sindex *si) {
     // Store facet id to string mappings
     uint32_t facet_id;
     char *str;
-    kh_foreach(si->wc->kh_facetid2str, facet_id, str, {
-        // Only store if required, we may have null values
-        if (str) {
-            store_facetid2str(si, facet_id, str);
-            free(str);
-        }
-    });
-    kh_destroy(FACETID2STR, si->wc->kh_facetid2str);
+    if (!si->mem) {
+        kh_foreach(si->wc->kh_facetid2str, facet_id, str, {
+            // Only store if required, we may have null values
+            if (str) {
+                store_facetid2str(si, facet_id, str);
+                free(str);
+            }
+        });
+        kh_destroy(FACETID2STR, si->wc->kh_facetid2str);
+    }
 
 	uint64_t grpid;
 	double *d;
@@ -241,14 +306,29 @@ static void si_write_end(struct sindex *si) {
     });
     kh_destroy(IDNUM2DBL, si->wc->kh_idnum2dbl);
 
-    dtrie_write_end(si->trie, si->boolid2bmap_dbi, si->txn);
+    struct dtrie_garbage *g = dtrie_write_end(si->trie, si->boolid2bmap_dbi, si->txn);
+    // Trie nodes replaced by this batch are reused once running queries are done
+    if (g) {
+        app_add_freejob(si->shard->index->app, FREE_TRIE_NODES, g);
+    }
     // Commit write transaction
-    mdb_txn_commit(si->txn);
-    mdb_txn_abort(si->read_txn);
+    if (!si->mem) {
+        mdb_txn_commit(si->txn);
+        mdb_txn_abort(si->read_txn);
+    }
+
+    // Free the words of the batch
+    batch_words_free(&si->wc->words);
+    for (int i = 0; i < si->wc->num_parts; i++) {
+        batch_words_free(&si->wc->parts[i]);
+    }
+    free(si->wc->parts);
 
     // Free common document data
     free(si->wc->od.num_data);
     free(si->wc->od.facet_data);
+    free(si->wc->od.changed_strings);
+    kh_destroy(UNIQWID, si->wc->od.kh_usedtwid);
     // Free write cache finally
     free(si->wc);
 }
@@ -290,7 +370,19 @@ static void store_docdata(struct sindex *si, struct doc_data *od, uint8_t *wpdat
     data.mv_data = NULL;
     data.mv_size = full_size;
 
-    if (mdb_put(si->txn, si->docid2data_dbi, &key, &data, MDB_RESERVE) != 0) {
+    if (si->mem) {
+        // The data follows its MDB_val in the same allocation
+        MDB_val *mdata = malloc(sizeof(MDB_val) + full_size);
+        mdata->mv_size = full_size;
+        mdata->mv_data = mdata + 1;
+        data.mv_data = mdata->mv_data;
+        int ret = 0;
+        khiter_t k = kh_put(DOCID2DATA, si->mem->kh_docid2data, od->docid, &ret);
+        if (ret == 0) {
+            free(kh_value(si->mem->kh_docid2data, k));
+        }
+        kh_value(si->mem->kh_docid2data, k) = mdata;
+    } else if (mdb_put(si->txn, si->docid2data_dbi, &key, &data, MDB_RESERVE) != 0) {
         M_ERR("Failed to allocate data to store docid2fndata for docid %u", od->docid);
         return;
     }
@@ -521,12 +613,106 @@ static void sindex_store_docdata(struct sindex *si) {
     }
 }
 
+/* Adds a word position read back from the docdata of a document to od, unless
+ * its field changed */
+static inline void add_docdata_word(struct doc_data *od, uint32_t wid, int priority,
+                                    uint32_t position) {
+    if (od->changed_strings[priority]) return;
+    wid_pos_t *widpos = malloc(sizeof(wid_pos_t));
+    widpos->wid = wid;
+    widpos->priority = priority;
+    widpos->position = position;
+    kv_push(wid_pos_t *, od->kv_widpos, widpos);
+    int ret = 0;
+    khiter_t k = kh_put(UNIQWID, od->kh_uniqwid, wid, &ret);
+    if (ret == 1) {
+        kh_value(od->kh_uniqwid, k) = 1;
+    } else {
+        kh_value(od->kh_uniqwid, k) = kh_value(od->kh_uniqwid, k) + 1;
+    }
+}
+
+/* Reads the docdata of a document back into od, leaving out the fields which
+ * changed.  This is the reverse of store_docdata and gen_wordpos_data.  Without
+ * od, it only checks the docdata is laid out as the current mapping expects */
+static bool read_docdata(struct sindex *si, uint32_t docid, struct doc_data *od) {
+    MDB_val data;
+    if (sindex_get_docdata(si, si->txn, docid, &data) != 0) return false;
+    uint8_t *start = data.mv_data;
+    uint8_t *end = start + data.mv_size;
+    if (data.mv_size < sizeof(uint32_t)) return false;
+    uint32_t size = *(uint32_t *)start;
+    if (size > data.mv_size) return false;
+
+    // Numbers, then a count and facet ids for every facet
+    double *dpos = (double *)(start + sizeof(uint32_t));
+    uint32_t *pos = (uint32_t *)(dpos + si->map->num_numbers);
+    if ((uint8_t *)pos > start + size) return false;
+    for (int i = 0; i < si->map->num_numbers; i++) {
+        if (od && !od->changed_numbers[i]) od->num_data[i] = dpos[i];
+    }
+    for (int i = 0; i < si->map->num_facets; i++) {
+        facets_t *f = (facets_t *)pos;
+        if ((uint8_t *)(pos + 1) > start + size) return false;
+        if ((uint8_t *)(pos + 1 + f->count) > start + size) return false;
+        if (od && !od->changed_facets[i]) {
+            for (int j = 0; j < f->count; j++) {
+                kv_push(uint32_t, od->facet_data[i], f->data[j]);
+            }
+        }
+        pos += (f->count + 1);
+    }
+
+    // Word positions, a document without words has none
+    if (size == data.mv_size) return true;
+    uint8_t *head = start + size;
+    if (head + 2 > end) return false;
+    uint16_t num_words = *(uint16_t *)head;
+    wid_info_t *wi = (wid_info_t *)(head + 2);
+    // Frequencies and positions of words seen more than once follow in order
+    uint8_t *c = (uint8_t *)(wi + num_words);
+    if (c > end) return false;
+    for (int i = 0; i < num_words; i++) {
+        if (wi[i].priority >= si->map->num_strings) return false;
+        if (wi[i].is_position) {
+            if (od) add_docdata_word(od, wi[i].wid, wi[i].priority, wi[i].offset);
+            continue;
+        }
+        if (head + wi[i].offset != c || c >= end) return false;
+        int freq = *c++;
+        if (freq < 2) return false;
+        while (freq > 0) {
+            if (c + 2 > end) return false;
+            int priority = *c++;
+            int count = *c++;
+            if (priority >= si->map->num_strings || count == 0) return false;
+            freq -= count;
+            while (count--) {
+                int position;
+                c = read_vint(c, &position);
+                if (c > end) return false;
+                if (od) add_docdata_word(od, wi[i].wid, priority, position);
+            }
+            // Every field ends with 0xFF
+            if (c >= end || *c != 0xFF) return false;
+            c++;
+        }
+        if (freq != 0) return false;
+    }
+    return c == end;
+}
 
 /**** Indexing *****/
 
 /* Indexes a double into the respective num_dbi */
 static inline void index_number(struct sindex *si, int priority, double d) {
     uint32_t docid = si->wc->od.docid;
+    // In memory indexes have no aggregations index, their docdata is used
+    if (si->mem) {
+        struct doc_number n = {d, docid};
+        kv_push(struct doc_number, si->mem->nums[priority], n);
+        return;
+    }
     MDB_val key, data;
     key.mv_size = sizeof(d);
     key.mv_data = &d;
@@ -567,6 +753,17 @@ static inline void index_number(struct sindex *si, int priority, double d) {
 /* Deindexes a double in the respective num_dbi */
 static inline void deindex_number(struct sindex *si, int priority, double d) {
     uint32_t docid = si->wc->od.docid;
+    if (si->mem) {
+        doc_numbers_t *nums = &si->mem->nums[priority];
+        for (size_t i = 0; i < kv_size(*nums); i++) {
+            if (kv_A(*nums, i).docid == docid && kv_A(*nums, i).value == d) {
+                kv_A(*nums, i) = kv_A(*nums, kv_size(*nums) - 1);
+                kv_size(*nums)--;
+                break;
+            }
+        }
+        return;
+    }
     MDB_val key, data;
     key.mv_size = sizeof(d);
     key.mv_data = &d;
@@ -615,7 +812,7 @@ static void index_string_facet(struct sindex *si, const char *str, int priority)
         key.mv_data = (void *)&facet_id;
         // If it already exists, we need not write so set a NULL value to 
         // avoid looking up mdb everytime we encounter this facetid
-        if (mdb_get(si->txn, si->facetid2str_dbi, &key, &data) == 0) {
+        if (!si->mem && mdb_get(si->txn, si->facetid2str_dbi, &key, &data) == 0) {
             kh_value(kh, k) = NULL;
         } else {
             // We need to store this value, create a copy which will 
@@ -655,30 +852,32 @@ static void deindex_number_facet(struct sindex *si, double d, int priority) {
 }
 
 
-static void string_new_word_pos(word_pos_t *wp, void *data) {
-    struct analyzer_data *ad = data;
+/* Indexes a word of the batch, the trie already has it */
+static void index_word(struct analyzer_data *ad, struct batch_word *bw, uint32_t position) {
     struct sindex *si = ad->si;
+    struct dtrie_word *w = &bw->w;
     struct doc_data *od = &si->wc->od;
     int p = ad->priority + 1;
-    int limit = wp->word.length >= LEVLIMIT ? LEVLIMIT : wp->word.length;
-
-    // Check if the word exists
-    uint32_t wid = dtrie_exists(si->trie, wp->word.chars, wp->word.length, od->twid);
-    if (wid == 0) {
-        // If it does not exist, insert it and update the top-level word ids
-        // mapping to include the newly added word id
-        wid = dtrie_insert(si->trie, wp->word.chars, wp->word.length, od->twid);
+    int limit = w->length >= DT_MAX_LEVELS ? DT_MAX_LEVELS : w->length;
+    uint32_t wid = w->wid;
+    const uint32_t *twid = w->twids;
+
+    if (w->added) {
+        // The batch added the word, update the top-level word ids mapping
+        // to include the new word id the first time it is seen
+        w->added = false;
         // Store top-level word id to word id mapping
         for (int i = 0; i < limit; i++) {
+            if (!twid[i]) continue;
             wid2bmap_add(si->twid2widbmap_dbi, si->wc->kh_twid2widbmap, si->read_txn, 
-                         od->twid[i], wid, 0);
+                         twid[i], wid, 0);
             wid2bmap_add(si->twid2widbmap_dbi, si->wc->kh_twid2widbmap, si->read_txn, 
-                         od->twid[i], wid, p);
+                         twid[i], wid, p);
         }
 #ifdef TRACK_WIDS
         MDB_val key, data;
-        data.mv_size = (wp->word.length) * sizeof(chr_t);
-        data.mv_data = wp->word.chars;
+        data.mv_size = (w->length) * sizeof(chr_t);
+        data.mv_data = (void *)w->chars;
 
         key.mv_size = sizeof(uint32_t);
         key.mv_data = &wid;
@@ -686,25 +885,42 @@ static void string_new_word_pos(word_pos_t *wp, void *data) {
 #endif
     }
 
+    // Look up the bitmaps the first time the word is seen, and again only
+    // when the field priority changes
+    if (UNLIKELY(!bw->wid_map)) {
+        bw->wid_map = id2mbmap(si->wid2bmap_dbi, si->wc->kh_wid2bmap, si->read_txn, wid, 0);
+        for (int i = 0; i < limit; i++) {
+            if (!twid[i]) continue;
+            bw->twid_maps[i] = id2mbmap(si->twid2bmap_dbi, si->wc->kh_twid2bmap,
+                                        si->read_txn, twid[i], 0);
+        }
+    }
+    if (UNLIKELY(bw->priority != p)) {
+        bw->priority = p;
+        bw->pwid_map = id2mbmap(si->wid2bmap_dbi, si->wc->kh_wid2bmap, si->read_txn, wid, p);
+        for (int i = 0; i < limit; i++) {
+            if (!twid[i]) continue;
+            bw->ptwid_maps[i] = id2mbmap(si->twid2bmap_dbi, si->wc->kh_twid2bmap,
+                                         si->read_txn, twid[i], p);
+        }
+    }
+
     // Set the top-level wid to obj id mapping
     for (int i = 0; i < limit; i++) {
-        wid2bmap_add(si->twid2bmap_dbi, si->wc->kh_twid2bmap, si->read_txn, 
-                     od->twid[i], od->docid, 0);
-        wid2bmap_add(si->twid2bmap_dbi, si->wc->kh_twid2bmap, si->read_txn, 
-                     od->twid[i], od->docid, p);
+        if (!twid[i]) continue;
+        mbmap_add(bw->twid_maps[i], od->docid, si->read_txn, si->twid2bmap_dbi);
+        mbmap_add(bw->ptwid_maps[i], od->docid, si->read_txn, si->twid2bmap_dbi);
     }
 
     // Set the wid to obj id mapping
-    wid2bmap_add(si->wid2bmap_dbi, si->wc->kh_wid2bmap, si->read_txn, 
-            wid, od->docid, 0);
-    wid2bmap_add(si->wid2bmap_dbi, si->wc->kh_wid2bmap, si->read_txn, 
-            wid, od->docid, p);
+    mbmap_add(bw->wid_map, od->docid, si->read_txn, si->wid2bmap_dbi);
+    mbmap_add(bw->pwid_map, od->docid, si->read_txn, si->wid2bmap_dbi);
 
     // Store wid positions
     wid_pos_t *widpos = malloc(sizeof(wid_pos_t));
     widpos->wid = wid;
     widpos->priority = ad->priority;
-    widpos->position = wp->position;
+    widpos->position = position;
     // Add it to the end of the list
     kv_push(wid_pos_t *, od->kv_widpos, widpos);
     // Add the word id to the hash set
@@ -725,14 +941,43 @@ static void string_new_word_pos(word_pos_t *wp, void *data) {
     ad->prev_wid = wid;
 }
 
-// TODO: better analyzer usage, configurable etc.,
-static void index_string(struct sindex *si, const char *str, int priority) {
+/* Indexes the next string of the batch, from the tokens it was split into
+ * when the words of the batch were collected */
+static void index_string(struct sindex *si, int priority) {
     struct analyzer_data ad;
     ad.si = si;
     ad.priority = priority;
     ad.prev_wid = 0;
-    struct analyzer *a = get_default_analyzer();
-    a->analyze_string_for_indexing(str, string_new_word_pos, &ad);
+    struct write_cache *wc = si->wc;
+    struct batch_token *t;
+    while ((t = &kv_A(wc->words.tokens, wc->next_token++))->word) {
+        index_word(&ad, t->word, t->position);
+    }
+}
+
+/* Checks if the unchanged fields of a document being updated have a word under
+ * a top-level word id */
+static bool twid_in_use(struct sindex *si, uint32_t twid) {
+    struct doc_data *od = &si->wc->od;
+    khiter_t k = kh_get(UNIQWID, od->kh_usedtwid, twid);
+    if (k != kh_end(od->kh_usedtwid)) {
+        return kh_value(od->kh_usedtwid, k);
+    }
+    bool used = false;
+    if (kh_size(od->kh_uniqwid)) {
+        struct bmap *wids = sindex_load_bmap(si, si->txn, SI_TWID2WIDBMAP, IDPRIORITY(twid, 0));
+        if (wids) {
+            uint32_t wid;
+            kh_foreach_key(od->kh_uniqwid, wid, {
+                if (!used && bmap_exists(wids, wid)) used = true;
+            });
+        }
+        bmap_free(wids);
+    }
+    int ret = 0;
+    k = kh_put(UNIQWID, od->kh_usedtwid, twid, &ret);
+    kh_value(od->kh_usedtwid, k) = used;
+    return used;
 }
 
 static void string_deindex_word_pos(word_pos_t *wp, void *data) {
@@ -740,7 +985,7 @@ static void string_deindex_word_pos(word_pos_t *wp, void *data) {
     struct sindex *si = ad->si;
     struct doc_data *od = &si->wc->od;
     int p = ad->priority + 1;
-    int limit = wp->word.length >= LEVLIMIT ? LEVLIMIT : wp->word.length;
+    int limit = wp->word.length >= DT_MAX_LEVELS ? DT_MAX_LEVELS : wp->word.length;
 
     // Check if the word exists
     uint32_t wid = dtrie_exists(si->trie, wp->word.chars, wp->word.length, od->twid);
@@ -749,17 +994,23 @@ static void string_deindex_word_pos(word_pos_t *wp, void *data) {
         return;
     }
 
-    // Set the top-level wid to obj id mapping
+    // Set the top-level wid to obj id mapping.  The mappings of all fields
+    // stay while an updated document still has a word under it
     for (int i = 0; i < limit; i++) {
-        wid2bmap_remove(si->twid2bmap_dbi, si->wc->kh_twid2bmap, si->txn, 
-                     od->twid[i], od->docid, 0);
+        if (!od->twid[i]) continue;
+        if (!od->updating || !twid_in_use(si, od->twid[i])) {
+            wid2bmap_remove(si->twid2bmap_dbi, si->wc->kh_twid2bmap, si->txn, 
+                         od->twid[i], od->docid, 0);
+        }
         wid2bmap_remove(si->twid2bmap_dbi, si->wc->kh_twid2bmap, si->txn, 
                      od->twid[i], od->docid, p);
     }
 
     // Set the wid to obj id mapping
-    wid2bmap_remove(si->wid2bmap_dbi, si->wc->kh_wid2bmap, si->txn, 
-            wid, od->docid, 0);
+    if (!od->updating || !obj_wid_count(od, wid)) {
+        wid2bmap_remove(si->wid2bmap_dbi, si->wc->kh_wid2bmap, si->txn, 
+                wid, od->docid, 0);
+    }
     wid2bmap_remove(si->wid2bmap_dbi, si->wc->kh_wid2bmap, si->txn, 
             wid, od->docid, p);
 
@@ -785,6 +1036,173 @@ static void deindex_string(struct sindex *si, const char *str, int priority) {
 }
 
 
+/* Adds a token of an indexed string to the write batch, and its word to the
+ * words of the batch if it is not there yet */
+static void string_collect_word_pos(word_pos_t *wp, void *data) {
+    struct batch_words *b = data;
+    struct batch_word key = {.w = {.chars = wp->word.chars, .length = wp->word.length}};
+    int ret = 0;
+    khiter_t k = kh_put(WORDDICT, b->kh_words, &key, &ret);
+    if (ret) {
+        // A new word, the analyzer reuses its buffer so keep a copy
+        struct batch_word *bw = arena_calloc(&b->arena, 1, sizeof(struct batch_word));
+        chr_t *chars = arena_alloc(&b->arena, wp->word.length * sizeof(chr_t));
+        memcpy(chars, wp->word.chars, wp->word.length * sizeof(chr_t));
+        bw->w.chars = chars;
+        bw->w.length = wp->word.length;
+        kh_key(b->kh_words, k) = bw;
+        kv_push(struct dtrie_word *, b->words, &bw->w);
+    }
+    struct batch_token t = {kh_key(b->kh_words, k), wp->position};
+    kv_push(struct batch_token, b->tokens, t);
+}
+
+// TODO: better analyzer usage, configurable etc.,
+static void collect_string(struct batch_words *b, const char *str) {
+    struct analyzer *a = get_default_analyzer();
+    a->analyze_string_for_indexing(str, string_collect_word_pos, b);
+    struct batch_token end = {NULL, 0};
+    kv_push(struct batch_token, b->tokens, end);
+}
+
+/* Collects the words of the indexed strings of a document.  This walks the
+ * document exactly like parse_index_document, which later indexes the
+ * strings in the same order */
+static void collect_document_words(struct batch_words *b, struct schema *s, json_t *j) {
+    while (s) {
+        switch (s->type) {
+            case F_STRING: {
+                if (!s->is_indexed) break;
+                json_t *js = json_object_get(j, s->fname);
+                if (!json_is_string(js)) break;
+                collect_string(b, json_string_value(js));
+            }
+            break;
+            case F_STRLIST: {
+                if (!s->is_indexed) break;
+                json_t *jarr = json_object_get(j, s->fname);
+                if (!json_is_array(jarr)) break;
+                size_t jid;
+                json_t *js;
+                json_array_foreach(jarr, jid, js) {
+                    collect_string(b, json_string_value(js));
+                }
+            }
+            break;
+            case F_OBJECT: {
+                json_t *jo = json_object_get(j, s->fname);
+                if (!json_is_object(jo)) break;
+                collect_document_words(b, s->child, jo);
+            }
+            break;
+            case F_OBJLIST: {
+                json_t *jarr = json_object_get(j, s->fname);
+                if (!json_is_array(jarr)) break;
+                size_t jid;
+                json_t *jo;
+                json_array_foreach(jarr, jid, jo) {
+                    if (json_is_object(jo)) {
+                        collect_document_words(b, s->child, jo);
+                    }
+                }
+            }
+            break;
+            default:
+                break;
+        }
+        s = s->next;
+    }
+}
+
+/* A part of a batch of documents, analyzed by a task of analyze_pool */
+struct analyze_part {
+    struct worker *worker;
+    struct schema *schema;
+    json_t *docs;
+    size_t start;
+    size_t end;
+    struct batch_words *words;
+};
+
+static void analyze_part_process(void *data) {
+    struct analyze_part *p = data;
+    for (size_t i = p->start; i < p->end; i++) {
+        collect_document_words(p->words, p->schema, json_array_get(p->docs, i));
+    }
+    worker_done(p->worker);
+}
+
+/* Merges the words and tokens of a part into the words of the batch */
+static void merge_batch_words(struct batch_words *b, struct batch_words *part) {
+    for (size_t i = 0; i < kv_size(part->words); i++) {
+        // The dtrie_word is the first member of a batch_word
+        struct batch_word *w = (struct batch_word *)kv_A(part->words, i);
+        int ret = 0;
+        khiter_t k = kh_put(WORDDICT, b->kh_words, w, &ret);
+        if (ret) {
+            kv_push(struct dtrie_word *, b->words, &w->w);
+        }
+        w->merged = kh_key(b->kh_words, k);
+    }
+    for (size_t i = 0; i < kv_size(part->tokens); i++) {
+        struct batch_token t = kv_A(part->tokens, i);
+        if (t.word) {
+            t.word = t.word->merged;
+        }
+        kv_push(struct batch_token, b->tokens, t);
+    }
+}
+
+/* Collects the words of a batch of documents.  Large batches are split into
+ * parts analyzed in parallel, the first one by this thread, and the words
+ * of the other parts are then merged in document order */
+static void collect_batch_words(struct sindex *si, json_t *j) {
+    struct write_cache *wc = si->wc;
+    struct schema *schema = si->map->index_schema->child;
+    if (!json_is_array(j)) {
+        collect_document_words(&wc->words, schema, j);
+        return;
+    }
+    size_t num_docs = json_array_size(j);
+    size_t num_parts = MIN((size_t)marlin->num_processors, num_docs / ANALYZE_PART_DOCS);
+    if (num_parts <= 1) {
+        for (size_t i = 0; i < num_docs; i++) {
+            collect_document_words(&wc->words, schema, json_array_get(j, i));
+        }
+        return;
+    }
+
+    wc->num_parts = num_parts - 1;
+    wc->parts = malloc(wc->num_parts * sizeof(struct batch_words));
+    struct analyze_part *parts = malloc(wc->num_parts * sizeof(struct analyze_part));
+    struct worker worker;
+    worker_init(&worker, wc->num_parts);
+    size_t first_end = num_docs / num_parts;
+    for (int i = 0; i < wc->num_parts; i++) {
+        struct analyze_part *p = &parts[i];
+        p->worker = &worker;
+        p->schema = schema;
+        p->docs = j;
+        p->start = num_docs * (i + 1) / num_parts;
+        p->end = num_docs * (i + 2) / num_parts;
+        p->words = &wc->parts[i];
+        batch_words_init(p->words);
+        if (threadpool_add(analyze_pool, analyze_part_process, p, 0) != 0) {
+            analyze_part_process(p);
+        }
+    }
+    for (size_t i = 0; i < first_end; i++) {
+        collect_document_words(&wc->words, schema, json_array_get(j, i));
+    }
+    wait_for_workers(&worker);
+    worker_destroy(&worker);
+
+    for (int i = 0; i < wc->num_parts; i++) {
+        merge_batch_words(&wc->words, &wc->parts[i]);
+    }
+    free(parts);
+}
+
 /**
  * Parses and indexes an document.  This uses the index schema map and updates the 
  * write cache with parsed information.
@@ -804,7 +1222,7 @@ static void parse_index_document(struct sindex *si, struct schema *s, json_t *j)
                     index_string_facet(si, str, s->f_priority);
                 }
                 if (s->is_indexed) {
-                    index_string(si, str, s->i_priority);
+                    index_string(si, s->i_priority);
                 }
             }
             break;
@@ -819,7 +1237,7 @@ static void parse_index_document(struct sindex *si, struct schema *s, json_t *j)
                         index_string_facet(si, str, s->f_priority);
                     }
                     if (s->is_indexed) {
-                        index_string(si, str, s->i_priority);
+                        index_string(si, s->i_priority);
                     }
                 }
             }
@@ -1026,7 +1444,13 @@ static void si_remove_docdata(struct sindex *si) {
     M_DBG("DELETING DOC %u", docid);
 
     // Delete the objid specific data
-    if (mdb_del(si->txn, si->docid2data_dbi, &key, NULL) != 0) {
+    if (si->mem) {
+        khiter_t k = kh_get(DOCID2DATA, si->mem->kh_docid2data, docid);
+        if (k != kh_end(si->mem->kh_docid2data)) {
+            free(kh_value(si->mem->kh_docid2data, k));
+            kh_del(DOCID2DATA, si->mem->kh_docid2data, k);
+        }
+    } else if (mdb_del(si->txn, si->docid2data_dbi, &key, NULL) != 0) {
         M_ERR("Failed to deallocate doc data for docid %u", docid);
     }
  
@@ -1042,6 +1466,13 @@ static void si_remove_docdata(struct sindex *si) {
 char *sindex_lookup_facet(struct sindex *si, uint32_t facet_id) {
     MDB_txn *txn;
     char *fstr = NULL;
+    if (si->mem) {
+        khiter_t k = kh_get(FACETID2STR, si->mem->kh_facetid2str, facet_id);
+        if (k != kh_end(si->mem->kh_facetid2str)) {
+            fstr = strdup(kh_value(si->mem->kh_facetid2str, k));
+        }
+        return fstr;
+    }
     mdb_txn_begin(si->env, NULL, MDB_RDONLY, &txn);
     MDB_val key, data;
     key.mv_size = sizeof(uint32_t);
@@ -1053,6 +1484,55 @@ char *sindex_lookup_facet(struct sindex *si, uint32_t facet_id) {
     return fstr;
 }
 
+/* Loads the bitmap id of an index, NULL if there is none.  Bitmaps of an in
+ * memory index are copied, those of lmdb are valid as long as txn is */
+struct bmap *sindex_load_bmap(struct sindex *si, MDB_txn *txn, SI_BMAP type, uint64_t id) {
+    MDB_dbi dbi;
+    khash_t(WID2MBMAP) *kh;
+    switch (type) {
+        case SI_FACETID2BMAP:
+            dbi = si->facetid2bmap_dbi;
+            kh = si->mem ? si->mem->kh_facetid2bmap : NULL;
+            break;
+        case SI_BOOLID2BMAP:
+            dbi = si->boolid2bmap_dbi;
+            kh = si->mem ? si->mem->kh_boolid2bmap : NULL;
+            break;
+        case SI_TWID2WIDBMAP:
+            dbi = si->twid2widbmap_dbi;
+            kh = si->mem ? si->mem->kh_twid2widbmap : NULL;
+            break;
+        case SI_TWID2BMAP:
+            dbi = si->twid2bmap_dbi;
+            kh = si->mem ? si->mem->kh_twid2bmap : NULL;
+            break;
+        default:
+            dbi = si->wid2bmap_dbi;
+            kh = si->mem ? si->mem->kh_wid2bmap : NULL;
+            break;
+    }
+    if (!kh) {
+        return mbmap_load_bmap(txn, dbi, id);
+    }
+    khiter_t k = kh_get(WID2MBMAP, kh, id);
+    if (k == kh_end(kh)) return NULL;
+    return mbmap_to_bmap(kh_value(kh, k));
+}
+
+/* Gets the index data of a document like mdb_get does */
+int sindex_get_docdata(struct sindex *si, MDB_txn *txn, uint32_t docid, MDB_val *data) {
+    if (si->mem) {
+        khiter_t k = kh_get(DOCID2DATA, si->mem->kh_docid2data, docid);
+        if (k == kh_end(si->mem->kh_docid2data)) return MDB_NOTFOUND;
+        *data = *kh_value(si->mem->kh_docid2data, k);
+        return 0;
+    }
+    MDB_val key;
+    key.mv_size = sizeof(docid);
+    key.mv_data = &docid;
+    return mdb_get(txn, si->docid2data_dbi, &key, data);
+}
+
 
 void si_delete_document(struct sindex *si, const json_t *j, uint32_t docid) {
     si->wc->od.docid = docid;
@@ -1078,7 +1558,13 @@ void sindex_add_documents(struct sindex *si, json_t *j) {
 
     //  We are good to go now
     si_write_start(si);
-    if (json_is_array(j)) {
+    // Collect the words of all documents first, so that the trie is updated
+    // once for the whole batch, in sorted order
+    collect_batch_words(si, j);
+    if (!dtrie_insert_batch(si->trie, si->wc->words.words.a, kv_size(si->wc->words.words))) {
+        // The trie is full, none of the documents can be indexed
+        M_ERR("Failed to add words to the trie of %s, documents not indexed", si->shard->index->name);
+    } else if (json_is_array(j)) {
         size_t idx;
         json_t *obj;
         json_array_foreach(j, idx, obj) {
@@ -1098,12 +1584,143 @@ void sindex_delete_document(struct sindex *si, const json_t *j, uint32_t docid)
     si_write_end(si);
 }
 
+/* Sets the top-level fields of the index schema which differ between the old and
+ * new version of a document in jo and jn, with their old and new values */
+static void diff_document(struct schema *s, const json_t *old, const json_t *new,
+                          json_t *jo, json_t *jn) {
+    for (; s; s = s->next) {
+        json_t *a = json_object_get(old, s->fname);
+        json_t *b = json_object_get(new, s->fname);
+        if (!a && !b) continue;
+        if (a && b && json_equal(a, b)) continue;
+        if (a) json_object_set(jo, s->fname, a);
+        if (b) json_object_set(jn, s->fname, b);
+    }
+}
+
+/* Marks the string, number and facet priorities of a field, and of all fields
+ * under it, as changed */
+static void mark_changed_field(struct doc_data *od, struct schema *s) {
+    switch (s->type) {
+        case F_STRING:
+        case F_STRLIST:
+            if (s->is_indexed) od->changed_strings[s->i_priority] = true;
+            break;
+        case F_NUMBER:
+        case F_NUMLIST:
+            if (s->is_indexed) od->changed_numbers[s->i_priority] = true;
+            break;
+        case F_OBJECT:
+        case F_OBJLIST:
+            for (struct schema *c = s->child; c; c = c->next) {
+                mark_changed_field(od, c);
+            }
+            break;
+        default:
+            break;
+    }
+    if (s->is_facet) od->changed_facets[s->f_priority] = true;
+}
+
+/* Updates a document in place, keeping its docid.  jo and jn hold the old and
+ * new values of the fields which changed, only those are deindexed and indexed
+ * again.  The docdata of the rest of the document is read back and stored
+ * along with that of the changed fields */
+static void si_update_document(struct sindex *si, const json_t *jo, json_t *jn) {
+    struct doc_data *od = &si->wc->od;
+    struct schema *schema = si->map->index_schema->child;
+    mdb_txn_renew(si->read_txn);
+    od->docid = json_number_value(json_object_get(jn, J_DOCID));
+    sindex_docdata_init(si);
+    memset(od->changed_strings, 0, (si->map->num_strings + si->map->num_numbers +
+                                    si->map->num_facets) * sizeof(bool));
+    for (struct schema *s = schema; s; s = s->next) {
+        if (json_object_get(jo, s->fname) || json_object_get(jn, s->fname)) {
+            mark_changed_field(od, s);
+        }
+    }
+    read_docdata(si, od->docid, od);
+
+    // Words of the unchanged fields are in kh_uniqwid now, these keep their
+    // mappings for all fields
+    od->updating = true;
+    kh_clear(UNIQWID, od->kh_usedtwid);
+    parse_deindex_document(si, schema, jo);
+    od->updating = false;
+
+    parse_index_document(si, schema, jn);
+    sindex_store_docdata(si);
+    mdb_txn_reset(si->read_txn);
+}
+
+/* Writes a batch of documents.  Deleted documents are deindexed and new ones
+ * indexed.  A document with a new version is updated in place, only the
+ * fields which changed are reindexed unless its docdata cannot be read back,
+ * in which case it is deindexed and indexed again as a whole */
+void sindex_write_documents(struct sindex *si, struct sindex_write *docs, int num_docs) {
+    if (UNLIKELY(si->map == NULL)) return;
+    if (UNLIKELY(!si->map->ready_to_index)) return;
+
+    si_write_start(si);
+    struct schema *schema = si->map->index_schema->child;
+    // Documents to index, in order.  Only the changed fields of an update are
+    // indexed, and the old values of those are kept by its position
+    json_t *adds = json_array();
+    json_t **updates = calloc(num_docs, sizeof(json_t *));
+    for (int i = 0; i < num_docs; i++) {
+        struct sindex_write *d = &docs[i];
+        if (d->old && d->j && read_docdata(si, d->docid, NULL)) {
+            json_t *jo = json_object();
+            json_t *jn = json_object();
+            diff_document(schema, d->old, d->j, jo, jn);
+            if (json_object_size(jo) || json_object_size(jn)) {
+                json_object_set_new(jn, J_DOCID, json_integer(d->docid));
+                updates[json_array_size(adds)] = jo;
+                json_array_append_new(adds, jn);
+            } else {
+                json_decref(jo);
+                json_decref(jn);
+            }
+            continue;
+        }
+        if (d->old && d->docid) {
+            si_delete_document(si, d->old, d->docid);
+        }
+        if (d->j) {
+            json_array_append(adds, d->j);
+        }
+    }
+
+    collect_batch_words(si, adds);
+    bool words_added = dtrie_insert_batch(si->trie, si->wc->words.words.a,
+                                          kv_size(si->wc->words.words));
+    if (!words_added) {
+        // The trie is full, the new versions of the documents cannot be indexed
+        M_ERR("Failed to add words to the trie of %s, documents not indexed", si->shard->index->name);
+    }
+
+    size_t idx;
+    json_t *obj;
+    json_array_foreach(adds, idx, obj) {
+        if (updates[idx]) {
+            if (words_added) si_update_document(si, updates[idx], obj);
+            json_decref(updates[idx]);
+        } else if (words_added) {
+            si_add_document(si, obj);
+        }
+    }
+    si_write_end(si);
+    json_decref(adds);
+    free(updates);
+}
+
 /**
  * Updates / sets the shard index mapping.
  * This opens the necessary dynamic dbis (num / geo) as required
  */
 void sindex_set_mapping(struct sindex *si, const struct mapping *map) {
     si->map = map;
+    if (si->mem) return;
 
     M_DBG("Index mapping set for index %s", si->shard->index->name);
     mdb_txn_begin(si->env, NULL, 0, &si->txn);
@@ -1144,7 +1761,59 @@ void sindex_delete(struct sindex *si) {
     rmdir(path);
 }
 
+static struct sindex_mem *sindex_mem_new(void) {
+    struct sindex_mem *m = calloc(1, sizeof(struct sindex_mem));
+    m->kh_facetid2str = kh_init(FACETID2STR);
+    m->kh_facetid2bmap = kh_init(WID2MBMAP);
+    m->kh_boolid2bmap = kh_init(WID2MBMAP);
+    m->kh_wid2bmap = kh_init(WID2MBMAP);
+    m->kh_twid2bmap = kh_init(WID2MBMAP);
+    m->kh_twid2widbmap = kh_init(WID2MBMAP);
+    m->kh_docid2data = kh_init(DOCID2DATA);
+    return m;
+}
+
+static void mem_bmaps_destroy(khash_t(WID2MBMAP) *kh) {
+    struct mbmap *mbmap;
+    kh_foreach_value(kh, mbmap, {
+        mbmap_free(mbmap);
+    });
+    kh_destroy(WID2MBMAP, kh);
+}
+
+static void sindex_mem_free(struct sindex_mem *m) {
+    char *str;
+    kh_foreach_value(m->kh_facetid2str, str, {
+        free(str);
+    });
+    kh_destroy(FACETID2STR, m->kh_facetid2str);
+    mem_bmaps_destroy(m->kh_facetid2bmap);
+    mem_bmaps_destroy(m->kh_boolid2bmap);
+    mem_bmaps_destroy(m->kh_wid2bmap);
+    mem_bmaps_destroy(m->kh_twid2bmap);
+    mem_bmaps_destroy(m->kh_twid2widbmap);
+    MDB_val *data;
+    kh_foreach_value(m->kh_docid2data, data, {
+        free(data);
+    });
+    kh_destroy(DOCID2DATA, m->kh_docid2data);
+    for (int i = 0; i < MAX_FIELDS; i++) {
+        kv_destroy(m->nums[i]);
+    }
+    free(m);
+}
+
 void sindex_clear(struct sindex *si, int close) {
+    if (si->mem) {
+        sindex_mem_free(si->mem);
+        si->mem = sindex_mem_new();
+        dtrie_clear(si->trie);
+        if (!close) {
+            app_add_freejob(si->shard->index->app, FREE_TRIE, si->trie);
+            si->trie = dtrie_new_memory();
+        }
+        return;
+    }
     // Drop all dbis
     mdb_txn_begin(si->env, NULL, 0, &si->txn);
     int rc = 0;
@@ -1204,10 +1873,20 @@ void sindex_clear(struct sindex *si, int close) {
 }
 
 void sindex_free(struct sindex *si) {
-    mdb_env_close(si->env);
+    if (si->mem) {
+        dtrie_free(si->trie, 0, NULL);
+        sindex_mem_free(si->mem);
+        free(si);
+        return;
+    }
     if (si->trie) {
-        dtrie_free(si->trie);
+        // Trie nodes retired by the last batches are stored as free
+        MDB_txn *txn;
+        mdb_txn_begin(si->env, NULL, 0, &txn);
+        dtrie_free(si->trie, si->boolid2bmap_dbi, txn);
+        mdb_txn_commit(txn);
     }
+    mdb_env_close(si->env);
     free(si);
 }
 
@@ -1252,3 +1931,14 @@ struct sindex *sindex_new(struct shard *shard) {
     return si;
 }
  
+
+/* Creates an index which is only kept in memory, for the documents of the
+ * segment of shard.  Its docdata is read like that of lmdb, see
+ * sindex_get_docdata and sindex_load_bmap */
+struct sindex *sindex_new_memory(struct shard *shard) {
+    struct sindex *si = calloc(1, sizeof(struct sindex));
+    si->shard = shard;
+    si->mem = sindex_mem_new();
+    si->trie = dtrie_new_memory();
+    return si;
+}
@@ -3,17 +3,60 @@
 #define __SINDEX_H_
 
 #include <lmdb.h>
+#include <string.h>
 #include "shard.h"
 #include "khash.h"
 #include "kvec.h"
 #include "dtrie.h"
 #include "squery.h"
+#include "arena.h"
+#include "farmhash-c.h"
 
 //#define TRACK_WIDS 1
 
 KHASH_MAP_INIT_INT(FACETID2STR, char *) // Facet id to string mapping
 KHASH_MAP_INIT_INT64(WID2MBMAP, struct mbmap *) // Word id to mbmap
 KHASH_MAP_INIT_INT(UNIQWID, int) // A hash set to maintain unique wordids for an document
+KHASH_MAP_INIT_INT(DOCID2DATA, MDB_val *) // Docid to index data, of in memory indexes
+
+/* A word of a write batch.  Besides its ids, it caches the bitmaps a
+ * document containing the word is added to, for the rest of the batch */
+struct batch_word {
+    struct dtrie_word w;
+    struct mbmap *wid_map;                      // Word id to docids
+    struct mbmap *twid_maps[DT_MAX_LEVELS];     // Top-level word ids to docids
+    int priority;                               // Of the maps below, 0 if none yet
+    struct mbmap *pwid_map;                     // Same for the field priority
+    struct mbmap *ptwid_maps[DT_MAX_LEVELS];
+    struct batch_word *merged;                  // Word of the batch a word of a part is
+};
+
+static inline khint_t batch_word_hash(const struct batch_word *bw) {
+    return farmhash32((const char *)bw->w.chars, bw->w.length * sizeof(chr_t));
+}
+
+static inline bool batch_word_equal(const struct batch_word *a, const struct batch_word *b) {
+    return a->w.length == b->w.length &&
+           memcmp(a->w.chars, b->w.chars, a->w.length * sizeof(chr_t)) == 0;
+}
+
+// A hash set of the distinct words of a write batch
+KHASH_INIT(WORDDICT, struct batch_word *, char, 1, batch_word_hash, batch_word_equal)
+
+/* A token of an indexed string of a write batch, a NULL word ends the string */
+struct batch_token {
+    struct batch_word *word;
+    uint32_t position;
+};
+
+/* The distinct words of the indexed strings of a run of documents, and the
+ * tokens of every string in the order the documents are parsed in */
+struct batch_words {
+    khash_t(WORDDICT) *kh_words;
+    kvec_t(struct dtrie_word *) words;
+    kvec_t(struct batch_token) tokens;
+    struct arena arena;     // Holds the words
+};
 
 /* Holds mapping for a word with a given priority and its position */
 typedef struct wid_pos {
@@ -26,10 +69,18 @@ typedef struct wid_pos {
 struct doc_data {
     uint32_t docid; // Document id of document currently being indexed
     double *num_data; // Numeric data for a given document, an array of size num_numbers
-    uint32_t twid[LEVLIMIT];
+    uint32_t twid[DT_MAX_LEVELS];   // Top-level word ids of the word being indexed, 0 if none
     kvec_t(uint32_t) *facet_data;   // Facet ids for the document, an array of size num_facets
     kvec_t(wid_pos_t *) kv_widpos;  // Word positions of all words for this document
     khash_t(UNIQWID)   *kh_uniqwid; // Unique word ids for this document
+
+    // Only the fields of an updated document which changed are reindexed,
+    // these are the string, number and facet priorities of those fields
+    bool *changed_strings;
+    bool *changed_numbers;
+    bool *changed_facets;
+    bool updating;                  // Deindexing the changed fields of an update
+    khash_t(UNIQWID) *kh_usedtwid;  // Top-level word ids the unchanged fields still use
 };
 
 // Write cache, used to cache information during a bulk write
@@ -45,10 +96,49 @@ struct write_cache {
     khash_t(WID2MBMAP) *kh_phrasebmap;      // Adjacent word id to docid bmap
     khash_t(IDNUM2DBL) *kh_idnum2dbl;       // IDNUM to double values
 
+    // Words of the batch, which are added to the trie before any document
+    // is indexed.  Large batches are analyzed in parts, whose words are
+    // merged into these but stay in the parts
+    struct batch_words words;
+    struct batch_words *parts;
+    int num_parts;
+    size_t next_token;      // Token the next indexed string starts at
+
     // Per document index info
     struct doc_data od;
 };
 
+/* The bitmaps of an index, see sindex_load_bmap */
+typedef enum si_bmap {
+    SI_FACETID2BMAP,
+    SI_BOOLID2BMAP,
+    SI_TWID2WIDBMAP,
+    SI_TWID2BMAP,
+    SI_WID2BMAP,
+} SI_BMAP;
+
+/* A number of a document in an in memory index */
+struct doc_number {
+    double value;
+    uint32_t docid;
+};
+
+typedef kvec_t(struct doc_number) doc_numbers_t;
+
+/* What an index which is only kept in memory has in place of its dbis.  The
+ * bitmaps and facet strings are those of its write cache, which are kept
+ * from one write to the next */
+struct sindex_mem {
+    khash_t(FACETID2STR) *kh_facetid2str;
+    khash_t(WID2MBMAP) *kh_facetid2bmap;
+    khash_t(WID2MBMAP) *kh_boolid2bmap;
+    khash_t(WID2MBMAP) *kh_wid2bmap;
+    khash_t(WID2MBMAP) *kh_twid2bmap;
+    khash_t(WID2MBMAP) *kh_twid2widbmap;
+    khash_t(DOCID2DATA) *kh_docid2data;
+    doc_numbers_t nums[MAX_FIELDS];     // Numbers of every number field, unsorted
+};
+
 /* sindex holds the search index for documents of a shard */
 struct sindex {
     struct shard *shard;
@@ -60,6 +150,9 @@ struct sindex {
     // Write cache
     struct write_cache *wc;
 
+    // Set for an index which is only kept in memory, which has no env
+    struct sindex_mem *mem;
+
     // LMDB
     MDB_env *env;
     MDB_txn *txn;
@@ -99,6 +192,14 @@ typedef struct __attribute__((__packed__)) wid_info {
     uint32_t offset:23;     // Offset to frequency and positions or the actual position
 } wid_info_t;
 
+/* A document written by a batch.  old is the version indexed under docid, NULL
+ * for a new document, and j is the new version, NULL if it is deleted */
+struct sindex_write {
+    const json_t *old;
+    json_t *j;
+    uint32_t docid;
+};
+
 struct sindex_stats {
     uint32_t min;
     uint32_t max;
@@ -108,15 +209,20 @@ struct sindex_stats {
 };
 
 struct sindex *sindex_new(struct shard *s);
+struct sindex *sindex_new_memory(struct shard *s);
 void sindex_add_documents(struct sindex *si, json_t *j);
 void sindex_free(struct sindex *si);
 void sindex_delete(struct sindex *si);
 void sindex_clear(struct sindex *si, int close);
 void sindex_set_mapping(struct sindex *si, const struct mapping *map);
 void sindex_delete_document(struct sindex *si, const json_t *j, uint32_t docid);
+void sindex_write_documents(struct sindex *si, struct sindex_write *docs, int num_docs);
 uint8_t *read_vint(uint8_t *buf, int *value);
 char *sindex_lookup_facet(struct sindex *si, uint32_t facet_id);
+struct bmap *sindex_load_bmap(struct sindex *si, MDB_txn *txn, SI_BMAP type, uint64_t id);
+int sindex_get_docdata(struct sindex *si, MDB_txn *txn, uint32_t docid, MDB_val *data);
 void sindex_update_stats(struct sindex *si, struct bmap *docids, json_t *result);
+void sindex_freeze(struct sindex *si, json_t *result);
 
 #endif
 
@@ -19,13 +19,15 @@ KSORT_INIT(facet_sort, facet_count_t, facet_gt)
 
 static struct squery_result *squery_result_new(struct query *q) {
     struct squery_result *sqres = calloc(1, sizeof(struct squery_result));
-    sqres->exact_docid_map = calloc(q->num_words, sizeof(struct bmap *));
+    arena_init(&sqres->arena);
+    sqres->exact_docid_map = arena_calloc(&sqres->arena, q->num_words, sizeof(struct bmap *));
     sqres->all_wordids = kh_init(WID2TYPOS);
     return sqres;
 }
 
-static struct facet_hash *init_facet_hash(struct index *in, struct query_cfg *cfg) {
-    struct facet_hash *fh = malloc(in->mapping->num_facets * sizeof(struct facet_hash));
+static struct facet_hash *init_facet_hash(struct squery_result *sqres, struct index *in,
+        struct query_cfg *cfg) {
+    struct facet_hash *fh = arena_alloc(&sqres->arena, in->mapping->num_facets * sizeof(struct facet_hash));
     for (int i = 0; i < in->mapping->num_facets; i++) {
         if (cfg->facet_enabled[i]) {
             fh[i].h = hashtable_new(1024);
@@ -39,18 +41,12 @@ static struct facet_hash *init_facet_hash(struct index *in, struct query_cfg *cf
 static struct bmap *get_twid_to_docids(struct squery *sq, struct sindex *si, uint32_t twid) {
     // TODO: Currently it handles matches from all fields, restrict based on requested fields
     // read the query to find that out
-    struct bmap *b = mbmap_load_bmap(sq->txn, si->twid2bmap_dbi, IDPRIORITY(twid, 0));
+    struct bmap *b = sindex_load_bmap(si, sq->txn, SI_TWID2BMAP, IDPRIORITY(twid, 0));
     // If we have any docids under this twid, return it
     // Return an empty bitmap otherwise
     return b ? b : bmap_new();
 }
 
-static inline void add_wid_to_wordids(uint32_t wid, void *data) {
-    khash_t(WID2TYPOS) *wordids = data;
-    khiter_t k;
-    kh_set(WID2TYPOS, wordids, wid, 0);
-}
-
 // TODO: Make sure we set the least distance when we get multiple entries with different dist
 // for same word id
 static inline void add_wid_dist_to_wordids(uint32_t wid, int dist, void *data) {
@@ -59,63 +55,85 @@ static inline void add_wid_dist_to_wordids(uint32_t wid, int dist, void *data) {
     kh_set(WID2TYPOS, wordids, wid, dist);
 }
 
-static void set_wids_under_twid(struct squery *sq, struct sindex *si, termresult_t *tr) {
+// Words under a top-level word id and the distance they match with
+struct twid_words {
+    khash_t(WID2TYPOS) *wordids;
+    khash_t(WID2TYPOS) *all_wordids;
+    int dist;
+};
+
+// Words found through more than one twid keep the least distance
+static void add_twid_word(uint32_t wid, void *data) {
+    struct twid_words *tw = data;
+    khiter_t k;
+    if (tw->dist < kh_get_val(WID2TYPOS, tw->wordids, wid, 0xFF)) {
+        kh_set(WID2TYPOS, tw->wordids, wid, tw->dist);
+    }
+    if (tw->dist < kh_get_val(WID2TYPOS, tw->all_wordids, wid, 0xFF)) {
+        kh_set(WID2TYPOS, tw->all_wordids, wid, tw->dist);
+    }
+}
+
+static void set_wids_under_twid(struct squery *sq, struct sindex *si, termresult_t *tr,
+                                uint32_t twid, int dist) {
     // TODO: Currently it handles matches from all fields, restrict based on requested fields
-    struct bmap *b = mbmap_load_bmap(sq->txn, si->twid2widbmap_dbi, IDPRIORITY(tr->twid, 0));
+    struct bmap *b = sindex_load_bmap(si, sq->txn, SI_TWID2WIDBMAP, IDPRIORITY(twid, 0));
     if (b) {
-        bmap_iterate(b, add_wid_to_wordids, tr->wordids);
-        bmap_iterate(b, add_wid_to_wordids, sq->sqres->all_wordids);
+        struct twid_words tw = {tr->wordids, sq->sqres->all_wordids, dist};
+        bmap_iterate(b, add_twid_word, &tw);
     }
     bmap_free(b);
 }
 
 static void process_termresult(struct squery *sq, struct sindex *si, struct termdata *td) {
     termresult_t *tr = td->tresult;
-    // Check if we have a twid or word ids set, if not just bail out
+    // Check if we have twids or word ids set, if not just bail out
     // we do not have any documents matching that term
-    if ((tr->twid == 0) && (kh_size(tr->wordids) == 0)) {
+    if ((kh_size(tr->twids) == 0) && (kh_size(tr->wordids) == 0)) {
         td->tbmap = bmap_new();
         td->tzero_typo_bmap = bmap_new();
         return;
     }
 
     // TODO: Currently it handles matches from all fields, restrict based on requested fields
-    // If we have a top level word id set, we can use the top level document matches
-    // We will need to load the words under this top level id though
-    if (tr->twid) {
-        td->tbmap = get_twid_to_docids(sq, si, tr->twid);
-        // Top level word ids have zero typos, so just set it
-        td->tzero_typo_bmap = get_twid_to_docids(sq, si, tr->twid);
-        // If we have docids under this twid, let us get all the words that are under it
-        if (bmap_cardinality(td->tbmap)) {
-            set_wids_under_twid(sq, si, tr);
-        }
-    } else {
-        // TODO: we may have to delete some words if we do not have results
-        // especially when we start handling matches in particular fields only
-        struct oper *o = oper_new();
-        struct oper *oz = oper_new();
-        uint32_t wid;
-        int dist;
-        khash_t(WID2TYPOS) *all_wordids = sq->sqres->all_wordids;
-        kh_foreach(tr->wordids, wid, dist, {
-            struct bmap *b = mbmap_load_bmap(sq->txn, si->wid2bmap_dbi, IDPRIORITY(wid, 0));
-            if (b) {
-                add_wid_dist_to_wordids(wid, dist, all_wordids);
-                oper_add(o, b);
-                // Track documents with no typos
-                if (dist == 0) {
-                    oper_add(oz, b);
-                }
+    // TODO: we may have to delete some words if we do not have results
+    // especially when we start handling matches in particular fields only
+    struct oper *o = oper_new();
+    struct oper *oz = oper_new();
+    uint32_t wid;
+    int dist;
+    khash_t(WID2TYPOS) *all_wordids = sq->sqres->all_wordids;
+    kh_foreach(tr->wordids, wid, dist, {
+        struct bmap *b = sindex_load_bmap(si, sq->txn, SI_WID2BMAP, IDPRIORITY(wid, 0));
+        if (b) {
+            add_wid_dist_to_wordids(wid, dist, all_wordids);
+            oper_add(o, b);
+            // Track documents with no typos
+            if (dist == 0) {
+                oper_add(oz, b);
             }
-        });
-        td->tbmap = oper_or(o);
-        td->tzero_typo_bmap = oper_or(oz);
-        // Free operation and all bitmaps under it
-        oper_total_free(o);
-        // Free just the operation, the zero typo bitmaps have already been freed
-        oper_free(oz);
-    }
+        }
+    });
+    // If we have top level word ids, we can use the top level document matches
+    // instead of the matches of every word under them.  We will need to load
+    // the words under them though
+    uint32_t twid;
+    kh_foreach(tr->twids, twid, dist, {
+        struct bmap *b = get_twid_to_docids(sq, si, twid);
+        if (bmap_cardinality(b)) {
+            set_wids_under_twid(sq, si, tr, twid, dist);
+        }
+        oper_add(o, b);
+        if (dist == 0) {
+            oper_add(oz, b);
+        }
+    });
+    td->tbmap = oper_or(o);
+    td->tzero_typo_bmap = oper_or(oz);
+    // Free operation and all bitmaps under it
+    oper_total_free(o);
+    // Free just the operation, the zero typo bitmaps have already been freed
+    oper_free(oz);
 
 #ifdef TRACK_WIDS
 #if 1
@@ -144,7 +162,7 @@ static void process_termresult(struct squery *sq, struct sindex *si, struct term
 static void lookup_terms(struct squery *sq, struct sindex *si) {
     int num_terms = kv_size(sq->q->terms);
     struct squery_result *sqres = sq->sqres;
-    sqres->termdata = calloc(num_terms, sizeof(struct termdata));
+    sqres->termdata = arena_calloc(&sqres->arena, num_terms, sizeof(struct termdata));
 
     // First collect matching words with distance and the corresponding document ids
     for (int i = 0; i < num_terms; i++) {
@@ -161,7 +179,7 @@ static void lookup_terms(struct squery *sq, struct sindex *si) {
         if (wid) {
             M_DBG("Exact wid is %u", wid);
             // TODO: Handle field restricted queries
-            sqres->exact_docid_map[i] = mbmap_load_bmap(sq->txn, si->wid2bmap_dbi, IDPRIORITY(wid, 0));
+            sqres->exact_docid_map[i] = sindex_load_bmap(si, sq->txn, SI_WID2BMAP, IDPRIORITY(wid, 0));
         }
     }
 }
@@ -216,7 +234,7 @@ static struct bmap *get_matching_docids(struct squery *sq) {
     // This happens when the query text is empty or not set
     if (num_terms == 0) {
         // Send all available docids
-        return shard_get_all_docids(sq->shard);
+        return bmap_duplicate(sq->all_docids);
     }
 
     // This happens when the query text is a single word
@@ -284,7 +302,7 @@ static struct bmap *get_matching_zero_typo_docids(struct squery *sq) {
     // This happens when the query text is empty or not set
     if (num_terms == 0) {
         // Send all available docids
-        return shard_get_all_docids(sq->shard);
+        return bmap_duplicate(sq->all_docids);
     }
 
     // This happens when the query text is a single word
@@ -340,21 +358,31 @@ void sqresult_free(struct query *q, struct squery_result *sqres) {
         }
     }
     kh_destroy(WID2TYPOS, sqres->all_wordids);
-    free(sqres->exact_docid_map);
-    free(sqres->ranks);
     for (int i = 0; i < q->in->mapping->num_facets; i++) {
         hashtable_free(sqres->fh[i].h);
-        free(sqres->fc[i]);
     }
     // Free aggregations
     if (sqres->agg) {
         sqres->agg->free(sqres->agg);
     }
-    free(sqres->fc);
-    free(sqres->fh);
+    for (int i = 0; i < sqres->num_seg_docs; i++) {
+        free(sqres->seg_docs[i]);
+    }
+    // Releases ranks, facet counts and everything else drawn from the arena
+    arena_destroy(&sqres->arena);
     free(sqres);
 }
 
+/* Returns a copy of the document of a hit from the segment */
+char *sqresult_segment_document(const struct squery_result *sqres, uint32_t docid) {
+    for (int i = 0; i < sqres->num_seg_docs; i++) {
+        if (sqres->seg_docids[i] == docid) {
+            return sqres->seg_docs[i] ? strdup(sqres->seg_docs[i]) : NULL;
+        }
+    }
+    return NULL;
+}
+
 static inline int sort_results(struct query *q, struct docrank *ranks, uint32_t resultcount) {
     // How many entries do we want to partially sort?
     // If user requests for page 1 we only need 1 * hitsperpage
@@ -375,7 +403,7 @@ static inline int sort_results(struct query *q, struct docrank *ranks, uint32_t
 }
 
 static void squery_apply_filters(struct squery *sq) {
-    struct sindex *si = sq->shard->sindex;
+    struct sindex *si = sq->si;
     struct filter *sf = filter_dup(sq->q->filter);
     struct bmap *fb = filter_apply(si, sf, sq->txn, sq->sqres->docid_map);
     if (fb) {
@@ -395,29 +423,38 @@ static void squery_apply_filters(struct squery *sq) {
 }
 
 
-static uint32_t get_facet_totalcount(struct squery *sq, uint32_t facet_id, 
-        int priority, struct bmap *rbmap) {
-    uint32_t result = 0;
-    uint64_t fhid = IDPRIORITY(facet_id, priority);
-    struct bmap *tbmap = mbmap_load_bmap(sq->txn, sq->shard->sindex->facetid2bmap_dbi, fhid);
-    if (tbmap) {
-        result = bmap_and_cardinality(tbmap, rbmap);
-        bmap_free(tbmap);
+/* Sets the accurate count of matching documents for count facets in one pass
+ * over rbmap, only facet containers that overlap rbmap are read */
+static void get_facet_totalcounts(struct squery *sq, int priority, struct facet_count *fc,
+        int count, struct bmap *rbmap) {
+    struct arena *arena = &sq->sqres->arena;
+    struct arena_mark mark = arena_get_mark(arena);
+    struct bmap **tbmaps = arena_alloc(arena, count * sizeof(struct bmap *));
+    uint32_t *cards = arena_alloc(arena, count * sizeof(uint32_t));
+    for (int x = 0; x < count; x++) {
+        uint64_t fhid = IDPRIORITY(fc[x].facet_id, priority);
+        tbmaps[x] = sindex_load_bmap(sq->si, sq->txn, SI_FACETID2BMAP, fhid);
     }
-    return result;
+    bmap_and_cardinality_many(rbmap, tbmaps, count, cards);
+    for (int x = 0; x < count; x++) {
+        fc[x].count = cards[x];
+        bmap_free(tbmaps[x]);
+    }
+    arena_release(arena, mark);
 }
 
 
 static struct facet_count **sort_facets(struct squery *sq) {
     struct mapping *m = sq->q->in->mapping;
-    struct facet_count **fc = calloc(m->num_facets, sizeof(struct facet_count *));
+    struct arena *arena = &sq->sqres->arena;
+    struct facet_count **fc = arena_calloc(arena, m->num_facets, sizeof(struct facet_count *));
 
     // Iterate all facets and set final facet counts
     for (int i = 0; i < m->num_facets; i++) {
         if (!sq->q->cfg.facet_enabled[i]) continue;
         // Get the result hashtable holding all facets and counts
         struct hashtable *h = sq->sqres->fh[i].h;
-        fc[i] = malloc(sizeof(struct facet_count) * h->m_population);
+        fc[i] = arena_alloc(arena, sizeof(struct facet_count) * h->m_population);
         int j = 0;
         // Lookup all hashtable cells and set facet-id and counts
         for (int x=0; x<h->m_arraySize; x++) {
@@ -439,10 +476,7 @@ static struct facet_count **sort_facets(struct squery *sq) {
         // If we did a fast rank, find the accurate facet counts as we skipped many documents
         if (sq->fast_rank) {
             // Get actual facet counts
-            for (int x = 0; x < rcount; x++) {
-                fc[i][x].count = get_facet_totalcount(sq, fc[i][x].facet_id, i, 
-                        sq->sqres->docid_map);
-            }
+            get_facet_totalcounts(sq, i, fc[i], rcount, sq->sqres->docid_map);
         } 
 
         // Set shard_id for necessary results
@@ -456,24 +490,17 @@ static struct facet_count **sort_facets(struct squery *sq) {
     return fc;
 }
 
-void execute_squery(void *w) {
+/* Runs a query on the shard index, the read transaction is open already */
+static void squery_run(struct squery *sq) {
     struct timeval start;
-    struct squery *sq = w;
 
     // Start time
     gettimeofday(&start, NULL);
 
     int num_terms = kv_size(sq->q->terms);
-    M_DBG("Performing squery for shard %d", sq->shard_idx);
-    // First allocate a sq_result
-    sq->sqres = squery_result_new(sq->q);
     // Let the shard index handle the query now
-    struct shard *s = sq->shard;
-    struct sindex *si = s->sindex;
-    sq->sqres->fh = init_facet_hash(sq->q->in, &sq->q->cfg);
-
-    // Setup a mdb txn
-    mdb_txn_begin(si->env, NULL, MDB_RDONLY, &sq->txn);
+    struct sindex *si = sq->si;
+    sq->sqres->fh = init_facet_hash(sq->sqres, sq->q->in, &sq->q->cfg);
 
     // First lookup all terms
     lookup_terms(sq, si);
@@ -485,6 +512,16 @@ void execute_squery(void *w) {
     // From the term data, find all documents with zero typos matching our query
     sq->sqres->zero_typo_docid_map = get_matching_zero_typo_docids(sq);
 
+    // The segment answers for documents written to it
+    if (sq->masked) {
+        struct bmap *b = bmap_andnot(sq->sqres->docid_map, sq->masked);
+        bmap_free(sq->sqres->docid_map);
+        sq->sqres->docid_map = b;
+        b = bmap_andnot(sq->sqres->zero_typo_docid_map, sq->masked);
+        bmap_free(sq->sqres->zero_typo_docid_map);
+        sq->sqres->zero_typo_docid_map = b;
+    }
+
     // Apply filters
     if (sq->q->filter) {
         squery_apply_filters(sq);
@@ -525,13 +562,123 @@ void execute_squery(void *w) {
     for (int i = 0; i < num_terms; i++) {
         termdata_free(&sq->sqres->termdata[i]);
     }
-    free(sq->sqres->termdata);
+}
+
+/* Runs the query on the in memory index of the segment of the shard of sq,
+ * which has no read transaction.  Documents of the hits are read right away,
+ * as a merge removes them from the segment.  Assumes the segment read lock is
+ * held */
+static void squery_segment(struct squery *sq, struct squery *ssq) {
+    struct segment *seg = sq->shard->segment;
+    ssq->q = sq->q;
+    ssq->shard = sq->shard;
+    ssq->si = seg->sindex;
+    ssq->shard_idx = sq->shard_idx;
+    ssq->sqres = squery_result_new(sq->q);
+    if (kv_size(sq->q->terms) == 0) {
+        ssq->all_docids = bmap_duplicate(seg->docids);
+    }
+    squery_run(ssq);
+    bmap_free(ssq->all_docids);
+
+    // The documents are kept with the results of the shard
+    struct squery_result *sqres = sq->sqres;
+    int count = ssq->sqres->rank_count;
+    sqres->seg_docids = arena_alloc(&sqres->arena, count * sizeof(uint32_t));
+    sqres->seg_docs = arena_alloc(&sqres->arena, count * sizeof(char *));
+    for (int i = 0; i < count; i++) {
+        uint32_t docid = ssq->sqres->ranks[i].docid;
+        sqres->seg_docids[i] = docid;
+        sqres->seg_docs[i] = segment_get_document_byid(seg, docid);
+    }
+    sqres->num_seg_docs = count;
+}
+
+/* Adds the results of the segment to those of the shard.  Docids of the
+ * segment index never collide with those of the shard, so ranks just add up
+ * and facet counts of the same facet are summed */
+static void squery_merge_segment(struct squery *sq, struct squery *ssq) {
+    struct squery_result *sqres = sq->sqres;
+    struct squery_result *seg = ssq->sqres;
+    struct arena *arena = &sqres->arena;
+    sqres->num_hits += seg->num_hits;
+    sq->fast_rank = sq->fast_rank || ssq->fast_rank;
+
+    int count = sqres->rank_count + seg->rank_count;
+    struct docrank *ranks = arena_alloc(arena, count * sizeof(struct docrank));
+    memcpy(ranks, sqres->ranks, sqres->rank_count * sizeof(struct docrank));
+    memcpy(&ranks[sqres->rank_count], seg->ranks, seg->rank_count * sizeof(struct docrank));
+    sqres->ranks = ranks;
+    sqres->rank_count = sort_results(sq->q, ranks, count);
+
+    struct mapping *m = sq->q->in->mapping;
+    for (int i = 0; i < m->num_facets; i++) {
+        if (!sq->q->cfg.facet_enabled[i]) continue;
+        int rcount = sqres->fh[i].rcount;
+        struct facet_count *fc = arena_alloc(arena,
+                (rcount + seg->fh[i].rcount) * sizeof(struct facet_count));
+        memcpy(fc, sqres->fc[i], rcount * sizeof(struct facet_count));
+        // Both hold at most twice the max facet results
+        for (int j = 0; j < seg->fh[i].rcount; j++) {
+            struct facet_count *sfc = &seg->fc[i][j];
+            int x = 0;
+            while (x < sqres->fh[i].rcount && fc[x].facet_id != sfc->facet_id) x++;
+            if (x < sqres->fh[i].rcount) {
+                fc[x].count += sfc->count;
+            } else {
+                fc[rcount++] = *sfc;
+            }
+        }
+        int max = sq->q->cfg.max_facet_results * 2;
+        if (rcount > max) {
+            ks_partialsort(facet_sort, fc, 0, rcount-1, max);
+            rcount = max;
+        }
+        sqres->fc[i] = fc;
+        sqres->fh[i].rcount = rcount;
+    }
+
+    if (sqres->agg) {
+        sqres->agg->merge(sqres->agg, seg->agg);
+    }
+}
+
+void execute_squery(void *w) {
+    struct squery *sq = w;
+    struct segment *seg = sq->shard->segment;
+    struct squery ssq = {0};
+
+    M_DBG("Performing squery for shard %d", sq->shard_idx);
+    // First allocate a sq_result
+    sq->sqres = squery_result_new(sq->q);
+    sq->si = sq->shard->sindex;
+
+    // The shard index, its documents and the segment are read at the same
+    // point, a merge moves documents from the segment to the shard
+    RDLOCK(&seg->lock);
+    mdb_txn_begin(sq->shard->sindex->env, NULL, MDB_RDONLY, &sq->txn);
+    if (kv_size(sq->q->terms) == 0) {
+        sq->all_docids = shard_get_all_docids(sq->shard);
+    }
+    if (segment_size(seg)) {
+        sq->masked = bmap_duplicate(seg->masked);
+        squery_segment(sq, &ssq);
+    }
+    UNLOCK(&seg->lock);
+
+    squery_run(sq);
     
     // Abort the read only transaction, we are done executing the query
     mdb_txn_abort(sq->txn);
 
+    if (ssq.sqres) {
+        squery_merge_segment(sq, &ssq);
+        sqresult_free(sq->q, ssq.sqres);
+    }
+    bmap_free(sq->masked);
+    bmap_free(sq->all_docids);
+
     if (sq->worker) {
         worker_done(sq->worker);
     }
 }
-
@@ -6,6 +6,7 @@
 #include "workers.h"
 #include "mbmap.h"
 #include "hashtable.h"
+#include "arena.h"
 
 
 typedef struct termdata {
@@ -43,6 +44,11 @@ struct squery_result {
     struct agg *agg;
     int rank_count;
     int num_hits;
+    // Documents of the hits from the segment, read while it still held them
+    uint32_t *seg_docids;
+    char **seg_docs;
+    int num_seg_docs;
+    struct arena arena;                 // Per query arrays, released in sqresult_free
 };
 
 struct squery {
@@ -50,14 +56,18 @@ struct squery {
     struct query *q;
     struct squery_result *sqres;
     struct shard *shard;
+    struct sindex *si;          // Index queried, of the shard or of its segment
     khash_t(IDNUM2DBL) *kh_idnum2dbl;   // IDNUM to double values
     bool fast_rank;    // Did we do a partial scan for processing this query?
     int shard_idx;
     MDB_txn *txn;
+    struct bmap *all_docids;    // Documents of the shard, for queries with no terms
+    struct bmap *masked;        // Documents with a newer version in the segment
 };
 
 void execute_squery(void *w);
 void sqresult_free(struct query *q, struct squery_result *sqres);
+char *sqresult_segment_document(const struct squery_result *sqres, uint32_t docid);
 
 #endif
 
@@ -14,6 +14,22 @@ void worker_done(struct worker *worker) {
     pthread_mutex_unlock(&worker->lock);
 }
 
+/* Adds a worker to the workers pending */
+void worker_add(struct worker *worker) {
+    pthread_mutex_lock(&worker->lock);
+    worker->pending++;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/* Waits till less than max workers are pending */
+void wait_for_workers_below(struct worker *worker, int max) {
+    pthread_mutex_lock(&worker->lock);
+    while (worker->pending >= max) {
+        pthread_cond_wait(&worker->cond, &worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
 void wait_for_workers(struct worker *worker) {
     // Wait till workers are done
     pthread_mutex_lock(&worker->lock);
@@ -12,6 +12,8 @@ struct worker {
 void worker_init(struct worker *worker, int num_workers);
 void worker_destroy(struct worker *worker);
 void worker_done(struct worker *worker);
+void worker_add(struct worker *worker);
+void wait_for_workers_below(struct worker *worker, int max);
 void wait_for_workers(struct worker *worker);
 
 #endif
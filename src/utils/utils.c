@@ -75,23 +75,26 @@ float timedifference_msec(struct timeval t0, struct timeval t1) {
     return (t1.tv_sec - t0.tv_sec) * 1000.0f + (t1.tv_usec - t0.tv_usec) / 1000.0f;
 }
 
-char *http_error(h2o_req_t *req, HTTP_CODE code) {
-    req->res.status = code;
+const char *http_reason(HTTP_CODE code) {
     switch (code) {
+        case HTTP_OK:
+            return "OK";
         case HTTP_NOT_FOUND:
-            req->res.reason = "Not Found";
-            break;
+            return "Not Found";
         case HTTP_BAD_REQUEST:
-            req->res.reason = "Bad Request";
-            break;
+            return "Bad Request";
         case HTTP_SERVER_ERROR:
-            req->res.reason = "Internal Error";
-            break;
+            return "Internal Error";
         case HTTP_TOO_MANY:
-            req->res.reason = "Too Many Requests";
+            return "Too Many Requests";
         default:
-            break;
+            return "";
     }
+}
+
+char *http_error(h2o_req_t *req, HTTP_CODE code) {
+    req->res.status = code;
+    req->res.reason = http_reason(code);
     return strdup(J_FAILURE);
 }
 